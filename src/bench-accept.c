@@ -0,0 +1,335 @@
+/* bench-accept
+ Measures how a server copes with a burst of new connections. It starts
+ the server as a child process, opens many connections to it as fast as
+ it can, and waits until every connection has echoed back one byte.
+ It then reports the total time, and how much memory (RSS) the server
+ grew by.
+ Example usage:
+    bench-accept --count 100000 --server bin/tcp-srv-poll
+ Options:
+    --count <n>       number of connections (default 100000)
+    --inflight <n>    max connections in progress at once (default 0,
+                      meaning all of them)
+    --server <path>   the echo server to run (default bin/tcp-srv-poll)
+    --backend <name>  passed through to the server
+    --port <port>     the port for the server (default 17001)
+    --seconds <n>     give up after this long (default 60)
+
+ Each connection needs a file descriptor in both this process and the
+ server, so use `ulimit -n` to raise the limit first. If the limit is too
+ low, the count is reduced.
+
+ All the connections stay open until the end, and each needs its own
+ source port. There are only about 28k ephemeral ports for each pair of
+ addresses, so beyond that, `connect()` would fail with EADDRNOTAVAIL.
+ So the connections are spread over several source addresses, 127.0.0.1,
+ 127.0.0.2, and so on, which all reach the server on 127.0.0.1. Each is
+ bound with IP_BIND_ADDRESS_NO_PORT, so that the kernel picks the port
+ when connecting, from the full range for that source address.
+
+ By default, every connection is started at once, before we wait for any
+ of them, so the server sees the whole burst in its listen backlog. When
+ the burst is bigger than the backlog, the kernel drops the SYNs that
+ don't fit, and the clients retransmit them a second or more later, so
+ the total time includes the kernel's retransmit timer. That's part of
+ how a server copes with a burst, but use `--inflight <n>` to limit the
+ connections in progress to fewer than the backlog, to measure only how
+ fast the server accepts them.
+
+ If the server stalls, such as when it stops accepting, we give up after
+ `--seconds`, and report the connections that never finished.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util-clockcycle.h"
+#include "util-events.h"
+
+/* The number of loopback source addresses to spread the connections
+ * over, each with its own range of ephemeral ports */
+#define SOURCE_COUNT 64
+
+/**
+ * Read a field like "VmRSS:" from /proc/<pid>/status, in kilobytes
+ */
+static unsigned long read_status_kb(pid_t pid, const char *field) {
+  char filename[64];
+  char line[256];
+  unsigned long result = 0;
+  FILE *fp;
+
+  snprintf(filename, sizeof(filename), "/proc/%d/status", (int)pid);
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    return 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, field, strlen(field)) == 0) {
+      result = strtoul(line + strlen(field), 0, 10);
+      break;
+    }
+  }
+  fclose(fp);
+  return result;
+}
+
+static size_t raise_file_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+    return 1024;
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  getrlimit(RLIMIT_NOFILE, &rl);
+  return (size_t)rl.rlim_cur;
+}
+
+/**
+ * Start a non-blocking connection to the server, from the loopback
+ * address 127.0.0.<1+source>
+ */
+static int start_connect(const struct sockaddr_in *sin, unsigned source) {
+  struct sockaddr_in src;
+  int yes = 1;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  /* Choose the address, but leave choosing the port until we connect */
+  memset(&src, 0, sizeof(src));
+  src.sin_family = AF_INET;
+  src.sin_addr.s_addr = htonl(0x7f000001 + source);
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+  setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+#else
+  (void)yes;
+#endif
+  if (bind(fd, (const struct sockaddr *)&src, sizeof(src)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (connect(fd, (const struct sockaddr *)sin, sizeof(*sin)) == -1 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = 100000;
+  size_t inflight_max = 0;
+  unsigned seconds = 60;
+  const char *server = "bin/tcp-srv-poll";
+  const char *backend = NULL;
+  const char *port = "17001";
+  struct sockaddr_in sin;
+  struct events_t *ev;
+  struct events_ready_t ready[256];
+  pid_t pid;
+  size_t file_limit;
+  size_t started = 0;
+  size_t finished = 0;
+  size_t inflight = 0;
+  size_t errors = 0;
+  int *fds;
+  unsigned long rss_before, rss_after, hwm_after;
+  unsigned long long start, elapsed, deadline;
+  int is_timeout = 0;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      fprintf(stderr, "[-] %s: missing value\n", argv[i]);
+      return 1;
+    } else if (strcmp(argv[i], "--count") == 0)
+      count = strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--inflight") == 0)
+      inflight_max = strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--server") == 0)
+      server = argv[++i];
+    else if (strcmp(argv[i], "--backend") == 0)
+      backend = argv[++i];
+    else if (strcmp(argv[i], "--port") == 0)
+      port = argv[++i];
+    else if (strcmp(argv[i], "--seconds") == 0)
+      seconds = (unsigned)strtoul(argv[++i], 0, 0);
+    else {
+      fprintf(stderr, "[-] unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (seconds == 0)
+    seconds = 1;
+
+  /* Leave some room for other descriptors in both processes */
+  file_limit = raise_file_limit();
+  if (count + 64 > file_limit) {
+    fprintf(stderr, "[-] reducing count to %u, use 'ulimit -n' to raise\n",
+            (unsigned)(file_limit - 64));
+    count = file_limit - 64;
+  }
+  if (inflight_max == 0 || inflight_max > count)
+    inflight_max = count;
+  fds = calloc(count, sizeof(*fds));
+  if (fds == NULL && count) {
+    fprintf(stderr, "[-] calloc(): %s\n", strerror(errno));
+    return 1;
+  }
+
+  /* Start the server, with its logging going to /dev/null */
+  signal(SIGPIPE, SIG_IGN);
+  pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 2);
+    if (backend)
+      execl(server, server, port, "127.0.0.1", "--backend", backend,
+            (char *)0);
+    else
+      execl(server, server, port, "127.0.0.1", (char *)0);
+    _exit(127);
+  }
+
+  /* Wait until it's listening */
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((unsigned short)atoi(port));
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  for (i = 0; i < 100; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int err = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+    close(fd);
+    if (err == 0)
+      break;
+    usleep(10000);
+  }
+  if (i == 100) {
+    fprintf(stderr, "[-] %s: server didn't start\n", server);
+    kill(pid, SIGTERM);
+    return 1;
+  }
+  usleep(100000);
+  rss_before = read_status_kb(pid, "VmRSS:");
+
+  ev = events_create(EVENTS_DEFAULT);
+  if (ev == NULL) {
+    fprintf(stderr, "[-] events_create(): %s\n", strerror(errno));
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    free(fds);
+    return 1;
+  }
+
+  /* Open all the connections, and wait for them to echo */
+  start = _get_monotonic();
+  deadline = start + seconds * 1000000000ULL;
+  while (finished + errors < count) {
+    int n;
+    int k;
+
+    if (_get_monotonic() >= deadline) {
+      is_timeout = 1;
+      break;
+    }
+
+    while (started < count && inflight < inflight_max) {
+      int fd = start_connect(&sin, (unsigned)(started % SOURCE_COUNT));
+      if (fd == -1) {
+        fprintf(stderr, "[-] connect(): %s\n", strerror(errno));
+        fds[started++] = -1;
+        errors++;
+        continue;
+      }
+      fds[started] = fd;
+      events_add(ev, fd, POLLOUT, started);
+      started++;
+      inflight++;
+    }
+
+    n = events_wait(ev, ready, 256, 1000);
+    for (k = 0; k < n; k++) {
+      size_t j = ready[k].id;
+      int fd = fds[j];
+      char c;
+      ssize_t len;
+
+      if (ready[k].revents & (POLLERR | POLLHUP)) {
+        errors++;
+        inflight--;
+        events_remove(ev, fd);
+      } else if (ready[k].revents & POLLIN) {
+        len = recv(fd, &c, 1, 0);
+        if (len == 1) {
+          finished++;
+          inflight--;
+          events_remove(ev, fd);
+        } else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                                 errno == EINTR))
+          events_modify(ev, fd, POLLIN, j);
+        else {
+          /* closed by the server before it echoed, or failed */
+          errors++;
+          inflight--;
+          events_remove(ev, fd);
+        }
+      } else if (ready[k].revents & POLLOUT) {
+        len = send(fd, "x", 1, 0);
+        if (len == 1)
+          events_modify(ev, fd, POLLIN, j);
+        else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                               errno == EINTR))
+          events_modify(ev, fd, POLLOUT, j);
+        else {
+          errors++;
+          inflight--;
+          events_remove(ev, fd);
+        }
+      }
+    }
+  }
+  elapsed = _get_monotonic() - start;
+
+  rss_after = read_status_kb(pid, "VmRSS:");
+  hwm_after = read_status_kb(pid, "VmHWM:");
+
+  if (is_timeout)
+    fprintf(stderr, "[-] timed out after %u seconds, server stalled?\n",
+            seconds);
+  printf("connections:   %u (%u errors, %u unfinished)\n",
+         (unsigned)finished, (unsigned)errors,
+         (unsigned)(count - finished - errors));
+  printf("total time:    %.3f-seconds\n", elapsed / 1000000000.0);
+  printf("rate:          %.0f-connections/second\n",
+         finished / (elapsed / 1000000000.0));
+  printf("server RSS:    %lu-KB before, %lu-KB after, %lu-KB peak\n",
+         rss_before, rss_after, hwm_after);
+  if (finished)
+    printf("per connection: %.0f-bytes\n",
+           (rss_after - rss_before) * 1024.0 / finished);
+
+  /* Cleanup */
+  kill(pid, SIGTERM);
+  waitpid(pid, 0, 0);
+  for (i = 0; i < (int)started; i++) {
+    if (fds[i] != -1)
+      close(fds[i]);
+  }
+  free(fds);
+  events_destroy(ev);
+  return is_timeout ? 1 : 0;
+}
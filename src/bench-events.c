@@ -0,0 +1,179 @@
+/* bench-events
+ Benchmarks the cost of a wakeup with the `poll()`, `epoll`, and `io_uring`
+ backends of `util-events` as the number of idle connections grows.
+ Example usage:
+    bench-events
+    bench-events 1000 10000 100000
+
+ For each count, we register that many idle descriptors, plus one socket
+ that we repeatedly make ready by writing a byte to the other end of its
+ socketpair. We then measure how long it takes to wait for the event,
+ read the byte, and re-arm the socket. With `poll()`, every wakeup scans
+ all the idle descriptors, so the time grows with the count. With the
+ other backends, it should stay roughly constant.
+
+ The idle descriptors are all `dup()`s of one socket, so we don't need
+ to create many thousands of TCP connections. You'll probably need to
+ raise the file limit with `ulimit -n` to test the larger counts.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "util-clockcycle.h"
+#include "util-events.h"
+
+#define ITERATIONS 2000
+
+/**
+ * Raise the file descriptor limit as far as we are allowed, and return
+ * how many descriptors we can have open.
+ */
+static size_t raise_file_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+    return 1024;
+  if (rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+  }
+  return (size_t)rl.rlim_cur;
+}
+
+/**
+ * Runs one test of one backend with the given number of idle descriptors.
+ * @return
+ *  0 on success, -1 if the backend isn't available
+ */
+static int bench_backend(enum events_backend_t backend, size_t idle_count,
+                         const int *idle) {
+  struct events_t *ev;
+  struct events_ready_t ready[64];
+  int pair[2];
+  size_t i;
+  unsigned long long start, stop, cycles_start, cycles_stop;
+  unsigned long long add_time;
+
+  ev = events_create(backend);
+  if (ev == NULL)
+    return -1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+    fprintf(stderr, "[-] socketpair(): %s\n", strerror(errno));
+    exit(1);
+  }
+
+  /* Register all the idle descriptors */
+  start = _get_monotonic();
+  for (i = 0; i < idle_count; i++) {
+    if (events_add(ev, idle[i], POLLIN, i) == -1) {
+      fprintf(stderr, "[-] events_add(): %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+  events_add(ev, pair[0], POLLIN, idle_count);
+  add_time = _get_monotonic() - start;
+
+  /* Repeatedly make the one socket ready, and measure how long it takes
+   * to get the notification and re-arm it */
+  start = _get_monotonic();
+  cycles_start = util_clockcycle();
+  for (i = 0; i < ITERATIONS; i++) {
+    char c;
+    int count;
+
+    if (send(pair[1], "x", 1, 0) != 1) {
+      fprintf(stderr, "[-] send(): %s\n", strerror(errno));
+      exit(1);
+    }
+    count = events_wait(ev, ready, 64, -1);
+    if (count != 1 || ready[0].id != idle_count) {
+      fprintf(stderr, "[-] %s: unexpected event\n", events_name(ev));
+      exit(1);
+    }
+    if (recv(pair[0], &c, 1, 0) != 1) {
+      fprintf(stderr, "[-] recv(): %s\n", strerror(errno));
+      exit(1);
+    }
+    events_modify(ev, pair[0], POLLIN, idle_count);
+  }
+  cycles_stop = util_clockcycle();
+  stop = _get_monotonic();
+
+  printf("%8u %-9s %10.1f-ns/wakeup %10.0f-cycles/wakeup %8.1f-ns/add\n",
+         (unsigned)idle_count, events_name(ev),
+         (double)(stop - start) / ITERATIONS,
+         (double)(cycles_stop - cycles_start) / ITERATIONS,
+         (double)add_time / (idle_count + 1));
+
+  for (i = 0; i < idle_count; i++)
+    events_remove(ev, idle[i]);
+  events_remove(ev, pair[0]);
+  events_destroy(ev);
+  close(pair[0]);
+  close(pair[1]);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t default_counts[] = {1000, 10000, 100000};
+  size_t counts[16];
+  size_t count_count = 0;
+  size_t file_limit;
+  int i;
+
+  for (i = 1; i < argc && count_count < 16; i++)
+    counts[count_count++] = strtoul(argv[i], 0, 0);
+  if (count_count == 0) {
+    for (count_count = 0; count_count < 3; count_count++)
+      counts[count_count] = default_counts[count_count];
+  }
+
+  file_limit = raise_file_limit();
+
+  for (i = 0; i < (int)count_count; i++) {
+    size_t n = counts[i];
+    int *idle;
+    int pair[2];
+    size_t j;
+
+    /* Leave room for stdin/stdout/stderr, the backend, and a socketpair */
+    if (n + 16 > file_limit) {
+      printf("%8u skipped, need 'ulimit -n %u' or more\n", (unsigned)n,
+             (unsigned)(n + 16));
+      continue;
+    }
+
+    /* Create all the idle descriptors */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+      fprintf(stderr, "[-] socketpair(): %s\n", strerror(errno));
+      return 1;
+    }
+    idle = malloc(n * sizeof(*idle));
+    for (j = 0; j < n; j++) {
+      idle[j] = (j == 0) ? pair[0] : dup(pair[0]);
+      if (idle[j] == -1) {
+        fprintf(stderr, "[-] dup(): %s\n", strerror(errno));
+        return 1;
+      }
+    }
+
+    bench_backend(EVENTS_POLL, n, idle);
+    bench_backend(EVENTS_EPOLL, n, idle);
+    bench_backend(EVENTS_IOURING, n, idle);
+
+    for (j = 0; j < n; j++)
+      close(idle[j]);
+    close(pair[1]);
+    free(idle);
+  }
+
+  return 0;
+}
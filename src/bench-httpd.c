@@ -0,0 +1,349 @@
+/* bench-httpd
+ Measures the requests/second and latency of a web server. It starts the
+ server as a child process, opens a number of keep-alive connections to
+ it, and keeps each connection busy with requests for a fixed time. It
+ then reports the rate, and the distribution of the time between sending
+ a request and receiving the complete response.
+ Example usage:
+    bench-httpd --connections 50 --depth 4 --seconds 5
+ Options:
+    --connections <n> number of connections (default 50)
+    --depth <n>       requests pipelined on each connection (default 1)
+    --seconds <n>     how long to run (default 5)
+    --url <path>      the URL to request (default /hello)
+    --server <path>   the server to run (default bin/httpd), or "-" to
+                      use a server that's already running
+    --backend <name>  passed through to the server
+    --port <port>     the port for the server (default 17002)
+
+ The latency of a pipelined request includes the time spent waiting
+ behind the requests ahead of it on the same connection, which is what
+ the client actually sees.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util-clockcycle.h"
+#include "util-events.h"
+
+#define MAX_DEPTH 64
+
+struct client_t {
+  int fd;
+
+  /* The time each outstanding request was sent, oldest first */
+  unsigned long long sent[MAX_DEPTH];
+  size_t sent_head;
+  size_t outstanding;
+
+  /* The responses we've received, but not yet parsed */
+  char buf[16384];
+  size_t len;
+};
+
+struct latencies_t {
+  unsigned long long *list;
+  size_t count;
+  size_t max;
+};
+
+static void latency_add(struct latencies_t *lat, unsigned long long ns) {
+  if (lat->count >= lat->max) {
+    lat->max = lat->max * 2 + 4096;
+    lat->list = realloc(lat->list, lat->max * sizeof(lat->list[0]));
+    if (lat->list == NULL) {
+      fprintf(stderr, "[-] out of memory\n");
+      exit(1);
+    }
+  }
+  lat->list[lat->count++] = ns;
+}
+
+static int compare_ull(const void *lhs, const void *rhs) {
+  unsigned long long a = *(const unsigned long long *)lhs;
+  unsigned long long b = *(const unsigned long long *)rhs;
+  return (a > b) - (a < b);
+}
+
+static double percentile(const struct latencies_t *lat, double p) {
+  size_t index;
+  if (lat->count == 0)
+    return 0;
+  index = (size_t)(p / 100.0 * (lat->count - 1) + 0.5);
+  return lat->list[index] / 1000.0;
+}
+
+/**
+ * If there's a complete response at the start of the buffer, return its
+ * length, otherwise return 0 to wait for more. Returns -1 if the response
+ * doesn't have a length we can understand.
+ */
+static ptrdiff_t response_length(const char *buf, size_t len) {
+  const char *end;
+  const char *p;
+  size_t header_length;
+  unsigned long content_length = 0;
+  int has_length = 0;
+
+  end = memmem(buf, len, "\r\n\r\n", 4);
+  if (end == NULL)
+    return (len >= 8192) ? -1 : 0;
+  header_length = end - buf + 4;
+
+  /* find the Content-Length field */
+  for (p = buf; p < end; p++) {
+    p = memchr(p, '\n', end - p);
+    if (p == NULL)
+      break;
+    if (end - p > 16 && strncasecmp(p + 1, "Content-Length:", 15) == 0) {
+      content_length = strtoul(p + 16, 0, 10);
+      has_length = 1;
+      break;
+    }
+  }
+  if (!has_length)
+    return -1;
+  if (len < header_length + content_length)
+    return 0;
+  return (ptrdiff_t)(header_length + content_length);
+}
+
+/**
+ * Send requests until the pipeline is full
+ */
+static int fill_pipeline(struct client_t *c, const char *request,
+                         size_t request_length, size_t depth) {
+  while (c->outstanding < depth) {
+    ptrdiff_t count = send(c->fd, request, request_length, 0);
+    if (count != (ptrdiff_t)request_length)
+      return -1;
+    c->sent[(c->sent_head + c->outstanding) % MAX_DEPTH] = _get_monotonic();
+    c->outstanding++;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t connection_count = 50;
+  size_t depth = 1;
+  unsigned seconds = 5;
+  const char *url = "/hello";
+  const char *server = "bin/httpd";
+  const char *backend = NULL;
+  const char *port = "17002";
+  char request[1024];
+  size_t request_length;
+  int len;
+  struct sockaddr_in sin;
+  struct events_t *ev;
+  struct events_ready_t ready[256];
+  struct client_t *clients;
+  struct latencies_t lat = {0};
+  pid_t pid = 0;
+  size_t errors = 0;
+  size_t active;
+  unsigned long long start, stop, now;
+  size_t i;
+
+  for (i = 1; i < (size_t)argc; i++) {
+    if (i + 1 >= (size_t)argc) {
+      fprintf(stderr, "[-] %s: missing value\n", argv[i]);
+      return 1;
+    } else if (strcmp(argv[i], "--connections") == 0)
+      connection_count = strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--depth") == 0)
+      depth = strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--seconds") == 0)
+      seconds = (unsigned)strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--url") == 0)
+      url = argv[++i];
+    else if (strcmp(argv[i], "--server") == 0)
+      server = argv[++i];
+    else if (strcmp(argv[i], "--backend") == 0)
+      backend = argv[++i];
+    else if (strcmp(argv[i], "--port") == 0)
+      port = argv[++i];
+    else {
+      fprintf(stderr, "[-] unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (depth < 1 || depth > MAX_DEPTH) {
+    fprintf(stderr, "[-] depth must be 1 to %d\n", MAX_DEPTH);
+    return 1;
+  }
+  if (connection_count < 1)
+    connection_count = 1;
+  len = snprintf(request, sizeof(request),
+                 "GET %s HTTP/1.1\r\n"
+                 "Host: localhost\r\n"
+                 "User-Agent: bench-httpd\r\n"
+                 "Accept: */*\r\n"
+                 "\r\n",
+                 url);
+  if (len < 0 || (size_t)len >= sizeof(request)) {
+    fprintf(stderr, "[-] --url: too long, the request must fit in %u bytes\n",
+            (unsigned)sizeof(request) - 1);
+    return 1;
+  }
+  request_length = (size_t)len;
+
+  /* Start the server, with its logging going to /dev/null */
+  signal(SIGPIPE, SIG_IGN);
+  if (strcmp(server, "-") != 0) {
+    pid = fork();
+    if (pid == 0) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, 2);
+      if (backend)
+        execl(server, server, "127.0.0.1", port, "--backend", backend,
+              (char *)0);
+      else
+        execl(server, server, "127.0.0.1", port, (char *)0);
+      _exit(127);
+    }
+  }
+
+  /* Wait until it's listening */
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((unsigned short)atoi(port));
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  for (i = 0; i < 100; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int err = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+    close(fd);
+    if (err == 0)
+      break;
+    usleep(10000);
+  }
+  if (i == 100) {
+    fprintf(stderr, "[-] %s: server didn't start\n", server);
+    if (pid)
+      kill(pid, SIGTERM);
+    return 1;
+  }
+
+  /* Open all the connections. These are blocking connects, since we
+   * don't want to include the connection time in the results */
+  ev = events_create(EVENTS_DEFAULT);
+  clients = calloc(connection_count, sizeof(*clients));
+  for (i = 0; i < connection_count; i++) {
+    struct client_t *c = &clients[i];
+    int yes = 1;
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(c->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+      fprintf(stderr, "[-] connect(): %s\n", strerror(errno));
+      return 1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    events_add(ev, c->fd, POLLIN, i);
+  }
+
+  /* Start all the connections sending requests */
+  start = _get_monotonic();
+  stop = start + seconds * 1000000000ULL;
+  for (i = 0; i < connection_count; i++)
+    fill_pipeline(&clients[i], request, request_length, depth);
+  active = connection_count;
+
+  /* Receive responses, and replace each one with a new request until
+   * the time is up. After that, we just drain what's outstanding */
+  while (active) {
+    int n;
+    int k;
+
+    n = events_wait(ev, ready, 256, 1000);
+    if (n == 0) {
+      fprintf(stderr, "[-] timeout waiting for responses\n");
+      break;
+    }
+    now = _get_monotonic();
+    for (k = 0; k < n; k++) {
+      struct client_t *c = &clients[ready[k].id];
+      ptrdiff_t count;
+      ptrdiff_t length;
+
+      count = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+      if (count <= 0) {
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          events_modify(ev, c->fd, POLLIN, ready[k].id);
+          continue;
+        }
+        errors += c->outstanding;
+        c->outstanding = 0;
+        goto done;
+      }
+      c->len += count;
+
+      /* Remove all the complete responses */
+      while ((length = response_length(c->buf, c->len)) > 0) {
+        latency_add(&lat, now - c->sent[c->sent_head]);
+        c->sent_head = (c->sent_head + 1) % MAX_DEPTH;
+        c->outstanding--;
+        memmove(c->buf, c->buf + length, c->len - length);
+        c->len -= length;
+      }
+      if (length < 0) {
+        fprintf(stderr, "[-] bad response\n");
+        errors += c->outstanding;
+        c->outstanding = 0;
+        goto done;
+      }
+
+      if (now < stop &&
+          fill_pipeline(c, request, request_length, depth) == -1) {
+        errors++;
+        goto done;
+      }
+      if (c->outstanding) {
+        events_modify(ev, c->fd, POLLIN, ready[k].id);
+        continue;
+      }
+    done:
+      events_remove(ev, c->fd);
+      active--;
+    }
+  }
+  now = _get_monotonic();
+
+  qsort(lat.list, lat.count, sizeof(lat.list[0]), compare_ull);
+  printf("requests:      %u (%u errors)\n", (unsigned)lat.count,
+         (unsigned)errors);
+  printf("connections:   %u, depth %u\n", (unsigned)connection_count,
+         (unsigned)depth);
+  printf("rate:          %.0f-requests/second\n",
+         lat.count / ((now - start) / 1000000000.0));
+  printf("latency:       p50=%.1f-us p90=%.1f-us p99=%.1f-us p99.9=%.1f-us "
+         "max=%.1f-us\n",
+         percentile(&lat, 50), percentile(&lat, 90), percentile(&lat, 99),
+         percentile(&lat, 99.9), percentile(&lat, 100));
+
+  /* Cleanup */
+  if (pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+  }
+  for (i = 0; i < connection_count; i++)
+    close(clients[i].fd);
+  free(clients);
+  free(lat.list);
+  events_destroy(ev);
+  return 0;
+}
@@ -0,0 +1,495 @@
+/* bench-httpparse
+ Benchmarks parsing HTTP request headers with `parse-http`, comparing
+ feeding the parser one byte at a time with `httpparse_next()` against
+ handing it the whole buffer with `httpparse_buffer()`, using each of the
+ SIMD versions of the scanner that this CPU supports.
+ Example usage:
+    bench-httpparse
+    bench-httpparse 1000000
+    bench-httpparse --iterations 1000000 req1.txt req2.txt
+    bench-httpparse --check
+    bench-httpparse --fuzz crash-1234
+ Options:
+    --iterations <n>  times to parse the corpus (default 100000)
+    --check           only check the parser, don't benchmark it
+    --fuzz <file...>  run the files through the fuzzer entry point
+    <file...>         use these requests instead of the built-in corpus,
+                      one raw request per file
+
+ Before benchmarking, this checks that the parser gives the same result
+ no matter how each request in the corpus is split into fragments: at
+ every possible boundary into two fragments, and into fragments of every
+ size, with every SIMD version. It exits with an error if any differ, so
+ that it can be used as a regression test when tuning the parser.
+
+ Each test parses the same set of requests over and over, and reports
+ the throughput in bytes per clock cycle and MB/s, as well as the time
+ per request.
+
+ Compiling with -DHTTPPARSE_FUZZER leaves out `main()`, so that this can
+ be linked with libFuzzer (see `make bin/fuzz-httpparse`), which calls
+ `LLVMFuzzerTestOneInput()` with random input. That runs the same checks
+ on the input, plus decoding any body after the header, and aborts if
+ anything differs.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse-http.h"
+#include "util-clockcycle.h"
+
+/* The requests being tested, either the samples or read from files */
+struct corpus {
+  size_t count;
+  const char **list;
+  size_t *lengths;
+};
+
+static struct httpparser *create_parser(void) {
+  struct httpparser *parser;
+
+  parser = httpparser_create();
+  httpparser_register_url_prefix(parser, 1, "/", 0);
+  httpparser_register_url_prefix(parser, 2, "/images/", 0);
+  httpparser_register_url_prefix(parser, 3, "/api/", 0);
+  httpparser_register_url_prefix(parser, 4, "/search", 0);
+  httpparser_compile(parser);
+  return parser;
+}
+
+/**
+ * Returns whether two headers parsed the same, including the values of
+ * the fields that get recorded.
+ */
+static int is_same_field(const struct httpheader *a,
+                         const struct httpheaderfield *fa,
+                         const struct httpheader *b,
+                         const struct httpheaderfield *fb) {
+  if (fa->length != fb->length)
+    return 0;
+  if (fa->length == 0)
+    return 1;
+  return memcmp(httpheader_string(a, fa), httpheader_string(b, fb),
+                fa->length) == 0;
+}
+static int is_same(const struct httpheader *a, const struct httpheader *b) {
+  return a->is_done == b->is_done && a->is_error == b->is_error &&
+         a->method == b->method && a->url_id == b->url_id &&
+         a->version_major == b->version_major &&
+         a->version_minor == b->version_minor &&
+         a->is_close == b->is_close && a->is_keepalive == b->is_keepalive &&
+         a->is_transfer_encoding == b->is_transfer_encoding &&
+         a->is_chunked == b->is_chunked &&
+         a->has_content_length == b->has_content_length &&
+         a->content_length == b->content_length &&
+         a->host_port == b->host_port &&
+         is_same_field(a, &a->host, b, &b->host) &&
+         is_same_field(a, &a->cookie, b, &b->cookie);
+}
+
+/**
+ * Parse one byte at a time, the reference that the other ways of parsing
+ * must agree with. Returns the number of bytes in the header.
+ */
+static size_t parse_bytes(const struct httpparser *parser,
+                          struct httpheader *hdr, const char *buf,
+                          size_t length) {
+  size_t i;
+
+  httpparse_start(parser, hdr);
+  for (i = 0; i < length;) {
+    if (httpparse_next(parser, hdr, (unsigned char)buf[i++]))
+      break;
+  }
+  return i;
+}
+
+/**
+ * Parse the first 'split' bytes as one fragment, then the rest in
+ * fragments of 'fragment_size'. Each fragment is copied into a scratch
+ * buffer that's erased afterwards, the way a receive buffer gets reused,
+ * so that we catch fields left pointing into it. Returns the number of
+ * bytes in the header.
+ */
+static size_t parse_fragments(const struct httpparser *parser,
+                              struct httpheader *hdr, const char *buf,
+                              size_t length, size_t split,
+                              size_t fragment_size, char *scratch) {
+  size_t offset = 0;
+
+  httpparse_start(parser, hdr);
+  while (offset < length) {
+    size_t n = (offset == 0 && split) ? split : fragment_size;
+
+    if (n > length - offset)
+      n = length - offset;
+    memcpy(scratch, buf + offset, n);
+    offset += httpparse_buffer(parser, hdr, scratch, n);
+    if (hdr->is_done)
+      break;
+    memset(scratch, 0, n);
+  }
+  return offset;
+}
+
+/**
+ * Check that parsing gives the same result however the input is split,
+ * trying every 'step'th split into two fragments, then every 'step'th
+ * fragment size. Returns 0 if it does, or 1 + the number of the first
+ * split that differed.
+ */
+static size_t check_request(const struct httpparser *parser, const char *buf,
+                            size_t length, size_t step) {
+  struct httpheader expected;
+  size_t expected_length;
+  char *scratch;
+  size_t i;
+  size_t err = 0;
+
+  scratch = malloc(length + 1);
+  if (scratch == NULL)
+    abort();
+  expected_length = parse_bytes(parser, &expected, buf, length);
+
+  for (i = 0; i < 2 * length && err == 0; i += step) {
+    struct httpheader hdr;
+    size_t n;
+
+    if (i < length)
+      n = parse_fragments(parser, &hdr, buf, length, i, length, scratch);
+    else
+      n = parse_fragments(parser, &hdr, buf, length, 0, i - length + 1,
+                          scratch);
+    if (n != expected_length || !is_same(&hdr, &expected))
+      err = 1 + i;
+    httpparse_end(&hdr);
+  }
+
+  httpparse_end(&expected);
+  free(scratch);
+  return err;
+}
+
+/**
+ * The libFuzzer entry point. The first byte picks a step through the
+ * ways of splitting the rest, since trying every one is O(n^2) on large
+ * inputs. Any body after the header must decode the same whether it's
+ * given all at once or a byte at a time.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static struct httpparser *parser;
+  struct httpheader hdr;
+  const char *buf;
+  size_t step;
+  size_t offset;
+
+  if (parser == NULL)
+    parser = create_parser();
+  if (size == 0)
+    return 0;
+  step = 1 + size / 64;
+  step += data[0] % step;
+  buf = (const char *)data + 1;
+  size--;
+
+  if (check_request(parser, buf, size, step))
+    abort();
+
+  offset = parse_bytes(parser, &hdr, buf, size);
+  if (hdr.is_done && !hdr.is_error) {
+    struct httpbody body1;
+    struct httpbody body2;
+    unsigned long long total = 0;
+    size_t i;
+
+    httpbody_start(&body1, &hdr);
+    for (i = offset; i < size && !body1.is_done && !body1.is_error;) {
+      const unsigned char *p;
+      size_t n;
+
+      i += httpbody_next(&body1, buf + i, size - i, &p, &n);
+      if (n && ((const char *)p < buf || (const char *)p + n > buf + size))
+        abort();
+    }
+
+    httpbody_start(&body2, &hdr);
+    for (i = offset; i < size && !body2.is_done && !body2.is_error;) {
+      const unsigned char *p;
+      size_t n;
+
+      i += httpbody_next(&body2, buf + i, 1, &p, &n);
+      total += n;
+    }
+
+    if (body1.is_done != body2.is_done || body1.is_error != body2.is_error ||
+        body1.total != body2.total || total != body2.total)
+      abort();
+  }
+  httpparse_end(&hdr);
+  return 0;
+}
+
+#ifndef HTTPPARSE_FUZZER
+/* Typical requests from browsers and other clients */
+static const char *samples[] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: www.nytimes.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_14_5) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/76.0.3809.100 "
+    "Safari/537.36\r\n"
+    "DNT: 1\r\n"
+    "Accept: "
+    "text/html,application/xhtml+xml,application/xml;q=0.9,image/"
+    "webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: nyt-a=Xa6aiXfxMmO-BS3Uf_LJoS; "
+    "optimizelyEndUserId=oeu1546063050462r0.5510475026965527\r\n"
+    "\r\n",
+
+    "GET /images/logo/2019/header-logo-small.png HTTP/1.1\r\n"
+    "Host: static.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 "
+    "Firefox/68.0\r\n"
+    "Accept: image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "\r\n",
+
+    "POST /api/v1/events HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 0\r\n"
+    "Authorization: Bearer "
+    "eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIn0\r\n"
+    "\r\n",
+
+    "GET /search?q=http+parser&sourceid=chrome&ie=UTF-8&oq=http%20parser "
+    "HTTP/1.1\r\n"
+    "Host: www.google.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://www.google.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: 1P_JAR=2019-08-25-17; NID=188=abcdefghijklmnopqrstuvwxyz01234"
+    "56789ABCDEFGHIJKLMNOPQRSTUVWXYZ; CONSENT=YES+US.en+20150628-20-0\r\n"
+    "\r\n",
+
+    "GET /robots.txt HTTP/1.0\r\n"
+    "User-Agent: curl/7.64.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "PUT /upload/video.mp4 HTTP/1.1\r\n"
+    "host: [2001:db8::1]:8443\r\n"
+    "transfer-encoding: chunked\r\n"
+    "content-type: video/mp4\r\n"
+    "expect: 100-continue\r\n"
+    "\r\n",
+
+    "OPTIONS * HTTP/1.1\r\n"
+    "Host: cdn.example.net\r\n"
+    "Origin: https://app.example.com\r\n"
+    "Access-Control-Request-Method: POST\r\n"
+    "Access-Control-Request-Headers: content-type,x-requested-with\r\n"
+    "\r\n",
+};
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+
+/**
+ * Check the whole corpus with each SIMD version
+ */
+static int check_corpus(struct httpparser *parser,
+                        const struct corpus *corpus) {
+  enum scan_isa_t isa;
+  size_t i;
+
+  for (isa = SCAN_ISA_SCALAR; isa <= SCAN_ISA_AVX2; isa++) {
+    if (!scan_isa_is_supported(isa))
+      continue;
+    httpparser_set_isa(parser, isa);
+    for (i = 0; i < corpus->count; i++) {
+      size_t err;
+
+      err = check_request(parser, corpus->list[i], corpus->lengths[i], 1);
+      if (err) {
+        err--;
+        fprintf(stderr, "[-] %s: request #%u differs when %s %u\n",
+                scan_isa_name(isa), (unsigned)i,
+                err < corpus->lengths[i] ? "split at" : "fragmented by",
+                (unsigned)(err < corpus->lengths[i]
+                               ? err
+                               : err - corpus->lengths[i] + 1));
+        return 1;
+      }
+    }
+  }
+  httpparser_set_isa(parser, SCAN_ISA_AUTO);
+  printf("[+] %u requests parse the same however they're fragmented\n",
+         (unsigned)corpus->count);
+  return 0;
+}
+
+static void bench(const struct httpparser *parser, const char *name,
+                  const struct corpus *corpus, int is_buffer,
+                  size_t iterations) {
+  struct httpheader hdr;
+  unsigned long long total_bytes = 0;
+  unsigned long long start, stop, cycles_start, cycles_stop;
+  unsigned long long checksum = 0;
+  size_t i, j;
+
+  start = _get_monotonic();
+  cycles_start = util_clockcycle();
+  for (i = 0; i < iterations; i++) {
+    for (j = 0; j < corpus->count; j++) {
+      const char *sample = corpus->list[j];
+      size_t length = corpus->lengths[j];
+
+      httpparse_start(parser, &hdr);
+      if (is_buffer) {
+        httpparse_buffer(parser, &hdr, sample, length);
+      } else {
+        size_t k;
+        for (k = 0; k < length; k++) {
+          if (httpparse_next(parser, &hdr, sample[k]))
+            break;
+        }
+      }
+
+      /* so that the compiler can't optimize anything away */
+      checksum += hdr.method + hdr.url_id + hdr.is_done;
+      httpparse_end(&hdr);
+      total_bytes += length;
+    }
+  }
+  cycles_stop = util_clockcycle();
+  stop = _get_monotonic();
+
+  printf("%-15s %6.3f-bytes/cycle %8.1f-ns/request %8.1f-MB/s (%llu)\n",
+         name,
+         (double)total_bytes / (cycles_stop - cycles_start),
+         (double)(stop - start) / (iterations * corpus->count),
+         total_bytes * 1000.0 / (stop - start), checksum);
+}
+
+/**
+ * Read a whole file, such as a captured request or a fuzzer crash
+ */
+static char *read_file(const char *filename, size_t *length) {
+  FILE *fp;
+  char *buf = NULL;
+  size_t max = 0;
+
+  *length = 0;
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[-] %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+  for (;;) {
+    size_t count;
+
+    if (*length == max) {
+      max = max * 2 + 4096;
+      buf = realloc(buf, max);
+      if (buf == NULL)
+        abort();
+    }
+    count = fread(buf + *length, 1, max - *length, fp);
+    if (count == 0)
+      break;
+    *length += count;
+  }
+  fclose(fp);
+  return buf;
+}
+
+int main(int argc, char *argv[]) {
+  struct httpparser *parser;
+  struct corpus corpus = {0};
+  size_t iterations = 100000;
+  int is_check_only = 0;
+  int is_fuzz = 0;
+  enum scan_isa_t isa;
+  int i;
+
+  corpus.list = calloc(argc + SAMPLE_COUNT, sizeof(corpus.list[0]));
+  corpus.lengths = calloc(argc + SAMPLE_COUNT, sizeof(corpus.lengths[0]));
+  if (corpus.list == NULL || corpus.lengths == NULL)
+    abort();
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+      iterations = strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--check") == 0)
+      is_check_only = 1;
+    else if (strcmp(argv[i], "--fuzz") == 0)
+      is_fuzz = 1;
+    else if (i == 1 && '0' <= argv[i][0] && argv[i][0] <= '9')
+      iterations = strtoul(argv[i], 0, 0);
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "[-] unknown option: %s\n", argv[i]);
+      return 1;
+    } else {
+      size_t length;
+      char *buf = read_file(argv[i], &length);
+      if (buf == NULL)
+        return 1;
+      corpus.list[corpus.count] = buf;
+      corpus.lengths[corpus.count++] = length;
+    }
+  }
+
+  /* Replay inputs, such as crashes found by the fuzzer */
+  if (is_fuzz) {
+    size_t j;
+    for (j = 0; j < corpus.count; j++)
+      LLVMFuzzerTestOneInput((const uint8_t *)corpus.list[j],
+                             corpus.lengths[j]);
+    printf("[+] %u inputs passed\n", (unsigned)corpus.count);
+    return 0;
+  }
+
+  if (corpus.count == 0) {
+    for (corpus.count = 0; corpus.count < SAMPLE_COUNT; corpus.count++) {
+      corpus.list[corpus.count] = samples[corpus.count];
+      corpus.lengths[corpus.count] = strlen(samples[corpus.count]);
+    }
+  }
+
+  parser = create_parser();
+  if (check_corpus(parser, &corpus)) {
+    httpparser_destroy(parser);
+    return 1;
+  }
+  if (is_check_only) {
+    httpparser_destroy(parser);
+    return 0;
+  }
+
+  bench(parser, "per-byte", &corpus, 0, iterations);
+  for (isa = SCAN_ISA_SCALAR; isa <= SCAN_ISA_AVX2; isa++) {
+    char name[64];
+    if (!scan_isa_is_supported(isa))
+      continue;
+    httpparser_set_isa(parser, isa);
+    snprintf(name, sizeof(name), "buffer/%s", scan_isa_name(isa));
+    bench(parser, name, &corpus, 1, iterations);
+  }
+
+  httpparser_destroy(parser);
+  return 0;
+}
+#endif
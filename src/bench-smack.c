@@ -0,0 +1,548 @@
+/* bench-smack
+ Benchmarks searching with `util-smack`, the Aho-Corasick pattern
+ matcher, with different sets of patterns and different kinds of input.
+ Example usage:
+    bench-smack
+    bench-smack --quick
+    bench-smack --words /usr/share/dict/words --pcap capture.pcap
+ Options:
+    --quick           only up to 10k patterns
+    --size <n>        megabytes of each kind of synthetic input (default 8)
+    --words <file>    English words, one per line, for the word patterns
+                      and the text, instead of made-up words
+    --pcap <file>     also search the TCP and UDP payloads in a capture
+    --threads <n>     threads for compiling (default 1)
+    --batch           get the matches with `smack_search_batch()`, instead
+                      of a callback for each one
+
+ The pattern sets are the HTTP methods, then 1k, 10k, and 100k patterns
+ of random printable characters, and the same counts of English words,
+ each both case-sensitive and not. Without a list of words, they are
+ made up from common English syllables, which is close enough for the
+ shape of the state-machine.
+
+ The inputs are random bytes, printable text made of the same words,
+ HTTP requests, and optionally the packets from a capture file. Each
+ input is searched in 1460 byte fragments, like the payloads of TCP
+ packets, with the state carried between them, except that packets from
+ a capture are each searched from the start.
+
+ For each pair, this reports the clock cycles per byte, the throughput,
+ the matches per second, and the size of the table, plus how long it
+ took to compile.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util-clockcycle.h"
+#include "util-smack.h"
+
+#define FRAGMENT_SIZE 1460
+
+/* A list of byte strings, used for both the patterns and the packets */
+struct strings {
+  size_t count;
+  size_t max;
+  unsigned char **list;
+  size_t *lengths;
+};
+
+static void strings_add(struct strings *s, const void *buf, size_t length) {
+  if (s->count == s->max) {
+    s->max = s->max * 2 + 1024;
+    s->list = realloc(s->list, s->max * sizeof(s->list[0]));
+    s->lengths = realloc(s->lengths, s->max * sizeof(s->lengths[0]));
+    if (s->list == NULL || s->lengths == NULL)
+      abort();
+  }
+  s->list[s->count] = malloc(length ? length : 1);
+  if (s->list[s->count] == NULL)
+    abort();
+  memcpy(s->list[s->count], buf, length);
+  s->lengths[s->count++] = length;
+}
+
+static void strings_free(struct strings *s) {
+  size_t i;
+
+  for (i = 0; i < s->count; i++)
+    free(s->list[i]);
+  free(s->list);
+  free(s->lengths);
+  memset(s, 0, sizeof(*s));
+}
+
+/* The same numbers every run, so that runs can be compared */
+static unsigned next_rand(unsigned long long *seed) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned)(*seed >> 33);
+}
+
+/**
+ * The next English word, either from the list, or made up from two to
+ * four syllables.
+ */
+static size_t next_word(unsigned long long *seed, const struct strings *words,
+                        char *word, size_t max) {
+  static const char *syllables[] = {
+      "the", "in",  "er",  "an",  "re",  "on",  "at",  "en", "nd",  "ti",
+      "es",  "or",  "te",  "of",  "ed",  "is",  "it",  "al", "ar",  "st",
+      "to",  "nt",  "ng",  "se",  "ha",  "as",  "ou",  "io", "le",  "ve",
+      "co",  "me",  "de",  "hi",  "ri",  "ro",  "ic",  "ne", "ea",  "ra",
+      "ce",  "li",  "ch",  "ll",  "be",  "ma",  "si",  "om", "ur",  "ca",
+      "el",  "ta",  "la",  "ns",  "di",  "fo",  "ho",  "pe", "ec",  "pr",
+      "no",  "ct",  "us",  "ac",  "ot",  "il",  "tr",  "ly", "nc",  "et",
+      "ut",  "ss",  "so",  "rs",  "un",  "lo",  "wa",  "ge", "ie",  "wh",
+      "ing", "ion", "ent", "and", "for", "tion", "ment", "ness", "able",
+      "ous", "pro", "con", "ver", "ter", "ally", "ful", "less", "ship"};
+  size_t syllable_count = sizeof(syllables) / sizeof(syllables[0]);
+  size_t length = 0;
+  unsigned n;
+
+  if (words->count) {
+    size_t i = next_rand(seed) % words->count;
+    length = words->lengths[i] < max ? words->lengths[i] : max;
+    memcpy(word, words->list[i], length);
+    return length;
+  }
+
+  for (n = 2 + next_rand(seed) % 3; n > 0; n--) {
+    const char *syllable = syllables[next_rand(seed) % syllable_count];
+    size_t i;
+
+    for (i = 0; syllable[i] && length < max; i++)
+      word[length++] = syllable[i];
+  }
+  return length;
+}
+
+/**
+ * Read the words from a file, one per line.
+ * @return
+ *  0 on success, -1 if there aren't any
+ */
+static int read_words(const char *filename, struct strings *words) {
+  char line[256];
+  FILE *fp;
+
+  fp = fopen(filename, "rt");
+  if (fp == NULL) {
+    fprintf(stderr, "[-] %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    size_t length = strcspn(line, "\r\n");
+    if (length)
+      strings_add(words, line, length);
+  }
+  fclose(fp);
+  if (words->count == 0) {
+    fprintf(stderr, "[-] %s: no words\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Read a capture in the libpcap format, keeping the TCP and UDP payloads
+ * of IPv4 and IPv6 packets over Ethernet.
+ */
+static int read_pcap(const char *filename, struct strings *packets) {
+  unsigned char hdr[24];
+  unsigned char *buf;
+  int is_swapped;
+  FILE *fp;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[-] %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  buf = malloc(65536);
+  if (buf == NULL)
+    abort();
+  if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+      (memcmp(hdr, "\xd4\xc3\xb2\xa1", 4) != 0 &&
+       memcmp(hdr, "\xa1\xb2\xc3\xd4", 4) != 0)) {
+    fprintf(stderr, "[-] %s: not a pcap file\n", filename);
+    fclose(fp);
+    free(buf);
+    return -1;
+  }
+  is_swapped = (hdr[0] == 0xa1);
+#define PCAP32(p)                                                             \
+  (is_swapped ? (unsigned)(p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3]  \
+              : (unsigned)(p)[3] << 24 | (p)[2] << 16 | (p)[1] << 8 | (p)[0])
+  if (PCAP32(hdr + 20) != 1) {
+    fprintf(stderr, "[-] %s: not Ethernet\n", filename);
+    fclose(fp);
+    free(buf);
+    return -1;
+  }
+
+  for (;;) {
+    unsigned char rec[16];
+    size_t length;
+    size_t offset = 14;
+    unsigned ethertype;
+    unsigned protocol;
+
+    if (fread(rec, 1, sizeof(rec), fp) != sizeof(rec))
+      break;
+    length = PCAP32(rec + 8);
+    if (length > 65536 || fread(buf, 1, length, fp) != length)
+      break;
+    if (length < offset)
+      continue;
+
+    /* Ethernet, maybe with a VLAN tag */
+    ethertype = buf[12] << 8 | buf[13];
+    if (ethertype == 0x8100 && length >= 18) {
+      ethertype = buf[16] << 8 | buf[17];
+      offset = 18;
+    }
+    if (ethertype == 0x0800 && length >= offset + 20) {
+      protocol = buf[offset + 9];
+      offset += (buf[offset] & 0x0F) * 4;
+    } else if (ethertype == 0x86dd && length >= offset + 40) {
+      protocol = buf[offset + 6];
+      offset += 40;
+    } else
+      continue;
+
+    if (protocol == 6 && length >= offset + 20)
+      offset += (buf[offset + 12] >> 4) * 4;
+    else if (protocol == 17 && length >= offset + 8)
+      offset += 8;
+    else
+      continue;
+    if (offset < length)
+      strings_add(packets, buf + offset, length - offset);
+  }
+#undef PCAP32
+  fclose(fp);
+  free(buf);
+  if (packets->count == 0) {
+    fprintf(stderr, "[-] %s: no TCP or UDP payloads\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/* An input to search, as a list of fragments or packets */
+struct input {
+  const char *name;
+  struct strings fragments;
+  size_t total;
+  int is_stream;
+};
+
+/**
+ * Split the buffer into fragments, the way TCP would
+ */
+static void input_fragment(struct input *input, const unsigned char *buf,
+                           size_t length) {
+  size_t offset;
+
+  for (offset = 0; offset < length; offset += FRAGMENT_SIZE) {
+    size_t n = length - offset < FRAGMENT_SIZE ? length - offset
+                                               : FRAGMENT_SIZE;
+    strings_add(&input->fragments, buf + offset, n);
+  }
+  input->total = length;
+  input->is_stream = 1;
+}
+
+static void make_random(struct input *input, size_t size) {
+  unsigned long long seed = 1;
+  unsigned char *buf;
+  size_t i;
+
+  buf = malloc(size);
+  if (buf == NULL)
+    abort();
+  for (i = 0; i < size; i++)
+    buf[i] = (unsigned char)next_rand(&seed);
+  input->name = "random";
+  input_fragment(input, buf, size);
+  free(buf);
+}
+
+static void make_text(struct input *input, size_t size,
+                      const struct strings *words) {
+  unsigned long long seed = 2;
+  unsigned char *buf;
+  size_t i = 0;
+
+  buf = malloc(size + 64);
+  if (buf == NULL)
+    abort();
+  while (i < size) {
+    unsigned r = next_rand(&seed);
+    size_t length = next_word(&seed, words, (char *)buf + i, 32);
+
+    if (r % 10 == 0 && length)
+      buf[i] = (unsigned char)toupper(buf[i]);
+    i += length;
+    if (r % 13 == 0)
+      buf[i++] = ',';
+    else if (r % 17 == 0)
+      buf[i++] = '.';
+    buf[i++] = (r % 71 == 0) ? '\n' : ' ';
+  }
+  input->name = "text";
+  input_fragment(input, buf, size);
+  free(buf);
+}
+
+static void make_http(struct input *input, size_t size,
+                      const struct strings *words) {
+  static const char *methods[] = {"GET", "GET", "GET", "POST", "PUT", "HEAD"};
+  static const char *agents[] = {
+      "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_14_5) AppleWebKit/537.36 "
+      "(KHTML, like Gecko) Chrome/76.0.3809.100 Safari/537.36",
+      "Mozilla/5.0 (X11; Linux x86_64; rv:68.0) Gecko/20100101 Firefox/68.0",
+      "curl/7.64.1"};
+  unsigned long long seed = 3;
+  unsigned char *buf;
+  size_t i = 0;
+
+  buf = malloc(size + 4096);
+  if (buf == NULL)
+    abort();
+  while (i < size) {
+    char path[100];
+    char host[40];
+    size_t n;
+
+    n = next_word(&seed, words, path, 30);
+    path[n] = '\0';
+    n = next_word(&seed, words, host, 30);
+    host[n] = '\0';
+    i += sprintf((char *)buf + i,
+                 "%s /%s/%u.html HTTP/1.1\r\n"
+                 "Host: www.%s.com\r\n"
+                 "User-Agent: %s\r\n"
+                 "Accept: text/html,application/xhtml+xml,application/xml;"
+                 "q=0.9,*/*;q=0.8\r\n"
+                 "Accept-Encoding: gzip, deflate\r\n"
+                 "Accept-Language: en-US,en;q=0.9\r\n"
+                 "Cookie: session=%08x%08x\r\n"
+                 "Connection: keep-alive\r\n"
+                 "\r\n",
+                 methods[next_rand(&seed) % 6], path, next_rand(&seed) % 1000,
+                 host, agents[next_rand(&seed) % 3], next_rand(&seed),
+                 next_rand(&seed));
+  }
+  input->name = "http";
+  input_fragment(input, buf, size);
+  free(buf);
+}
+
+/* A set of patterns to compile */
+struct patternset {
+  char name[32];
+  struct strings patterns;
+};
+
+static void make_methods(struct patternset *set) {
+  static const char *methods[] = {
+      "GET",     "PUT",        "POST",        "OPTIONS",  "HEAD",
+      "DELETE",  "TRACE",      "CONNECT",     "PROPFIND", "PROPPATCH",
+      "MKCOL",   "COPY",       "MOVE",        "LOCK",     "UNLOCK",
+      "PATCH",   "SEARCH",     "REPORT",      "CHECKOUT", "CHECKIN",
+      "MERGE",   "MKACTIVITY", "MKWORKSPACE", "UPDATE",   "LABEL",
+      "ACL",     "ORDERPATCH", "VERSION-CONTROL", "BASELINE-CONTROL",
+      "UNCHECKOUT"};
+  size_t i;
+
+  snprintf(set->name, sizeof(set->name), "methods");
+  for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    strings_add(&set->patterns, methods[i], strlen(methods[i]));
+}
+
+static void make_random_patterns(struct patternset *set, size_t count) {
+  unsigned long long seed = 4 + count;
+  size_t i;
+
+  snprintf(set->name, sizeof(set->name), "random-%uk",
+           (unsigned)(count / 1000));
+  for (i = 0; i < count; i++) {
+    unsigned char pattern[20];
+    size_t length = 4 + next_rand(&seed) % 16;
+    size_t j;
+
+    for (j = 0; j < length; j++)
+      pattern[j] = (unsigned char)(' ' + next_rand(&seed) % 95);
+    strings_add(&set->patterns, pattern, length);
+  }
+}
+
+static void make_word_patterns(struct patternset *set, size_t count,
+                               const struct strings *words) {
+  unsigned long long seed = 5 + count;
+  size_t i;
+
+  snprintf(set->name, sizeof(set->name), "words-%uk",
+           (unsigned)(count / 1000));
+  for (i = 0; i < count; i++) {
+    char word[32];
+    size_t length = next_word(&seed, words, word, sizeof(word));
+    strings_add(&set->patterns, word, length);
+  }
+}
+
+static int count_found(size_t id, int offset, void *data) {
+  (void)id;
+  (void)offset;
+  (*(unsigned long long *)data)++;
+  return 0;
+}
+
+/**
+ * Search the input enough times to take at least a second, then report
+ * the speed.
+ */
+static void bench(const struct SMACK *smack, const char *name,
+                  const struct input *input, int is_batch) {
+  struct SmackMatch matches[256];
+  unsigned long long found = 0;
+  unsigned long long total = 0;
+  unsigned long long start, stop, cycles_start, cycles_stop;
+
+  start = _get_monotonic();
+  cycles_start = util_clockcycle();
+  do {
+    struct SmackCursor cursor = {0};
+    unsigned state = 0;
+    size_t i;
+
+    for (i = 0; i < input->fragments.count; i++) {
+      if (!input->is_stream)
+        state = 0;
+      if (!is_batch) {
+        smack_search(smack, input->fragments.list[i],
+                     (unsigned)input->fragments.lengths[i], count_found,
+                     &found, &state);
+        continue;
+      }
+      if (!input->is_stream)
+        memset(&cursor, 0, sizeof(cursor));
+      for (;;) {
+        unsigned count = smack_search_batch(
+            smack, input->fragments.list[i],
+            (unsigned)input->fragments.lengths[i], matches, 256, &cursor);
+        found += count;
+        if (count < 256)
+          break;
+      }
+    }
+    if (!is_batch)
+      smack_search_end(smack, count_found, &found, &state);
+    total += input->total;
+    stop = _get_monotonic();
+  } while (stop - start < 1000000000ULL);
+  cycles_stop = util_clockcycle();
+
+  printf("%-18s %-7s %7.2f-cycles/byte %8.1f-MB/s %12.0f-matches/s\n", name,
+         input->name, (double)(cycles_stop - cycles_start) / total,
+         total * 1000.0 / (stop - start),
+         found * 1000000000.0 / (stop - start));
+}
+
+int main(int argc, char *argv[]) {
+  enum { MAX_SETS = 8, MAX_INPUTS = 4 };
+  struct patternset sets[MAX_SETS];
+  struct input inputs[MAX_INPUTS];
+  struct strings words = {0};
+  const char *pcap = NULL;
+  size_t size = 8;
+  size_t max_count = 100000;
+  unsigned threads = 1;
+  int is_batch = 0;
+  size_t set_count = 0;
+  size_t input_count = 0;
+  size_t count;
+  size_t i;
+  int nocase;
+
+  for (i = 1; i < (size_t)argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0)
+      max_count = 10000;
+    else if (strcmp(argv[i], "--size") == 0 && i + 1 < (size_t)argc)
+      size = strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--words") == 0 && i + 1 < (size_t)argc) {
+      if (read_words(argv[++i], &words) != 0)
+        return 1;
+    } else if (strcmp(argv[i], "--pcap") == 0 && i + 1 < (size_t)argc)
+      pcap = argv[++i];
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < (size_t)argc)
+      threads = (unsigned)strtoul(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "--batch") == 0)
+      is_batch = 1;
+    else {
+      fprintf(stderr, "[-] unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (size == 0)
+    size = 1;
+  size *= 1024 * 1024;
+
+  memset(sets, 0, sizeof(sets));
+  memset(inputs, 0, sizeof(inputs));
+  make_methods(&sets[set_count++]);
+  for (count = 1000; count <= max_count; count *= 10)
+    make_random_patterns(&sets[set_count++], count);
+  for (count = 1000; count <= max_count; count *= 10)
+    make_word_patterns(&sets[set_count++], count, &words);
+
+  make_random(&inputs[input_count++], size);
+  make_text(&inputs[input_count++], size, &words);
+  make_http(&inputs[input_count++], size, &words);
+  if (pcap) {
+    struct input *input = &inputs[input_count++];
+    input->name = "pcap";
+    if (read_pcap(pcap, &input->fragments) != 0)
+      return 1;
+    for (i = 0; i < input->fragments.count; i++)
+      input->total += input->fragments.lengths[i];
+  }
+
+  for (i = 0; i < set_count; i++) {
+    for (nocase = 0; nocase < 2; nocase++) {
+      struct SMACK *smack;
+      unsigned long long start, stop;
+      char name[64];
+      size_t j;
+
+      smack = smack_create(sets[i].name, nocase);
+      smack_set_threads(smack, threads);
+      for (j = 0; j < sets[i].patterns.count; j++)
+        smack_add_pattern(smack, sets[i].patterns.list[j],
+                          sets[i].patterns.lengths[j], j, 0);
+      start = _get_monotonic();
+      smack_compile(smack);
+      stop = _get_monotonic();
+
+      snprintf(name, sizeof(name), "%s%s", sets[i].name,
+               nocase ? "/nocase" : "");
+      printf("%-18s compiled %u patterns in %.3f-sec, %.1f-MB\n", name,
+             (unsigned)sets[i].patterns.count, (stop - start) / 1000000000.0,
+             smack_memory_size(smack) / (1024.0 * 1024.0));
+      for (j = 0; j < input_count; j++)
+        bench(smack, name, &inputs[j], is_batch);
+      smack_destroy(smack);
+    }
+    strings_free(&sets[i].patterns);
+  }
+
+  for (i = 0; i < input_count; i++)
+    strings_free(&inputs[i].fragments);
+  strings_free(&words);
+  return 0;
+}
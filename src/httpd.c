@@ -1,8 +1,35 @@
 /*
     This is a basic web server.
+
+    It's event-driven, handling all the connections in a single thread,
+    using the `util-events` module to wait only on the sockets that are
+    ready. Incoming bytes are fed into the incremental HTTP parser as they
+    arrive, so a request split across many packets is handled the same as
+    one that arrives all at once, and we never need to buffer a partial
+    request header.
+
+    Connections are reused for many requests (keep-alive), and clients
+    may send more requests before receiving the responses to the earlier
+    ones (pipelining). The responses are queued in order, and we stop
+    reading from a connection while it has responses waiting to be sent,
+    so that a client can't make us buffer an unlimited amount.
+
+    The request is dispatched by matching the URL against a table of
+    prefixes, using the Aho-Corasick state-machine built by the parser.
+
+    Messages about connections are logged with the `util-logger` module,
+    which only copies the binary address when the message is logged, and
+    formats it later in a background thread. Accepting a connection never
+    calls `getnameinfo()`, or writes to `stderr`.
+
+    Usage:
+        httpd [<address>] <port> [--backend <poll|epoll|uring>] [-d]
 */
-#include "http-parse.h"
-#include "smack.h"
+#define _GNU_SOURCE /* accept4() */
+#include "parse-http.h"
+#include "util-events.h"
+#include "util-logger.h"
+#include "util-malloc.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -13,7 +40,6 @@
 #include <signal.h>
 
 #include <unistd.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -23,18 +49,40 @@
 /* Set with command-line '-d' otion to enable debug printf() */
 int is_debug = 0;
 
+/* The number of bytes we receive at a time */
+#define RECV_BUFFER_SIZE 8192
+
+/* The maximum size of a request header, before we reject it */
+#define MAX_HEADER_SIZE 16384
+
+/* The maximum number of events we process per wakeup */
+#define MAX_EVENTS 256
+
+/* The number of connection records we allocate at a time */
+#define CONNECTIONS_PER_SLAB 64
 
+/* The most messages we can log before the logging thread gets to them */
+#define LOG_RING_SIZE 4096
 
+/* Log a message about a connection, with the address of the other side */
+#define LOG_PEER(httpd, fmt, c, err) \
+    logger_addr((httpd)->log, fmt, (struct sockaddr *)&(c)->peer, \
+                (c)->peer_addrlen, err)
+
+struct httpserver;
+struct connection;
+
+/**
+ * An entry in the table of URLs we serve. A request is handled by the
+ * entry with the longest prefix matching the start of its URL.
+ */
 struct url
 {
-    char *prefix;
-    char *filename;
-    int type;
-    void *userdata;
-    int (*callback_open)(struct connection *c);
-    int (*callback_read)(struct connection *c);
-    int (*callback_write)(struct connection *c);
-    int (*callback_close)(struct connection *c, int status);
+    const char *prefix;
+    const char *content_type;
+    const char *body;
+    void (*callback_request)(struct httpserver *httpd, struct connection *c,
+                             const struct url *url);
 };
 
 struct configuration
@@ -42,28 +90,85 @@ struct configuration
     const char *hostname;
     const char *portname;
     unsigned milliseconds_timeout;
-    struct url *urls;
-    size_t url_count;
+    enum events_backend_t backend;
 };
 
 struct connection
 {
-    char *buf; 
-    size_t len;
+    /* The socket, or -1 if this record is free */
     int fd;
-    bool is_writing;
-    struct url *url;
-    char addrname[NI_MAXHOST];
-    char portname[NI_MAXSERV];
+
+    /* While this record is on the free list, the next free record */
+    struct connection *next_free;
+
+    /* The bytes we've received, but haven't yet parsed. This buffer
+     * stays with the record when it's freed, to be reused by the next
+     * connection */
+    unsigned char *buf;
+    size_t len;
+
+    /* The state of parsing the current request header */
+    struct httpheader hdr;
+    size_t header_bytes;
+
+    /* The state of decoding the current request's body, which we skip
+     * before the next request starts */
+    struct httpbody body;
+    bool is_body;
+
+    /* The responses we've queued, but haven't yet sent */
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_max;
+
+    /* Set when we should close the connection after sending the
+     * queued responses */
+    bool is_closing;
+
+    /* The address of the other side, which isn't formatted until we
+     * log a message about this connection */
+    struct sockaddr_in6 peer;
+    socklen_t peer_addrlen;
+};
+
+/**
+ * Connection records are allocated in "slabs", and never move, so that we
+ * can give the event backend a pointer to the record as the 'id'.
+ */
+struct slab
+{
+    struct slab *next;
+    struct connection records[CONNECTIONS_PER_SLAB];
 };
 
 struct httpserver
 {
-    struct connection connections[FD_SETSIZE];
+    struct events_t *events;
+    struct httpparser *parser;
+    const struct url *urls;
+    size_t url_count;
+
+    /* The listening socket, which we can tell apart from connections
+     * because its 'id' is zero */
+    int fd;
+
+    struct slab *slabs;
+    struct connection *freelist;
     size_t connection_count;
-};
 
+    unsigned long long request_count;
 
+    /* Formats and writes our log messages in the background, and the
+     * ring buffer we log them into */
+    struct logger_t *logger;
+    struct logring_t *log;
+
+    /* Set when we've run out of file descriptors, and stopped waiting for
+     * incoming connections until one closes */
+    bool is_accept_paused;
+    bool is_emfile_logged;
+};
 
 enum {
     SOCKETS_NONBLOCKING     = 0x00000001,
@@ -71,51 +176,6 @@ enum {
     SOCKETS_IMEDIATE        = 0x00000004,
 };
 
-struct http_request
-{
-    
-};
-
-bool
-my_isspace(int c)
-{
-    return isspace(c&0xFF);
-}
-
-int
-parse_http_request(unsigned *state, unsigned *state2, struct httpserver *httpd, struct http_request *req, const unsigned char *buf, size_t length)
-{
-    unsigned s = *state;
-    size_t i;
-    size_t id;
-    enum {
-        S_LEADING_SPACE,
-        S_METHOD,
-    };
-
-    for (i=0; i<length; i++) {
-        unsigned char c = buf[i];
-        switch (s) {
-            case S_LEADING_SPACE:
-                if (my_isspace(c))
-                    continue;
-                TRANSITION_NOW(S_METHOD);
-                break;
-            case S_METHOD:
-                req->method = smack_search_next(
-                        httpd->methods,
-                        state2,
-                        buf, &i, length);
-                i--;
-                if (req->method == SMACK_NOT_FOUND)
-                    continue;
-        }
-    }
-
-    *state = s;
-    return 0;
-}
-
 
 /**
  * Called when a configuration error occurs to print usage information
@@ -123,7 +183,8 @@ parse_http_request(unsigned *state, unsigned *state2, struct httpserver *httpd,
 static void
 print_usage_and_exit(void)
 {
-    fprintf(stderr, "usage: mycat <hostname> <port> [<options> ...]\n");
+    fprintf(stderr, "usage: httpd [<address>] <port> "
+                    "[--backend <poll|epoll|uring>] [-d]\n");
     exit(1);
 }
 
@@ -135,10 +196,10 @@ parse_command_line(int argc, char *argv[])
 {
     int i;
     struct configuration config = {0};
-    
+
     if (argc == 1)
         print_usage_and_exit();
-    
+
     for (i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
             switch (argv[i][1]) {
@@ -150,26 +211,33 @@ parse_command_line(int argc, char *argv[])
                 case 'd':
                     is_debug++;
                     break;
-                case 'K':
-                    is_halfclose = 1;
-                    break;
                 case '-':
                     if (strcmp(argv[i], "--help") == 0)
                         print_usage_and_exit();
+                    else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+                        config.backend = events_backend_from_name(argv[++i]);
+                        if (config.backend == EVENTS_DEFAULT) {
+                            fprintf(stderr, "[-] unknown backend: %s\n", argv[i]);
+                            exit(1);
+                        }
+                    } else {
+                        fprintf(stderr, "[-] unknown option: %s\n", argv[i]);
+                        exit(1);
+                    }
                     break;
             }
+        } else if (strchr(argv[i], '.') || strchr(argv[i], ':')) {
+            if (config.hostname) {
+                fprintf(stderr, "[-] unknown option: %s (target=%s)\n", argv[i], config.hostname);
+                exit(1);
+            }
+            config.hostname = argv[i];
         } else if (0 < atoi(argv[i]) && atoi(argv[i]) < 65535) {
             if (config.portname) {
                 fprintf(stderr, "[-] unknown option: %s (port=%s)\n", argv[i], config.portname);
                 exit(1);
             }
             config.portname = argv[i];
-        } else if (strchr(argv[i], '.')) {
-            if (config.hostname) {
-                fprintf(stderr, "[-] unknown option: %s (target=%s)\n", argv[i], config.hostname);
-                exit(1);
-            }
-            config.hostname = argv[i];
         } else {
             fprintf(stderr, "[-] unknown option: %s\n", argv[i]);
         }
@@ -178,6 +246,20 @@ parse_command_line(int argc, char *argv[])
     return config;
 }
 
+/**
+ * The event backends need non-blocking sockets, because with edge-triggered
+ * `epoll`, a socket may be reported as ready even though a later call would
+ * block.
+ */
+static int
+wrap_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 int
 wrap_listen(const char *addrname, const char *portname, int flags)
 {
@@ -185,14 +267,16 @@ wrap_listen(const char *addrname, const char *portname, int flags)
     struct addrinfo hints = {0};
     int err;
     int fd = -1;
+    int yes = 1;
     char hostaddr[NI_MAXHOST];
     char hostport[NI_MAXSERV];
 
     /* Convert address/port into a sockaddr structure */
     hints.ai_flags = AI_PASSIVE;
-    err = getaddrinfo(addrname, portname, 0, &ai);
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(addrname, portname, &hints, &ai);
     if (err) {
-        fprintf(stderr, "[-] getaddrinfo([%s]:%s): %s\n", 
+        fprintf(stderr, "[-] getaddrinfo([%s]:%s): %s\n",
                 addrname, portname, gai_strerror(err));
         return -1;
     }
@@ -224,7 +308,7 @@ wrap_listen(const char *addrname, const char *portname, int flags)
         fprintf(stderr, "[-] SO_REUSEADDR([%s]:%s): %s\n", hostaddr, hostport, strerror(errno));
         goto error_cleanup;
     }
-    
+
 #if defined(SO_REUSEPORT)
     /* Allow multiple processes to share this port */
     err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
@@ -241,14 +325,17 @@ wrap_listen(const char *addrname, const char *portname, int flags)
         goto error_cleanup;
     }
 
-    /* Configure the socket for listening (i.e. accepting incoming connections) */
-    err = listen(fd, 10);
+    /* Configure the socket for listening (i.e. accepting incoming
+     * connections). A burst of connections from a load balancer
+     * would quickly overflow a small backlog */
+    err = listen(fd, SOMAXCONN);
     if (err) {
         fprintf(stderr, "[-] listen([%s]:%s): %s\n", hostaddr, hostport, strerror(errno));
         goto error_cleanup;
     }
 
-    free(ai);
+    fprintf(stderr, "[+] listening on [%s]:%s\n", hostaddr, hostport);
+    freeaddrinfo(ai);
     return fd;
 
 error_cleanup:
@@ -260,88 +347,530 @@ error_cleanup:
 }
 
 /**
- * This wraps a call to `accept()`. It creates a new connection record in our
- * server, formats the strings for the address/port for later logging, and
- * sets flags on the connection
+ * Get a free connection record, allocating a new slab of them if needed.
+ */
+static struct connection *
+connection_alloc(struct httpserver *httpd)
+{
+    struct connection *c;
+
+    if (httpd->freelist == NULL) {
+        struct slab *slab;
+        size_t i;
+
+        slab = CALLOC(1, sizeof(*slab));
+        slab->next = httpd->slabs;
+        httpd->slabs = slab;
+        for (i = CONNECTIONS_PER_SLAB; i > 0; i--) {
+            c = &slab->records[i - 1];
+            c->fd = -1;
+            c->next_free = httpd->freelist;
+            httpd->freelist = c;
+        }
+    }
+
+    c = httpd->freelist;
+    httpd->freelist = c->next_free;
+    c->next_free = NULL;
+    httpd->connection_count++;
+    return c;
+}
+
+/**
+ * Start waiting for incoming connections again, after we stopped because
+ * we ran out of file descriptors. Called when a connection closes, freeing
+ * one, or when we're idle, in case something else freed them.
+ */
+static void
+httpserver_resume_accept(struct httpserver *httpd)
+{
+    if (httpd->is_accept_paused) {
+        httpd->is_accept_paused = false;
+        events_modify(httpd->events, httpd->fd, POLLIN, 0);
+    }
+}
+
+/**
+ * Close the connection, putting its record back on the free list. The
+ * buffers stay with the record to be reused.
+ */
+static void
+connection_close(struct httpserver *httpd, struct connection *c)
+{
+    if (is_debug)
+        LOG_PEER(httpd, "[+] close(%s)\n", c, 0);
+    events_remove(httpd->events, c->fd);
+    close(c->fd);
+    httpparse_end(&c->hdr);
+    c->fd = -1;
+    c->next_free = httpd->freelist;
+    httpd->freelist = c;
+    httpd->connection_count--;
+    httpserver_resume_accept(httpd);
+}
+
+/**
+ * Accepts a connection that's already non-blocking, and won't be inherited
+ * by child processes, in a single system call where we can.
+ */
+static int
+wrap_accept_nonblocking(int fd, struct sockaddr *sa, socklen_t *sa_addrlen)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    return accept4(fd, sa, sa_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd2 = accept(fd, sa, sa_addrlen);
+    if (fd2 != -1) {
+        wrap_set_nonblocking(fd2);
+        fcntl(fd2, F_SETFD, FD_CLOEXEC);
+    }
+    return fd2;
+#endif
+}
+
+/**
+ * This wraps calls to `accept()`. For each incoming connection waiting in
+ * the backlog, it creates a new connection record in our server, remembers
+ * the address for later logging, and sets flags on the connection. We
+ * accept them all, until there are none left, rather than one per wakeup,
+ * so that in a storm we keep up with the kernel.
  */
 int
 wrap_accept(struct httpserver *httpd, int fd)
 {
-    int fd2 = -1;
-    struct sockaddr_storage peer;
-    socklen_t peer_addrlen = sizeof(peer);
-    int err;
-    struct connection *c = &httpd->connections[httpd->connection_count];
+    for (;;) {
+        int fd2 = -1;
+        struct sockaddr_storage peer;
+        socklen_t peer_addrlen = sizeof(peer);
+        int err;
+        struct connection *c;
+
+        /* Create a socket for the incoming connection */
+        fd2 = wrap_accept_nonblocking(fd, (struct sockaddr *)&peer, &peer_addrlen);
+        if (fd2 == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; /* no more waiting */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue; /* reset before we got to it, so try the next */
+            if (errno == EMFILE || errno == ENFILE) {
+                /* The connections are still waiting, so if we re-armed the
+                 * listener now, we'd be woken again straight away, and
+                 * spin. Instead, stop waiting for them until we have a
+                 * descriptor free. Only say so once. */
+                if (!httpd->is_emfile_logged) {
+                    fprintf(stderr, "[-] accept(): %s\n", strerror(errno));
+                    fprintf(stderr, "[-] files=%u, use 'ulimit -n <n>' to raise\n",
+                            (unsigned)httpd->connection_count);
+                    httpd->is_emfile_logged = true;
+                }
+                httpd->is_accept_paused = true;
+            } else
+                fprintf(stderr, "[-] accept(): %s\n", strerror(errno));
+            return -1;
+        }
 
-    
-    /* Create a socket for the incoming connection */
-    fd2 = accept(fd, &peer, &peer_addrlen);
-    if (fd2 == -1) {
-        fprintf(stderr, "[-] accept(): %s\n", strerror(errno));
-        goto error_cleanup;
+        /* Responses are usually one small packet, so don't wait for an ACK
+         * before sending them */
+        {
+            int yes = 1;
+            setsockopt(fd2, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+
+        /* Initialize this connection record */
+        c = connection_alloc(httpd);
+        c->fd = fd2;
+        c->len = 0;
+        c->header_bytes = 0;
+        c->is_body = false;
+        c->out_len = 0;
+        c->out_sent = 0;
+        c->is_closing = false;
+        if (c->buf == NULL)
+            c->buf = MALLOC(RECV_BUFFER_SIZE);
+        httpparse_start(httpd->parser, &c->hdr);
+
+        /* Remember the incoming address/port, to be formatted only when
+         * something is logged */
+        if (peer_addrlen > sizeof(c->peer))
+            peer_addrlen = sizeof(c->peer);
+        memcpy(&c->peer, &peer, peer_addrlen);
+        c->peer_addrlen = peer_addrlen;
+        if (is_debug)
+            LOG_PEER(httpd, "[+] accept() from %s\n", c, 0);
+
+        /* Wait for the request */
+        err = events_add(httpd->events, fd2, POLLIN, (size_t)c);
+        if (err) {
+            LOG_PEER(httpd, "[-] events_add(%s): %s\n", c, errno);
+            close(fd2);
+            c->fd = -1;
+            c->next_free = httpd->freelist;
+            httpd->freelist = c;
+            httpd->connection_count--;
+        }
     }
+}
 
-    /* Make sure we have sufficient space to hold it */
-    if (httpd->connection_count > sizeof(httpd->connections)/sizeof(httpd->connections[0])) {
-        fprintf(stderr, "[-] out of connection space\n");
-        goto error_cleanup;
+/**
+ * Append bytes to the queue of responses waiting to be sent on this
+ * connection, growing it if necessary.
+ */
+static void
+output_append(struct connection *c, const void *buf, size_t length)
+{
+    if (c->out_len + length > c->out_max) {
+        size_t new_max = c->out_max * 2 + 1024;
+        while (new_max < c->out_len + length)
+            new_max *= 2;
+        c->out = REALLOC(c->out, new_max);
+        c->out_max = new_max;
+    }
+    memcpy(c->out + c->out_len, buf, length);
+    c->out_len += length;
+}
+
+/**
+ * Queue a complete response, with the header and body.
+ */
+static void
+http_respond(struct connection *c, int status, const char *reason,
+             const char *content_type, const char *body, size_t body_length)
+{
+    char header[256];
+    int header_length;
+    const char *connection = "";
+
+    /* HTTP/1.1 connections stay open unless we say otherwise, but HTTP/1.0
+     * connections close unless we say otherwise, which a client that asked
+     * for keep-alive needs to hear, or it will wait for us to close */
+    if (c->is_closing)
+        connection = "Connection: close\r\n";
+    else if (c->hdr.version_major < 1
+             || (c->hdr.version_major == 1 && c->hdr.version_minor == 0))
+        connection = "Connection: keep-alive\r\n";
+
+    header_length = snprintf(header, sizeof(header),
+                             "HTTP/1.1 %d %s\r\n"
+                             "Server: httpd\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %u\r\n"
+                             "%s"
+                             "\r\n",
+                             status, reason, content_type,
+                             (unsigned)body_length,
+                             connection);
+    output_append(c, header, header_length);
+
+    /* A HEAD request gets the same header as a GET, but no body */
+    if (c->hdr.method != METHOD_HEAD)
+        output_append(c, body, body_length);
+}
+
+static void
+http_respond_error(struct connection *c, int status, const char *reason)
+{
+    char body[128];
+    int body_length;
+
+    body_length = snprintf(body, sizeof(body), "%d %s\n", status, reason);
+    http_respond(c, status, reason, "text/plain", body, body_length);
+}
+
+/**
+ * A URL handler that returns the same page every time.
+ */
+static void
+handle_static(struct httpserver *httpd, struct connection *c,
+              const struct url *url)
+{
+    (void)httpd;
+    http_respond(c, 200, "OK", url->content_type, url->body,
+                 strlen(url->body));
+}
+
+/**
+ * A URL handler that reports some statistics about the server.
+ */
+static void
+handle_status(struct httpserver *httpd, struct connection *c,
+              const struct url *url)
+{
+    char body[256];
+    int body_length;
+
+    body_length = snprintf(body, sizeof(body),
+                           "backend: %s\n"
+                           "connections: %u\n"
+                           "requests: %llu\n",
+                           events_name(httpd->events),
+                           (unsigned)httpd->connection_count,
+                           httpd->request_count);
+    http_respond(c, 200, "OK", url->content_type, body, body_length);
+}
+
+static const struct url default_urls[] = {
+    {"/", "text/html", "<html><body>Hello, world!</body></html>\n",
+     handle_static},
+    {"/hello", "text/plain", "Hello, world!\n", handle_static},
+    {"/status", "text/plain", 0, handle_status},
+};
+
+/**
+ * Called when we've parsed a complete request header, to queue the
+ * response, and figure out what happens to the connection next.
+ */
+static void
+http_request(struct httpserver *httpd, struct connection *c)
+{
+    const struct httpheader *hdr = &c->hdr;
+
+    httpd->request_count++;
+
+    /* Decide whether to keep the connection open after this request. For
+     * HTTP/1.1, the default is to keep it open, for HTTP/1.0, the
+     * default is to close it */
+    if (hdr->version_major < 1 || (hdr->version_major == 1 && hdr->version_minor == 0))
+        c->is_closing = !hdr->is_keepalive;
+    else
+        c->is_closing = hdr->is_close;
+
+    /* The request body, if any, comes next. If we can't tell how long
+     * it is, we can't tell where the next request starts */
+    httpbody_start(&c->body, hdr);
+    c->is_body = !c->body.is_done;
+    if (hdr->is_error) {
+        c->is_closing = true;
+        http_respond_error(c, 400, "Bad Request");
+    } else if (hdr->is_transfer_encoding && !hdr->is_chunked) {
+        c->is_closing = true;
+        http_respond_error(c, 501, "Not Implemented");
+    } else if (c->body.is_error) {
+        c->is_closing = true;
+        http_respond_error(c, 400, "Bad Request");
+    } else if (hdr->method <= 0) {
+        c->is_closing = true;
+        http_respond_error(c, 501, "Not Implemented");
+    } else if (hdr->url_id == 0 || hdr->url_id > httpd->url_count) {
+        http_respond_error(c, 404, "Not Found");
+    } else {
+        const struct url *url = &httpd->urls[hdr->url_id - 1];
+        url->callback_request(httpd, c, url);
     }
 
-    /* Initialize this connection record */
-    memset(c, 0, sizeof(*c));
-    c->fd = fd2;
+    if (is_debug) {
+        char addrname[NI_MAXHOST] = "err";
+        char portname[NI_MAXSERV] = "err";
 
-    /* Pretty print the incoming address/port */
-    err = getnameinfo((struct sockaddr *)&peer, peer_addrlen,
-                    c->addrname, sizeof(c->addrname),
-                    c->portname, sizeof(c->portname),
+        /* This message has more than an address in it, so it's formatted
+         * now, after writing out the messages logged before it */
+        logger_flush(httpd->logger);
+        getnameinfo((struct sockaddr *)&c->peer, c->peer_addrlen,
+                    addrname, sizeof(addrname),
+                    portname, sizeof(portname),
                     NI_NUMERICHOST | NI_NUMERICSERV);
-    if (err) {
-        fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
-        goto error_cleanup;
+        fprintf(stderr, "[+] request([%s]:%s) method=%d url=%u\n",
+                addrname, portname, hdr->method, hdr->url_id);
     }
-    fprintf(stderr, "[+] accept() from [%s]:%s\n", c->addrname, c->portname);
+}
 
-    httpd->connection_count=+;
-    return 0;
+/**
+ * Parse the bytes we've received. There may be several pipelined requests
+ * in the buffer, or only part of one.
+ */
+static void
+http_process_input(struct httpserver *httpd, struct connection *c)
+{
+    size_t i = 0;
+
+    while (i < c->len && !c->is_closing) {
+        size_t n;
+
+        /* Skip the body of the previous request. If it's chunked, and
+         * there's something wrong with the chunks, then we've lost track
+         * of where the next request starts */
+        if (c->is_body) {
+            const unsigned char *data;
+            size_t data_length;
+
+            n = httpbody_next(&c->body, c->buf + i, c->len - i,
+                &data, &data_length);
+            i += n;
+            if (c->body.is_error)
+                c->is_closing = true;
+            else if (c->body.is_done)
+                c->is_body = false;
+            continue;
+        }
 
-error_cleanup:
-    if (fd2 != -1)
-        close(fd2);
-    return -1;
+        /* Parse as much of the header as we've got */
+        n = httpparse_buffer(httpd->parser, &c->hdr, c->buf + i, c->len - i);
+        i += n;
+        c->header_bytes += n;
+        if (c->header_bytes > MAX_HEADER_SIZE) {
+            /* Reject headers that are too big */
+            c->is_closing = true;
+            http_respond_error(c, 431, "Request Header Fields Too Large");
+        } else if (c->hdr.is_done) {
+            http_request(httpd, c);
+            httpparse_end(&c->hdr);
+            httpparse_start(httpd->parser, &c->hdr);
+            c->header_bytes = 0;
+        }
+    }
+
+    /* The parser keeps its own state, so we don't need the bytes anymore */
+    c->len = 0;
 }
 
-int
-wrap_receive(struct httpserver *httpd, size_t index)
+/**
+ * Send the queued responses. When they've all been sent, we go back to
+ * reading more requests, or close the connection.
+ */
+static void
+http_flush_output(struct httpserver *httpd, struct connection *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t count;
+
+        count = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, 0);
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* wait until there's room in the kernel's buffer */
+            events_modify(httpd->events, c->fd, POLLOUT, (size_t)c);
+            return;
+        } else if (count == -1) {
+            if (is_debug)
+                LOG_PEER(httpd, "[-] send(%s): %s\n", c, errno);
+            connection_close(httpd, c);
+            return;
+        }
+        c->out_sent += count;
+    }
+    c->out_sent = 0;
+    c->out_len = 0;
+
+    if (c->is_closing)
+        connection_close(httpd, c);
+    else
+        events_modify(httpd->events, c->fd, POLLIN, (size_t)c);
+}
+
+/**
+ * Called when a connection is ready for reading.
+ */
+static void
+wrap_receive(struct httpserver *httpd, struct connection *c)
 {
-    char buf[512];
     ssize_t count;
-    struct connection *c = &httpd->connections[index];
 
     /* Receive a buffer */
-    count = recv(c->fd, buf, sizeof(buf), 0);
+    count = recv(c->fd, c->buf, RECV_BUFFER_SIZE, 0);
     if (count == 0) {
-        fprintf(stderr, "[+] close() from [%s]:%s\n", c->addrname, c->portname);
-        c->url->callback_close(c, 0);
-        return 0;
+        /* The other side closed, but might still be waiting for
+         * responses to requests we've already parsed */
+        c->is_closing = true;
+    } else if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        events_modify(httpd->events, c->fd, POLLIN, (size_t)c);
+        return;
     } else if (count == -1) {
-        fprintf(stderr, "[-] error from [%s]:%s: %s\n", c->addrname, c->portname, strerror(errno));
-        c->url->callback_close(c, errno);
-        return 0;
+        if (is_debug)
+            LOG_PEER(httpd, "[-] error from %s: %s\n", c, errno);
+        connection_close(httpd, c);
+        return;
     } else {
-        fprintf(stderr, "[+] recv([%s]:%s) %d bytes\n", c->addrname, c->portname, (int)count);
+        c->len = count;
+        http_process_input(httpd, c);
     }
 
-    /* Parse the HTTP header */
-}                
+    http_flush_output(httpd, c);
+}
+
+/**
+ * Create the server, with its parser and event backend.
+ */
+static struct httpserver *
+httpserver_create(int fd, enum events_backend_t backend,
+                  const struct url *urls, size_t url_count)
+{
+    struct httpserver *httpd;
+    size_t i;
+
+    httpd = CALLOC(1, sizeof(*httpd));
+    httpd->fd = fd;
+    httpd->urls = urls;
+    httpd->url_count = url_count;
+
+    httpd->events = events_create(backend);
+    if (httpd->events == NULL) {
+        fprintf(stderr, "[-] events_create(): %s\n", strerror(errno));
+        free(httpd);
+        return NULL;
+    }
 
-         
+    /* The 'id' of each prefix is its index in the table plus one,
+     * since zero means no prefix matched */
+    httpd->parser = httpparser_create();
+    for (i = 0; i < url_count; i++)
+        httpparser_register_url_prefix(httpd->parser, (unsigned)i + 1,
+                                       urls[i].prefix, 0);
+    httpparser_compile(httpd->parser);
+
+    httpd->logger = logger_create(stderr, 1);
+    if (httpd->logger == NULL) {
+        fprintf(stderr, "[-] logger_create(): %s\n", strerror(errno));
+        goto error_parser;
+    }
+    httpd->log = logger_ring(httpd->logger, LOG_RING_SIZE);
+    if (httpd->log == NULL) {
+        fprintf(stderr, "[-] logger_ring(): %s\n", strerror(errno));
+        goto error_logger;
+    }
+
+    /* Without this, we'd never be told about incoming connections, and
+     * would silently never accept any */
+    if (events_add(httpd->events, fd, POLLIN, 0) == -1) {
+        fprintf(stderr, "[-] events_add(): %s\n", strerror(errno));
+        goto error_logger;
+    }
+    return httpd;
+
+error_logger:
+    logger_destroy(httpd->logger);
+error_parser:
+    httpparser_destroy(httpd->parser);
+    events_destroy(httpd->events);
+    free(httpd);
+    return NULL;
+}
+
+static void
+httpserver_destroy(struct httpserver *httpd)
+{
+    while (httpd->slabs) {
+        struct slab *slab = httpd->slabs;
+        size_t i;
+
+        for (i = 0; i < CONNECTIONS_PER_SLAB; i++) {
+            struct connection *c = &slab->records[i];
+            if (c->fd != -1)
+                connection_close(httpd, c);
+            free(c->buf);
+            free(c->out);
+        }
+        httpd->slabs = slab->next;
+        free(slab);
+    }
+    events_remove(httpd->events, httpd->fd);
+    events_destroy(httpd->events);
+    httpparser_destroy(httpd->parser);
+    logger_destroy(httpd->logger);
+    free(httpd);
+}
 
 int main(int argc, char *argv[])
 {
     int fd;
     struct configuration config = {0};
-    struct httpserver httpd = {0};
+    struct httpserver *httpd;
 
     /* Ignore the send() problem */
     signal(SIGPIPE, SIG_IGN);
@@ -354,115 +883,56 @@ int main(int argc, char *argv[])
         config.milliseconds_timeout = 100;
 
     /* Create a listening server socket */
-    fd = wrap_listen(config.hostname, config.portname, 0);
+    fd = wrap_listen(config.hostname, config.portname, SOCKETS_NONBLOCKING);
     if (fd == -1) {
         fprintf(stderr, "[-] failed to create server, exiting...\n");
         return 1;
     }
 
+    httpd = httpserver_create(fd, config.backend, default_urls,
+                              sizeof(default_urls) / sizeof(default_urls[0]));
+    if (httpd == NULL) {
+        close(fd);
+        return 1;
+    }
+    fprintf(stderr, "[+] using backend: %s\n", events_name(httpd->events));
+
     /* Sit in dispatch loop */
     for (;;) {
-        fd_set readset;
-        fd_set writeset;
-        fd_set errset;
-        int nfds;
-        int err;
-        struct timeval tv;
-        size_t count;
-        size_t i;
-
-        tv.tv_sec = config.milliseconds_timeout / 1000;
-        tv.tv_usec = config.milliseconds_timeout * 1000;
-
-        /* Zero the sets */
-        FD_ZERO(&readset);
-        FD_ZERO(&writeset);
-        FD_ZERO(&errset);
-
-        /* Add the server socket */
-        nfds = fd;
-        FD_SET(fd, &readset);
-        FD_SET(fd, &writeset);
-        FD_SET(fd, &errset);
-        for (i=0; i<httpd.connection_count; i++) {
-            if (nfds < httpd.connections[i].fd)
-                nfds = httpd.connections[i].fd;
-            FD_SET(httpd.connections[i].fd, &readset);
-            FD_SET(httpd.connections[i].fd, &writeset);
-            FD_SET(httpd.connections[i].fd, &errset);
-        }
-
-        /*
-         * Do the select, waiting for either incoming connections,
-         * for incoming data on connections, or for errors.
-         */
-        err = select(nfds+1, &readset, &writeset, &errset, &tv);
-        if (err < 0) {
-            fprintf(stderr, "[-] select() error: %s\n", strerror(errno));
+        struct events_ready_t ready[MAX_EVENTS];
+        int count;
+        int i;
+
+        count = events_wait(httpd->events, ready, MAX_EVENTS,
+                            config.milliseconds_timeout);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "[-] events_wait(): %s\n", strerror(errno));
             break;
+        } else if (count == 0)
+            httpserver_resume_accept(httpd);
+
+        for (i = 0; i < count; i++) {
+            struct connection *c = (struct connection *)ready[i].id;
+            unsigned revents = ready[i].revents;
+
+            if (c == NULL) {
+                /* incoming connection on the listening socket */
+                wrap_accept(httpd, fd);
+                if (!httpd->is_accept_paused)
+                    events_modify(httpd->events, fd, POLLIN, 0);
+            } else if (revents & POLLERR) {
+                connection_close(httpd, c);
+            } else if (revents & POLLOUT) {
+                http_flush_output(httpd, c);
+            } else if (revents & (POLLIN | POLLHUP)) {
+                wrap_receive(httpd, c);
+            }
         }
-        if (err == 0) {
-            /* timeout reached with no activity, so loop around again */
-            continue;
-        }
-
-        if (FD_ISSET(fd, &readset) || FD_ISSET(fd, &writeset) || FD_ISSET(fd, &errset)) {
-            wrap_accept(&httpd, fd);
-        }
-
-        for (i=0; i<httpd.connection_count; i++) {
-            if (FD_ISSET(httpd.connections[i].fd, &readset))
-                wrap_receive(&httpd, i);
-            if (FD_ISSET(httpd.connections[i].fd, &writeset))
-                wrap_write(&httpd, i);
-            if (FD_ISSET(httpd.connections[i].fd, &errset))
-                wrap_error(&httpd, i);
-        }
-
-
-    }
-    
-
-        /* Loop on this connection receiving/transmitting data */
-        for (;;) {
-            char buf[512];
-            ssize_t bytes_received;
-            ptrdiff_t bytes_sent;
-
-            /* Wait until some bytes received or connection closed */
-            bytes_received = recv(fd2, buf, sizeof(buf), 0);
-            if (bytes_received == 0) {
-                fprintf(stderr, "[+] close() from [%s]:%s\n", peeraddr, peerport);
-                break;
-            } else if (bytes_received == -1) {
-                fprintf(stderr, "[-] error from [%s]:%s\n", peeraddr, peerport);
-                break;
-            } else
-                fprintf(stderr, "[+] recv([%s]:%s) %d bytes\n", peeraddr, peerport, (int)bytes_received);
-                
-
-            /* Echo back to sender */
-            bytes_sent = send(fd2, buf, bytes_received, 0);
-            if (bytes_sent == -1) {
-                fprintf(stderr, "[-] send([%s]:%s): %s\n", peeraddr, peerport, strerror(errno));
-                break;
-            } else
-                fprintf(stderr, "[+] send([%s]:%s) %d bytes\n", peeraddr, peerport, (int)bytes_sent);
-        }
-     
-        close(fd2);
     }
 
-    
-cleanup:
-    if (fd > 0)
-        close(fd);
-    if (sa)
-        free(sa);
-    if (ai)
-        freeaddrinfo(ai);
+    httpserver_destroy(httpd);
+    close(fd);
     return 0;
 }
-
-
-}
\ No newline at end of file
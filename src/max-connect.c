@@ -1,127 +1,339 @@
 /* max-connect
- Demonstrates what happens when you create too many outbound TCP
- connections.
+ Demonstrates what happens when you create too many TCP connections to a
+ server, faster than it can accept them.
  Example usage:
-    tcp-client www.google.com 80
+    max-connect 127.0.0.1 7777 --seconds 10
+ This opens connections to the server as fast as it can, closing each one
+ as soon as it's established, and prints how many connections per second
+ were established.
+ Options:
+    --seconds <n>     how long to run (default 5)
+    --inflight <n>    connections in progress at once (default 256)
+    --hold            keep the connections open, until we run out of
+                      something, such as file descriptors or ports
+
+ The kernel completes the handshake for a server, and queues the new
+ connection in the server's listen backlog until the server calls
+ `accept()`. When the server falls behind, and the backlog is full, the
+ kernel drops incoming SYNs. The client doesn't get an error, it just
+ retransmits the SYN a second later. So a server that can't keep up
+ doesn't refuse connections, it makes them slow.
+
+ To see that happen, we print how the kernel's counters changed while
+ we ran, from `/proc/net/netstat`. `ListenOverflows` and `ListenDrops`
+ count the SYNs the server's side dropped, and `TCPSynRetrans` counts the
+ SYNs the client's side retransmitted. Linux also counts the handshake's
+ last ACK as dropped when the backlog is full, so there can be more drops
+ than SYNs. The counters are for the whole system, so the server's only
+ mean something when it's on this machine, such as when testing over
+ loopback, and only if nothing else is busy.
+
+ Normally, whichever side closes first keeps the connection in TIME_WAIT
+ for a minute, holding on to its port. Every connection we make goes to
+ the same address and port, so it needs its own source port. We'd run
+ out of them, about 28k, within a couple of seconds, and then we'd be
+ measuring `connect()` failing with EADDRNOTAVAIL instead of the server.
+ So we close each connection with SO_LINGER set to zero, which sends a
+ RST instead of a FIN, and skips TIME_WAIT, freeing the port right away.
  */
 #include <ctype.h>
 #include <errno.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <unistd.h>
 
 //#include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/poll.h>
 #include <netdb.h>
 
-static const char *my_http_request =
-    "GET / HTTP/1.0\r\n"
-    "User-Agent: tcp_client/0.0\r\n"
-    "\r\n";
+#include "util-clockcycle.h"
+
+/* Errors are counted by their 'errno' value */
+#define ERRNO_MAX 256
+
+/**
+ * The kernel's counters that tell us about dropped SYNs
+ */
+struct netstat_t
+{
+    unsigned long long listen_overflows;
+    unsigned long long listen_drops;
+    unsigned long long syn_retrans;
+};
+
+struct my_options
+{
+    unsigned seconds;
+    unsigned inflight;
+    int is_hold;
+};
+
+/**
+ * Reads the counters from `/proc/net/netstat`. Each group of counters is a
+ * line of names followed by a line of values, both starting with the name
+ * of the group, such as "TcpExt:".
+ * @return 0 on success, -1 if they aren't available
+ */
+int netstat_read(struct netstat_t *netstat)
+{
+    FILE *fp;
+    static char names[8192];
+    static char values[8192];
+    int result = -1;
+
+    memset(netstat, 0, sizeof(*netstat));
+
+    fp = fopen("/proc/net/netstat", "r");
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(names, sizeof(names), fp) && fgets(values, sizeof(values), fp)) {
+        char *name_next = NULL;
+        char *value_next = NULL;
+        char *name;
+        char *value;
+
+        if (strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+
+        /* Walk through the names and values in step */
+        name = strtok_r(names, " \n", &name_next);
+        value = strtok_r(values, " \n", &value_next);
+        while (name && value) {
+            if (strcmp(name, "ListenOverflows") == 0)
+                netstat->listen_overflows = strtoull(value, 0, 10);
+            else if (strcmp(name, "ListenDrops") == 0)
+                netstat->listen_drops = strtoull(value, 0, 10);
+            else if (strcmp(name, "TCPSynRetrans") == 0)
+                netstat->syn_retrans = strtoull(value, 0, 10);
+            name = strtok_r(NULL, " \n", &name_next);
+            value = strtok_r(NULL, " \n", &value_next);
+        }
+        result = 0;
+    }
+
+    fclose(fp);
+    return result;
+}
+
+void print_usage_and_exit(void)
+{
+    fprintf(stderr, "[-] usage: max-connect <host> <port> [--seconds <n>] "
+                    "[--inflight <n>] [--hold]\n");
+    exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-    struct addrinfo *addresses = NULL;
-    struct addrinfo *ai;
+    struct addrinfo hints = {0};
+    struct addrinfo *ai = NULL;
+    struct my_options options = {5, 256, 0};
+    const char *hostname = NULL;
+    const char *portname = NULL;
+    char addrname[64];
+    char portname2[8];
+    struct pollfd *list;
+    unsigned long long *started;
+    unsigned long long error_codes[ERRNO_MAX] = {0};
+    unsigned long long attempts = 0;
+    unsigned long long established = 0;
+    unsigned long long errors = 0;
+    unsigned long long last_established = 0;
+    unsigned long long latency_total = 0;
+    unsigned long long latency_max = 0;
+    unsigned long long start;
+    unsigned long long last_report;
+    unsigned long long retry = 0;
+    unsigned long long now;
+    struct netstat_t before;
+    struct netstat_t after;
+    int is_netstat;
+    size_t count = 0;
+    size_t i;
+    double seconds;
     int err;
-    int fd = -1;
-    ptrdiff_t count;
-    
+
     /* Ignore the send() problem */
     signal(SIGPIPE, SIG_IGN);
 
-    if (argc != 3) {
-        fprintf(stderr, "[-] usage: tcp-client <host> <port>\n");
-        return -1;
+    for (i=1; i<(size_t)argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < (size_t)argc)
+            options.seconds = (unsigned)strtoul(argv[++i], 0, 0);
+        else if (strcmp(argv[i], "--inflight") == 0 && i + 1 < (size_t)argc)
+            options.inflight = (unsigned)strtoul(argv[++i], 0, 0);
+        else if (strcmp(argv[i], "--hold") == 0)
+            options.is_hold = 1;
+        else if (argv[i][0] == '-')
+            print_usage_and_exit();
+        else if (hostname == NULL)
+            hostname = argv[i];
+        else if (portname == NULL)
+            portname = argv[i];
+        else
+            print_usage_and_exit();
     }
-    
-    /* Do a DNS lookup on the name */
-    err = getaddrinfo(argv[1],      /* host name */
-                      argv[2],      /* port number */
-                      0,            /* hints (defaults) */
-                      &addresses);  /* results */
+    if (hostname == NULL || portname == NULL || options.inflight == 0 || options.seconds == 0)
+        print_usage_and_exit();
+
+    /* Do a DNS lookup on the name, and use the first result */
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(hostname, portname, &hints, &ai);
     if (err) {
         fprintf(stderr, "[-] getaddrinfo(): %s\n", gai_strerror(err));
         return -1;
-    } else {
-	    count = 0;
-	    for (ai=addresses; ai; ai = ai->ai_next)
-	        count++;
-	    fprintf(stderr, "[+] getaddrinfo(): returned %d addresses\n", (int)count);
     }
-    
-    /* Of the several results, keep trying to connect until
-     * we get one that works */
-    for (ai=addresses; ai; ai = ai->ai_next) {
-        char addrname[64];
-        char portname[8];
-        
-        /* Print the address/port to strings for logging/debugging  */
-        err = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-                          addrname, sizeof(addrname),
-                          portname, sizeof(portname),
-                          NI_NUMERICHOST | NI_NUMERICSERV);
-        if (err) {
-            fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
-            goto cleanup;
-        }
-        
-        /* Create a socket */
-        fd = socket(ai->ai_family, SOCK_STREAM, 0);
-        if (fd == -1) {
-            fprintf(stderr, "[-] socket(): %s\n", strerror(errno));
-            goto cleanup;
-        }
-        
-        /* Try to connect */
-        err = connect(fd, ai->ai_addr, ai->ai_addrlen);
-        if (err) {
-            fprintf(stderr, "[-] connect([%s]:%s): %s\n", addrname, portname, strerror(errno));
-            close(fd);
-            fd = -1;
-            continue;
-        } else {
-            fprintf(stderr, "[+] connect([%s]:%s): %s\n", addrname, portname, "succeeded");
-            break; /* got one that works, so break out of loop */
-        }
-    }
-    if (fd == -1) {
-        fprintf(stderr, "[-] error: no successful connection\n");
+    err = getnameinfo(ai->ai_addr, ai->ai_addrlen,
+                      addrname, sizeof(addrname),
+                      portname2, sizeof(portname2),
+                      NI_NUMERICHOST | NI_NUMERICSERV);
+    if (err) {
+        fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
         goto cleanup;
     }
-    
-    /* The 'fd' socket now has a valid connection to the server, so
-     * send the HTTP request */
-    count = send(fd, my_http_request, strlen(my_http_request), 0);
-    if (count < strlen(my_http_request)) {
-        fprintf(stderr, "send(): %s\n", strerror(errno));
+    fprintf(stderr, "[+] connecting to [%s]:%s\n", addrname, portname2);
+
+    /* The connections still in progress, and when we started each one */
+    list = calloc(options.inflight, sizeof(*list));
+    started = calloc(options.inflight, sizeof(*started));
+    if (list == NULL || started == NULL) {
+        fprintf(stderr, "[-] calloc(): %s\n", strerror(errno));
+        free(list);
+        free(started);
         goto cleanup;
     }
-    fprintf(stderr, "[+] send(): sent %d bytes\n", (int)count);
-    
-    /* Now dump all the bytes in response */
+
+    is_netstat = (netstat_read(&before) == 0);
+    start = _get_monotonic();
+    last_report = start;
+
     for (;;) {
-        char c;
-        
-        count = recv(fd, &c, 1, 0);
-        if (count == 0)
-            break; /* opposite side closed connection */
-        else if (count < 0) {
-            fprintf(stderr, "recv(): %s\n", strerror(errno));
+        now = _get_monotonic();
+        if (now - start >= options.seconds * 1000000000ULL)
             break;
+
+        /* Start new connections until there are 'inflight' of them. If
+         * we've run out of something, like ports, wait a bit instead of
+         * spinning. */
+        while (count < options.inflight && now >= retry) {
+            int fd;
+
+            fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd == -1) {
+                err = errno;
+            } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+                list[count].fd = fd;
+                list[count].events = POLLOUT;
+                started[count] = now;
+                count++;
+                attempts++;
+                continue;
+            } else {
+                err = errno;
+                close(fd);
+                attempts++;
+            }
+
+            if (error_codes[err % ERRNO_MAX]++ == 0)
+                fprintf(stderr, "[-] connect([%s]:%s): %s\n", addrname, portname2, strerror(err));
+            errors++;
+            retry = now + 10000000ULL; /* 10 ms */
+        }
+
+        err = poll(list, count, 10);
+        if (err == -1 && errno != EINTR) {
+            fprintf(stderr, "[-] poll(): %s\n", strerror(errno));
+            break;
+        }
+        now = _get_monotonic();
+
+        /* Finish the connections that are done, whether they succeeded
+         * or failed, and move the last one into its place */
+        for (i=0; err > 0 && i<count; i++) {
+            int opt = 0;
+            socklen_t opt_len = sizeof(opt);
+
+            if (list[i].revents == 0)
+                continue;
+
+            getsockopt(list[i].fd, SOL_SOCKET, SO_ERROR, &opt, &opt_len);
+            if (opt == 0) {
+                unsigned long long latency = now - started[i];
+                established++;
+                latency_total += latency;
+                if (latency > latency_max)
+                    latency_max = latency;
+                if (!options.is_hold) {
+                    /* Reset, rather than close, so that the port isn't
+                     * held in TIME_WAIT */
+                    struct linger linger = {1, 0};
+                    setsockopt(list[i].fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+                    close(list[i].fd);
+                }
+            } else {
+                if (error_codes[opt % ERRNO_MAX]++ == 0)
+                    fprintf(stderr, "[-] connect([%s]:%s): %s\n", addrname, portname2, strerror(opt));
+                errors++;
+                close(list[i].fd);
+            }
+
+            list[i] = list[count - 1];
+            started[i] = started[count - 1];
+            count--;
+            i--;
+        }
+
+        /* Print the rate every second */
+        if (now - last_report >= 1000000000ULL) {
+            seconds = (now - last_report) / 1000000000.0;
+            fprintf(stderr, "[+] %4.0f-sec: %8.0f-connects/sec %8llu-errors\n",
+                    (now - start) / 1000000000.0,
+                    (established - last_established) / seconds,
+                    errors);
+            last_established = established;
+            last_report = now;
         }
-        
-        if (isprint(c) || isspace(c))
-            printf("%c", c);
-        else
-            printf(".");
     }
-    
+    seconds = (now - start) / 1000000000.0;
+
+    /* Connections still in progress never finished, which is what
+     * happens when their SYNs keep getting dropped */
+    for (i=0; i<count; i++)
+        close(list[i].fd);
+
+    printf("connections:     %llu tried, %llu established, %llu errors, %llu unfinished\n",
+           attempts, established, errors, (unsigned long long)count);
+    printf("rate:            %.0f-connects/second\n", established / seconds);
+    printf("connect:         avg=%.3f-ms max=%.3f-ms\n",
+           established ? latency_total / 1000000.0 / established : 0.0,
+           latency_max / 1000000.0);
+    for (i=0; i<ERRNO_MAX; i++) {
+        if (error_codes[i])
+            printf("error:           %llu %s\n", error_codes[i], strerror((int)i));
+    }
+
+    /* A connection can be dropped more than once, such as its first SYN,
+     * then its retransmit, so drops are per connection, not a percent */
+    if (is_netstat && netstat_read(&after) == 0) {
+        after.listen_overflows -= before.listen_overflows;
+        after.listen_drops -= before.listen_drops;
+        after.syn_retrans -= before.syn_retrans;
+        printf("ListenOverflows: %llu\n", after.listen_overflows);
+        printf("ListenDrops:     %llu\n", after.listen_drops);
+        printf("TCPSynRetrans:   %llu\n", after.syn_retrans);
+        printf("drop-rate:       %.0f-drops/second %.2f-drops/connection\n",
+               after.listen_drops / seconds,
+               established ? (double)after.listen_drops / established : 0.0);
+    }
+
+    free(started);
+    free(list);
 cleanup:
-    if (addresses)
-        freeaddrinfo(addresses);
+    if (ai)
+        freeaddrinfo(ai);
+    return 0;
 }
-
@@ -0,0 +1,325 @@
+/*
+    Decoding the body of an HTTP/1.1 request
+
+    The body is either a fixed size, from "Content-Length:", or is a
+    series of chunks, each preceded by its size in hex, ending with an
+    empty chunk and an optional trailer of header fields:
+
+        1a;ext=1\r\n
+        <26 bytes of data>\r\n
+        0\r\n
+        Trailer-Field: value\r\n
+        \r\n
+
+    Like the header parser, this is a state-machine that can be fed the
+    input in any number of fragments. The body data itself is never
+    copied: we just return where it is in the caller's buffer, so that a
+    large body can be streamed through in constant memory.
+*/
+#include "parse-http.h"
+#include "util-ctype.h"
+#include <string.h>
+
+/* The states for `httpbody_next()`, stored in `body->state` */
+enum {
+    BODY_DONE,
+    BODY_DATA,
+    CHUNK_SIZE_START,
+    CHUNK_SIZE,
+    CHUNK_SIZE_SPACE,
+    CHUNK_EXT,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_DATA_LF,
+    TRAILER_START,
+    TRAILER_LINE,
+    BODY_ERROR,
+};
+
+/***************************************************************************
+ ***************************************************************************/
+void
+httpbody_start(struct httpbody *body, const struct httpheader *hdr)
+{
+    memset(body, 0, sizeof(*body));
+
+    if (hdr->is_transfer_encoding) {
+        if (!hdr->is_chunked || hdr->has_content_length) {
+            body->is_error = true;
+            body->state = BODY_ERROR;
+        } else {
+            body->is_chunked = true;
+            body->state = CHUNK_SIZE_START;
+        }
+    } else if (hdr->has_content_length && hdr->content_length) {
+        body->remaining = hdr->content_length;
+        body->state = BODY_DATA;
+    } else {
+        body->is_done = true;
+        body->state = BODY_DONE;
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static unsigned
+hexval(unsigned char c)
+{
+    if ('0' <= c && c <= '9')
+        return (unsigned)(c - '0');
+    else if ('a' <= c && c <= 'f')
+        return (unsigned)(c - 'a' + 10);
+    else
+        return (unsigned)(c - 'A' + 10);
+}
+
+/***************************************************************************
+ * Return a span of data from the current chunk, or the whole body.
+ ***************************************************************************/
+static size_t
+_data(struct httpbody *body, const unsigned char *buf, size_t length,
+    const unsigned char **data, size_t *data_length)
+{
+    size_t n = length;
+
+    if (n > body->remaining)
+        n = (size_t)body->remaining;
+    body->remaining -= n;
+    body->total += n;
+    *data = buf;
+    *data_length = n;
+    return n;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+httpbody_next(struct httpbody *body, const void *v_buf, size_t length,
+    const unsigned char **data, size_t *data_length)
+{
+    const unsigned char *buf = (const unsigned char *)v_buf;
+    unsigned state = body->state;
+    size_t i;
+
+    *data = buf;
+    *data_length = 0;
+
+    for (i = 0; i < length && state != BODY_DONE; i++) {
+        unsigned char c = buf[i];
+
+        switch (state) {
+        case BODY_DATA:
+            i += _data(body, buf + i, length - i, data, data_length);
+            if (body->remaining == 0)
+                state = BODY_DONE;
+            goto end;
+
+        case CHUNK_SIZE_START:
+            if (!ISXDIGIT(c))
+                goto error;
+            body->remaining = 0;
+            state = CHUNK_SIZE;
+            /* fall through */
+        case CHUNK_SIZE:
+            if (ISXDIGIT(c)) {
+                /* reject sizes that can't be represented */
+                if (body->remaining > (~0ULL >> 4))
+                    goto error;
+                body->remaining = body->remaining << 4 | hexval(c);
+                break;
+            }
+            state = CHUNK_SIZE_SPACE;
+            /* fall through */
+        case CHUNK_SIZE_SPACE:
+            if (c == '\n')
+                state = body->remaining ? CHUNK_DATA : TRAILER_START;
+            else if (c == ';')
+                state = CHUNK_EXT;
+            else if (c != ' ' && c != '\t' && c != '\r')
+                goto error;
+            break;
+        case CHUNK_EXT:
+            /* Chunk extensions aren't defined for anything, so we
+             * ignore them, along with the '\r' at the end of the line */
+            if (c == '\n')
+                state = body->remaining ? CHUNK_DATA : TRAILER_START;
+            else if ((c < ' ' && c != '\t' && c != '\r') || c == 0x7F)
+                goto error;
+            break;
+
+        case CHUNK_DATA:
+            i += _data(body, buf + i, length - i, data, data_length);
+            if (body->remaining == 0)
+                state = CHUNK_DATA_END;
+            goto end;
+
+        case CHUNK_DATA_END:
+            /* The data is followed by the end of the line */
+            if (c == '\r')
+                state = CHUNK_DATA_LF;
+            else if (c == '\n')
+                state = CHUNK_SIZE_START;
+            else
+                goto error;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                goto error;
+            state = CHUNK_SIZE_START;
+            break;
+
+        case TRAILER_START:
+            /* After the last chunk, fields like in the header, which we
+             * skip, until an empty line */
+            if (c == '\n') {
+                state = BODY_DONE;
+                body->is_done = true;
+            } else if (c == '\r')
+                ;
+            else if (c == ' ' || c == '\t')
+                goto error; /* obsolete line folding */
+            else
+                state = TRAILER_LINE;
+            break;
+        case TRAILER_LINE:
+            if (c == '\n')
+                state = TRAILER_START;
+            break;
+
+        case BODY_ERROR:
+        default:
+            goto error;
+        }
+    }
+
+end:
+    if (state == BODY_DONE)
+        body->is_done = true;
+    body->state = state;
+    return i;
+
+error:
+    body->is_error = true;
+    body->state = BODY_ERROR;
+    return i;
+}
+
+/***************************************************************************
+ * Decode the body a fragment at a time, collecting the data, and check
+ * that it's what we expect.
+ ***************************************************************************/
+static int
+_selftest_body(const struct httpheader *hdr, const char *input,
+    size_t fragment_size, const char *expected, int is_error)
+{
+    struct httpbody body;
+    char result[256];
+    size_t result_length = 0;
+    size_t length = strlen(input);
+    size_t offset = 0;
+
+    httpbody_start(&body, hdr);
+    while (offset < length && !body.is_done && !body.is_error) {
+        size_t fragment_length = length - offset;
+        size_t i = 0;
+
+        if (fragment_length > fragment_size)
+            fragment_length = fragment_size;
+
+        /* Keep calling until the fragment is used up */
+        while (i < fragment_length && !body.is_done && !body.is_error) {
+            const unsigned char *data;
+            size_t data_length;
+            size_t n;
+
+            n = httpbody_next(&body, input + offset + i, fragment_length - i,
+                &data, &data_length);
+            if (result_length + data_length > sizeof(result))
+                return 1;
+            memcpy(result + result_length, data, data_length);
+            result_length += data_length;
+            i += n;
+        }
+        offset += i;
+    }
+
+    if (is_error)
+        return !body.is_error;
+    if (body.is_error || !body.is_done)
+        return 1;
+    if (result_length != strlen(expected) || body.total != result_length)
+        return 1;
+    if (memcmp(result, expected, result_length) != 0)
+        return 1;
+
+    /* Anything after the body is the next request */
+    if (offset + strlen("NEXT") != length
+        || memcmp(input + offset, "NEXT", 4) != 0)
+        return 1;
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+httpbody_selftest(void)
+{
+    struct httpheader chunked;
+    struct httpheader sized;
+    struct httpheader both;
+    struct httpheader gzip;
+    static const struct {
+        const char *input;
+        const char *expected;
+        int is_error;
+    } tests[] = {
+        {"5\r\nhello\r\n0\r\n\r\nNEXT", "hello", 0},
+        {"5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\nNEXT", "hello, world", 0},
+        {"A;name=value\r\n0123456789\r\n0;x\r\n\r\nNEXT", "0123456789", 0},
+        {"1a\nabcdefghijklmnopqrstuvwxyz\n0\n\nNEXT",
+         "abcdefghijklmnopqrstuvwxyz", 0},
+        {"3\r\nabc\r\n0\r\nExpires: never\r\nX-Sum: 1\r\n\r\nNEXT", "abc", 0},
+        {"0\r\n\r\nNEXT", "", 0},
+        {"\r\n0\r\n\r\n", "", 1},
+        {"5\r\nhelloX\r\n0\r\n\r\n", "", 1},
+        {"z\r\n", "", 1},
+        {"1 2\r\n", "", 1},
+        {"fffffffffffffffff\r\n", "", 1},
+        {"0\r\nX: a\r\n folded\r\n\r\n", "", 1},
+        {0, 0, 0}};
+    size_t i;
+    size_t fragment_size;
+
+    memset(&chunked, 0, sizeof(chunked));
+    chunked.is_transfer_encoding = true;
+    chunked.is_chunked = true;
+
+    memset(&sized, 0, sizeof(sized));
+    sized.has_content_length = true;
+    sized.content_length = 12;
+
+    both = chunked;
+    both.has_content_length = true;
+
+    memset(&gzip, 0, sizeof(gzip));
+    gzip.is_transfer_encoding = true;
+
+    for (fragment_size = 1; fragment_size < 64; fragment_size++) {
+        for (i = 0; tests[i].input; i++) {
+            if (_selftest_body(&chunked, tests[i].input, fragment_size,
+                    tests[i].expected, tests[i].is_error)) {
+                fprintf(stderr, "[-] httpbody: test %u failed\n", (unsigned)i);
+                return 1;
+            }
+        }
+        if (_selftest_body(&sized, "hello, worldNEXT", fragment_size,
+                "hello, world", 0))
+            return 1;
+    }
+
+    if (_selftest_body(&both, "0\r\n\r\n", 64, "", 1))
+        return 1;
+    if (_selftest_body(&gzip, "0\r\n\r\n", 64, "", 1))
+        return 1;
+    return 0;
+}
@@ -2,23 +2,116 @@
 #include "parse-http.h"
 #include "util-malloc.h"
 #include "util-ctype.h"
+#include <string.h>
 
+/*****************************************************************************
+ * Make room for 'count' more bytes in the header's own buffer.
+ *****************************************************************************/
+static void
+_field_reserve(struct httpheader *hdr, size_t count)
+{
+    if (hdr->offset + count > hdr->length) {
+        hdr->length = (hdr->offset + count) * 2;
+        hdr->buf = REALLOC(hdr->buf, hdr->length);
+    }
+}
 
+/*****************************************************************************
+ * Make sure a copied field is the last thing in the header's buffer, so
+ * that bytes appended to it follow the rest of it. It might not be if
+ * another field was copied after it, such as when `httpparse_buffer()`
+ * copies all the fields at the end of a fragment.
+ *****************************************************************************/
 static void
-_field_append(struct httpheader *hdr, unsigned char c)
+_field_tail(struct httpheader *hdr, struct httpheaderfield *field)
+{
+    if (field->offset + field->length == hdr->offset)
+        return;
+    _field_reserve(hdr, field->length);
+    memcpy(hdr->buf + hdr->offset, hdr->buf + field->offset, field->length);
+    field->offset = hdr->offset;
+    hdr->offset += field->length;
+}
+
+/*****************************************************************************
+ * Start a field's value with the current byte. When we're parsing the
+ * caller's buffer, the field simply points to it, and we add it to the
+ * header's list of such fields, unless it's already there from an
+ * earlier value.
+ *****************************************************************************/
+void
+http_field_start(struct httpheader *hdr, struct httpheaderfield *field)
 {
-    hdr->buf[hdr->offset++] = c;
+    if (hdr->input) {
+        struct httpheaderfield *f;
+
+        for (f = hdr->fields; f && f != field; f = f->next)
+            ;
+        if (f == NULL) {
+            field->next = hdr->fields;
+            hdr->fields = field;
+        }
+        field->offset = hdr->input_offset;
+        field->is_copy = false;
+    } else {
+        field->offset = hdr->offset;
+        field->is_copy = true;
+    }
+    field->length = 0;
 }
 
-static size_t
-_field_length(struct httpheader *hdr)
+/*****************************************************************************
+ * Add the current byte to the field. When the field points to the
+ * caller's buffer, the byte is normally already there, right after the
+ * rest of the field. If it's not, because we skipped a byte like '\r' in
+ * the middle, then we have to copy it after all.
+ *****************************************************************************/
+void
+http_field_append(struct httpheader *hdr, struct httpheaderfield *field,
+    unsigned char c)
 {
-    return hdr->length - hdr->offset;
+    if (!field->is_copy && field->offset + field->length != hdr->input_offset)
+        http_field_copy(hdr, field);
+    if (field->is_copy) {
+        _field_tail(hdr, field);
+        _field_reserve(hdr, 1);
+        hdr->buf[hdr->offset++] = c;
+    }
+    field->length++;
 }
-static size_t
-_field_init(struct httpheader *hdr)
+
+/*****************************************************************************
+ * Add a run of bytes starting with the current one.
+ *****************************************************************************/
+void
+http_field_append_span(struct httpheader *hdr, struct httpheaderfield *field,
+    const unsigned char *buf, size_t length)
+{
+    if (length == 0)
+        return;
+    if (!field->is_copy && field->offset + field->length != hdr->input_offset)
+        http_field_copy(hdr, field);
+    if (field->is_copy) {
+        _field_tail(hdr, field);
+        _field_reserve(hdr, length);
+        memcpy(hdr->buf + hdr->offset, buf, length);
+        hdr->offset += length;
+    }
+    field->length += length;
+}
+
+/*****************************************************************************
+ *****************************************************************************/
+void
+http_field_copy(struct httpheader *hdr, struct httpheaderfield *field)
 {
-    return hdr->offset;
+    if (field->is_copy || hdr->input == NULL)
+        return;
+    _field_reserve(hdr, field->length);
+    memcpy(hdr->buf + hdr->offset, hdr->input + field->offset, field->length);
+    field->offset = hdr->offset;
+    field->is_copy = true;
+    hdr->offset += field->length;
 }
 
 /*****************************************************************************
@@ -32,20 +125,15 @@ http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned cha
         HOST_TEXT,
         HOST_TEXT_SPACE,
         HOST_IPV6,
-        HOST_IPV6_SPACE,
         HOST_PORT,
         HOST_PORT_SPACE,
         HOST_ERROR = ~0
     };
-    /* make sure we have enough buffer space to hold the host field */
-    if (hdr->offset >= hdr->length) {
-        hdr->length = hdr->length * 2 + 1;
-        hdr->buf = REALLOC(hdr->buf, hdr->length);
-    }
-    
+
+    (void)p;
     switch (next_state) {
         case HOST_START:
-            if (hdr->host.offset || hdr->host.length) {
+            if (hdr->host.length) {
                 /* reject headers with two Host:fields */
                 hdr->is_error = 1;
                 next_state = HOST_ERROR;
@@ -56,13 +144,13 @@ http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned cha
                     hdr->is_error = 1;
                     break;
                 case '[':
-                    hdr->host.offset = _field_init(hdr);
-                    _field_append(hdr, c);
+                    http_field_start(hdr, &hdr->host);
+                    http_field_append(hdr, &hdr->host, c);
                     next_state = HOST_IPV6;
                     break;
                 default:
-                    hdr->host.offset = _field_init(hdr);
-                    _field_append(hdr, c);
+                    http_field_start(hdr, &hdr->host);
+                    http_field_append(hdr, &hdr->host, c);
                     next_state = HOST_TEXT;
                     break;
             }
@@ -71,7 +159,6 @@ http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned cha
             /* TODO: for now, just copy the field up to 256 bytes*/
             switch (c) {
                 case '\n':
-                    hdr->host.length = _field_length(hdr);
                     break;
                 case ':':
                     next_state = HOST_PORT;
@@ -79,11 +166,25 @@ http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned cha
                 case ' ':
                 case '\r':
                 case '\t':
-                    hdr->host.length = _field_length(hdr);
                     next_state = HOST_TEXT_SPACE;
                     break;
                 default:
-                    _field_append(hdr, c);
+                    http_field_append(hdr, &hdr->host, c);
+                    break;
+            }
+            break;
+        case HOST_IPV6:
+            /* copy everything up to and including the closing bracket */
+            switch (c) {
+                case '\n':
+                    hdr->is_error = 1;
+                    break;
+                case ']':
+                    http_field_append(hdr, &hdr->host, c);
+                    next_state = HOST_TEXT_SPACE;
+                    break;
+                default:
+                    http_field_append(hdr, &hdr->host, c);
                     break;
             }
             break;
@@ -122,7 +223,8 @@ http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned cha
                     next_state = HOST_PORT_SPACE;
                     break;
                 default:
-                    _field_append(hdr, c);
+                    hdr->is_error = 1;
+                    next_state = HOST_ERROR;
                     break;
             }
             break;
@@ -140,3 +242,163 @@ http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned cha
     return 0;
 }
 
+/*****************************************************************************
+ * Parses the comma-separated list of options in the "Connection:" field,
+ * looking for "close" or "keep-alive". The low byte of the state is the
+ * number of characters of the current option that matched, and the bits
+ * above that are cleared as each candidate stops matching.
+ *****************************************************************************/
+int
+http_parse_connection(const struct httpparser *p, struct httpheader *hdr, unsigned char c)
+{
+    static const char close_str[] = "close";
+    static const char keepalive_str[] = "keep-alive";
+    enum {
+        CONN_IS_CLOSE = 0x100,
+        CONN_IS_KEEPALIVE = 0x200,
+        CONN_START = CONN_IS_CLOSE | CONN_IS_KEEPALIVE,
+    };
+    unsigned state = hdr->state2;
+    unsigned i;
+
+    (void)p;
+    if (state == 0)
+        state = CONN_START;
+    i = state & 0xFF;
+
+    switch (c) {
+        case ',':
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            /* end of this option, see which one matched */
+            if ((state & CONN_IS_CLOSE) && i == sizeof(close_str) - 1)
+                hdr->is_close = true;
+            if ((state & CONN_IS_KEEPALIVE) && i == sizeof(keepalive_str) - 1)
+                hdr->is_keepalive = true;
+            state = CONN_START;
+            break;
+        default:
+            if (i >= sizeof(close_str) - 1 || TOLOWER(c) != close_str[i])
+                state &= ~CONN_IS_CLOSE;
+            if (i >= sizeof(keepalive_str) - 1 || TOLOWER(c) != keepalive_str[i])
+                state &= ~CONN_IS_KEEPALIVE;
+            if (i < 0xFF)
+                i++;
+            state = (state & ~0xFF) | i;
+            break;
+    }
+
+    hdr->state2 = state;
+    return 0;
+}
+
+/*****************************************************************************
+ *****************************************************************************/
+int
+http_parse_content_length(const struct httpparser *p, struct httpheader *hdr, unsigned char c)
+{
+    unsigned next_state = hdr->state2;
+    enum {
+        LENGTH_START,
+        LENGTH_DIGITS,
+        LENGTH_SPACE,
+        LENGTH_ERROR = ~0
+    };
+
+    (void)p;
+    switch (next_state) {
+        case LENGTH_START:
+            if (hdr->has_content_length || !ISDIGIT(c)) {
+                /* reject duplicate or empty fields */
+                hdr->is_error = 1;
+                next_state = LENGTH_ERROR;
+                break;
+            }
+            hdr->has_content_length = true;
+            hdr->content_length = 0;
+            /* fall through */
+        case LENGTH_DIGITS:
+            if (ISDIGIT(c)) {
+                /* reject lengths that can't be represented */
+                if (hdr->content_length > (~0ULL - 9) / 10) {
+                    hdr->is_error = 1;
+                    next_state = LENGTH_ERROR;
+                    break;
+                }
+                hdr->content_length = hdr->content_length * 10 + (c - '0');
+                next_state = LENGTH_DIGITS;
+            } else if (ISSPACE(c)) {
+                next_state = LENGTH_SPACE;
+            } else {
+                hdr->is_error = 1;
+                next_state = LENGTH_ERROR;
+            }
+            break;
+        case LENGTH_SPACE:
+            if (!ISSPACE(c)) {
+                hdr->is_error = 1;
+                next_state = LENGTH_ERROR;
+            }
+            break;
+        case LENGTH_ERROR:
+        default:
+            hdr->is_error = 1;
+            break;
+    }
+    hdr->state2 = next_state;
+    return 0;
+}
+
+/*****************************************************************************
+ * Parses the comma-separated list of transfer codings, to see whether the
+ * last one is "chunked", since that's the only way to find the end of the
+ * body. The state is the same as for "Connection:", with the number of
+ * characters that matched in the low byte.
+ *****************************************************************************/
+int
+http_parse_transfer_encoding(const struct httpparser *p, struct httpheader *hdr, unsigned char c)
+{
+    static const char chunked_str[] = "chunked";
+    enum {
+        TE_IS_CHUNKED = 0x100,
+        TE_IS_EMPTY = 0x200,
+        TE_START = TE_IS_CHUNKED | TE_IS_EMPTY,
+    };
+    unsigned state = hdr->state2;
+    unsigned i;
+
+    (void)p;
+    hdr->is_transfer_encoding = true;
+    if (state == 0)
+        state = TE_START;
+    i = state & 0xFF;
+
+    switch (c) {
+        case ',':
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            /* end of this coding, which is the last one so far */
+            if (!(state & TE_IS_EMPTY)) {
+                hdr->is_chunked = (state & TE_IS_CHUNKED)
+                    && i == sizeof(chunked_str) - 1;
+            }
+            state = TE_START;
+            break;
+        default:
+            /* this includes parameters, like "gzip;q=1" */
+            if (i >= sizeof(chunked_str) - 1 || TOLOWER(c) != chunked_str[i])
+                state &= ~TE_IS_CHUNKED;
+            if (i < 0xFF)
+                i++;
+            state = (state & ~(0xFF | TE_IS_EMPTY)) | i;
+            break;
+    }
+
+    hdr->state2 = state;
+    return 0;
+}
+
@@ -1,11 +1,49 @@
 #ifndef PARSE_HTTP_FIELDS_H
 #define PARSE_HTTP_FIELDS_H
+#include <stddef.h>
 
 struct httpparser;
 struct httpheader;
+struct httpheaderfield;
+
+/**
+ * Start recording a field's value, beginning with the current byte.
+ */
+void
+http_field_start(struct httpheader *hdr, struct httpheaderfield *field);
+
+/**
+ * Add the current byte to a field's value.
+ */
+void
+http_field_append(struct httpheader *hdr, struct httpheaderfield *field,
+    unsigned char c);
+
+/**
+ * Add a run of bytes starting at the current byte to a field's value.
+ */
+void
+http_field_append_span(struct httpheader *hdr, struct httpheaderfield *field,
+    const unsigned char *buf, size_t length);
+
+/**
+ * Copies a field's value out of the caller's buffer into the header's
+ * own buffer, before the caller reuses its buffer.
+ */
+void
+http_field_copy(struct httpheader *hdr, struct httpheaderfield *field);
 
 int
 http_parse_host(const struct httpparser *p, struct httpheader *hdr, unsigned char c);
 
+int
+http_parse_connection(const struct httpparser *p, struct httpheader *hdr, unsigned char c);
+
+int
+http_parse_content_length(const struct httpparser *p, struct httpheader *hdr, unsigned char c);
+
+int
+http_parse_transfer_encoding(const struct httpparser *p, struct httpheader *hdr, unsigned char c);
+
 #endif
 
@@ -1,23 +1,101 @@
 #include "parse-http.h"
+#include "parse-http-fields.h"
 #include "util-ctype.h"
 #include "util-malloc.h"
+#include "util-scan.h"
 #include "util-smack.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+/* The states for `httpparse_next()`, stored in `hdr->state1` */
+enum {
+    SPACE0,
+    METHOD,
+    SPACE1,
+    URI,
+    URL_PERCENT1,
+    URL_PERCENT2,
+    SPACE2,
+    VERSION_H,
+    VERSION_HT,
+    VERSION_HTT,
+    VERSION_HTTP,
+    VERSION_HTTPMAJ,
+    VERSION_HTTPMIN,
+    VERSION_ERR,
+    EOL,
+    NAME,
+    VALUE_SPACE,
+    VALUE,
+    DONE,
+};
+
+
+/* The fields that every parser understands. Rather than a parser, some
+ * fields just record their whole value in the header */
+static const struct {
+    const char *name;
+    unsigned id;
+    httpfield_parse_t parse;
+    size_t value_offset;
+} builtin_fields[] = {
+    {"Host", FIELD_HOST, http_parse_host, 0},
+    {"Connection", FIELD_CONNECTION, http_parse_connection, 0},
+    {"Content-Length", FIELD_CONTENT_LENGTH, http_parse_content_length, 0},
+    {"Transfer-Encoding", FIELD_TRANSFER_ENCODING,
+        http_parse_transfer_encoding, 0},
+    {"Cookie", FIELD_COOKIE, 0, offsetof(struct httpheader, cookie)},
+    {0, 0, 0, 0}};
+
+struct fieldparser {
+    char *name;
+    size_t length;
+    unsigned id;
+    httpfield_parse_t parse;
+
+    /* If not zero, the offset of the `struct httpheaderfield` in the
+     * header where we record the value, instead of parsing it */
+    size_t value_offset;
+};
+
+/* The states in `hdr->state2` while recording a field's value */
+enum {
+    VALUE_START,
+    VALUE_RECORD,
+    VALUE_IGNORE,
+};
+
 struct uriprefix {
     char *prefix;
     size_t length;
+    unsigned id;
 };
 struct httpparser {
     struct SMACK *ac_methods;
     struct SMACK *ac_prefixes;
+    struct SMACK *ac_fields;
+
+    /* The characters allowed in the method and field names (tokens), the
+     * URL (other than percent-encoding), and field values. These are
+     * both for validating them, and for `httpparse_buffer()` to find the
+     * end of a run of them in bulk */
+    struct scanclass_t scan_token;
+    struct scanclass_t scan_uri;
+    struct scanclass_t scan_value;
 
     struct {
         size_t count;
         struct uriprefix *list;
     } uri;
+
+    /* The registered header fields. The index into this list is the id
+     * of its pattern in `ac_fields`, plus one, so that zero means none */
+    struct {
+        size_t count;
+        struct fieldparser *list;
+    } fields;
 };
 
 
@@ -27,6 +105,7 @@ struct httpparser *
 httpparser_create(void)
 {
     struct httpparser *parser;
+    size_t i;
 
     /* Create a parser structure */
     parser = malloc(sizeof(*parser));
@@ -34,9 +113,43 @@ httpparser_create(void)
         return NULL;
     memset(parser, 0, sizeof(*parser));
 
+    httpparser_set_isa(parser, SCAN_ISA_AUTO);
+
+    for (i = 0; builtin_fields[i].name; i++) {
+        httpparser_register_field(parser, builtin_fields[i].id,
+            builtin_fields[i].name, 0, builtin_fields[i].parse);
+        parser->fields.list[i].value_offset = builtin_fields[i].value_offset;
+    }
+
     return parser;
 }
 
+/*****************************************************************************
+ *****************************************************************************/
+void
+httpparser_set_isa(struct httpparser *parser, enum scan_isa_t isa)
+{
+    unsigned char token[256];
+    unsigned char uri[256];
+    unsigned char value[256];
+    unsigned c;
+
+    for (c = 0; c < 256; c++) {
+        /* RFC 7230 3.2.6: tchar */
+        token[c] = ISALNUM(c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+
+        /* Visible characters and obs-text, except those that we decode
+         * or which end the URL */
+        uri[c] = (c > ' ' && c != 0x7F && c != '%' && c != '+');
+
+        /* RFC 7230 3.2: VCHAR, SP, HTAB, and obs-text */
+        value[c] = (c >= ' ' && c != 0x7F) || c == '\t';
+    }
+    scanclass_init(&parser->scan_token, token, isa);
+    scanclass_init(&parser->scan_uri, uri, isa);
+    scanclass_init(&parser->scan_value, value, isa);
+}
+
 
 
 
@@ -64,17 +177,48 @@ httpparser_compile(struct httpparser *p)
     /* others: http://webconcepts.info/concepts/http-method/*/
     smack_compile(p->ac_methods);
 
-    /* Add header field parsers */
-    
-    
-    /* Add URL prefixes */
+    /* Add header field parsers, all in one state-machine, so that we
+     * recognize the name in a single pass no matter how many there are */
+    p->ac_fields = smack_create("fields", SMACK_CASE_INSENSITIVE);
+    for (i = 0; i < p->fields.count; i++) {
+        smack_add_pattern(p->ac_fields, p->fields.list[i].name,
+            p->fields.list[i].length, i + 1, flags);
+    }
+    smack_compile(p->ac_fields);
+
+    /* Add URL prefixes. These are anchored only at the start, so that
+     * they match any URL that begins with them */
     p->ac_prefixes = smack_create("uris", 1);
     for (i = 0; i < p->uri.count; i++) {
         smack_add_pattern(p->ac_prefixes, p->uri.list[i].prefix,
-            p->uri.list[i].length, i,
-            SMACK_ANCHOR_BEGIN | SMACK_ANCHOR_END);
+            p->uri.list[i].length, p->uri.list[i].id,
+            SMACK_ANCHOR_BEGIN);
     }
-    smack_compile(p->ac_methods);
+    smack_compile(p->ac_prefixes);
+}
+
+/*****************************************************************************
+ *****************************************************************************/
+void
+httpparser_destroy(struct httpparser *p)
+{
+    size_t i;
+
+    if (p == NULL)
+        return;
+    if (p->ac_methods)
+        smack_destroy(p->ac_methods);
+    if (p->ac_fields)
+        smack_destroy(p->ac_fields);
+    if (p->ac_prefixes)
+        smack_destroy(p->ac_prefixes);
+    for (i = 0; i < p->uri.count; i++)
+        free(p->uri.list[i].prefix);
+    free(p->uri.list);
+    for (i = 0; i < p->fields.count; i++)
+        free(p->fields.list[i].name);
+    free(p->fields.list);
+    free(p);
 }
 
 /*****************************************************************************
@@ -93,25 +237,70 @@ httpparser_register_url_prefix(
     p = &parser->uri.list[parser->uri.count++];
     p->length = length;
     p->prefix = MALLOCDUP(uri, length);
+    p->id = id;
 
-    return (unsigned)parser->uri.count - 1;
+    return id;
 }
 
 /*****************************************************************************
  *****************************************************************************/
-void
-httpparse_begin(struct httpparser *parser, struct httpheader *hdr)
+unsigned
+httpparser_register_field(struct httpparser *parser, unsigned id,
+    const char *name, size_t length, httpfield_parse_t parse)
 {
-    memset(hdr, 0, sizeof(*hdr));
+    struct fieldparser *f;
+    size_t i;
+
+    if (length == 0 && name != 0)
+        length = strlen(name);
+
+    /* Replace the existing field with the same name */
+    for (i = 0; i < parser->fields.count; i++) {
+        size_t j;
+        f = &parser->fields.list[i];
+        if (f->length != length)
+            continue;
+        for (j = 0; j < length; j++) {
+            if (TOLOWER(f->name[j]) != TOLOWER(name[j]))
+                break;
+        }
+        if (j == length) {
+            f->id = id;
+            f->parse = parse;
+            f->value_offset = 0;
+            return id;
+        }
+    }
+
+    parser->fields.list = REALLOCARRAY(parser->fields.list,
+        parser->fields.count + 1, sizeof(parser->fields.list[0]));
+    f = &parser->fields.list[parser->fields.count++];
+    f->name = MALLOCDUP(name, length);
+    f->length = length;
+    f->id = id;
+    f->parse = parse;
+    f->value_offset = 0;
+
+    return id;
 }
 
+/*****************************************************************************
+ * Called with each (decoded) character of the URL to match it against the
+ * registered prefixes. Since the prefixes are anchored at the start, once
+ * the URL stops matching, we stay in the root state and never match again,
+ * so the last match we see is the longest prefix.
+ *****************************************************************************/
 int
 httpparse_next_uri(
     const struct httpparser *parser, struct httpheader *hdr, unsigned char c)
 {
-    /*id = smack_search_next(parser->ac_prefixes, &hdr->state2, &c, 0, 1);
+    size_t id;
 
-    printf("%c", c);*/
+    id = smack_search_next(parser->ac_prefixes, &hdr->state2, &c, 0, 1);
+    while (id != SMACK_NOT_FOUND) {
+        hdr->url_id = (unsigned)id;
+        id = smack_next_match(parser->ac_prefixes, &hdr->state2);
+    }
     return 0;
 }
 
@@ -135,9 +324,90 @@ hexval(char c)
 void
 httpparse_start(const struct httpparser *parser, struct httpheader *hdr)
 {
+    (void)parser;
     memset(hdr, 0, sizeof(*hdr));
 }
 
+/***************************************************************************
+ ***************************************************************************/
+void
+httpparse_end(struct httpheader *hdr)
+{
+    free(hdr->buf);
+    hdr->buf = NULL;
+    hdr->offset = 0;
+    hdr->length = 0;
+}
+
+/***************************************************************************
+ * Returns where to record the value of the current field, or NULL if it
+ * has a parser instead.
+ ***************************************************************************/
+static struct httpheaderfield *
+_field_value(const struct httpparser *parser, struct httpheader *hdr)
+{
+    const struct fieldparser *f;
+
+    f = &parser->fields.list[hdr->field_index - 1];
+    if (f->value_offset == 0)
+        return NULL;
+    return (struct httpheaderfield *)((char *)hdr + f->value_offset);
+}
+
+/***************************************************************************
+ * Record the value of a field that doesn't need parsing, without the
+ * trailing whitespace. A client shouldn't send more than one of these,
+ * so we ignore the others.
+ ***************************************************************************/
+static void
+_record_field(struct httpheader *hdr, struct httpheaderfield *value,
+    unsigned char c)
+{
+    switch (hdr->state2) {
+    case VALUE_START:
+        if (value->length || c == '\n') {
+            hdr->state2 = VALUE_IGNORE;
+            break;
+        }
+        http_field_start(hdr, value);
+        hdr->state2 = VALUE_RECORD;
+        /* fall through */
+    case VALUE_RECORD:
+        if (c != '\n') {
+            http_field_append(hdr, value, c);
+            break;
+        }
+        while (value->length) {
+            char last = httpheader_string(hdr, value)[value->length - 1];
+            if (last != ' ' && last != '\t')
+                break;
+            value->length--;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/***************************************************************************
+ * Called with each character of a field's value, as well as the '\n' at
+ * the end of the line, to pass it to the parser for that field.
+ ***************************************************************************/
+static void
+_parse_field(
+    const struct httpparser *parser, struct httpheader *hdr, unsigned char c)
+{
+    const struct fieldparser *f;
+
+    if (hdr->field_index == 0)
+        return;
+    f = &parser->fields.list[hdr->field_index - 1];
+    if (f->parse)
+        f->parse(parser, hdr, c);
+    else if (f->value_offset)
+        _record_field(hdr, _field_value(parser, hdr), c);
+}
+
 /***************************************************************************
  ***************************************************************************/
 int
@@ -145,26 +415,7 @@ httpparse_next(
     const struct httpparser *parser, struct httpheader *hdr, unsigned char c)
 {
     unsigned next_state = hdr->state1;
-    enum {
-        SPACE0,
-        METHOD,
-        SPACE1,
-        URI,
-        URL_PERCENT1,
-        URL_PERCENT2,
-        SPACE2,
-        VERSION_H,
-        VERSION_HT,
-        VERSION_HTT,
-        VERSION_HTTP,
-        VERSION_HTTPMAJ,
-        VERSION_HTTPMIN,
-        VERSION_ERR,
-        EOL,
-        NAME,
-        VALUE,
-
-    };
+    int is_done = 0;
 
     switch (next_state) {
     case SPACE0:
@@ -174,6 +425,8 @@ httpparse_next(
         /* fall through */
     case METHOD:
         if (c == '\n') {
+            /* HTTP/0.9 requests aren't supported */
+            hdr->is_error = true;
             next_state = EOL;
             break;
         }
@@ -181,23 +434,30 @@ httpparse_next(
             hdr->method = smack_search_done(parser->ac_methods, &hdr->state2);
             next_state = SPACE1;
         } else {
+            if (!parser->scan_token.allowed[c])
+                hdr->is_error = true;
             smack_search_next(parser->ac_methods, &hdr->state2, &c, 0, 1);
             next_state = METHOD;
         }
         break;
     case SPACE1:
         if (c == '\n') {
+            hdr->is_error = true;
             next_state = EOL;
             break;
         }
         if (ISSPACE(c))
             break;
         next_state = URI;
+        hdr->state2 = 0;
         /* fall through */
     case URI:
         switch (c) {
         case '/':
         default:
+            /* control characters aren't allowed */
+            if (c < ' ' || c == 0x7F)
+                hdr->is_error = true;
             httpparse_next_uri(parser, hdr, c);
             break;
         case '+':
@@ -212,6 +472,7 @@ httpparse_next(
             next_state = SPACE2;
             break;
         case '\n':
+            hdr->is_error = true;
             next_state = EOL;
             break;
         }
@@ -231,8 +492,10 @@ httpparse_next(
     case URL_PERCENT2:
         if (ISXDIGIT(c)) {
             hdr->tmp |= hexval(c);
+            httpparse_next_uri(parser, hdr, (unsigned char)hdr->tmp);
             next_state = URI;
         } else {
+            hdr->is_error = true;
             if (c == '\n')
                 next_state = EOL;
             else
@@ -242,6 +505,7 @@ httpparse_next(
     case SPACE2:
             switch (c) {
                 case '\n':
+                    hdr->is_error = true;
                     next_state = EOL;
                     break;
                 case '\t':
@@ -254,6 +518,7 @@ httpparse_next(
                     next_state = VERSION_H;
                     break;
                 default:
+                    hdr->is_error = true;
                     next_state = VERSION_ERR;
             }
             break;
@@ -263,66 +528,45 @@ httpparse_next(
             break;
         case VERSION_H:
             switch (c) {
-                case '\n':
-                    next_state = EOL;
-                    break;
                 case 't':
                 case 'T':
                     next_state = VERSION_HT;
                     break;
                 default:
-                    next_state = VERSION_ERR;
-                    break;
+                    goto version_error;
             }
             break;
         case VERSION_HT:
             switch (c) {
-                case '\n':
-                    next_state = EOL;
-                    break;
                 case 't':
                 case 'T':
                     next_state = VERSION_HTT;
                     break;
                 default:
-                    next_state = VERSION_ERR;
-                    break;
+                    goto version_error;
             }
             break;
         case VERSION_HTT:
             switch (c) {
-                case '\n':
-                    next_state = EOL;
-                    break;
                 case 'p':
                 case 'P':
                     next_state = VERSION_HTTP;
                     break;
                 default:
-                    next_state = VERSION_ERR;
-                    break;
+                    goto version_error;
             }
             break;
         case VERSION_HTTP:
             switch (c) {
-                case '\n':
-                    next_state = EOL;
-                    break;
                 case '/':
                     next_state = VERSION_HTTPMAJ;
                     break;
                 default:
-                    next_state = VERSION_ERR;
-                    break;
+                    goto version_error;
             }
             break;
         case VERSION_HTTPMAJ:
             switch (c) {
-                case '\r':
-                    break;
-                case '\n':
-                    next_state = EOL;
-                    break;
                 case '0':
                 case '1':
                 case '2':
@@ -337,15 +581,14 @@ httpparse_next(
                         hdr->version_major = hdr->version_major * 10 + (c - '0');
                     else {
                         hdr->version_major = 0;
-                        next_state = VERSION_ERR;
+                        goto version_error;
                     }
                     break;
                 case '.':
                     next_state = VERSION_HTTPMIN;
                     break;
                 default:
-                    next_state = VERSION_ERR;
-                    break;
+                    goto version_error;
             }
             break;
         case VERSION_HTTPMIN:
@@ -369,28 +612,416 @@ httpparse_next(
                         hdr->version_minor = hdr->version_minor * 10 + (c - '0');
                     else {
                         hdr->version_minor = 0;
-                        next_state = VERSION_ERR;
+                        goto version_error;
                     }
                     break;
                 default:
-                    next_state = VERSION_ERR;
-                    break;
+                    goto version_error;
             }
             break;
+    version_error:
+        /* Anything unexpected in the version marks the header as bad, but
+         * we still need to find the end of the line */
+        hdr->is_error = true;
+        next_state = (c == '\n') ? EOL : VERSION_ERR;
+        break;
+
     case EOL:
+        /* At the start of a line, which is either the next field, or
+         * the empty line at the end of the header */
+        switch (c) {
+        case '\r':
+            break;
+        case '\n':
+            next_state = DONE;
+            is_done = 1;
+            break;
+        case ' ':
+        case '\t':
+            /* Obsolete line folding, which RFC 7230 says servers must
+             * reject, so skip the rest of the line */
+            hdr->is_error = true;
+            hdr->field = FIELD_UNKNOWN;
+            hdr->field_index = 0;
+            next_state = VALUE;
+            break;
+        default:
+            hdr->state2 = 0;
+            smack_search_next(parser->ac_fields, &hdr->state2, &c, 0, 1);
+            next_state = NAME;
+            break;
+        }
+        break;
+    case NAME:
+        switch (c) {
+        case ':': {
+            size_t index;
+            index = smack_search_done(parser->ac_fields, &hdr->state2);
+            if (index == SMACK_NOT_FOUND) {
+                hdr->field = FIELD_UNKNOWN;
+                hdr->field_index = 0;
+            } else {
+                hdr->field = parser->fields.list[index - 1].id;
+                hdr->field_index = (unsigned)index;
+            }
+            hdr->state2 = 0;
+            next_state = VALUE_SPACE;
+            break;
+        }
+        case '\n':
+            /* a line without a colon */
+            hdr->is_error = true;
+            next_state = EOL;
+            break;
+        default:
+            /* includes whitespace before the colon, which RFC 7230
+             * says servers must reject */
+            if (!parser->scan_token.allowed[c])
+                hdr->is_error = true;
+            smack_search_next(parser->ac_fields, &hdr->state2, &c, 0, 1);
+            break;
+        }
+        break;
+    case VALUE_SPACE:
+        if (c == ' ' || c == '\t')
+            break;
+        next_state = VALUE;
+        /* fall through */
+    case VALUE:
+        switch (c) {
+        case '\r':
+            break;
+        case '\n':
+            _parse_field(parser, hdr, c);
+            next_state = EOL;
             break;
-            
+        default:
+            if (!parser->scan_value.allowed[c])
+                hdr->is_error = true;
+            _parse_field(parser, hdr, c);
+            break;
+        }
+        break;
+    case DONE:
+        /* the caller should've stopped at the end of the header */
+        break;
 
     default:
-            printf("err\n");
+            hdr->is_error = true;
     }
 
     hdr->state1 = next_state;
+    if (is_done)
+        hdr->is_done = true;
+    return is_done;
+}
+
+/***************************************************************************
+ * Run a state-machine over a whole span of bytes, instead of one byte at
+ * a time. The patterns are anchored at the end, or only at the start,
+ * so the only matches can be URL prefixes, which we record.
+ ***************************************************************************/
+static void
+_search_span(const struct SMACK *smack, unsigned *state, unsigned *id,
+    const unsigned char *buf, size_t length)
+{
+    unsigned offset = 0;
+
+    while (offset < length) {
+        size_t found;
+
+        found = smack_search_next(smack, state, buf, &offset,
+            (unsigned)length);
+        while (found != SMACK_NOT_FOUND) {
+            if (id)
+                *id = (unsigned)found;
+            found = smack_next_match(smack, state);
+        }
+    }
+}
+
+/***************************************************************************
+ * Copy any fields that point into the caller's buffer before it goes
+ * away. That's every field started with `http_field_start()` while
+ * parsing it, including those of fields registered by the caller.
+ ***************************************************************************/
+static void
+_copy_fields(struct httpheader *hdr)
+{
+    struct httpheaderfield *field;
+
+    for (field = hdr->fields; field; field = field->next)
+        http_field_copy(hdr, field);
+    hdr->fields = NULL;
+    hdr->input = NULL;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+size_t
+httpparse_buffer(const struct httpparser *parser, struct httpheader *hdr,
+    const void *v_buf, size_t length)
+{
+    const unsigned char *buf = (const unsigned char *)v_buf;
+    size_t i = 0;
+
+    /* Let fields point into this buffer while we parse it */
+    hdr->input = buf;
+
+    while (i < length) {
+        size_t n;
+
+        /* In the states where most of the bytes are, consume the run of
+         * valid characters at once. Whatever ends the run, whether it's
+         * a delimiter or an invalid character, is handled below */
+        switch (hdr->state1) {
+        case METHOD:
+            n = scanclass_span(&parser->scan_token, buf + i, length - i);
+            _search_span(parser->ac_methods, &hdr->state2, 0, buf + i, n);
+            i += n;
+            break;
+        case URI:
+            n = scanclass_span(&parser->scan_uri, buf + i, length - i);
+            _search_span(parser->ac_prefixes, &hdr->state2, &hdr->url_id,
+                buf + i, n);
+            i += n;
+            break;
+        case NAME:
+            n = scanclass_span(&parser->scan_token, buf + i, length - i);
+            _search_span(parser->ac_fields, &hdr->state2, 0, buf + i, n);
+            i += n;
+            break;
+        case VALUE:
+            /* Fields we don't care about are skipped entirely, and
+             * those we just record are recorded a run at a time */
+            if (hdr->field_index == 0)
+                i += scanclass_span(&parser->scan_value, buf + i, length - i);
+            else if (hdr->state2 == VALUE_RECORD
+                     && _field_value(parser, hdr) != NULL) {
+                n = scanclass_span(&parser->scan_value, buf + i, length - i);
+                hdr->input_offset = i;
+                http_field_append_span(hdr, _field_value(parser, hdr),
+                    buf + i, n);
+                i += n;
+            }
+            break;
+        case DONE:
+            return i;
+        }
+
+        /* Handle the delimiter one byte at a time */
+        if (i < length) {
+            hdr->input_offset = i;
+            if (httpparse_next(parser, hdr, buf[i++]))
+                break;
+        }
+    }
+
+    /* If we need more of the header, the caller will reuse its buffer
+     * for it, so the fields can't keep pointing to it */
+    if (!hdr->is_done)
+        _copy_fields(hdr);
+
+    return i;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static int
+_selftest_parse(struct httpparser *parser, struct httpheader *hdr,
+    const char *sample, size_t length, size_t fragment_size)
+{
+    size_t i;
+    int is_done = 0;
+
+    /* Feed the input a fragment at a time, as if it arrived in several
+     * packets, since the parser must produce the same result */
+    httpparse_start(parser, hdr);
+    for (i = 0; i < length; i += fragment_size) {
+        size_t j;
+        for (j = i; j < i + fragment_size && j < length; j++) {
+            if (is_done)
+                return -1; /* bytes after the end */
+            is_done = httpparse_next(parser, hdr, sample[j]);
+        }
+    }
+    return is_done ? 0 : -1;
+}
+
+/***************************************************************************
+ * Parse the input in two fragments with `httpparse_buffer()`, split at
+ * every possible point, and make sure the result is the same as the one
+ * we got one byte at a time.
+ ***************************************************************************/
+static int
+_selftest_buffer(struct httpparser *parser, const struct httpheader *expected,
+    const char *sample, size_t length)
+{
+    char first[2048];
+    size_t split;
+
+    if (length > sizeof(first))
+        return -1;
+
+    for (split = 0; split <= length; split++) {
+        struct httpheader hdr;
+        size_t n;
+        int is_same;
+
+        /* The fields must survive the caller reusing its buffer for the
+         * next fragment, so we erase the first one afterwards */
+        httpparse_start(parser, &hdr);
+        memcpy(first, sample, split);
+        n = httpparse_buffer(parser, &hdr, first, split);
+        if (n == split && !hdr.is_done) {
+            memset(first, 0, split);
+            n += httpparse_buffer(parser, &hdr, sample + split, length - split);
+        }
+
+        is_same = n == length
+            && hdr.is_done
+            && hdr.is_error == expected->is_error
+            && hdr.method == expected->method
+            && hdr.url_id == expected->url_id
+            && hdr.version_major == expected->version_major
+            && hdr.version_minor == expected->version_minor
+            && hdr.is_close == expected->is_close
+            && hdr.is_keepalive == expected->is_keepalive
+            && hdr.is_transfer_encoding == expected->is_transfer_encoding
+            && hdr.content_length == expected->content_length
+            && hdr.host_port == expected->host_port
+            && hdr.host.length == expected->host.length
+            && (hdr.host.length == 0
+                || memcmp(httpheader_string(&hdr, &hdr.host),
+                          httpheader_string(expected, &expected->host),
+                          hdr.host.length) == 0)
+            && hdr.cookie.length == expected->cookie.length
+            && (hdr.cookie.length == 0
+                || memcmp(httpheader_string(&hdr, &hdr.cookie),
+                          httpheader_string(expected, &expected->cookie),
+                          hdr.cookie.length) == 0);
+        httpparse_end(&hdr);
+        if (!is_same)
+            return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ * A parser for a registered field, which adds up the lengths of the
+ * values it sees.
+ ***************************************************************************/
+static int
+_selftest_field(
+    const struct httpparser *parser, struct httpheader *hdr, unsigned char c)
+{
+    unsigned *total = (unsigned *)hdr->userdata;
+
+    (void)parser;
+    if (c == '\n')
+        *total += hdr->state2;
+    else
+        hdr->state2++;
     return 0;
 }
 
+/***************************************************************************
+ * A parser for a registered field, which records the value in a field of
+ * the caller's, rather than in the header.
+ ***************************************************************************/
+static int
+_selftest_record(
+    const struct httpparser *parser, struct httpheader *hdr, unsigned char c)
+{
+    struct httpheaderfield *value = (struct httpheaderfield *)hdr->userdata;
+
+    (void)parser;
+    if (c == '\n')
+        return 0;
+    if (hdr->state2 == 0) {
+        http_field_start(hdr, value);
+        hdr->state2 = 1;
+    }
+    http_field_append(hdr, value, c);
+    return 0;
+}
+
+/***************************************************************************
+ * A field recorded by the caller's own parser must be copied too, when
+ * the header arrives a byte at a time from a buffer that's reused.
+ ***************************************************************************/
+static int
+_selftest_register_record(void)
+{
+    struct httpparser *parser;
+    struct httpheader hdr;
+    struct httpheaderfield value = {0};
+    unsigned char buf[1];
+    size_t i;
+    int err = 0;
+    static const char sample[]
+        = "GET / HTTP/1.1\r\n"
+          "X-Trace: abc123\r\n"
+          "Host: example.com\r\n"
+          "\r\n";
+
+    parser = httpparser_create();
+    httpparser_register_field(parser, FIELD_USER, "X-Trace", 0,
+        _selftest_record);
+    httpparser_compile(parser);
+
+    httpparse_start(parser, &hdr);
+    hdr.userdata = &value;
+    for (i = 0; i < sizeof(sample) - 1 && !hdr.is_done; i++) {
+        buf[0] = sample[i];
+        httpparse_buffer(parser, &hdr, buf, 1);
+        buf[0] = 0; /* the caller reuses its buffer */
+    }
+    if (!hdr.is_done || hdr.is_error || !value.is_copy || value.length != 6
+        || memcmp(httpheader_string(&hdr, &value), "abc123", 6) != 0
+        || hdr.host.length != 11
+        || memcmp(httpheader_string(&hdr, &hdr.host), "example.com", 11) != 0)
+        err = 1;
+    httpparse_end(&hdr);
+
+    httpparser_destroy(parser);
+    return err;
+}
+
+/***************************************************************************
+ * Test registering our own fields, including replacing a built-in one.
+ ***************************************************************************/
+static int
+_selftest_register(void)
+{
+    struct httpparser *parser;
+    struct httpheader hdr;
+    unsigned total = 0;
+    int err = 0;
+    static const char sample[]
+        = "GET / HTTP/1.1\r\n"
+          "X-Request-ID: abc123\r\n"
+          "Connection: close\r\n"
+          "X-Other: ignored\r\n"
+          "\r\n";
 
-          
+    parser = httpparser_create();
+    httpparser_register_field(parser, FIELD_USER, "x-request-id", 0,
+        _selftest_field);
+    httpparser_register_field(parser, FIELD_USER + 1, "CONNECTION", 0,
+        _selftest_field);
+    httpparser_compile(parser);
+
+    httpparse_start(parser, &hdr);
+    hdr.userdata = &total;
+    httpparse_buffer(parser, &hdr, sample, sizeof(sample) - 1);
+    if (!hdr.is_done || hdr.is_error || hdr.is_close || total != 11)
+        err = 1;
+    httpparse_end(&hdr);
+
+    httpparser_destroy(parser);
+    return err;
+}
 
 /***************************************************************************
  ***************************************************************************/
@@ -417,21 +1048,139 @@ httpparser_selftest(void)
           "Cookie: nyt-a=Xa6aiXfxMmO-BS3Uf_LJoS; "
           "optimizelyEndUserId=oeu1546063050462r0.5510475026965527\r\n"
           "\r\n";
+    static const char sample2[]
+        = "\r\nPOST /cgi-bin/%74est.cgi HTTP/1.0\n"
+          "host: [::1]:8080\n"
+          "content-length: 1234\n"
+          "CONNECTION: Upgrade, Close\n"
+          "\n";
+    static const struct {
+        const char *text;
+        int is_error;
+    } errors[] = {
+        {"GET /\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 1\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nHost: a\r\nHost: b\r\n\r\n", 1},
+        {"GET / HTTQ/1.1\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nno colon\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nX-Unknown: yes\r\n\r\n", 0},
+        {"GET / HTTP/1.1\r\nHost: a\rb\r\n\r\n", 0},
+        {"GET / HTTP/1.1\r\nHost: a.b\r\nCookie: x=1\ry=2; z=3\r\n\r\n",
+         0},
+        {"GET / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", 0},
+        {"G(T / HTTP/1.1\r\n\r\n", 1},
+        {"GET /a\x01b HTTP/1.1\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nHost : a\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nX-Unknown: a\x7F\r\n\r\n", 1},
+        {"GET / HTTP/1.1\r\nX-Unknown: caf\xC3\xA9\tok\r\n\r\n", 0},
+        {"GET /a/long/path/that/spans/more/than/32/bytes HTTP/1.1\r\n"
+         "X-A-Long-Field-Name-Over-32-Bytes: "
+         "a value that is longer than 32 bytes\x0b\r\n\r\n", 1},
+        {"GET /a/long/path/that/spans/more/than/32/bytes HTTP/1.1\r\n"
+         "X-A-Long-Field-Name-Over-32-Bytes: "
+         "a value that is longer than 32 bytes\r\n\r\n", 0},
+        {0, 0}};
+    enum scan_isa_t isa;
 
     parser = httpparser_create();
-    httpparser_register_url_prefix(parser, 1, "/index.html", 0);
-    httpparser_register_url_prefix(parser, 2, "/cgi-bin", 0);
+    httpparser_register_url_prefix(parser, 1, "/", 0);
+    httpparser_register_url_prefix(parser, 2, "/index.html", 0);
+    httpparser_register_url_prefix(parser, 3, "/cgi-bin/", 0);
+    httpparser_register_url_prefix(parser, 4, "/cgi-bin/test", 0);
     httpparser_compile(parser);
 
-    httpparse_start(parser, &hdr);
-    for (i = 0; sample[i]; i++) {
-        int err;
-        err = httpparse_next(parser, &hdr, sample[i]);
-        if (err == 1) {
-            printf("done\n");
-            return 1;
+    /* Test all the SIMD versions of `httpparse_buffer()` */
+    for (isa = SCAN_ISA_SCALAR; isa <= SCAN_ISA_AVX2; isa++) {
+        httpparser_set_isa(parser, isa);
+
+        for (i = 1; i < sizeof(sample); i++) {
+            if (_selftest_parse(parser, &hdr, sample, sizeof(sample) - 1, i))
+                goto fail;
+            if (hdr.is_error || hdr.method != METHOD_GET || hdr.url_id != 1)
+                goto fail;
+            if (hdr.version_major != 1 || hdr.version_minor != 1)
+                goto fail;
+            if (!hdr.is_keepalive || hdr.is_close || hdr.has_content_length)
+                goto fail;
+            if (hdr.host.length != 15
+                || memcmp(httpheader_string(&hdr, &hdr.host),
+                       "www.nytimes.com", 15) != 0)
+                goto fail;
+            if (hdr.cookie.length != 85
+                || memcmp(httpheader_string(&hdr, &hdr.cookie), "nyt-a=", 6)
+                    != 0)
+                goto fail;
+            if (i == 1
+                && _selftest_buffer(parser, &hdr, sample, sizeof(sample) - 1))
+                goto fail;
+            httpparse_end(&hdr);
+        }
+
+        /* When the header is in one buffer, nothing should be copied */
+        httpparse_start(parser, &hdr);
+        httpparse_buffer(parser, &hdr, sample, sizeof(sample) - 1);
+        if (!hdr.is_done || hdr.host.is_copy || hdr.buf != NULL)
+            goto fail;
+        if (httpheader_string(&hdr, &hdr.host) != sample + 22)
+            goto fail;
+        httpparse_end(&hdr);
+
+        if (_selftest_parse(parser, &hdr, sample2, sizeof(sample2) - 1, 1))
+            goto fail;
+        if (hdr.is_error || hdr.method != METHOD_POST || hdr.url_id != 4)
+            goto fail;
+        if (hdr.version_major != 1 || hdr.version_minor != 0)
+            goto fail;
+        if (!hdr.is_close || hdr.is_keepalive)
+            goto fail;
+        if (!hdr.has_content_length || hdr.content_length != 1234)
+            goto fail;
+        if (hdr.host.length != 5 || hdr.host_port != 8080
+            || memcmp(httpheader_string(&hdr, &hdr.host), "[::1]", 5) != 0)
+            goto fail;
+        if (_selftest_buffer(parser, &hdr, sample2, sizeof(sample2) - 1))
+            goto fail;
+        httpparse_end(&hdr);
+
+        for (i = 0; errors[i].text; i++) {
+            const char *text = errors[i].text;
+            if (_selftest_parse(parser, &hdr, text, strlen(text), 1))
+                goto fail;
+            if (hdr.is_error != errors[i].is_error)
+                goto fail;
+            if (_selftest_buffer(parser, &hdr, text, strlen(text)))
+                goto fail;
+            httpparse_end(&hdr);
         }
     }
 
+    httpparser_destroy(parser);
+
+    if (_selftest_register())
+        return 1;
+    if (_selftest_register_record())
+        return 1;
+    if (httpbody_selftest())
+        return 1;
     return 0;
+fail:
+    fprintf(stderr, "[-] httpparser: selftest failed\n");
+    httpparse_end(&hdr);
+    httpparser_destroy(parser);
+    return 1;
+}
+
+#ifdef HTTPPARSESTANDALONE
+int main(void)
+{
+    if (httpparser_selftest() == 0) {
+        fprintf(stderr, "[+] httpparser: success\n");
+        return 0;
+    } else {
+        fprintf(stderr, "[-] httpparser: FAILURE\n");
+        return 1;
+    }
 }
+#endif
@@ -5,19 +5,53 @@ extern "C" {
 #endif
 #include <stdio.h>
 #include <stdbool.h>
+#include "util-scan.h"
 
 enum Methods {
     METHOD_CONNECT=1, METHOD_DELETE, METHOD_GET, METHOD_HEAD, METHOD_OPTIONS,
     METHOD_PATCH, METHOD_POST, METHOD_PUT, METHOD_TRACE
 };
 
-int httpparser_selftest(void);
+/**
+ * The header fields the parser understands. Other fields are skipped.
+ * Fields registered with `httpparser_register_field()` should use ids
+ * starting at FIELD_USER.
+ */
+enum HttpFields {
+    FIELD_UNKNOWN=0, FIELD_HOST, FIELD_CONNECTION, FIELD_CONTENT_LENGTH,
+    FIELD_TRANSFER_ENCODING, FIELD_COOKIE,
+    FIELD_USER=1024
+};
 
+struct httpparser;
+struct httpheader;
+
+/**
+ * A parser for the value of a header field. It's called with each byte
+ * of the value after the leading whitespace, except for '\r', and then
+ * with the '\n' at the end of the line. At the start of the value,
+ * `hdr->state2` is zero, and the parser can use it for its own state.
+ */
+typedef int (*httpfield_parse_t)(const struct httpparser *parser,
+    struct httpheader *hdr, unsigned char c);
+
+/**
+ * The location of a field's value. Normally this points into the buffer
+ * given to `httpparse_buffer()`, without copying it. The value is only
+ * copied into the header's own buffer when the header arrives in more
+ * than one piece, since the caller reuses its buffer between them. Use
+ * `httpheader_string()` to get the value either way.
+ */
 struct httpheaderfield {
     size_t offset;
     size_t length;
+    bool is_copy;
+
+    /* While this points into the caller's buffer, the next field that
+     * does, so that they can all be copied before the buffer is reused */
+    struct httpheaderfield *next;
 };
-    
+
 /**
  * This structure represents a parsed HTTP request header, either during the
  * parsing, or as the result from having parsed the header.
@@ -27,49 +61,285 @@ struct httpheader {
      * such as states for the method, URL, version, and so on. Set to
      * zero (0) as the initial state before parsing */
     unsigned state1;
-    
+
     /** The state-machine variable for parsing individual header fields.
      * Set to zero (0) to start parsing the field (after the field name,
      * colon, and leading space). A value of (~0) indicates an error
      * occured while parsing the state */
     unsigned state2;
-    
+
     /**
      * The method (GET, PUT, HEAD, etc.) for the HTTP request. Values
      * from 1-1023 indicate standard methods, while values above 1024
      * indicate custom methods set with `httpparser_add_method()`.
      */
     int method;
-    
+
     /**
      * The major version, which should really be either 0 or 1, for
      * HTTP/0.9, HTTP/1.0, HTTP/1.1 */
     unsigned char version_major;
-    
+
     /**
      * The parsed minor version
      */
     unsigned char version_minor;
-    
+
     /**
      * Whether an error occurred while parsing the HTTP header. When
      * this flag is set, the header should be discarded.
      */
     bool is_error;
-    
+
+    /**
+     * Set when we've reached the empty line at the end of the header.
+     */
+    bool is_done;
+
+    /**
+     * Set by the "Connection:" field, containing "close" or "keep-alive"
+     * respectively.
+     */
+    bool is_close;
+    bool is_keepalive;
+
+    /**
+     * Set when there's a "Transfer-Encoding:" field, meaning the body
+     * is encoded, rather than sized by "Content-Length:". We can only
+     * find the end of the body when the last encoding is "chunked".
+     */
+    bool is_transfer_encoding;
+    bool is_chunked;
+
+    /**
+     * Set when there's a "Content-Length:" field.
+     */
+    bool has_content_length;
+    unsigned long long content_length;
+
     unsigned tmp;
-    
+
+    /**
+     * The id of the longest URL prefix registered with
+     * `httpparser_register_url_prefix()` that matches the start of the
+     * URL, or zero if none matched.
+     */
+    unsigned url_id;
+
+    /**
+     * The header field currently being parsed, one of `enum HttpFields`,
+     * or an id registered with `httpparser_register_field()`.
+     */
+    unsigned field;
+    unsigned field_index;
+
     /**
      * The parsed host field.
      */
     struct httpheaderfield host;
     unsigned host_port;
-    
+
+    /**
+     * The value of the "Cookie:" field, not yet split into cookies.
+     */
+    struct httpheaderfield cookie;
+
+    /**
+     * For use by the parsers of fields registered by the caller, which
+     * the caller sets after `httpparse_start()`.
+     */
+    void *userdata;
+
+    /**
+     * While inside `httpparse_buffer()`, the caller's buffer, and the
+     * offset of the byte being parsed, so that fields can point to it.
+     * This is left pointing to the buffer when the header is done. */
+    const unsigned char *input;
+    size_t input_offset;
+
+    /**
+     * The fields that point into the caller's buffer, whether they are
+     * in this header, or in a structure of the caller's, such as one
+     * reached through `userdata`. They're started with
+     * `http_field_start()`, and copied when the header is incomplete.
+     * A caller's field must last until the header is done. */
+    struct httpheaderfield *fields;
+
+    /**
+     * Where fields are copied when they can't point to the caller's
+     * buffer, which is allocated only when needed */
     char *buf;
     size_t offset;
     size_t length;
 };
 
+/**
+ * Returns the value of a field like `hdr->host`, which is `length` bytes
+ * long and not nul-terminated. When the header was parsed in a single
+ * call to `httpparse_buffer()`, this points into the caller's buffer, so
+ * it's only valid until the caller reuses that buffer.
+ */
+static inline const char *
+httpheader_string(const struct httpheader *hdr,
+    const struct httpheaderfield *field)
+{
+    if (field->is_copy)
+        return hdr->buf + field->offset;
+    else
+        return (const char *)hdr->input + field->offset;
+}
+
+/**
+ * Create a parser. After creating, register URL prefixes, then compile it.
+ */
+struct httpparser *
+httpparser_create(void);
+
+/**
+ * Choose the SIMD instructions used by `httpparse_buffer()`. By default,
+ * the parser uses the fastest ones the CPU supports, so this is only
+ * needed for testing and benchmarking.
+ */
+void
+httpparser_set_isa(struct httpparser *parser, enum scan_isa_t isa);
+
+/**
+ * Register a header field, such as "X-Forwarded-For", whose value is
+ * passed to the 'parse' function. Names are case-insensitive. This
+ * replaces the parser of a field that's already registered, including
+ * the built-in ones like "Host". The 'id' is what's reported in the
+ * `field` member of the header while parsing the field. If the 'length'
+ * is zero, then the name is a nul-terminated string.
+ */
+unsigned
+httpparser_register_field(struct httpparser *parser, unsigned id,
+    const char *name, size_t length, httpfield_parse_t parse);
+
+/**
+ * Register a URL prefix, such as "/cgi-bin/". When a request's URL starts
+ * with the prefix, its 'id' is reported in the `url_id` field of the
+ * header. The 'id' must be non-zero. If the 'length' is zero, then the
+ * prefix is a nul-terminated string.
+ */
+unsigned
+httpparser_register_url_prefix(
+    struct httpparser *parser, unsigned id, const char *uri, size_t length);
+
+/**
+ * Compile the parser after all URL prefixes and fields have been
+ * registered. The parser can't be used until this is called.
+ */
+void
+httpparser_compile(struct httpparser *parser);
+
+/**
+ * Cleans up a parser created with `httpparser_create()`.
+ */
+void
+httpparser_destroy(struct httpparser *parser);
+
+/**
+ * Initialize the header structure before parsing a new request. This
+ * must also be called between requests on the same connection.
+ */
+void
+httpparse_start(const struct httpparser *parser, struct httpheader *hdr);
+
+/**
+ * Parse the next byte of the header. The header can be received in any
+ * number of fragments, calling this for each byte as it arrives.
+ * @return
+ *      1 when the byte was the end of the header (the empty line), in
+ *      which case the next byte is the start of the body, otherwise 0.
+ */
+int
+httpparse_next(
+    const struct httpparser *parser, struct httpheader *hdr, unsigned char c);
+
+/**
+ * Parse a buffer containing the next fragment of the header. This
+ * produces the same result as calling `httpparse_next()` for each byte,
+ * but is much faster, handling runs of bytes at a time rather than
+ * re-entering the state-machine for each one.
+ * Field values point into the buffer without copying them, as long as
+ * the whole header is in this buffer. Otherwise, the values are copied
+ * before returning, so that the caller can reuse its buffer for the
+ * next fragment.
+ * @return
+ *      The number of bytes parsed. Parsing stops after the end of the
+ *      header, setting `is_done`, in which case any remaining bytes are
+ *      the body or the next request.
+ */
+size_t
+httpparse_buffer(const struct httpparser *parser, struct httpheader *hdr,
+    const void *buf, size_t length);
+
+/**
+ * Frees the memory allocated while parsing the header. This must be
+ * called before calling `httpparse_start()` on it again.
+ */
+void
+httpparse_end(struct httpheader *hdr);
+
+/**
+ * The state of decoding a request body, which comes after the header,
+ * sized either by "Content-Length:" or by "Transfer-Encoding: chunked".
+ * Like the header, it can arrive in any number of fragments.
+ */
+struct httpbody {
+    /** The state-machine variable, set by `httpbody_start()` */
+    unsigned state;
+
+    /** Bytes left of the body, or of the current chunk */
+    unsigned long long remaining;
+
+    /** The total number of bytes of body data so far */
+    unsigned long long total;
+
+    /** Set when the body is chunked, rather than sized */
+    bool is_chunked;
+
+    /** Set after the last byte of the body, including any trailer */
+    bool is_done;
+
+    /** Set when the body isn't valid, in which case we can't tell where
+     * it ends, and the connection should be closed */
+    bool is_error;
+};
+
+/**
+ * Start decoding the body of the request whose header was just parsed.
+ * A request with neither "Content-Length:" nor "Transfer-Encoding:"
+ * has no body, so is done immediately. A request with a transfer
+ * encoding other than chunked, or with both fields, is an error, since
+ * we couldn't agree with other servers about where the body ends.
+ */
+void
+httpbody_start(struct httpbody *body, const struct httpheader *hdr);
+
+/**
+ * Decode the next fragment of the body. The data isn't copied, but
+ * returned as a span within the buffer. The chunk sizes and trailer
+ * are consumed without being returned.
+ * @param data
+ *      Set to where the span of body data starts within 'buf'.
+ * @param data_length
+ *      Set to the length of the span, which is zero when the fragment
+ *      was all framing.
+ * @return
+ *      The number of bytes consumed. This is less than 'length' when
+ *      there's more body data after this span, in which case call this
+ *      again with the rest, or when the body is done, in which case the
+ *      rest is the next request.
+ */
+size_t
+httpbody_next(struct httpbody *body, const void *buf, size_t length,
+    const unsigned char **data, size_t *data_length);
+
+int httpbody_selftest(void);
+
+int httpparser_selftest(void);
+
 #ifdef __cplusplus
 }
 #endif
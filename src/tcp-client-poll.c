@@ -8,6 +8,46 @@
  to connect to.
  To get more than 65535 connections, more than one source or target needs to
  be specified.
+
+ We use it to load-test servers with a "connection storm". Each connection
+ sends a short message, waits for it to be echoed back, and repeats that
+ some number of times before closing. Another connection then takes its
+ place, so that there are up to `-c` connections open at once, opened no
+ faster than the `--rate`. Errors, like a refused or reset connection,
+ are counted instead of being fatal, because under load, they are what
+ we are trying to find out about.
+ Options:
+    -c <n>            connections open at once (default 100)
+    -s <addr>         a source address to bind to
+    -t <addr:port>    a target to connect to
+    --rate <n>        new connections per second (default 0, no limit)
+    --threads <n>     the number of threads (default 1)
+    --echoes <n>      round-trips on each connection before closing it
+                      (default 1), or 0 to keep it open
+    --timeout <ms>    how long to wait for a connect or echo (default 5000)
+    --seconds <n>     how long to run (default 0, until <ctrl-c>)
+    --interval <n>    seconds between reports (default 1)
+    --ports <n>-<n>   the source ports to use (default 1024-65535), or 0
+                      for the kernel to pick them
+
+ One `poll()` loop can only use one CPU core. With `--threads`, each thread
+ runs its own loop, with its own share of the connections, of the rate,
+ and of the source addresses, so nothing is shared between threads. Each
+ interval, we print how many connections and echoes per second there were.
+ At the end, we print the distribution of the time it took to connect, to
+ receive the first byte, and to receive each echo.
+
+ The kernel picks a source port for each connection, out of its range of
+ "ephemeral" ports, normally about 28 thousand of them. Once we bind to a
+ source address, that limit applies to each source address, no matter
+ how many targets there are, and connect() gets slow searching for a
+ free port. So instead, for each source address and target pair, we keep
+ our own bitmap of which source ports are in use, and bind to a free one
+ ourselves. Since a connection is identified by the source and target
+ address and port, the same source port can be used once for each target,
+ so with several sources and targets, we can get past a million
+ connections. With `--ports 0`, the kernel still picks, but we tell it to
+ wait until connect() to do that, so it can do the same.
  */
 #include <ctype.h>
 #include <errno.h>
@@ -20,24 +60,127 @@
 #include <unistd.h>
 
 //#include <sys/types.h>
+#include <fcntl.h>
+#include <netinet/in.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <sys/resource.h>
 
+#include "util-clockcycle.h"
+#include "util-logger.h"
+
+/* The message each connection sends, to be echoed back */
+static const char my_message[] = "0123456789abcdef";
+#define MESSAGE_LENGTH (sizeof(my_message) - 1)
+
+/* The most connections a thread opens before it next calls `poll()`, so
+ * that with no rate limit, it still handles the ones already open */
+#define CONNECTS_PER_LOOP 256
+
+/* Errors are counted by their 'errno' value. Zero means the other side
+ * closed the connection before we were done with it. */
+#define ERRNO_MAX 256
+
+/* Set by <ctrl-c>, or when the time is up, to tell the threads to stop */
+static volatile sig_atomic_t is_stopping = 0;
+
+/**
+ * Latencies are recorded in a histogram, the way "HDR histograms" do it.
+ * Each power-of-two range of nanoseconds is split into 32 equal buckets,
+ * so a value is recorded to within about 3%, no matter how big it is, and
+ * recording is just an increment. Unlike a list of every value, the size
+ * doesn't grow with the number of connections.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT * (64 - HISTOGRAM_SUB_BITS + 1))
+
+struct histogram_t
+{
+    unsigned long long count;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long long buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * These are written only by the thread that owns them, but read by the
+ * main thread for the periodic reports, so they are read and written with
+ * atomic operations. Since there's only one writer, that's just a normal
+ * load and store, not a locked instruction.
+ */
+struct stats_t
+{
+    unsigned long long connects;    /* calls to connect(), or tries */
+    unsigned long long established; /* connections that succeeded */
+    unsigned long long echoes;      /* round-trips completed */
+    unsigned long long closed;      /* closed by us when done */
+    unsigned long long errors;      /* all the failed connections */
+    unsigned long long open;        /* connections currently open */
+    unsigned long long error_codes[ERRNO_MAX];
+};
+
+#define STAT_ADD(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+enum {
+    STATE_CONNECTING,
+    STATE_SENDING,
+    STATE_RECEIVING,
+};
+
+/**
+ * Just what we need to handle the events on a connection, in 32 bytes,
+ * so that two fit in a cache line. The socket itself is in the parallel
+ * array of `pollfd` structures that we give to `poll()`. We don't need a
+ * buffer, because all we receive is the message we sent, which we check
+ * as it arrives. Nor do we keep the addresses, because we only need them
+ * to log an error, and can get them again when we do.
+ */
 struct connection_t
 {
-    size_t bytes_received;
-    size_t bytes_sent;
-    struct sockaddr_in6 sa;
-    socklen_t sa_addrlen;
-    ptrdiff_t len;
-    char peeraddr[64];
-    char peerport[8];
-    char hostaddr[64];
-    char hostport[8];
-    char buf[512];
+    /* When we called `connect()`, and when we started waiting for
+     * whatever we are now waiting for */
+    unsigned long long started;
+    unsigned long long timestamp;
+
+    /* How many times the message has been echoed back */
+    unsigned echoes;
+
+    /* The 'tuple' the connection is from, or if there are no source
+     * addresses, the index of the target */
+    unsigned tuple;
+
+    /* The source port we picked, to be freed when the connection is
+     * removed, or zero if the kernel picked it */
+    unsigned short port;
+
+    /* Whether we are waiting to connect, send, or receive */
+    unsigned char state;
+
+    /* How much of the message has been sent, or received back */
+    unsigned char len;
+};
+
+/**
+ * A pair of source and target addresses, and the source ports in use for
+ * connections between them, one bit for each port. We don't look through
+ * the bits for a free port starting from the first one, but from after
+ * the last one we picked, so that we don't reuse a port until we've gone
+ * around all of them. That gives the last connection that used it time to
+ * get out of the TIME_WAIT state, which would otherwise stop us from
+ * using it again.
+ */
+struct tuple_t
+{
+    struct addrinfo *source;
+    struct addrinfo *target;
+    unsigned next_port;
+    unsigned free_count;
+    unsigned long long in_use[65536 / 64];
 };
 
 struct my_dispatcher
@@ -52,14 +195,171 @@ struct my_dispatcher
     struct addrinfo **targets;
     size_t targets_count;
     size_t targets_index;
+
+    /* Every pair of source and target addresses, which we go through in
+     * turn, and the range of source ports we pick from. */
+    struct tuple_t *tuples;
+    size_t tuples_count;
+    size_t tuples_index;
+    unsigned port_first;
+    unsigned port_last;
+
+    /* The limit on new connections per second, or zero for none. We can
+     * open one connection for each "token", which are added at that rate,
+     * up to 1/10th of a second's worth. */
+    double rate;
+    double tokens;
+    unsigned long long refilled;
+
+    /* When a connection fails right away, such as when we are out of
+     * source ports, we don't try another until this time */
+    unsigned long long retry;
+
+    /* How many echoes before closing, and how long we wait for each */
+    unsigned echoes;
+    unsigned timeout;
+    unsigned long long expired;
+
+    /* This thread's ring buffer for logging messages */
+    struct logring_t *log;
+
+    struct stats_t stats;
+    struct histogram_t connect_latency;
+    struct histogram_t first_byte_latency;
+    struct histogram_t echo_latency;
 };
 
+/**
+ * The options that apply to the whole program, rather than to each
+ * thread's dispatcher.
+ */
+struct my_options
+{
+    unsigned thread_count;
+    unsigned seconds;
+    unsigned interval;
+};
+
+/**
+ * Each thread runs its own "shard", with its own dispatcher, connections
+ * and statistics, so no locking is needed.
+ */
+struct shard_t
+{
+    unsigned index;
+    struct my_dispatcher *dispatcher;
+    struct logger_t *logger;
+    pthread_t thread;
+};
+
+/**
+ * Find which bucket a value goes in. Values below 32 get their own
+ * bucket, after that, the bucket is the top 5 bits after the highest
+ * one, plus the position of that highest bit.
+ */
+static unsigned histogram_index(unsigned long long value)
+{
+    unsigned msb;
+    unsigned shift;
+
+    if (value < HISTOGRAM_SUB_COUNT)
+        return (unsigned)value;
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HISTOGRAM_SUB_BITS;
+    return HISTOGRAM_SUB_COUNT * (shift + 1)
+        + (unsigned)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+/**
+ * The smallest value that goes into a bucket.
+ */
+static unsigned long long histogram_value(unsigned index)
+{
+    unsigned shift;
+
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+    shift = index / HISTOGRAM_SUB_COUNT - 1;
+    return (unsigned long long)(HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT) << shift;
+}
+
+void histogram_record(struct histogram_t *h, unsigned long long value)
+{
+    if (h->count == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->buckets[histogram_index(value)]++;
+}
+
+void histogram_merge(struct histogram_t *h, const struct histogram_t *other)
+{
+    size_t i;
+
+    if (other->count == 0)
+        return;
+    if (h->count == 0 || other->min < h->min)
+        h->min = other->min;
+    if (other->max > h->max)
+        h->max = other->max;
+    h->count += other->count;
+    for (i=0; i<HISTOGRAM_BUCKETS; i++)
+        h->buckets[i] += other->buckets[i];
+}
+
+/**
+ * Returns the value that 'p' percent of the values are at or below. It's
+ * the middle of the bucket that value is in, but never outside of the
+ * smallest and largest values we actually recorded.
+ */
+unsigned long long histogram_percentile(const struct histogram_t *h, double p)
+{
+    unsigned long long threshold;
+    unsigned long long sum = 0;
+    unsigned long long result;
+    unsigned i;
+
+    if (h->count == 0)
+        return 0;
+    threshold = (unsigned long long)(p / 100.0 * h->count + 0.5);
+    if (threshold < 1)
+        threshold = 1;
+    for (i=0; i<HISTOGRAM_BUCKETS - 1; i++) {
+        sum += h->buckets[i];
+        if (sum >= threshold)
+            break;
+    }
+    result = (histogram_value(i) + histogram_value(i + 1)) / 2;
+    if (result < h->min)
+        result = h->min;
+    if (result > h->max)
+        result = h->max;
+    return result;
+}
+
+void histogram_print(const char *name, const struct histogram_t *h)
+{
+    printf("%-14s n=%llu p50=%.1f-us p90=%.1f-us p99=%.1f-us p99.9=%.1f-us "
+           "max=%.1f-us\n",
+           name, h->count,
+           histogram_percentile(h, 50) / 1000.0,
+           histogram_percentile(h, 90) / 1000.0,
+           histogram_percentile(h, 99) / 1000.0,
+           histogram_percentile(h, 99.9) / 1000.0,
+           h->max / 1000.0);
+}
+
 struct my_dispatcher *dispatcher_create()
 {
     struct my_dispatcher *dispatcher;
 
     dispatcher = malloc(sizeof(*dispatcher));
     memset(dispatcher, 0, sizeof(*dispatcher));
+    dispatcher->echoes = 1;
+    dispatcher->timeout = 5000;
+    dispatcher->port_first = 1024;
+    dispatcher->port_last = 65535;
 
     return dispatcher;
 }
@@ -125,7 +425,7 @@ void split_address(const char *name, char **r_addr, char **r_port)
     if (is_decimal(name)) {
         addr = NULL;
         port = strdup(name);
-    } else if (index_of(name, ':') && index_of(name, ':') == rindex_of(name, ':')) {
+    } else if (index_of(name, ':') > 0 && index_of(name, ':') == rindex_of(name, ':')) {
         addrlen = index_of(name, ':');;
         portlen = namelen - addrlen - 1;
         addr = malloc(addrlen + 1);
@@ -162,14 +462,18 @@ void dispatcher_add_source(struct my_dispatcher *dispatcher, const char *name)
     char *port;
     struct addrinfo *ai;
     struct addrinfo *addresses = 0;
+    struct addrinfo hints = {0};
 
     /* split address, in case port is also specified */
     split_address(name, &addr, &port);
 
-    /* lookup name/port */
+    /* lookup name/port, once per address rather than once for each
+     * kind of socket, since we split the list between threads */
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
     err = getaddrinfo(addr,                 /* IPv4/IPv6/DNS address*/
                       port,                 /* port number */
-                      0,                    /* hints */
+                      &hints,               /* hints */
                       &addresses);                 /* result */
     if (err) {
         fprintf(stderr, "[-] getaddrinfo(): %s\n", gai_strerror(err));
@@ -180,7 +484,7 @@ void dispatcher_add_source(struct my_dispatcher *dispatcher, const char *name)
         free(addr);
     if (port)
         free(port);
-    
+
     for (ai = addresses; ai; ai = ai->ai_next) {
         if (dispatcher->sources_count == 0)
             dispatcher->sources = malloc(sizeof(void*));
@@ -198,20 +502,22 @@ void dispatcher_add_target(struct my_dispatcher *dispatcher, const char *name)
     char *port;
     struct addrinfo *ai;
     struct addrinfo *addresses = 0;
+    struct addrinfo hints = {0};
 
     /* split address, in case port is also specified */
     split_address(name, &addr, &port);
 
     /* lookup name/port */
+    hints.ai_socktype = SOCK_STREAM;
     err = getaddrinfo(addr,                 /* IPv4/IPv6/DNS address*/
                       port,                 /* port number */
-                      0,                    /* hints */
+                      &hints,               /* hints */
                       &addresses);                 /* result */
     if (err) {
         fprintf(stderr, "[-] getaddrinfo(): %s\n", gai_strerror(err));
         return;
     }
-    
+
     for (ai = addresses; ai; ai = ai->ai_next) {
         if (dispatcher->targets_count == 0)
             dispatcher->targets = malloc(sizeof(void*));
@@ -222,44 +528,156 @@ void dispatcher_add_target(struct my_dispatcher *dispatcher, const char *name)
     }
 }
 
-void dispatcher_add(struct my_dispatcher *dispatcher, int fd, struct sockaddr_in6 *sa, socklen_t sa_addrlen)
+/**
+ * Picks the next free source port, and marks it as being in use. There
+ * must be at least one free.
+ */
+unsigned tuple_alloc(struct tuple_t *tuple, unsigned first, unsigned last)
+{
+    unsigned port = tuple->next_port;
+
+    /* Look at 64 ports at a time, ignoring the ones before where we
+     * started in the first word, and those past the end in the last */
+    for (;;) {
+        unsigned long long free_bits = ~tuple->in_use[port / 64] & (~0ULL << (port % 64));
+        if (free_bits) {
+            port = (port & ~63u) + __builtin_ctzll(free_bits);
+            if (port <= last)
+                break;
+        }
+        port = (port | 63) + 1;
+        if (port > last)
+            port = first;
+    }
+
+    tuple->in_use[port / 64] |= 1ULL << (port % 64);
+    tuple->free_count--;
+    tuple->next_port = (port < last) ? port + 1 : first;
+    return port;
+}
+
+void tuple_free(struct tuple_t *tuple, unsigned port)
+{
+    tuple->in_use[port / 64] &= ~(1ULL << (port % 64));
+    tuple->free_count++;
+}
+
+/**
+ * Creates a tuple for each of our source addresses with each of the
+ * targets of the same family (IPv4 or IPv6). A source that can't reach
+ * any target is ignored.
+ */
+void dispatcher_create_tuples(struct my_dispatcher *dispatcher)
+{
+    size_t i;
+    size_t j;
+
+    for (i=0; i<dispatcher->sources_count; i++) {
+        for (j=0; j<dispatcher->targets_count; j++) {
+            struct addrinfo *source = dispatcher->sources[i];
+            struct addrinfo *target = dispatcher->targets[j];
+            struct tuple_t *tuple;
+
+            if (source->ai_family != target->ai_family)
+                continue;
+            dispatcher->tuples = realloc(dispatcher->tuples, (dispatcher->tuples_count+1) * sizeof(*tuple));
+            tuple = &dispatcher->tuples[dispatcher->tuples_count++];
+            memset(tuple, 0, sizeof(*tuple));
+            tuple->source = source;
+            tuple->target = target;
+            tuple->next_port = dispatcher->port_first;
+            if (dispatcher->port_first && dispatcher->port_first <= dispatcher->port_last)
+                tuple->free_count = dispatcher->port_last - dispatcher->port_first + 1;
+        }
+    }
+}
+
+/**
+ * The next tuple in turn that has a free source port, and that port, or
+ * zero if the kernel is to pick. Returns NULL if they are all in use.
+ */
+struct tuple_t *dispatcher_next_tuple(struct my_dispatcher *dispatcher, unsigned *port)
+{
+    size_t i;
+
+    for (i=0; i<dispatcher->tuples_count; i++) {
+        struct tuple_t *tuple = &dispatcher->tuples[dispatcher->tuples_index];
+        if (++dispatcher->tuples_index >= dispatcher->tuples_count)
+            dispatcher->tuples_index = 0;
+        if (dispatcher->port_first == 0) {
+            *port = 0;
+            return tuple;
+        } else if (tuple->free_count) {
+            *port = tuple_alloc(tuple, dispatcher->port_first, dispatcher->port_last);
+            return tuple;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Creates the dispatcher for one of 'count' threads, from the one we
+ * parsed the command-line into. It gets its share of the connections and
+ * of the rate. The source addresses are dealt out between the threads
+ * like cards, so that two threads never use the same one, unless there
+ * aren't enough to go around, in which case they split the source ports
+ * instead. The targets are shared.
+ */
+struct my_dispatcher *dispatcher_create_shard(const struct my_dispatcher *all, unsigned index, unsigned count)
+{
+    struct my_dispatcher *dispatcher;
+    size_t i;
+
+    dispatcher = dispatcher_create();
+    dispatcher_alloc_connections(dispatcher, all->max / count + (index < all->max % count));
+    dispatcher->rate = all->rate / count;
+    dispatcher->echoes = all->echoes;
+    dispatcher->timeout = all->timeout;
+    dispatcher->port_first = all->port_first;
+    dispatcher->port_last = all->port_last;
+
+    dispatcher->targets = all->targets;
+    dispatcher->targets_count = all->targets_count;
+    dispatcher->targets_index = index % all->targets_count;
+
+    if (all->sources_count) {
+        dispatcher->sources = malloc(all->sources_count * sizeof(void*));
+        for (i=index; i<all->sources_count; i += count)
+            dispatcher->sources[dispatcher->sources_count++] = all->sources[i];
+        if (dispatcher->sources_count == 0)
+            dispatcher->sources[dispatcher->sources_count++] = all->sources[index % all->sources_count];
+    }
+
+    /* Threads sharing a source address mustn't pick the same ports */
+    if (all->port_first && all->sources_count && all->sources_count < count) {
+        unsigned long long range = all->port_last - all->port_first + 1;
+        dispatcher->port_first = all->port_first + (unsigned)(range * index / count);
+        dispatcher->port_last = all->port_first + (unsigned)(range * (index + 1) / count) - 1;
+    }
+    dispatcher_create_tuples(dispatcher);
+
+    return dispatcher;
+}
+
+void dispatcher_add(struct my_dispatcher *dispatcher, int fd)
 {
     struct connection_t *c;
-    int err;
-    
+
     /* add to the poll() list, set for reading */
     dispatcher->list[dispatcher->count].fd = fd;
     dispatcher->list[dispatcher->count].events = POLLIN;
     dispatcher->list[dispatcher->count].revents = 0;
-    
+
     /* add per=connection info */
     c = &dispatcher->connections[dispatcher->count];
-    c->len = 0; /* init buffer */
-    c->sa_addrlen = sa_addrlen;
-    memcpy(&c->sa, sa, sa_addrlen);
-    c->bytes_sent = 0;
-    c->bytes_received = 0;
-
-    /* get print name of remote connection */
-    err = getnameinfo(  (struct sockaddr *)&c->sa, c->sa_addrlen,
-                        c->peeraddr, sizeof(c->peeraddr),
-                        c->peerport, sizeof(c->peerport),
-                        NI_NUMERICHOST | NI_NUMERICSERV);
-    if (err) {
-        fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
-        memcpy(c->peeraddr, "err", 4);
-        memcpy(c->peerport, "err", 4);
-    } else {
-        ; //fprintf(stderr, "[+] connect() to [%s]:%s\n", c->peeraddr, c->peerport);
-    }
+    c->len = 0;
+    c->state = STATE_CONNECTING;
+    c->echoes = 0;
+    c->port = 0;
 
-    /* grow the lists by 1, if needed*/
+    /* The lists were allocated for the most connections we'll have open,
+     * and we only get called when there's room */
     dispatcher->count++;
-    if (dispatcher->count >= dispatcher->max) {
-        dispatcher->max++;
-        dispatcher->list = realloc(dispatcher->list, dispatcher->max * sizeof(*dispatcher->list));
-        dispatcher->connections = realloc(dispatcher->connections, dispatcher->max * sizeof(*dispatcher->connections));
-    }
 }
 
 void dispatcher_remove_at(struct my_dispatcher *dispatcher, size_t i)
@@ -272,6 +690,10 @@ void dispatcher_remove_at(struct my_dispatcher *dispatcher, size_t i)
         dispatcher->list[i].fd = -1;
     }
 
+    /* give back the source port, if we picked it */
+    if (dispatcher->connections[i].port)
+        tuple_free(&dispatcher->tuples[dispatcher->connections[i].tuple], dispatcher->connections[i].port);
+
     /* For efficiency, replace this entry with the one at the end of the list */
     end = dispatcher->count - 1;
     if (end > i) {
@@ -281,6 +703,53 @@ void dispatcher_remove_at(struct my_dispatcher *dispatcher, size_t i)
     dispatcher->count--;
 }
 
+/**
+ * Counts a connection that failed. The 'err' is the 'errno' value, or
+ * zero if the other side closed the connection. Returns how many times
+ * that happened before.
+ */
+unsigned long long stats_error(struct stats_t *stats, int err)
+{
+    unsigned long long count;
+
+    if (err < 0 || ERRNO_MAX <= err)
+        err = ERRNO_MAX - 1;
+    count = stats->error_codes[err];
+    STAT_ADD(stats->error_codes[err], 1);
+    STAT_ADD(stats->errors, 1);
+    return count;
+}
+
+/**
+ * Counts a connection that failed, then removes it. Only the first of each
+ * kind of error is logged, so that a storm of errors doesn't become a storm
+ * of messages. The message is only formatted later, by the logging thread,
+ * from the source address we get back from the socket, and the target
+ * address from the tuple, or list of targets.
+ */
+void dispatcher_fail_at(struct my_dispatcher *dispatcher, size_t i, int err)
+{
+    struct connection_t *c = &dispatcher->connections[i];
+    struct addrinfo *target;
+    struct sockaddr_in6 sin6;
+    socklen_t sizeof_sin6 = sizeof(sin6);
+
+    if (stats_error(&dispatcher->stats, err) == 0) {
+        if (dispatcher->tuples_count)
+            target = dispatcher->tuples[c->tuple].target;
+        else
+            target = dispatcher->targets[c->tuple];
+        if (getsockname(dispatcher->list[i].fd, (struct sockaddr*)&sin6, &sizeof_sin6) != 0)
+            sizeof_sin6 = 0;
+        logger_addr2(dispatcher->log,
+                     err ? "[-] connection(%s -> %s): %s\n"
+                         : "[-] connection(%s -> %s): closed by peer\n",
+                     (struct sockaddr *)&sin6, sizeof_sin6,
+                     target->ai_addr, target->ai_addrlen, err);
+    }
+    dispatcher_remove_at(dispatcher, i);
+}
+
 void dispatcher_destroy(struct my_dispatcher *dispatcher)
 {
     while (dispatcher->count)
@@ -288,9 +757,10 @@ void dispatcher_destroy(struct my_dispatcher *dispatcher)
 
     free(dispatcher->list);
     free(dispatcher->connections);
+    free(dispatcher->tuples);
 }
 
-void dispatcher_parse_command_line(struct my_dispatcher *dispatcher, int argc, char *argv[])
+void dispatcher_parse_command_line(struct my_dispatcher *dispatcher, struct my_options *options, int argc, char *argv[])
 {
     int i;
 
@@ -298,7 +768,52 @@ void dispatcher_parse_command_line(struct my_dispatcher *dispatcher, int argc, c
         const char *value;
         long n;
 
-        if (argv[i][0] != '-') {
+        if (strcmp(argv[i], "--ports") == 0 && (i+1) < argc) {
+            unsigned long first;
+            unsigned long last;
+            char *end;
+
+            value = argv[++i];
+            first = strtoul(value, &end, 0);
+            last = (*end == '-') ? strtoul(end + 1, &end, 0) : first;
+            if (*end != '\0' || 65535 < last || last < first || (first == 0 && last != 0)) {
+                fprintf(stderr, "[-] --ports %s: invalid port range\n", value);
+                exit(1);
+            }
+            dispatcher->port_first = (unsigned)first;
+            dispatcher->port_last = (unsigned)last;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "[-] %s: missing value\n", argv[i]);
+                exit(1);
+            }
+            value = argv[++i];
+            n = strtol(value, 0, 0);
+            if (n < 0 || 1000000000 < n) {
+                fprintf(stderr, "[-] %s: invalid value: %s\n", argv[i-1], value);
+                exit(1);
+            } else if (strcmp(argv[i-1], "--rate") == 0)
+                dispatcher->rate = (double)n;
+            else if (strcmp(argv[i-1], "--threads") == 0) {
+                if (n < 1 || 1024 < n) {
+                    fprintf(stderr, "[-] %s: invalid value: %s (1 to 1024)\n", argv[i-1], value);
+                    exit(1);
+                }
+                options->thread_count = (unsigned)n;
+            }
+            else if (strcmp(argv[i-1], "--echoes") == 0)
+                dispatcher->echoes = (unsigned)n;
+            else if (strcmp(argv[i-1], "--timeout") == 0 && n > 0)
+                dispatcher->timeout = (unsigned)n;
+            else if (strcmp(argv[i-1], "--seconds") == 0)
+                options->seconds = (unsigned)n;
+            else if (strcmp(argv[i-1], "--interval") == 0 && n > 0)
+                options->interval = (unsigned)n;
+            else {
+                fprintf(stderr, "[-] %s %s: unknown option\n", argv[i-1], value);
+                exit(1);
+            }
+        } else if (argv[i][0] != '-') {
             value = argv[i];
             dispatcher_add_target(dispatcher, value);
         } else
@@ -313,7 +828,8 @@ void dispatcher_parse_command_line(struct my_dispatcher *dispatcher, int argc, c
                     fprintf(stderr, "[-] invalid connection count\n");
                     exit(1);
                 } else {
-                    dispatcher_alloc_connections(dispatcher, n);
+                    /* each thread allocates its own share */
+                    dispatcher->max = n;
                 }
                 break;
             case 's': /* source */
@@ -337,46 +853,129 @@ void dispatcher_parse_command_line(struct my_dispatcher *dispatcher, int argc, c
     }
 }
 
-void dispatcher_getsockname(struct my_dispatcher *dispatcher, size_t i)
+/**
+ * Binds to the source address, and the port we picked. Connections to
+ * other targets may already be bound to that port, which SO_REUSEADDR
+ * allows, as long as none of them are listening. With no port, we tell
+ * the kernel to wait until we connect to pick one, when it knows the
+ * target, so that it can also reuse ports between targets.
+ */
+int source_bind(int fd, const struct addrinfo *source, unsigned port)
 {
-    int fd = dispatcher->list[i].fd;
-    int err;
-    struct sockaddr_in6 sin6;
-    socklen_t sizeof_sin6 = sizeof(sin6);
-    struct connection_t *c = &dispatcher->connections[i];
-    err = getsockname(fd, (struct sockaddr*)&sin6, &sizeof_sin6);
-    if (err) {
-        fprintf(stderr, "[-] getsockname(): %s\n", strerror(errno));
-        exit(1);
+    struct sockaddr_storage sa;
+    int yes = 1;
+
+    memcpy(&sa, source->ai_addr, source->ai_addrlen);
+    if (port == 0) {
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+#endif
+    } else {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (sa.ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&sa)->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *)&sa)->sin_port = htons(port);
     }
-    err = getnameinfo((struct sockaddr *)&sin6, sizeof_sin6,
-                        c->hostaddr, sizeof(c->hostaddr),
-                        c->hostport, sizeof(c->hostport),
-                        NI_NUMERICHOST | NI_NUMERICSERV);
+    return bind(fd, (struct sockaddr *)&sa, source->ai_addrlen);
+}
+
+/**
+ * How many new connections we can open now, because of the rate limit,
+ * and because of how many are already open.
+ */
+size_t dispatcher_connect_budget(struct my_dispatcher *dispatcher, unsigned long long now)
+{
+    size_t room = dispatcher->max - dispatcher->count;
+    double burst;
 
+    if (now < dispatcher->retry)
+        return 0;
+    if (room > CONNECTS_PER_LOOP)
+        room = CONNECTS_PER_LOOP;
+    if (dispatcher->rate == 0)
+        return room;
+
+    if (dispatcher->refilled)
+        dispatcher->tokens += (now - dispatcher->refilled) * dispatcher->rate / 1000000000.0;
+    dispatcher->refilled = now;
+    burst = dispatcher->rate / 10;
+    if (burst < 1)
+        burst = 1;
+    if (dispatcher->tokens > burst)
+        dispatcher->tokens = burst;
+
+    if (room > (size_t)dispatcher->tokens)
+        room = (size_t)dispatcher->tokens;
+    dispatcher->tokens -= room;
+    return room;
 }
 
-void dispatcher_connect_next(struct my_dispatcher *dispatcher)
+/**
+ * How long `poll()` should wait: not at all if there's room for more
+ * connections we can open right away, until the next one can be opened
+ * if we are waiting on the rate limit or to retry, or otherwise, 100
+ * milliseconds.
+ */
+int dispatcher_poll_timeout(const struct my_dispatcher *dispatcher, unsigned long long now)
+{
+    int timeout;
+
+    if (dispatcher->count >= dispatcher->max)
+        return 100;
+    if (now < dispatcher->retry)
+        return (int)((dispatcher->retry - now) / 1000000) + 1;
+    if (dispatcher->rate == 0)
+        return 0;
+    timeout = (int)((1 - dispatcher->tokens) * 1000 / dispatcher->rate) + 1;
+    return (timeout < 100) ? timeout : 100;
+}
+
+/**
+ * Opens the next connection, to the next target. A connection that fails
+ * is counted. Returns -1 if the next one will likely fail in the same way,
+ * so that the caller can stop trying for now. When we picked the source
+ * port, a failure, such as from a previous connection with the same port
+ * still being in TIME_WAIT, probably doesn't affect the next port.
+ */
+int dispatcher_connect_next(struct my_dispatcher *dispatcher, unsigned long long now)
 {
     int fd;
     int err;
     struct addrinfo *ai;
+    struct tuple_t *tuple = NULL;
+    unsigned port = 0;
+    struct connection_t *c;
+    size_t target = 0;
     size_t i;
 
-    ai = dispatcher->targets[dispatcher->targets_index];
-    if (++dispatcher->targets_index >= dispatcher->targets_count)
-        dispatcher->targets_index = 0;
+    STAT_ADD(dispatcher->stats.connects, 1);
+
+    /* Pick the source and target. Without any source addresses, we go
+     * through the targets in turn, and the kernel picks the source. */
+    if (dispatcher->tuples_count) {
+        tuple = dispatcher_next_tuple(dispatcher, &port);
+        if (tuple == NULL) {
+            /* every source port is in use with every target */
+            stats_error(&dispatcher->stats, EADDRNOTAVAIL);
+            return -1;
+        }
+        ai = tuple->target;
+    } else {
+        target = dispatcher->targets_index;
+        ai = dispatcher->targets[target];
+        if (++dispatcher->targets_index >= dispatcher->targets_count)
+            dispatcher->targets_index = 0;
+    }
 
     /* Create a socket */
     fd = socket(ai->ai_family, SOCK_STREAM, 0);
     if (fd == -1) {
-        fprintf(stderr, "[-] socket(): %d: %s\n", errno, strerror(errno));
-        switch (errno) {
-            case EMFILE:
-                fprintf(stderr, "[-] files=%d, use 'ulimit -n %d' to raise\n", (int)dispatcher->count, (int)dispatcher->max);;
-                break;
-        }
-        exit(1);
+        /* Probably EMFILE, out of file descriptors */
+        stats_error(&dispatcher->stats, errno);
+        if (port)
+            tuple_free(tuple, port);
+        return -1;
     }
 
 #if defined(FIONBIO)
@@ -392,81 +991,200 @@ void dispatcher_connect_next(struct my_dispatcher *dispatcher)
         int flag;
         flag = fcntl(fd, F_GETFL, 0);
         flag |= O_NONBLOCK;
-        fcntl(socketfd, F_SETFL,  flag);
+        fcntl(fd, F_SETFL,  flag);
     }
 #else
     fprintf(stderr, "[-] non-blocking not set\n");
 #endif
-    
+
     /* Add to our poll list */
-    dispatcher_add(dispatcher, fd, (struct sockaddr_in6*)ai->ai_addr, ai->ai_addrlen);
+    dispatcher_add(dispatcher, fd);
     i = dispatcher->count - 1;
-    memcpy(dispatcher->connections[i].buf, "0123456789abcdef", 16);
-    dispatcher->connections[i].len = 16;
+    c = &dispatcher->connections[i];
+    c->started = now;
+    c->timestamp = now;
+    c->port = (unsigned short)port;
+    c->tuple = (unsigned)(tuple ? (size_t)(tuple - dispatcher->tuples) : target);
+
+    /* Bind to the source address and port */
+    if (tuple) {
+        err = source_bind(fd, tuple->source, port);
+        if (err) {
+            dispatcher_fail_at(dispatcher, i, errno);
+            return port ? 0 : -1;
+        }
+    }
 
     /* Try to connect */
     err = connect(fd, ai->ai_addr, ai->ai_addrlen);
     if (err && (errno == EWOULDBLOCK || errno == EINPROGRESS)) {
-        dispatcher_getsockname(dispatcher, i);
-        //fprintf(stderr, "."); fflush(stderr);
         /* normal condition, except when on the same machine  */
         dispatcher->list[i].events = POLLOUT;
     } else if (err == 0) {
         /* normal when on same machine */
         dispatcher->list[i].events = POLLOUT;
     } else {
-        fprintf(stderr, "[-] connect([%s]:%s): %d: %s\n",
-            dispatcher->connections[i].peeraddr,
-            dispatcher->connections[i].peerport,
-            errno,
-            strerror(errno));
+        /* Probably EADDRNOTAVAIL, the source port is still in TIME_WAIT
+         * with this target, or the kernel is out of ports */
+        dispatcher_fail_at(dispatcher, i, errno);
+        return port ? 0 : -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends the rest of the message. When it's all been sent, we wait for
+ * it to come back. Returns -1 if the connection was removed.
+ */
+int dispatcher_send_at(struct my_dispatcher *dispatcher, size_t i)
+{
+    struct connection_t *c = &dispatcher->connections[i];
+    ptrdiff_t bytes_sent;
+
+    bytes_sent = send(dispatcher->list[i].fd, my_message + c->len, MESSAGE_LENGTH - c->len, 0);
+    if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        dispatcher->list[i].events = POLLOUT;
+    } else if (bytes_sent < 0) {
+        /* might've reset connection between poll() and send() */
+        dispatcher_fail_at(dispatcher, i, errno);
+        return -1;
+    } else if (c->len + bytes_sent < (ptrdiff_t)MESSAGE_LENGTH) {
+        /* hit the send() incomplete issue */
+        c->len += (unsigned char)bytes_sent;
+        dispatcher->list[i].events = POLLOUT;
+    } else {
+        /* all the bytes have been sent, so go back to reading */
+        c->len = 0;
+        c->state = STATE_RECEIVING;
+        dispatcher->list[i].events = POLLIN;
+    }
+    return 0;
+}
+
+/**
+ * Receives the message being echoed back, checking that it's the same as
+ * what we sent. When it's all come back, we either close the connection,
+ * or send it again. Returns -1 if the connection was removed.
+ */
+int dispatcher_recv_at(struct my_dispatcher *dispatcher, size_t i, unsigned long long now)
+{
+    struct connection_t *c = &dispatcher->connections[i];
+    char buf[MESSAGE_LENGTH];
+    ptrdiff_t bytes_received;
+
+    bytes_received = recv(dispatcher->list[i].fd, buf, MESSAGE_LENGTH - c->len, 0);
+    if (bytes_received == 0) {
+        dispatcher_fail_at(dispatcher, i, 0);
+        return -1;
+    } else if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    } else if (bytes_received < 0) {
+        dispatcher_fail_at(dispatcher, i, errno);
+        return -1;
+    } else if (memcmp(buf, my_message + c->len, bytes_received) != 0) {
+        /* the server didn't echo back what we sent */
+        dispatcher_fail_at(dispatcher, i, EBADMSG);
+        return -1;
+    }
+
+    if (c->echoes == 0 && c->len == 0)
+        histogram_record(&dispatcher->first_byte_latency, now - c->started);
+    c->len += (unsigned char)bytes_received;
+    if (c->len < (ptrdiff_t)MESSAGE_LENGTH)
+        return 0;
+
+    /* The whole message has come back */
+    histogram_record(&dispatcher->echo_latency, now - c->timestamp);
+    STAT_ADD(dispatcher->stats.echoes, 1);
+    c->echoes++;
+    if (dispatcher->echoes && c->echoes >= dispatcher->echoes) {
+        STAT_ADD(dispatcher->stats.closed, 1);
         dispatcher_remove_at(dispatcher, i);
-        exit(1);
-        return;
+        return -1;
     }
+
+    /* Send it again */
+    c->len = 0;
+    c->state = STATE_SENDING;
+    c->timestamp = now;
+    return dispatcher_send_at(dispatcher, i);
 }
 
+/**
+ * Counts a connection that has connected, then sends the message.
+ * Returns -1 if the connection was removed.
+ */
+int dispatcher_connected_at(struct my_dispatcher *dispatcher, size_t i, unsigned long long now)
+{
+    struct connection_t *c = &dispatcher->connections[i];
 
-int main(int argc, char *argv[])
+    histogram_record(&dispatcher->connect_latency, now - c->started);
+    STAT_ADD(dispatcher->stats.established, 1);
+    c->len = 0;
+    c->state = STATE_SENDING;
+    c->timestamp = now;
+    return dispatcher_send_at(dispatcher, i);
+}
+
+/**
+ * Fails the connections that have waited longer than the timeout. This
+ * has to look at every connection, but so does `poll()`, so we only do
+ * it ten times a second.
+ */
+void dispatcher_expire(struct my_dispatcher *dispatcher, unsigned long long now)
 {
-    int err;
-    struct my_dispatcher *dispatcher = NULL;
+    unsigned long long timeout = dispatcher->timeout * 1000000ULL;
     size_t i;
-    
-    /* Ignore the send() problem */
-    signal(SIGPIPE, SIG_IGN);
 
-    /* create an instance of our polling object */
-    dispatcher = dispatcher_create();
-    dispatcher_parse_command_line(dispatcher, argc, argv);
-    if (dispatcher->targets_count == 0) {
-        fprintf(stderr, "[-] no targets specified, use -t <target>\n");
-        exit(1);
-    } else
-        fprintf(stderr, "[+] %d targets\n", (int)dispatcher->targets_count);
-    if (dispatcher->max == 0) {
-        dispatcher_alloc_connections(dispatcher, 100);
+    if (now - dispatcher->expired < 100000000ULL)
+        return;
+    dispatcher->expired = now;
+
+    for (i=0; i<dispatcher->count; i++) {
+        if (now - dispatcher->connections[i].timestamp > timeout)
+            dispatcher_fail_at(dispatcher, i--, ETIMEDOUT);
     }
+}
 
-    /* Create the next target */
-    for (i=0; i<10 && i < dispatcher->targets_count; i++)
-        dispatcher_connect_next(dispatcher);
-    
-    /* dispatch loop */
-    while (dispatcher->count) {
-        int timeout = 100; /* 100 milliseconds */
+/**
+ * The main loop for one thread, until told to stop.
+ */
+void *shard_run(void *v)
+{
+    struct shard_t *shard = (struct shard_t *)v;
+    struct my_dispatcher *dispatcher = shard->dispatcher;
+    int err;
+
+    dispatcher->log = logger_ring(shard->logger, 1024);
+    if (dispatcher->log == NULL) {
+        fprintf(stderr, "[-] logger_ring(): %s\n", strerror(errno));
+        return NULL;
+    }
+
+    while (!is_stopping) {
+        unsigned long long now = _get_monotonic();
+        size_t n;
         size_t i;
 
-        if (dispatcher->count < dispatcher->max)
-            dispatcher_connect_next(dispatcher);
+        /* Open as many new connections as we are allowed to */
+        n = dispatcher_connect_budget(dispatcher, now);
+        for (i=0; i<n; i++) {
+            if (dispatcher_connect_next(dispatcher, now) != 0) {
+                dispatcher->retry = now + 10000000ULL; /* 10 ms */
+                break;
+            }
+        }
+        __atomic_store_n(&dispatcher->stats.open, dispatcher->count, __ATOMIC_RELAXED);
 
         /* wait for incoming event on any connection */
-        err = poll(dispatcher->list, dispatcher->count, timeout);
+        err = poll(dispatcher->list, dispatcher->count, dispatcher_poll_timeout(dispatcher, now));
         if (err == -1) {
+            if (errno == EINTR)
+                continue;
             fprintf(stderr, "[-] poll(): %s\n", strerror(errno));
             switch (errno) {
                 case EINVAL:
-                    fprintf(stderr, "max file descriptor reached? nfds=%d\n", dispatcher->count);
+                    fprintf(stderr, "max file descriptor reached? nfds=%d\n", (int)dispatcher->count);
                     {
                         struct rlimit rl;
                         getrlimit(RLIMIT_NOFILE, &rl);
@@ -476,102 +1194,225 @@ int main(int argc, char *argv[])
                     break;
             }
             break;
-        } else if (err == 0) {
-            /* timeout happened, nothing was recevied */
-            continue;
         }
+        now = _get_monotonic();
 
         /* handle all the TCP connections */
-        for (i=1; i<dispatcher->count; i++) {
+        for (i=0; err > 0 && i<dispatcher->count; i++) {
             struct connection_t *c = &dispatcher->connections[i];
-            if (dispatcher->list[i].revents == 0) {
+            unsigned revents = dispatcher->list[i].revents;
+
+            if (revents == 0) {
                 /* no events for this socket */
                 continue;
-            } else if ((dispatcher->list[i].revents & POLLHUP) != 0) {
-                /* other side hungup (i.e. sent FIN, closed socket) */
-                if (c->bytes_received == 0 && c->bytes_sent == 0) {
-                    fprintf(stderr, "-"); fflush(stderr);
-                    //fprintf(stderr, "[-] connect([%s]:%s): connection refused\n", c->peeraddr, c->peerport);
-                } else {
-                    fprintf(stderr, "sent=%u recv=%u\n", (unsigned)c->bytes_sent, (unsigned)c->bytes_received);
-                    fprintf(stderr, "[+] close([%s}:%s -> [%s]:%s): connection closed gracefully\n", 
-                        c->hostaddr, c->hostport,
-                        c->peeraddr, c->peerport);
-                    dispatcher_remove_at(dispatcher, i--);
-                    exit(1);
-                }
-            } else if ((dispatcher->list[i].revents & POLLERR) != 0) {
-                /* error, probably RST sent by other side, but to be sure,
-                 * get the error associated with the socket */
-                int opt;
+            } else if ((revents & POLLERR) != 0) {
+                /* error, probably the connection was refused, or RST sent
+                 * by other side, but to be sure, get the error associated
+                 * with the socket */
+                int opt = 0;
                 socklen_t opt_len = sizeof(opt);
-                err = getsockopt(dispatcher->list[i].fd, SOL_SOCKET, SO_ERROR, &opt, &opt_len);
-                if (err) {
-                    /* should never happen*/
-                    fprintf(stderr, "[-] getsockopt([%s]:%s): %s\n", c->peeraddr, c->peerport, strerror(errno));
-                } else {
-                    fprintf(stderr, "[-] recv([%s]:%s): %s\n", c->peeraddr, c->peerport, strerror(opt));
-                }
-                dispatcher_remove_at(dispatcher, i--);
-                exit(1);
-            } else if ((dispatcher->list[i].revents & POLLIN) != 0) {
+                getsockopt(dispatcher->list[i].fd, SOL_SOCKET, SO_ERROR, &opt, &opt_len);
+                dispatcher_fail_at(dispatcher, i--, opt);
+            } else if (c->state == STATE_CONNECTING && (revents & POLLOUT) != 0) {
+                /* The connection succeeded */
+                if (dispatcher_connected_at(dispatcher, i, now) != 0)
+                    i--;
+            } else if ((revents & POLLIN) != 0) {
                 /* Data is ready to receive */
-                c->len = recv(dispatcher->list[i].fd, c->buf, sizeof(c->buf), 0);
-                if (c->len == 0 ) {
-                    /* Shouldn't be possible, should've got POLLHUP instead */
-                    fprintf(stderr, "[-] RECV([%s]:%s): %s\n", c->peeraddr, c->peerport, "CONNECTION CLOSED");
-                    dispatcher_remove_at(dispatcher, i--);
-                    exit(1);
-                } else if (c->len < 0) {
-                    fprintf(stderr, "[-] RECV([%s]:%s): %s\n", c->peeraddr, c->peerport, strerror(errno));
-                    dispatcher_remove_at(dispatcher, i--);
-                    exit(1);
-                } else {
-                    /* change poll() entry to transmit instead of receive */
-                    //fprintf(stderr, "[+] recv([%s]:%s): received %d bytes\n", c->peeraddr, c->peerport, (int)c->len);
-                    c->bytes_received += c->len;
-                    dispatcher->list[i].events = POLLOUT;
-                }
-            } else if ((dispatcher->list[i].revents & POLLOUT) != 0) {
+                if (dispatcher_recv_at(dispatcher, i, now) != 0)
+                    i--;
+            } else if ((revents & POLLHUP) != 0) {
+                /* other side hungup (i.e. sent FIN, closed socket) */
+                dispatcher_fail_at(dispatcher, i--, 0);
+            } else if ((revents & POLLOUT) != 0) {
                 /* We are ready to transmit data */
-                ptrdiff_t bytes_sent;
-                if (c->bytes_received == 0 && c->bytes_sent == 0) {
-                    fprintf(stderr, "+"); fflush(stderr);
-                }
-                
-                bytes_sent = send(dispatcher->list[i].fd, c->buf, c->len, 0);
-                if (bytes_sent < 0) {
-                    /* might've reset connection between poll() and send() */
-                    fprintf(stderr, "[-] SEND([%s]:%s -> [%s]:%s): %s\n", 
-                        c->hostaddr, c->hostport,
-                        c->peeraddr, c->peerport, strerror(errno));
-                    dispatcher_remove_at(dispatcher, i);
-                    exit(1);
-                } else if (bytes_sent < c->len) {
-                    /* hit the send() incomplete issue */
-                    fprintf(stderr, "[+] SEND([%s]:%s): %s\n", c->peeraddr, c->peerport, "out of buffer");
-                    memmove(c->buf, c->buf+bytes_sent, c->len - bytes_sent);
-                    c->len -= bytes_sent;
-                    c->bytes_sent += bytes_sent;
-                    dispatcher->list[i].events = POLLOUT;
-                } else {
-                    /* all the bytes have been sent, so go back to reading */
-                    //fprintf(stderr, "[+] send([%s]:%s): sent %d bytes\n", c->peeraddr, c->peerport, (int)bytes_sent);
-                    c->bytes_sent += bytes_sent;
-                    dispatcher->list[i].events = POLLIN;
-                }
-            } else {
-                fprintf(stderr, "[-] poll([%s]:%s): unknown event[%d] 0x%x\n", c->peeraddr, c->peerport, (int)i, dispatcher->list[i].revents);
-                dispatcher_remove_at(dispatcher, i--);
-                exit(1);
+                if (dispatcher_send_at(dispatcher, i) != 0)
+                    i--;
             }
         } /* end handling connections */
+
+        dispatcher_expire(dispatcher, now);
     } /* end dispatch loop */
 
-    
+    return NULL;
+}
+
+void handle_stop(int sig)
+{
+    (void)sig;
+    is_stopping = 1;
+}
+
+/**
+ * Opening lots of connections needs lots of file descriptors, so raise the
+ * limit as high as we are allowed.
+ */
+void raise_file_limit(size_t needed)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= needed)
+        return;
+    rl.rlim_cur = (rl.rlim_max < needed) ? rl.rlim_max : needed;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < needed)
+        fprintf(stderr, "[-] files=%lu, use 'ulimit -n %lu' to raise\n",
+                (unsigned long)rl.rlim_cur, (unsigned long)needed);
+}
+
+/**
+ * Adds up the statistics from all the threads, while they are running.
+ */
+void stats_sum(struct stats_t *sum, struct shard_t *shards, unsigned count)
+{
+    unsigned j;
+    size_t k;
 
+    memset(sum, 0, sizeof(*sum));
+    for (j=0; j<count; j++) {
+        struct stats_t *s = &shards[j].dispatcher->stats;
+        sum->connects += STAT_GET(s->connects);
+        sum->established += STAT_GET(s->established);
+        sum->echoes += STAT_GET(s->echoes);
+        sum->closed += STAT_GET(s->closed);
+        sum->errors += STAT_GET(s->errors);
+        sum->open += STAT_GET(s->open);
+        for (k=0; k<ERRNO_MAX; k++)
+            sum->error_codes[k] += STAT_GET(s->error_codes[k]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int err;
+    struct my_dispatcher *dispatcher = NULL;
+    struct my_options options = {1, 0, 1};
+    struct shard_t *shards;
+    struct logger_t *logger;
+    struct stats_t last = {0};
+    struct stats_t now_stats;
+    struct histogram_t *latency;
+    unsigned long long start;
+    unsigned long long last_report;
+    unsigned long long now;
+    double seconds;
+    unsigned j;
+    size_t k;
+
+    /* Ignore the send() problem */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+
+    /* create an instance of our polling object */
+    dispatcher = dispatcher_create();
+    dispatcher_parse_command_line(dispatcher, &options, argc, argv);
+    if (dispatcher->targets_count == 0) {
+        fprintf(stderr, "[-] no targets specified, use -t <target>\n");
+        exit(1);
+    } else
+        fprintf(stderr, "[+] %d targets\n", (int)dispatcher->targets_count);
+    if (dispatcher->max == 0) {
+        dispatcher->max = 100;
+    }
+    if (options.thread_count > dispatcher->max)
+        options.thread_count = (unsigned)dispatcher->max;
+    if (dispatcher->sources_count && dispatcher->sources_count < options.thread_count)
+        fprintf(stderr, "[-] %d sources for %u threads, so they'll share\n",
+                (int)dispatcher->sources_count, options.thread_count);
+    raise_file_limit(dispatcher->max + 64);
+
+    /* Errors are logged by a background thread, so that the threads making
+     * connections never wait on it */
+    logger = logger_create(stderr, 1);
+    if (logger == NULL) {
+        fprintf(stderr, "[-] logger_create(): %s\n", strerror(errno));
+        exit(1);
+    }
+
+    /* Split everything between the threads */
+    shards = calloc(options.thread_count, sizeof(*shards));
+    if (shards == NULL) {
+        fprintf(stderr, "[-] calloc(): %s\n", strerror(errno));
+        exit(1);
+    }
+    for (j=0; j<options.thread_count; j++) {
+        shards[j].index = j;
+        shards[j].logger = logger;
+        shards[j].dispatcher = dispatcher_create_shard(dispatcher, j, options.thread_count);
+    }
+
+    start = _get_monotonic();
+    last_report = start;
+    for (j=0; j<options.thread_count; j++) {
+        err = pthread_create(&shards[j].thread, 0, shard_run, &shards[j]);
+        if (err) {
+            fprintf(stderr, "[-] pthread_create(): %s\n", strerror(err));
+            exit(1);
+        }
+    }
+
+    /* Print the rates since the last report, until it's time to stop */
+    while (!is_stopping) {
+        usleep(10000);
+        now = _get_monotonic();
+        if (options.seconds && now - start >= options.seconds * 1000000000ULL)
+            is_stopping = 1;
+        if (now - last_report < options.interval * 1000000000ULL)
+            continue;
+
+        stats_sum(&now_stats, shards, options.thread_count);
+        seconds = (now - last_report) / 1000000000.0;
+        fprintf(stderr, "[+] %6.1f-sec: %8.0f-connects/sec %8.0f-echoes/sec %6.0f-errors/sec %8llu-open\n",
+                (now - start) / 1000000000.0,
+                (now_stats.established - last.established) / seconds,
+                (now_stats.echoes - last.echoes) / seconds,
+                (now_stats.errors - last.errors) / seconds,
+                now_stats.open);
+        last = now_stats;
+        last_report = now;
+    }
+
+    for (j=0; j<options.thread_count; j++)
+        pthread_join(shards[j].thread, 0);
+    now = _get_monotonic();
+    logger_destroy(logger);
+    seconds = (now - start) / 1000000000.0;
+
+    /* Print the totals */
+    stats_sum(&now_stats, shards, options.thread_count);
+    printf("connections:   %llu tried, %llu connected, %llu closed, %llu errors\n",
+           now_stats.connects, now_stats.established, now_stats.closed, now_stats.errors);
+    printf("rate:          %.0f-connects/second %.0f-echoes/second\n",
+           now_stats.established / seconds, now_stats.echoes / seconds);
+    latency = calloc(3, sizeof(*latency));
+    if (latency == NULL) {
+        fprintf(stderr, "[-] calloc(): %s\n", strerror(errno));
+        exit(1);
+    }
+    for (j=0; j<options.thread_count; j++) {
+        histogram_merge(&latency[0], &shards[j].dispatcher->connect_latency);
+        histogram_merge(&latency[1], &shards[j].dispatcher->first_byte_latency);
+        histogram_merge(&latency[2], &shards[j].dispatcher->echo_latency);
+    }
+    histogram_print("connect:", &latency[0]);
+    histogram_print("first-byte:", &latency[1]);
+    histogram_print("echo:", &latency[2]);
+    for (k=0; k<ERRNO_MAX; k++) {
+        if (now_stats.error_codes[k] == 0)
+            continue;
+        printf("error:         %llu %s\n", now_stats.error_codes[k],
+               (k == 0) ? "closed by peer" : strerror((int)k));
+    }
+    free(latency);
+
+    for (j=0; j<options.thread_count; j++) {
+        dispatcher_destroy(shards[j].dispatcher);
+        free(shards[j].dispatcher->sources);
+        free(shards[j].dispatcher);
+    }
+    free(shards);
     if (dispatcher)
         dispatcher_destroy(dispatcher);
     return 0;
 }
-
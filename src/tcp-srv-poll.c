@@ -2,10 +2,50 @@
  Simple example of TCP server written with poll.
  This is an 'echo' server that echoes back whatever it receives.
  Example usage:
-    tcp-srv-one 7777
- This will listen on port 7777, accept one connection at a time,
- and echo back whatever it receives on the connection.
+    tcp-srv-poll 7777 [--backlog <n>]
+ This will listen on port 7777, handling many connections at once, and
+ echo back whatever it receives on each of them. Each time the listening
+ socket is ready, it accepts every connection waiting in the backlog,
+ calling `accept4()` until it returns EAGAIN. The backlog defaults to,
+ and is capped at, the kernel's limit, `net.core.somaxconn`.
+
+ The original version of this program called `poll()` directly. That
+ works, but after every wakeup, we have to scan the entire array of
+ connections looking for the one that's ready. With thousands of idle
+ connections, that scan becomes the bottleneck. The program now uses
+ the `util-events` module, which can use `epoll` or `io_uring` to report
+ only the connections that are ready. Use the `--backend` option to
+ select "poll", "epoll", or "uring", such as to compare them.
+
+ A single event loop can only use one CPU core. Use `--threads <n>` to
+ run that many loops, each on its own thread pinned to its own core,
+ each with its own listening socket bound to the same port with
+ SO_REUSEPORT. Add `--cbpf` to have the kernel give each connection to
+ the thread running on the CPU that received it.
+
+ To hold lots of connections, each one needs to use as little memory as
+ possible. A connection's record has just what we need to handle its
+ events, in 32 bytes. Its address is kept apart from the record, since we
+ only need it for logging, and isn't formatted until then. It only has a
+ buffer while it has data we couldn't echo back yet, which is rare, since
+ we try to echo it back as soon as it's received.
+
+ Every connection is logged, which in a storm of connections used to cost
+ more than handling them: a `getnameinfo()` to format the address, and a
+ write to `stderr` for each message. Now each thread just copies the
+ binary address into its own ring buffer, using the `util-logger` module,
+ and a background thread formats and writes them out many at a time.
+
+ In a storm of connections, the kernel completes the handshakes for us,
+ and queues them in the listen backlog until we call `accept()`. When the
+ backlog is full, it drops incoming SYNs, and the client has to retransmit
+ them a second later. So when woken up, we accept every connection that's
+ waiting, not just one, and each one is created non-blocking by
+ `accept4()`, rather than with another system call. The backlog defaults
+ to the most the kernel allows (`net.core.somaxconn`). Use `--backlog <n>`
+ to make it smaller, such as to see what happens when it overflows.
  */
+#define _GNU_SOURCE /* pthread_setaffinity_np(), accept4() */
 #include <ctype.h>
 #include <errno.h>
 #include <signal.h>
@@ -14,188 +54,438 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
-#include <sys/poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
 
-struct connection_t {
-  /* Instead of calling `getpeername()` every time we want to log a message
-   * about this connection, we remember it here in this structure */
+#include "util-events.h"
+#include "util-logger.h"
+
+/* The maximum number of events we process per wakeup */
+#define MAX_EVENTS 256
+
+/* The most we receive at a time */
+#define BUFFER_SIZE 512
+
+/* The most messages each thread can log before the logging thread gets
+ * to them, which it does every 10 milliseconds. Any more are dropped. */
+#define LOG_RING_SIZE 4096
+
+/* Log a message about a connection, with the address of the other side */
+#define LOG_PEER(fmt, c, err)                                                 \
+  logger_addr(poller->log, fmt, (struct sockaddr *)&(c)->peer->sa,            \
+              (c)->peer->sa_addrlen, err)
+
+/**
+ * Data that we've received, but couldn't echo back yet. Under load, the
+ * kernel may run out of buffer space, so that we can't `send()` it
+ * without causing this server to block. We buffer it in user-mode until
+ * we can, which is something almost every programmer does in real-world
+ * use of `poll()`. Buffers are only attached to a connection while they
+ * have data in them, and are then kept on a free list for the next
+ * connection that needs one.
+ */
+struct buffer_t {
+  /* While this buffer is on the free list, the next free buffer */
+  struct buffer_t *next_free;
+
+  /* How much data is in the buffer */
+  ptrdiff_t len;
+
+  char data[BUFFER_SIZE];
+};
+
+/**
+ * The address of the other side of a connection. Instead of calling
+ * `getpeername()` every time we want to log a message about this
+ * connection, we remember it here. We don't format it to text until we
+ * actually log something. It's kept apart from the connection record,
+ * since we don't need it to handle events.
+ */
+struct peer_t {
   struct sockaddr_in6 sa;
   socklen_t sa_addrlen;
+};
 
-  /* Instead of formatting the address to text every time we want to log
-   * a message about this connection, we just format it once. */
-  char peeraddr[64];
-  char peerport[8];
+struct connection_t {
+  /* The socket for this connection, or -1 if this record is free */
+  int fd;
 
-  /* The current length of our buffer */
-  ptrdiff_t len;
+  /* The events (POLLIN or POLLOUT) that we are waiting for */
+  unsigned events;
+
+  /* While this record is on the free list, the next free record */
+  struct connection_t *next_free;
+
+  /* The data we are waiting to echo back, or NULL if there isn't any */
+  struct buffer_t *buf;
+
+  /* The address of the other side, which never changes for a record */
+  struct peer_t *peer;
+};
 
-  /* Instead of immediately using `send()` to echo back what we got on the
-   * `recv()`, we'll buffer the data in user-mode. This deals with the
-   * problem that under load, the kernel may run out of buffer space,
-   * and there may be no way to `send()` data without causing this
-   * server to block. In real-world use of `poll()`, this is something
-   * almost every programmer will do, buffering data in user-mode. */
-  char buf[512];
+/* The number of connection records we allocate at a time */
+#define CONNECTIONS_PER_SLAB 64
+
+/**
+ * Connection records are allocated in "slabs" of many records at a time.
+ * A slab is never moved or freed until the poller is destroyed, so a
+ * record's address stays the same for as long as the connection is open.
+ * That means we can give the backend a pointer to the record as the 'id',
+ * rather than an index into an array that has to be kept up-to-date.
+ */
+struct slab_t {
+  struct slab_t *next;
+  struct connection_t records[CONNECTIONS_PER_SLAB];
+  struct peer_t peers[CONNECTIONS_PER_SLAB];
 };
 
 struct poller_t {
-  struct connection_t *connections;
-  struct pollfd *list;
+  struct events_t *events;
+
+  /* The record for the half-open server receiving connections */
+  struct connection_t *server;
+
+  /* All the slabs we've allocated, and the records within them that
+   * aren't currently being used */
+  struct slab_t *slabs;
+  struct connection_t *freelist;
+
+  /* The buffers that aren't being used by a connection */
+  struct buffer_t *free_buffers;
+
+  /* The number of records in use, including the server */
   size_t count;
-  size_t max;
+
+  /* This thread's ring buffer for logging messages */
+  struct logring_t *log;
+
+  /* Set when we've run out of file descriptors, and stopped waiting for
+   * incoming connections until one closes */
+  int is_accept_paused;
+  int is_emfile_logged;
 };
 
-/** We are calling our subsystem a "poller". This contains the array of
- * descriptors that we manage for the `poll()` system call, as well
- * as an array of descriptions about each connection.
+/**
+ * The event backends need non-blocking sockets, because with edge-triggered
+ * `epoll`, a socket may be reported as ready even though a later call would
+ * block.
+ */
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Get a free connection record. When there are none left, we allocate
+ * a new slab of them rather than growing (and moving) an array.
+ */
+static struct connection_t *poller_alloc(struct poller_t *poller) {
+  struct connection_t *c;
+
+  if (poller->freelist == NULL) {
+    struct slab_t *slab;
+    size_t i;
+
+    slab = malloc(sizeof(*slab));
+    if (slab == NULL) {
+      fprintf(stderr, "[-] malloc(): %s\n", strerror(errno));
+      return NULL;
+    }
+    slab->next = poller->slabs;
+    poller->slabs = slab;
+
+    /* Put them on the list backwards, so that they get used in order */
+    for (i = CONNECTIONS_PER_SLAB; i > 0; i--) {
+      c = &slab->records[i - 1];
+      c->fd = -1;
+      c->buf = NULL;
+      c->peer = &slab->peers[i - 1];
+      c->next_free = poller->freelist;
+      poller->freelist = c;
+    }
+  }
+
+  c = poller->freelist;
+  poller->freelist = c->next_free;
+  c->next_free = NULL;
+  poller->count++;
+  return c;
+}
+
+/**
+ * Put a connection record back on the free list, to be reused by the
+ * next connection we accept.
+ */
+static void poller_free(struct poller_t *poller, struct connection_t *c) {
+  c->fd = -1;
+  c->next_free = poller->freelist;
+  poller->freelist = c;
+  poller->count--;
+}
+
+/**
+ * Get a buffer for data we couldn't send yet, reusing one from the free
+ * list if we can.
+ */
+static struct buffer_t *buffer_alloc(struct poller_t *poller) {
+  struct buffer_t *buf = poller->free_buffers;
+
+  if (buf == NULL) {
+    buf = malloc(sizeof(*buf));
+    if (buf == NULL) {
+      fprintf(stderr, "[-] malloc(): %s\n", strerror(errno));
+      return NULL;
+    }
+  } else
+    poller->free_buffers = buf->next_free;
+  buf->next_free = NULL;
+  buf->len = 0;
+  return buf;
+}
+
+static void buffer_free(struct poller_t *poller, struct buffer_t *buf) {
+  buf->next_free = poller->free_buffers;
+  poller->free_buffers = buf;
+}
+
+/**
+ * Accepts a connection that's already non-blocking, and won't be inherited
+ * by child processes, in a single system call where we can.
+ */
+static int accept_nonblocking(int fd, struct sockaddr *sa,
+                              socklen_t *sa_addrlen) {
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+  return accept4(fd, sa, sa_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int fd2 = accept(fd, sa, sa_addrlen);
+  if (fd2 != -1) {
+    set_nonblocking(fd2);
+    fcntl(fd2, F_SETFD, FD_CLOEXEC);
+  }
+  return fd2;
+#endif
+}
+
+/**
+ * Formats the address of the other side as "[addr]:port", for logging.
+ */
+static const char *connection_name(const struct connection_t *c, char *name,
+                                   size_t sizeof_name) {
+  char peeraddr[64];
+  char peerport[8];
+  int err;
+
+  err = getnameinfo((struct sockaddr *)&c->peer->sa, c->peer->sa_addrlen,
+                    peeraddr, sizeof(peeraddr), peerport, sizeof(peerport),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+  if (err)
+    snprintf(name, sizeof_name, "[err]:err");
+  else
+    snprintf(name, sizeof_name, "[%s]:%s", peeraddr, peerport);
+  return name;
+}
+
+/** We are calling our subsystem a "poller". This contains the backend
+ * that waits on our descriptors (`poll()`, `epoll`, or `io_uring`), as well
+ * as the records describing each connection. A pointer to the record is
+ * the 'id' that the backend reports back to us.
  *
- * The first item in the array isn't a connection, but the half-open
- * server that we'll use to receive connections. */
-struct poller_t *poller_create(int fd) {
+ * The first record isn't a connection, but the half-open server that
+ * we'll use to receive connections. */
+struct poller_t *poller_create(int fd, enum events_backend_t backend,
+                               struct logring_t *log) {
   struct poller_t *poller;
-  poller = malloc(sizeof(*poller));
+  struct connection_t *c;
 
-  /* Start with 2 entries, one for the server, and one empty for incoming */
-  poller->max = 2;
-  poller->list = malloc(poller->max * sizeof(*poller->list));
-  poller->list[0].fd = fd;
-  poller->list[0].events = POLLIN; /* incoming connection events */
-  poller->count = 1;
-  poller->connections = malloc(poller->max * sizeof(*poller->connections));
+  poller = calloc(1, sizeof(*poller));
+  if (poller == NULL) {
+    fprintf(stderr, "[-] calloc(): %s\n", strerror(errno));
+    return NULL;
+  }
+  poller->log = log;
+
+  poller->events = events_create(backend);
+  if (poller->events == NULL) {
+    fprintf(stderr, "[-] events_create(): %s\n", strerror(errno));
+    free(poller);
+    return NULL;
+  }
+
+  c = poller_alloc(poller);
+  if (c == NULL) {
+    events_destroy(poller->events);
+    free(poller);
+    return NULL;
+  }
+  c->fd = fd;
+  c->events = POLLIN; /* incoming connection events */
+  poller->server = c;
+
+  /* Without this, we'd never be told about incoming connections, and
+   * would silently never accept any */
+  if (events_add(poller->events, fd, POLLIN, (size_t)c) == -1) {
+    fprintf(stderr, "[-] events_add(): %s\n", strerror(errno));
+    free(poller->slabs); /* the only slab, holding just the server */
+    events_destroy(poller->events);
+    free(poller);
+    return NULL;
+  }
 
   return poller;
 }
 
+/**
+ * Change the events we are waiting for, which also re-arms the connection
+ * so that the backend will report it again.
+ */
+void poller_set_events(struct poller_t *poller, struct connection_t *c,
+                       unsigned events) {
+  c->events = events;
+  events_modify(poller->events, c->fd, events, (size_t)c);
+}
+
 /**
  * Right after calling`accept()` for an incomign connection, we use this
- * function to add that connection to our arrays. We have one array
- * for tracking the descriptor (`fd`) and associated poll events. We have
- * another array that tracks a buffer for outoing data for each `fd`.
- * The `pollfd` array is part of the Scokets API, so we can't add custom
- * fieldds to it, hence the second array.
+ * function to add that connection to our records, and register it with
+ * the backend to wait for incoming data. The socket must already be
+ * non-blocking.
  */
 void poller_add(struct poller_t *poller, int fd, struct sockaddr_in6 *sa,
                 socklen_t sa_addrlen) {
   struct connection_t *c;
   int err;
 
-  /* add to the poll() list, set for reading */
-  poller->list[poller->count].fd = fd;
-  poller->list[poller->count].events = POLLIN;
-  poller->list[poller->count].revents = 0;
-
-  /* add per-connection buffer and logging info */
-  c = &poller->connections[poller->count];
-  c->len = 0; /* init buffer */
-  c->sa_addrlen = sa_addrlen;
-  memcpy(&c->sa, sa, sa_addrlen);
-
-  /* log the address of remote connection */
-  err = getnameinfo((struct sockaddr *)&c->sa, c->sa_addrlen, c->peeraddr,
-                    sizeof(c->peeraddr), c->peerport, sizeof(c->peerport),
-                    NI_NUMERICHOST | NI_NUMERICSERV);
+  /* add per-connection logging info */
+  c = poller_alloc(poller);
+  if (c == NULL) {
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+  c->events = POLLIN;
+  c->peer->sa_addrlen = sa_addrlen;
+  memcpy(&c->peer->sa, sa, sa_addrlen);
+
+  /* log the address of remote connection, which just copies it to be
+   * formatted later by the logging thread */
+  logger_addr(poller->log, "[+] connect() from %s\n",
+              (struct sockaddr *)&c->peer->sa, c->peer->sa_addrlen, 0);
+
+  /* add to the backend, set for reading */
+  err = events_add(poller->events, fd, POLLIN, (size_t)c);
   if (err) {
-    fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
-    memcpy(c->peeraddr, "err", 4);
-    memcpy(c->peerport, "err", 4);
-  } else {
-    fprintf(stderr, "[+] connect() from [%s]:%s\n", c->peeraddr, c->peerport);
+    logger_addr(poller->log, "[-] events_add(%s): %s\n",
+                (struct sockaddr *)&c->peer->sa, c->peer->sa_addrlen, errno);
+    close(fd);
+    poller_free(poller, c);
+    return;
   }
+}
 
-  /* grow the lists by 1, if needed*/
-  poller->count++;
-  if (poller->count >= poller->max) {
-    poller->max++;
-    poller->list = realloc(poller->list, poller->max * sizeof(*poller->list));
-    poller->connections = realloc(poller->connections,
-                                  poller->max * sizeof(*poller->connections));
+/**
+ * Start waiting for incoming connections again, after we stopped because
+ * we ran out of file descriptors. Called when a connection closes, freeing
+ * one, or when we're idle, in case something else freed them.
+ */
+static void poller_resume_accept(struct poller_t *poller) {
+  if (poller->is_accept_paused) {
+    poller->is_accept_paused = 0;
+    poller_set_events(poller, poller->server, POLLIN);
   }
 }
 
 /**
- * Removes a connection.
- * The array has to be dense, so we can't leave a hole in the middle.
- * Therefore, we move whatever entry is at the end of our arrays to the
- * spot just vacated.
+ * Closes a connection and frees its record. Since no other record moves,
+ * we can do this immediately, even in the middle of handling a batch of
+ * events: the backend reports each descriptor at most once per batch,
+ * so there can't be a pending event still pointing at this record.
  */
-void poller_remove_at(struct poller_t *poller, size_t i) {
-  size_t end;
-
-  /* close the socket if it's still open */
-  if (poller->list[i].fd > 0) {
-    close(poller->list[i].fd);
-    poller->list[i].fd = -1;
+void poller_remove(struct poller_t *poller, struct connection_t *c) {
+  if (c->fd != -1) {
+    events_remove(poller->events, c->fd);
+    close(c->fd);
   }
-
-  /* For efficiency, replace this entry with the one at the end of the list */
-  end = poller->count - 1;
-  if (end > i) {
-    memcpy(&poller->list[i], &poller->list[end], sizeof(poller->list[0]));
-    memcpy(&poller->connections[i], &poller->connections[end],
-           sizeof(poller->connections[0]));
+  if (c->buf) {
+    buffer_free(poller, c->buf);
+    c->buf = NULL;
   }
-  poller->count--;
+  poller_free(poller, c);
+  poller_resume_accept(poller);
 }
 
 /**
  * This cleans up our "poller" subsystem.
  */
 void poller_destroy(struct poller_t *poller) {
-  while (poller->count)
-    poller_remove_at(poller, poller->count - 1);
-
-  free(poller->list);
-  free(poller->connections);
-}
-
-int main(int argc, char *argv[]) {
-  struct addrinfo *ai = NULL;
-  struct addrinfo hints = {0};
-  int err;
-  int fd = -1;
-  char hostaddr[NI_MAXHOST];
-  char hostport[NI_MAXSERV];
-  struct poller_t *poller = NULL;
-
-  /* Ignore the send() problem */
-  signal(SIGPIPE, SIG_IGN);
+  while (poller->slabs) {
+    struct slab_t *slab = poller->slabs;
+    size_t i;
 
-  if (argc < 2 || 3 < argc) {
-    fprintf(stderr, "[-] usage: tcp-srv-one <port> [address]\n");
-    return -1;
+    for (i = 0; i < CONNECTIONS_PER_SLAB; i++) {
+      struct connection_t *c = &slab->records[i];
+      if (c->fd != -1) {
+        events_remove(poller->events, c->fd);
+        close(c->fd);
+      }
+      free(c->buf);
+    }
+    poller->slabs = slab->next;
+    free(slab);
   }
-
-  /* Get an address structure for the port */
-  hints.ai_flags = AI_PASSIVE;
-  err = getaddrinfo((argc == 3) ? argv[2] : 0, /* local address*/
-                    argv[1],                   /* local port number */
-                    &hints,                    /* hints */
-                    &ai);                      /* result */
-  if (err) {
-    fprintf(stderr, "[-] getaddrinfo(): %s\n", gai_strerror(err));
-    return -1;
+  while (poller->free_buffers) {
+    struct buffer_t *buf = poller->free_buffers;
+    poller->free_buffers = buf->next_free;
+    free(buf);
   }
 
-  /* ..and retrieve back again which addresses were assigned. Normally,
-   * this will be [::] meaning we are accepting incoming connections
-   * on all our IP addresses, even IPv4 addresses */
-  err =
-      getnameinfo(ai->ai_addr, ai->ai_addrlen, hostaddr, sizeof(hostaddr),
-                  hostport, sizeof(hostport), NI_NUMERICHOST | NI_NUMERICSERV);
-  if (err) {
-    fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
-    goto cleanup;
-  }
+  events_destroy(poller->events);
+  free(poller);
+}
+
+/**
+ * Each thread runs its own "shard" of the server, with its own listening
+ * socket, its own poller, and its own connections. Nothing is shared
+ * between threads, so no locking is needed. The kernel spreads incoming
+ * connections across the listening sockets because they were all bound
+ * with SO_REUSEPORT.
+ */
+struct shard_t {
+  unsigned index;
+  int fd;
+  int cpu;
+  enum events_backend_t backend;
+  struct logger_t *logger;
+  const char *hostaddr;
+  const char *hostport;
+  pthread_t thread;
+
+  /* Set if the shard couldn't start its event loop */
+  int is_failed;
+};
+
+/**
+ * Create a listening socket. When running multiple threads, we call this
+ * once per thread, all bound to the same address and port.
+ */
+static int create_listener(const struct addrinfo *ai, const char *hostaddr,
+                           const char *hostport, int backlog) {
+  int err;
+  int fd;
 
   /* Create a file handle for the half-open server  */
   fd = socket(ai->ai_family, SOCK_STREAM, 0);
   if (fd == -1) {
     fprintf(stderr, "[-] socket(): %s\n", strerror(errno));
-    goto cleanup;
+    return -1;
   }
 
   /* Allow multiple processes to share this IP address */
@@ -206,12 +496,13 @@ int main(int argc, char *argv[]) {
     if (err) {
       fprintf(stderr, "[-] SO_REUSEADDR([%s]:%s): %s\n", hostaddr, hostport,
               strerror(errno));
-      goto cleanup;
+      goto fail;
     }
   }
 
   /* Allow multiple processes to share this port, if it's available
-   * in this operating-ssytem */
+   * in this operating-ssytem. This is also what allows our threads to
+   * each have their own listening socket on the same port. */
 #if defined(SO_REUSEPORT)
   {
     int yes = 1;
@@ -220,7 +511,7 @@ int main(int argc, char *argv[]) {
     if (err) {
       fprintf(stderr, "[-] SO_REUSEPORT([%s]:%s): %s\n", hostaddr, hostport,
               strerror(errno));
-      goto cleanup;
+      goto fail;
     }
   }
 #endif
@@ -231,142 +522,459 @@ int main(int argc, char *argv[]) {
   if (err) {
     fprintf(stderr, "[-] bind([%s]:%s): %s\n", hostaddr, hostport,
             strerror(errno));
-    goto cleanup;
+    goto fail;
   }
 
-  /* Configure the socket for listening (i.e. accept incoming connections)
-   */
-  err = listen(fd, 10);
+  /* Configure the socket for listening (i.e. accept incoming connections),
+   * with room for this many connections waiting to be accepted */
+  err = listen(fd, backlog);
   if (err) {
     fprintf(stderr, "[-] listen([%s]:%s): %s\n", hostaddr, hostport,
             strerror(errno));
-    goto cleanup;
-  } else
-    fprintf(stderr, "[+] listening on [%s]:%s\n", hostaddr, hostport);
+    goto fail;
+  }
+
+  /* The edge-triggered backends need a non-blocking socket */
+  set_nonblocking(fd);
+  return fd;
 
-  /* create an instance of our polling object */
-  poller = poller_create(fd);
-  fd = -1;
+fail:
+  close(fd);
+  return -1;
+}
+
+/**
+ * By default, the kernel picks which SO_REUSEPORT socket gets a new
+ * connection with a hash of the addresses and ports. We can instead
+ * attach a tiny BPF program that picks the socket for the CPU that
+ * received the packet. Since thread N is pinned to CPU N, the connection
+ * is then handled on the same CPU that processed its packets.
+ */
+static int attach_cpu_steering(int fd, unsigned shard_count) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+  struct sock_filter code[] = {
+      /* A = the current CPU number */
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+      /* A = A % shard_count */
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, shard_count},
+      /* return A, the index of the socket within the group */
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)) == -1) {
+    fprintf(stderr, "[-] SO_ATTACH_REUSEPORT_CBPF: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+#else
+  (void)fd;
+  (void)shard_count;
+  fprintf(stderr, "[-] SO_ATTACH_REUSEPORT_CBPF: not supported\n");
+  return -1;
+#endif
+}
+
+/**
+ * The main loop for one thread, handling its own connections.
+ */
+static void *shard_run(void *v) {
+  struct shard_t *shard = (struct shard_t *)v;
+  struct poller_t *poller;
+  struct logring_t *log;
+  int fd = -1;
+  int err;
+
+  /* Pin ourselves to a CPU, so that the thread doesn't migrate away from
+   * the cache holding its connection data */
+#if defined(__linux__)
+  if (shard->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err)
+      fprintf(stderr, "[-] thread #%u: pthread_setaffinity_np(): %s\n",
+              shard->index, strerror(err));
+  }
+#endif
+
+  /* create an instance of our polling object, with our own ring buffer
+   * for logging */
+  log = logger_ring(shard->logger, LOG_RING_SIZE);
+  if (log == NULL) {
+    fprintf(stderr, "[-] thread #%u: logger_ring(): %s\n", shard->index,
+            strerror(errno));
+    close(shard->fd);
+    shard->is_failed = 1;
+    return NULL;
+  }
+  poller = poller_create(shard->fd, shard->backend, log);
+  if (poller == NULL) {
+    fprintf(stderr, "[-] thread #%u: failed, won't accept connections\n",
+            shard->index);
+    close(shard->fd);
+    shard->is_failed = 1;
+    return NULL;
+  }
+  fprintf(stderr, "[+] thread #%u: using backend: %s\n", shard->index,
+          events_name(poller->events));
 
   /* dispatch loop */
   while (poller->count) {
+    struct events_ready_t ready[MAX_EVENTS];
     int timeout = 100; /* 100 milliseconds */
-    size_t i;
-
-    /* wait for incoming event on any connection */
-    err = poll(poller->list, poller->count, timeout);
-    if (err == -1) {
+    int count;
+    int k;
+
+    /* wait for incoming event on any connection. Unlike `poll()`, we
+     * get back only the connections that are ready */
+    count = events_wait(poller->events, ready, MAX_EVENTS, timeout);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
       /* fatal program error, shouldn't be possible */
-      fprintf(stderr, "[-] poll(): %s\n", strerror(errno));
+      fprintf(stderr, "[-] events_wait(): %s\n", strerror(errno));
       break;
-    } else if (err == 0) {
+    } else if (count == 0) {
       /* timeout happened, nothing was recevied */
+      poller_resume_accept(poller);
       continue;
     }
 
-    /* accept incoming connections, if any */
-    if (poller->list[0].revents) {
-      struct sockaddr_in6 sa;
-      socklen_t sa_addrlen = sizeof(sa);
-
-      /* accept a new connection */
-      fd = accept(poller->list[0].fd, (struct sockaddr *)&sa, &sa_addrlen);
-      if (fd == -1) {
-        fprintf(stderr, "[-] accept([%s]:%s): %s\n", hostaddr, hostport,
-                strerror(errno));
-        switch (errno) {
-        case EMFILE:
-          fprintf(stderr, "[-] files=%d, use 'ulimit -n <n>' to raise\n",
-                  (int)poller->count);
+    /* handle only the connections that have events */
+    for (k = 0; k < count; k++) {
+      struct connection_t *c = (struct connection_t *)ready[k].id;
+      unsigned revents = ready[k].revents;
+
+      if (c == poller->server) {
+        /* Accept all the incoming connections waiting in the backlog,
+         * rather than one per wakeup, so that in a storm we keep up with
+         * the kernel. The backlog limits how many there can be. */
+        for (;;) {
+          struct sockaddr_in6 sa;
+          socklen_t sa_addrlen = sizeof(sa);
+
+          fd = accept_nonblocking(c->fd, (struct sockaddr *)&sa, &sa_addrlen);
+          if (fd != -1) {
+            /* add the new connection to the poller */
+            poller_add(poller, fd, &sa, sa_addrlen);
+            fd = -1;
+            continue;
+          }
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break; /* no more waiting */
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue; /* reset before we got to it, so try the next */
+          if (errno == EMFILE || errno == ENFILE) {
+            /* The connections are still waiting, so if we re-armed the
+             * listener now, we'd be woken again straight away, and spin.
+             * Instead, stop waiting for them until we have a descriptor
+             * free. Only say so once, since this is the accept path. */
+            if (!poller->is_emfile_logged) {
+              fprintf(stderr, "[-] accept([%s]:%s): %s\n", shard->hostaddr,
+                      shard->hostport, strerror(errno));
+              fprintf(stderr, "[-] files=%d, use 'ulimit -n <n>' to raise\n",
+                      (int)poller->count);
+              poller->is_emfile_logged = 1;
+            }
+            poller->is_accept_paused = 1;
+          } else
+            fprintf(stderr, "[-] accept([%s]:%s): %s\n", shard->hostaddr,
+                    shard->hostport, strerror(errno));
           break;
         }
-        continue;
-      }
-
-      /* add the new connection to the poller */
-      poller_add(poller, fd, &sa, sa_addrlen);
-    }
-
-    /* handle all the TCP connections */
-    for (i = 1; i < poller->count; i++) {
-      struct connection_t *c = &poller->connections[i];
-      if (poller->list[i].revents == 0) {
-        /* no events for this socket */
-        continue;
-      } else if ((poller->list[i].revents & POLLHUP) != 0) {
+        if (!poller->is_accept_paused)
+          poller_set_events(poller, c, POLLIN);
+      } else if ((revents & POLLHUP) != 0) {
         /* other side hungup (i.e. sent FIN, closed socket) */
-        fprintf(stderr, "[+] close([%s]:%s): connection closed gracefully\n",
-                c->peeraddr, c->peerport);
-        poller_remove_at(poller, i--);
-      } else if ((poller->list[i].revents & POLLERR) != 0) {
+        LOG_PEER("[+] close(%s): connection closed gracefully\n", c, 0);
+        poller_remove(poller, c);
+      } else if ((revents & POLLERR) != 0) {
         /* error, probably RST sent by other side, but to be sure,
          * get the error associated with the socket */
         int opt;
         socklen_t opt_len = sizeof(opt);
-        err = getsockopt(poller->list[i].fd, SOL_SOCKET, SO_ERROR, &opt,
-                         &opt_len);
+        err = getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &opt, &opt_len);
         if (err) {
           /* should never happen*/
-          fprintf(stderr, "[-] getsockopt([%s]:%s): %s\n", c->peeraddr,
-                  c->peerport, strerror(errno));
+          LOG_PEER("[-] getsockopt(%s): %s\n", c, errno);
         } else {
-          fprintf(stderr, "[-] recv([%s]:%s): %s\n", c->peeraddr, c->peerport,
-                  strerror(opt));
+          LOG_PEER("[-] recv(%s): %s\n", c, opt);
         }
-        poller_remove_at(poller, i--);
-      } else if ((poller->list[i].revents & POLLIN) != 0) {
-        /* Data is ready to receive */
-        c->len = recv(poller->list[i].fd, c->buf, sizeof(c->buf), 0);
-        if (c->len == 0) {
+        poller_remove(poller, c);
+      } else if ((revents & POLLIN) != 0) {
+        /* Data is ready to receive. We receive it into a buffer on the
+         * stack, and echo it back right away, so a connection only
+         * needs a buffer of its own if it can't all be sent */
+        char buf[BUFFER_SIZE];
+        ptrdiff_t len;
+        ptrdiff_t bytes_sent;
+
+        len = recv(c->fd, buf, sizeof(buf), 0);
+        if (len == 0) {
           /* Shouldn't be possible, should've got POLLHUP instead */
-          fprintf(stderr, "[-] RECV([%s]:%s): %s\n", c->peeraddr, c->peerport,
-                  "CONNECTION CLOSED");
-          poller_remove_at(poller, i--);
-        } else if (c->len < 0) {
-          fprintf(stderr, "[-] RECV([%s]:%s): %s\n", c->peeraddr, c->peerport,
-                  strerror(errno));
-          poller_remove_at(poller, i--);
+          LOG_PEER("[-] RECV(%s): CONNECTION CLOSED\n", c, 0);
+          poller_remove(poller, c);
+          continue;
+        } else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          /* spurious wakeup, so wait again */
+          poller_set_events(poller, c, POLLIN);
+          continue;
+        } else if (len < 0) {
+          LOG_PEER("[-] RECV(%s): %s\n", c, errno);
+          poller_remove(poller, c);
+          continue;
+        }
+
+        bytes_sent = send(c->fd, buf, len, 0);
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          bytes_sent = 0;
+        } else if (bytes_sent < 0) {
+          /* might've reset connection between recv() and send() */
+          LOG_PEER("[-] SEND(%s): %s\n", c, errno);
+          poller_remove(poller, c);
+          continue;
+        }
+
+        if (bytes_sent < len) {
+          /* keep the rest until we can send it */
+          c->buf = buffer_alloc(poller);
+          if (c->buf == NULL) {
+            poller_remove(poller, c);
+            continue;
+          }
+          memcpy(c->buf->data, buf + bytes_sent, len - bytes_sent);
+          c->buf->len = len - bytes_sent;
+          poller_set_events(poller, c, POLLOUT);
         } else {
-          /* change poll() entry to transmit instead of receive */
-          poller->list[i].events = POLLOUT;
+          /* all the bytes have been sent, so go back to reading */
+          poller_set_events(poller, c, POLLIN);
         }
-      } else if ((poller->list[i].revents & POLLOUT) != 0) {
-        /* We are ready to transmit data */
+      } else if ((revents & POLLOUT) != 0) {
+        /* We are ready to transmit the data we couldn't before */
+        struct buffer_t *buf = c->buf;
         ptrdiff_t bytes_sent;
-        bytes_sent = send(poller->list[i].fd, c->buf, c->len, 0);
-        if (bytes_sent < 0) {
+        bytes_sent = send(c->fd, buf->data, buf->len, 0);
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          poller_set_events(poller, c, POLLOUT);
+        } else if (bytes_sent < 0) {
           /* might've reset connection between poll() and send() */
-          fprintf(stderr, "[-] SEND([%s]:%s): %s\n", c->peeraddr, c->peerport,
-                  strerror(errno));
-          poller_remove_at(poller, i);
-        } else if (bytes_sent < c->len) {
+          LOG_PEER("[-] SEND(%s): %s\n", c, errno);
+          poller_remove(poller, c);
+        } else if (bytes_sent < buf->len) {
           /* hit the send() incomplete issue */
-          fprintf(stderr, "[+] SEND([%s]:%s): %s\n", c->peeraddr, c->peerport,
-                  "out of buffer");
-          memmove(c->buf, c->buf + bytes_sent, c->len - bytes_sent);
-          c->len -= bytes_sent;
-          poller->list[i].events = POLLOUT;
+          LOG_PEER("[+] SEND(%s): out of buffer\n", c, 0);
+          memmove(buf->data, buf->data + bytes_sent, buf->len - bytes_sent);
+          buf->len -= bytes_sent;
+          poller_set_events(poller, c, POLLOUT);
         } else {
-          /* all the bytes have been sent, so go back to reading */
-          poller->list[i].events = POLLIN;
+          /* all the bytes have been sent, so give back the buffer, and
+           * go back to reading */
+          buffer_free(poller, buf);
+          c->buf = NULL;
+          poller_set_events(poller, c, POLLIN);
         }
       } else {
-        fprintf(stderr, "[-] poll([%s]:%s): unknown event[%d] 0x%x\n",
-                c->peeraddr, c->peerport, (int)i, poller->list[i].revents);
-        poller_remove_at(poller, i--);
+        char name[96];
+        fprintf(stderr, "[-] poll(%s): unknown event 0x%x\n",
+                connection_name(c, name, sizeof(name)), revents);
+        poller_remove(poller, c);
         exit(1);
       }
     } /* end handling connections */
-  }   /* end dispatch loop */
+  } /* end dispatch loop */
+
+  poller_destroy(poller);
+  return NULL;
+}
+
+/**
+ * The biggest listen backlog the kernel allows. Asking `listen()` for more
+ * isn't an error, it just gets silently reduced to this.
+ */
+static int get_somaxconn(void) {
+  int result = SOMAXCONN;
+#if defined(__linux__)
+  FILE *fp = fopen("/proc/sys/net/core/somaxconn", "r");
+  if (fp) {
+    if (fscanf(fp, "%d", &result) != 1 || result < 1)
+      result = SOMAXCONN;
+    fclose(fp);
+  }
+#endif
+  return result;
+}
+
+static void print_usage_and_exit(void) {
+  fprintf(stderr, "[-] usage: tcp-srv-poll <port> [address] "
+                  "[--backend <poll|epoll|uring>] [--threads <n>] "
+                  "[--cbpf] [--backlog <n>]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct addrinfo *ai = NULL;
+  struct addrinfo hints = {0};
+  int err;
+  char hostaddr[NI_MAXHOST];
+  char hostport[NI_MAXSERV];
+  const char *portname = NULL;
+  const char *addrname = NULL;
+  enum events_backend_t backend = EVENTS_DEFAULT;
+  struct shard_t *shards = NULL;
+  struct logger_t *logger = NULL;
+  unsigned shard_count = 1;
+  unsigned cpu_count = 1;
+  int is_cbpf = 0;
+  int backlog = 0;
+  int somaxconn;
+  int result = 1;
+  int i;
+  unsigned j;
+
+  /* Ignore the send() problem */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+      backend = events_backend_from_name(argv[++i]);
+      if (backend == EVENTS_DEFAULT) {
+        fprintf(stderr, "[-] unknown backend: %s\n", argv[i]);
+        print_usage_and_exit();
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      long n = strtol(argv[++i], 0, 0);
+      if (n < 1 || 1024 < n) {
+        fprintf(stderr, "[-] invalid thread count: %s\n", argv[i]);
+        print_usage_and_exit();
+      }
+      shard_count = (unsigned)n;
+    } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+      long n = strtol(argv[++i], 0, 0);
+      if (n < 1 || 0x7fffffff < n) {
+        fprintf(stderr, "[-] invalid backlog: %s\n", argv[i]);
+        print_usage_and_exit();
+      }
+      backlog = (int)n;
+    } else if (strcmp(argv[i], "--cbpf") == 0) {
+      is_cbpf = 1;
+    } else if (argv[i][0] == '-') {
+      print_usage_and_exit();
+    } else if (portname == NULL) {
+      portname = argv[i];
+    } else if (addrname == NULL) {
+      addrname = argv[i];
+    } else {
+      print_usage_and_exit();
+    }
+  }
+  if (portname == NULL)
+    print_usage_and_exit();
+
+  /* The backlog can't be more than the kernel allows, and by default,
+   * is all of it */
+  somaxconn = get_somaxconn();
+  if (backlog == 0) {
+    backlog = somaxconn;
+  } else if (backlog > somaxconn) {
+    fprintf(stderr, "[-] backlog %d is more than somaxconn, so using %d\n",
+            backlog, somaxconn);
+    backlog = somaxconn;
+  }
+
+  /* Get an address structure for the port */
+  hints.ai_flags = AI_PASSIVE;
+  err = getaddrinfo(addrname, /* local address*/
+                    portname, /* local port number */
+                    &hints,   /* hints */
+                    &ai);     /* result */
+  if (err) {
+    fprintf(stderr, "[-] getaddrinfo(): %s\n", gai_strerror(err));
+    return -1;
+  }
+
+  /* ..and retrieve back again which addresses were assigned. Normally,
+   * this will be [::] meaning we are accepting incoming connections
+   * on all our IP addresses, even IPv4 addresses */
+  err =
+      getnameinfo(ai->ai_addr, ai->ai_addrlen, hostaddr, sizeof(hostaddr),
+                  hostport, sizeof(hostport), NI_NUMERICHOST | NI_NUMERICSERV);
+  if (err) {
+    fprintf(stderr, "[-] getnameinfo(): %s\n", gai_strerror(err));
+    goto cleanup;
+  }
+
+  /* Create all the listening sockets up front, in order, because with
+   * the BPF steering program, the kernel picks sockets by their order
+   * within the SO_REUSEPORT group */
+#if defined(_SC_NPROCESSORS_ONLN)
+  if (sysconf(_SC_NPROCESSORS_ONLN) > 0)
+    cpu_count = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  logger = logger_create(stderr, 1);
+  if (logger == NULL) {
+    fprintf(stderr, "[-] logger_create(): %s\n", strerror(errno));
+    goto cleanup;
+  }
+  shards = calloc(shard_count, sizeof(*shards));
+  if (shards == NULL) {
+    fprintf(stderr, "[-] calloc(): %s\n", strerror(errno));
+    goto cleanup;
+  }
+  for (j = 0; j < shard_count; j++) {
+    shards[j].index = j;
+    shards[j].backend = backend;
+    shards[j].logger = logger;
+    shards[j].hostaddr = hostaddr;
+    shards[j].hostport = hostport;
+    shards[j].cpu = (shard_count > 1) ? (int)(j % cpu_count) : -1;
+    shards[j].fd = create_listener(ai, hostaddr, hostport, backlog);
+    if (shards[j].fd == -1)
+      goto cleanup;
+  }
+  fprintf(stderr, "[+] listening on [%s]:%s, backlog %d\n", hostaddr,
+          hostport, backlog);
+  if (is_cbpf && attach_cpu_steering(shards[0].fd, shard_count) == 0)
+    fprintf(stderr, "[+] steering connections by CPU\n");
+
+  /* With one thread, just run the loop ourselves. Otherwise, spawn a
+   * thread for each shard, and wait for them */
+  if (shard_count == 1) {
+    shard_run(&shards[0]);
+  } else {
+    for (j = 0; j < shard_count; j++) {
+      err = pthread_create(&shards[j].thread, 0, shard_run, &shards[j]);
+      if (err) {
+        fprintf(stderr, "[-] pthread_create(): %s\n", strerror(err));
+        exit(1);
+      }
+    }
+    for (j = 0; j < shard_count; j++)
+      pthread_join(shards[j].thread, 0);
+  }
+
+  /* It's only a failure if none of the shards could start */
+  result = 1;
+  for (j = 0; j < shard_count; j++) {
+    if (!shards[j].is_failed)
+      result = 0;
+  }
+  shard_count = 0; /* the threads closed their own sockets */
 
 cleanup:
   /* Cleans up and exits. In practice, we'll never reach this because
    * the code loops indefinitely until the user hits <ctrl-c> */
-  if (fd > 0)
-    close(fd);
+  if (shards) {
+    for (j = 0; j < shard_count; j++) {
+      if (shards[j].fd > 0)
+        close(shards[j].fd);
+    }
+    free(shards);
+  }
   if (ai)
     freeaddrinfo(ai);
-  if (poller)
-    poller_destroy(poller);
-  return 0;
+  logger_destroy(logger);
+  return result;
 }
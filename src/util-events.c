@@ -0,0 +1,856 @@
+/*
+    Readiness notification using poll(), epoll(), or io_uring.
+
+    See the header file for the overview. Briefly, all three backends
+    share a table indexed by file descriptor that remembers the caller's
+    'id' and desired events for that descriptor. The `poll()` backend
+    additionally keeps a dense array of `struct pollfd` that it must scan
+    after every call. The other two backends only touch descriptors that
+    the kernel reports as ready.
+*/
+#include "util-events.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#define EVENTS_HAVE_IOURING 1
+#endif
+#endif
+
+/**
+ * Information we track for every descriptor, regardless of the backend.
+ * The table is indexed by the descriptor number, which the kernel keeps
+ * small and dense, so there's no need for a hash table.
+ */
+struct fdinfo_t {
+    size_t id;
+    unsigned events;
+
+    /** For `poll()`, the index into the `pollfd` array */
+    size_t slot;
+
+    /** For `io_uring`, incremented every time a request is cancelled so
+     * that we can recognize stale completions */
+    unsigned gen;
+
+    unsigned is_used : 1;
+    unsigned is_armed : 1;
+};
+
+#if defined(EVENTS_HAVE_IOURING)
+/**
+ * The pointers into the memory we share with the kernel for the
+ * submission and completion rings.
+ */
+struct uring_t {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/** The `user_data` of requests whose completions we don't care about */
+#define URING_IGNORE (~(unsigned long long)0)
+#endif
+
+struct events_t {
+    enum events_backend_t backend;
+
+    /** Per-descriptor information, indexed by descriptor */
+    struct fdinfo_t *fds;
+    size_t fds_max;
+
+    /** poll(): the dense array we hand to the kernel */
+    struct pollfd *list;
+    size_t count;
+    size_t max;
+
+#if defined(__linux__)
+    /** epoll(): the kernel object, and buffer for results */
+    int epfd;
+    struct epoll_event *epoll_list;
+    size_t epoll_max;
+#endif
+
+#if defined(EVENTS_HAVE_IOURING)
+    struct uring_t uring;
+#endif
+};
+
+/****************************************************************************
+ * Make sure our table indexed by descriptor is big enough. This grows
+ * geometrically, so a burst of new connections doesn't cause us to
+ * reallocate the table on every one.
+ ****************************************************************************/
+static int
+_fds_reserve(struct events_t *ev, int fd)
+{
+    size_t new_max;
+    struct fdinfo_t *new_fds;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if ((size_t)fd < ev->fds_max)
+        return 0;
+
+    new_max = ev->fds_max ? ev->fds_max : 64;
+    while (new_max <= (size_t)fd)
+        new_max *= 2;
+    new_fds = realloc(ev->fds, new_max * sizeof(*new_fds));
+    if (new_fds == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(new_fds + ev->fds_max, 0,
+        (new_max - ev->fds_max) * sizeof(*new_fds));
+    ev->fds = new_fds;
+    ev->fds_max = new_max;
+    return 0;
+}
+
+static struct fdinfo_t *
+_fds_lookup(struct events_t *ev, int fd)
+{
+    if (fd < 0 || (size_t)fd >= ev->fds_max || !ev->fds[fd].is_used) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return &ev->fds[fd];
+}
+
+/****************************************************************************
+ * poll() backend
+ ****************************************************************************/
+static int
+_poll_add(struct events_t *ev, int fd, struct fdinfo_t *info)
+{
+    if (ev->count >= ev->max) {
+        size_t new_max = ev->max ? ev->max * 2 : 64;
+        struct pollfd *new_list;
+
+        new_list = realloc(ev->list, new_max * sizeof(*new_list));
+        if (new_list == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ev->list = new_list;
+        ev->max = new_max;
+    }
+    info->slot = ev->count++;
+    ev->list[info->slot].fd = fd;
+    ev->list[info->slot].events = (short)info->events;
+    ev->list[info->slot].revents = 0;
+    return 0;
+}
+
+static void
+_poll_modify(struct events_t *ev, int fd, struct fdinfo_t *info)
+{
+    ev->list[info->slot].fd = fd;
+    ev->list[info->slot].events = (short)info->events;
+    ev->list[info->slot].revents = 0;
+}
+
+static void
+_poll_remove(struct events_t *ev, struct fdinfo_t *info)
+{
+    size_t end = ev->count - 1;
+
+    /* Keep the array dense by moving the last entry into the hole */
+    if (info->slot != end) {
+        struct pollfd *moved = &ev->list[end];
+        int moved_fd = (moved->fd < 0) ? ~moved->fd : moved->fd;
+
+        ev->list[info->slot] = *moved;
+        ev->fds[moved_fd].slot = info->slot;
+    }
+    ev->count--;
+}
+
+static int
+_poll_wait(struct events_t *ev, struct events_ready_t *ready, size_t max,
+    int milliseconds)
+{
+    int err;
+    size_t i;
+    size_t n = 0;
+
+    err = poll(ev->list, ev->count, milliseconds);
+    if (err <= 0)
+        return err;
+
+    /* This is the O(n) scan that the other backends avoid */
+    for (i = 0; i < ev->count && n < max; i++) {
+        struct pollfd *p = &ev->list[i];
+
+        if (p->revents == 0)
+            continue;
+
+        ready[n].fd = p->fd;
+        ready[n].id = ev->fds[p->fd].id;
+        ready[n].revents = p->revents;
+        n++;
+
+        /* Disarm by making the descriptor negative, which tells
+         * `poll()` to ignore this entry until it's re-armed */
+        p->fd = ~p->fd;
+        p->revents = 0;
+    }
+    return (int)n;
+}
+
+/****************************************************************************
+ * epoll() backend
+ ****************************************************************************/
+#if defined(__linux__)
+static int
+_epoll_ctl(struct events_t *ev, int op, int fd, unsigned events)
+{
+    struct epoll_event e;
+
+    /* Edge-triggered alone would report a new edge, such as more data
+     * arriving, without being re-armed, so it's one-shot as well */
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLET | EPOLLONESHOT;
+    if (events & POLLIN)
+        e.events |= EPOLLIN;
+    if (events & POLLOUT)
+        e.events |= EPOLLOUT;
+    e.data.fd = fd;
+    return epoll_ctl(ev->epfd, op, fd, &e);
+}
+
+static int
+_epoll_wait(struct events_t *ev, struct events_ready_t *ready, size_t max,
+    int milliseconds)
+{
+    int count;
+    int i;
+
+    if (max > ev->epoll_max) {
+        struct epoll_event *new_list;
+
+        new_list = realloc(ev->epoll_list, max * sizeof(*new_list));
+        if (new_list == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ev->epoll_list = new_list;
+        ev->epoll_max = max;
+    }
+
+    count = epoll_wait(ev->epfd, ev->epoll_list, (int)max, milliseconds);
+    for (i = 0; i < count; i++) {
+        const struct epoll_event *e = &ev->epoll_list[i];
+        unsigned revents = 0;
+
+        if (e->events & EPOLLIN)
+            revents |= POLLIN;
+        if (e->events & EPOLLOUT)
+            revents |= POLLOUT;
+        if (e->events & EPOLLERR)
+            revents |= POLLERR;
+        if (e->events & EPOLLHUP)
+            revents |= POLLHUP;
+
+        ready[i].fd = e->data.fd;
+        ready[i].id = ev->fds[e->data.fd].id;
+        ready[i].revents = revents;
+    }
+    return count;
+}
+#endif
+
+/****************************************************************************
+ * io_uring backend
+ *
+ * We don't link with `liburing`, but instead talk to the kernel directly,
+ * which is only a few dozen lines of code. Each armed descriptor has one
+ * outstanding IORING_OP_POLL_ADD request. These are "one-shot" requests,
+ * meaning that after a completion, the descriptor is disarmed until the
+ * next `events_modify()` submits a new request.
+ ****************************************************************************/
+#if defined(EVENTS_HAVE_IOURING)
+static int
+_uring_setup(struct uring_t *u)
+{
+    struct io_uring_params p;
+    void *ptr;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 16384;
+    u->fd = (int)syscall(__NR_io_uring_setup, 1024, &p);
+    if (u->fd == -1)
+        return -1;
+
+    /* We need the ability to pass a timeout to io_uring_enter(), which
+     * was added in Linux 5.11 */
+    if ((p.features & IORING_FEAT_EXT_ARG) == 0) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Map the rings into our memory */
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(*u->cqes);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = 0;
+    }
+    ptr = mmap(0, u->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+        goto fail;
+    u->sq_ring = ptr;
+    if (u->cq_ring_size) {
+        ptr = mmap(0, u->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED)
+            goto fail;
+    }
+    u->cq_ring = ptr;
+    u->sqes_size = p.sq_entries * sizeof(*u->sqes);
+    ptr = mmap(0, u->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+        goto fail;
+    u->sqes = ptr;
+
+    u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    return 0;
+
+fail:
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->cq_ring_size && u->cq_ring && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_size);
+    close(u->fd);
+    return -1;
+}
+
+static void
+_uring_cleanup(struct uring_t *u)
+{
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring_size)
+        munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+static int
+_uring_enter(struct uring_t *u, unsigned min_complete, int milliseconds)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+
+    to_submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (milliseconds >= 0) {
+            ts.tv_sec = milliseconds / 1000;
+            ts.tv_nsec = (milliseconds % 1000) * 1000000LL;
+            arg.ts = (unsigned long long)(size_t)&ts;
+        }
+    }
+    return (int)syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+        flags, &arg, sizeof(arg));
+}
+
+/**
+ * Get the next free submission entry, flushing the queue to the
+ * kernel if it's full.
+ */
+static struct io_uring_sqe *
+_uring_get_sqe(struct uring_t *u)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)
+        >= u->sq_entries) {
+        if (_uring_enter(u, 0, 0) == -1 && errno != EINTR)
+            return NULL;
+    }
+
+    index = tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+static void
+_uring_commit_sqe(struct uring_t *u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+_uring_poll_add(struct events_t *ev, int fd, struct fdinfo_t *info)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(&ev->uring);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = info->events | POLLERR | POLLHUP;
+    sqe->user_data = ((unsigned long long)info->gen << 32) | (unsigned)fd;
+    _uring_commit_sqe(&ev->uring);
+    info->is_armed = 1;
+    return 0;
+}
+
+/**
+ * Cancel an outstanding poll request. Its completion (if any) will have
+ * the old generation number, which we'll then ignore.
+ */
+static int
+_uring_poll_cancel(struct events_t *ev, int fd, struct fdinfo_t *info)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!info->is_armed) {
+        info->gen++;
+        return 0;
+    }
+    sqe = _uring_get_sqe(&ev->uring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((unsigned long long)info->gen << 32) | (unsigned)fd;
+    sqe->user_data = URING_IGNORE;
+    _uring_commit_sqe(&ev->uring);
+    info->is_armed = 0;
+    info->gen++;
+    return 0;
+}
+
+static int
+_uring_wait(struct events_t *ev, struct events_ready_t *ready, size_t max,
+    int milliseconds)
+{
+    struct uring_t *u = &ev->uring;
+    unsigned head;
+    unsigned tail;
+    size_t n = 0;
+    int err;
+
+    /* Submit any queued requests, and wait for at least one completion
+     * if there are none already waiting */
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    err = _uring_enter(u, (tail == *u->cq_head && milliseconds) ? 1 : 0,
+        milliseconds);
+    if (err == -1 && errno != ETIME && errno != EINTR)
+        return -1;
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n < max; head++) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        int fd = (int)(cqe->user_data & 0xFFFFFFFF);
+        unsigned gen = (unsigned)(cqe->user_data >> 32);
+        struct fdinfo_t *info;
+
+        if (cqe->user_data == URING_IGNORE || cqe->res == -ECANCELED)
+            continue;
+        if (fd < 0 || (size_t)fd >= ev->fds_max)
+            continue;
+        info = &ev->fds[fd];
+        if (!info->is_used || info->gen != gen)
+            continue; /* stale completion for a cancelled request */
+
+        info->is_armed = 0;
+        ready[n].fd = fd;
+        ready[n].id = info->id;
+        ready[n].revents = (cqe->res < 0) ? POLLERR : (unsigned)cqe->res;
+        n++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return (int)n;
+}
+#endif
+
+/****************************************************************************
+ ****************************************************************************/
+struct events_t *
+events_create(enum events_backend_t backend)
+{
+    struct events_t *ev;
+
+    if (backend == EVENTS_DEFAULT) {
+#if defined(__linux__)
+        backend = EVENTS_EPOLL;
+#else
+        backend = EVENTS_POLL;
+#endif
+    }
+
+    ev = calloc(1, sizeof(*ev));
+    if (ev == NULL)
+        return NULL;
+    ev->backend = backend;
+
+    switch (backend) {
+    case EVENTS_POLL:
+        return ev;
+#if defined(__linux__)
+    case EVENTS_EPOLL:
+        ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (ev->epfd == -1)
+            break;
+        return ev;
+#endif
+#if defined(EVENTS_HAVE_IOURING)
+    case EVENTS_IOURING:
+        if (_uring_setup(&ev->uring) == -1)
+            break;
+        return ev;
+#endif
+    default:
+        errno = ENOSYS;
+        break;
+    }
+
+    free(ev);
+    return NULL;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+enum events_backend_t
+events_backend_from_name(const char *name)
+{
+    if (strcmp(name, "poll") == 0)
+        return EVENTS_POLL;
+    if (strcmp(name, "epoll") == 0)
+        return EVENTS_EPOLL;
+    if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+        return EVENTS_IOURING;
+    return EVENTS_DEFAULT;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+const char *
+events_name(const struct events_t *ev)
+{
+    switch (ev->backend) {
+    case EVENTS_POLL:
+        return "poll";
+    case EVENTS_EPOLL:
+        return "epoll";
+    case EVENTS_IOURING:
+        return "io_uring";
+    default:
+        return "unknown";
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+events_add(struct events_t *ev, int fd, unsigned events, size_t id)
+{
+    struct fdinfo_t *info;
+    int err = -1;
+
+    if (_fds_reserve(ev, fd) == -1)
+        return -1;
+    info = &ev->fds[fd];
+    if (info->is_used) {
+        errno = EEXIST;
+        return -1;
+    }
+    info->id = id;
+    info->events = events;
+    info->is_armed = 0;
+
+    switch (ev->backend) {
+    case EVENTS_POLL:
+        err = _poll_add(ev, fd, info);
+        break;
+#if defined(__linux__)
+    case EVENTS_EPOLL:
+        err = _epoll_ctl(ev, EPOLL_CTL_ADD, fd, events);
+        break;
+#endif
+#if defined(EVENTS_HAVE_IOURING)
+    case EVENTS_IOURING:
+        info->gen++;
+        err = _uring_poll_add(ev, fd, info);
+        break;
+#endif
+    default:
+        errno = ENOSYS;
+        break;
+    }
+
+    if (err == 0)
+        info->is_used = 1;
+    return err;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+events_modify(struct events_t *ev, int fd, unsigned events, size_t id)
+{
+    struct fdinfo_t *info = _fds_lookup(ev, fd);
+
+    if (info == NULL)
+        return -1;
+    info->id = id;
+    info->events = events;
+
+    switch (ev->backend) {
+    case EVENTS_POLL:
+        _poll_modify(ev, fd, info);
+        return 0;
+#if defined(__linux__)
+    case EVENTS_EPOLL:
+        /* Even when the events are unchanged, this re-arms the
+         * one-shot trigger, reporting the descriptor again if it's
+         * still ready */
+        return _epoll_ctl(ev, EPOLL_CTL_MOD, fd, events);
+#endif
+#if defined(EVENTS_HAVE_IOURING)
+    case EVENTS_IOURING:
+        if (_uring_poll_cancel(ev, fd, info) == -1)
+            return -1;
+        return _uring_poll_add(ev, fd, info);
+#endif
+    default:
+        errno = ENOSYS;
+        return -1;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+events_remove(struct events_t *ev, int fd)
+{
+    struct fdinfo_t *info = _fds_lookup(ev, fd);
+    int err = 0;
+
+    if (info == NULL)
+        return -1;
+
+    switch (ev->backend) {
+    case EVENTS_POLL:
+        _poll_remove(ev, info);
+        break;
+#if defined(__linux__)
+    case EVENTS_EPOLL:
+        err = epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, 0);
+        break;
+#endif
+#if defined(EVENTS_HAVE_IOURING)
+    case EVENTS_IOURING:
+        err = _uring_poll_cancel(ev, fd, info);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    info->is_used = 0;
+    return err;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+events_wait(struct events_t *ev, struct events_ready_t *ready, size_t max,
+    int milliseconds)
+{
+    switch (ev->backend) {
+    case EVENTS_POLL:
+        return _poll_wait(ev, ready, max, milliseconds);
+#if defined(__linux__)
+    case EVENTS_EPOLL:
+        return _epoll_wait(ev, ready, max, milliseconds);
+#endif
+#if defined(EVENTS_HAVE_IOURING)
+    case EVENTS_IOURING:
+        return _uring_wait(ev, ready, max, milliseconds);
+#endif
+    default:
+        errno = ENOSYS;
+        return -1;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+events_destroy(struct events_t *ev)
+{
+    if (ev == NULL)
+        return;
+    switch (ev->backend) {
+#if defined(__linux__)
+    case EVENTS_EPOLL:
+        close(ev->epfd);
+        free(ev->epoll_list);
+        break;
+#endif
+#if defined(EVENTS_HAVE_IOURING)
+    case EVENTS_IOURING:
+        _uring_cleanup(&ev->uring);
+        break;
+#endif
+    default:
+        break;
+    }
+    free(ev->list);
+    free(ev->fds);
+    free(ev);
+}
+
+/****************************************************************************
+ * Test one backend with a socketpair: data written to one end should
+ * be reported as POLLIN on the other, once, until we re-arm it.
+ ****************************************************************************/
+#include <sys/socket.h>
+static int
+_selftest_backend(enum events_backend_t backend)
+{
+    struct events_t *ev;
+    struct events_ready_t ready[4];
+    int pair[2] = {-1, -1};
+    int count;
+    int result = 1;
+
+    ev = events_create(backend);
+    if (ev == NULL)
+        return 0; /* not supported on this system, so not a failure */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+        goto cleanup;
+
+    if (events_add(ev, pair[0], POLLIN, 42) == -1)
+        goto cleanup;
+
+    /* Nothing should be ready yet */
+    if (events_wait(ev, ready, 4, 0) != 0)
+        goto cleanup;
+
+    /* Now that there's data, it should be reported with our id */
+    if (send(pair[1], "x", 1, 0) != 1)
+        goto cleanup;
+    count = events_wait(ev, ready, 4, 1000);
+    if (count != 1 || ready[0].id != 42 || ready[0].fd != pair[0]
+        || (ready[0].revents & POLLIN) == 0)
+        goto cleanup;
+
+    /* Since we haven't re-armed it, it shouldn't be reported again */
+    if (events_wait(ev, ready, 4, 0) != 0)
+        goto cleanup;
+
+    /* Not even when more data arrives, which is a new edge */
+    if (send(pair[1], "y", 1, 0) != 1)
+        goto cleanup;
+    if (events_wait(ev, ready, 4, 10) != 0)
+        goto cleanup;
+
+    /* Re-arm, and since the data is still unread, it's reported again,
+     * this time with a new id */
+    if (events_modify(ev, pair[0], POLLIN, 43) == -1)
+        goto cleanup;
+    count = events_wait(ev, ready, 4, 1000);
+    if (count != 1 || ready[0].id != 43)
+        goto cleanup;
+
+    /* Ask for transmit, which should immediately be ready */
+    if (events_modify(ev, pair[0], POLLOUT, 44) == -1)
+        goto cleanup;
+    count = events_wait(ev, ready, 4, 1000);
+    if (count != 1 || ready[0].id != 44 || (ready[0].revents & POLLOUT) == 0)
+        goto cleanup;
+
+    /* Once removed, nothing more is reported */
+    if (events_modify(ev, pair[0], POLLIN, 45) == -1)
+        goto cleanup;
+    if (events_remove(ev, pair[0]) == -1)
+        goto cleanup;
+    if (events_wait(ev, ready, 4, 0) != 0)
+        goto cleanup;
+
+    result = 0;
+cleanup:
+    if (result)
+        fprintf(stderr, "[-] events: %s: selftest failed\n", events_name(ev));
+    if (pair[0] != -1) {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    events_destroy(ev);
+    return result;
+}
+
+int
+events_selftest(void)
+{
+    int err = 0;
+
+    err |= _selftest_backend(EVENTS_POLL);
+    err |= _selftest_backend(EVENTS_EPOLL);
+    err |= _selftest_backend(EVENTS_IOURING);
+    return err;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+#ifdef EVENTSSTANDALONE
+int
+main(void)
+{
+    if (events_selftest()) {
+        fprintf(stderr, "[-] events: selftest failed\n");
+        return 1;
+    } else {
+        fprintf(stderr, "[+] events: selftest succeeded\n");
+        return 0;
+    }
+}
+#endif
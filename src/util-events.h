@@ -0,0 +1,147 @@
+/*
+    "Readiness notification for many sockets"
+
+    This module hides the differences between `poll()`, `epoll()`, and
+    `io_uring` behind one small API. The original examples in this project
+    call `poll()` directly, which means that every time a single socket
+    becomes ready, the program must scan the entire array of sockets to find
+    it. That's fine for a few hundred connections, but with tens of
+    thousands of idle connections, the scan itself becomes the bottleneck.
+    The `epoll` and `io_uring` backends report only the sockets that are
+    actually ready, so the cost of a wakeup is proportional to the number
+    of events, not the number of connections.
+
+    Readiness is reported with the same POLLIN/POLLOUT/POLLERR/POLLHUP
+    flags used by `poll()`, so code written for `poll()` can switch over
+    with few changes.
+
+    Events are "one-shot": once an event has been reported for a socket,
+    it may not be reported again until the caller re-arms the socket by
+    calling `events_modify()`. This matches how the echo examples already
+    work, toggling between POLLIN and POLLOUT after each `recv()` and
+    `send()`. The `epoll` backend is edge-triggered and one-shot
+    (EPOLLET|EPOLLONESHOT), so sockets must be set to non-blocking mode.
+*/
+#ifndef UTIL_EVENTS_H
+#define UTIL_EVENTS_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdio.h>
+#include <poll.h>
+
+enum events_backend_t {
+    /** Pick the fastest backend available on this system */
+    EVENTS_DEFAULT = 0,
+
+    /** The portable `poll()` backend, which scans all descriptors */
+    EVENTS_POLL,
+
+    /** Linux edge-triggered `epoll()` */
+    EVENTS_EPOLL,
+
+    /** Linux `io_uring` with IORING_OP_POLL_ADD requests */
+    EVENTS_IOURING,
+};
+
+/**
+ * One of these is filled in by `events_wait()` for every descriptor that
+ * is ready.
+ */
+struct events_ready_t {
+    /** The caller's identifier given to `events_add()`. This is declared
+     * as `size_t` so that it can hold either an index or a pointer. */
+    size_t id;
+
+    /** The descriptor that is ready */
+    int fd;
+
+    /** The POLLIN, POLLOUT, POLLERR, or POLLHUP flags */
+    unsigned revents;
+};
+
+/**
+ * Create an instance of the event subsystem using the desired backend.
+ * @return
+ *      NULL if the backend isn't supported on this system.
+ */
+struct events_t *
+events_create(enum events_backend_t backend);
+
+/**
+ * Convert a name ("poll", "epoll", "uring") to the backend enum, such as
+ * when parsing a command-line option.
+ * @return
+ *      EVENTS_DEFAULT if the name isn't recognized.
+ */
+enum events_backend_t
+events_backend_from_name(const char *name);
+
+/**
+ * Returns the name of the backend being used, for logging.
+ */
+const char *
+events_name(const struct events_t *events);
+
+/**
+ * Start monitoring the descriptor.
+ * @param events
+ *      POLLIN, POLLOUT, or both.
+ * @param id
+ *      The identifier reported back by `events_wait()`.
+ * @return
+ *      0 on success, or -1 on error with `errno` set.
+ */
+int
+events_add(struct events_t *ev, int fd, unsigned events, size_t id);
+
+/**
+ * Change the events we are waiting for on this descriptor, and re-arm
+ * it so that it can be reported again. The 'id' can be changed too.
+ */
+int
+events_modify(struct events_t *ev, int fd, unsigned events, size_t id);
+
+/**
+ * Stop monitoring the descriptor. This must be called before the
+ * descriptor is closed.
+ */
+int
+events_remove(struct events_t *ev, int fd);
+
+/**
+ * Wait for events. A descriptor appears at most once in the results of
+ * a single call.
+ * @param ready
+ *      An array to hold the results.
+ * @param max
+ *      The number of elements in the `ready` array.
+ * @param milliseconds
+ *      How long to wait, or -1 to wait forever.
+ * @return
+ *      The number of ready descriptors, 0 on timeout, or -1 on error
+ *      with `errno` set.
+ */
+int
+events_wait(struct events_t *ev, struct events_ready_t *ready, size_t max,
+    int milliseconds);
+
+/**
+ * Cleans up the resources. This doesn't close the descriptors that
+ * are still registered.
+ */
+void
+events_destroy(struct events_t *ev);
+
+/**
+ * A quick sanity check of the backends available on this system.
+ * @return
+ *      0 on success, non-zero on failure
+ */
+int
+events_selftest(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
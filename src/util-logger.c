@@ -0,0 +1,434 @@
+/*
+    Logging connections without formatting them
+
+    See the header file for the overview. Each ring buffer has a 'head',
+    written only by the thread that logs into it, and a 'tail', written
+    only by whoever is flushing it, so the thread logging never waits on
+    a lock. Flushing is done under a mutex, since both the background
+    thread and "logger_flush()" may do it.
+*/
+#include "util-logger.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** How long the background thread sleeps between flushes. The rings
+ * need to be big enough to hold this long's worth of messages. */
+#define FLUSH_INTERVAL_MS 10
+
+/**
+ * A message, as logged, before it's formatted. Addresses are copied in
+ * binary, up to the size of an IPv6 address, which is the biggest we
+ * expect to log.
+ */
+struct logrecord_t {
+    const char *fmt;
+    int err;
+    unsigned char count;
+    unsigned char sa_addrlen[2];
+    struct sockaddr_in6 sa[2];
+};
+
+struct logring_t {
+    struct logring_t *next;
+    unsigned mask;
+
+    /** Written only by the thread logging */
+    unsigned head;
+    unsigned long long dropped;
+
+    /** Written only while flushing, on its own cache line so that it
+     * doesn't slow down the thread logging */
+    unsigned tail __attribute__((aligned(64)));
+    unsigned long long reported;
+
+    struct logrecord_t records[];
+};
+
+struct logger_t {
+    FILE *fp;
+    pthread_mutex_t lock;
+    struct logring_t *rings;
+    int is_background;
+    int is_stopping;
+    pthread_t thread;
+
+    /** Where messages are formatted, so that many are written at once */
+    size_t buf_length;
+    char buf[65536];
+};
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+_record(struct logring_t *ring, const char *fmt, int err,
+        const struct sockaddr *sa, socklen_t sa_addrlen,
+        const struct sockaddr *sa2, socklen_t sa2_addrlen)
+{
+    struct logrecord_t *record;
+    unsigned head = ring->head;
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > ring->mask) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head & ring->mask];
+    record->fmt = fmt;
+    record->err = err;
+    record->count = (sa2 == NULL) ? 1 : 2;
+
+    if (sa_addrlen > sizeof(record->sa[0]))
+        sa_addrlen = sizeof(record->sa[0]);
+    record->sa_addrlen[0] = (unsigned char)sa_addrlen;
+    memcpy(&record->sa[0], sa, sa_addrlen);
+
+    if (sa2) {
+        if (sa2_addrlen > sizeof(record->sa[1]))
+            sa2_addrlen = sizeof(record->sa[1]);
+        record->sa_addrlen[1] = (unsigned char)sa2_addrlen;
+        memcpy(&record->sa[1], sa2, sa2_addrlen);
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+logger_addr(struct logring_t *ring, const char *fmt,
+    const struct sockaddr *sa, socklen_t sa_addrlen, int err)
+{
+    _record(ring, fmt, err, sa, sa_addrlen, NULL, 0);
+}
+
+void
+logger_addr2(struct logring_t *ring, const char *fmt,
+    const struct sockaddr *sa, socklen_t sa_addrlen,
+    const struct sockaddr *sa2, socklen_t sa2_addrlen, int err)
+{
+    _record(ring, fmt, err, sa, sa_addrlen, sa2, sa2_addrlen);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+_format_addr(const struct sockaddr_in6 *sa, socklen_t sa_addrlen,
+             char *name, size_t name_size)
+{
+    char addrname[NI_MAXHOST];
+    char portname[NI_MAXSERV];
+    int err;
+
+    err = getnameinfo((const struct sockaddr *)sa, sa_addrlen,
+                      addrname, sizeof(addrname),
+                      portname, sizeof(portname),
+                      NI_NUMERICHOST | NI_NUMERICSERV);
+    if (err)
+        snprintf(name, name_size, "[?]");
+    else
+        snprintf(name, name_size, "[%s]:%s", addrname, portname);
+}
+
+/**
+ * Write out whatever has been formatted so far.
+ */
+static void
+_write(struct logger_t *logger)
+{
+    if (logger->buf_length) {
+        fwrite(logger->buf, 1, logger->buf_length, logger->fp);
+        logger->buf_length = 0;
+    }
+}
+
+/**
+ * Add one formatted line to the buffer, writing the buffer out first if
+ * it won't fit.
+ */
+static void
+_append(struct logger_t *logger, const char *line, size_t length)
+{
+    if (length > sizeof(logger->buf) - logger->buf_length)
+        _write(logger);
+    memcpy(logger->buf + logger->buf_length, line, length);
+    logger->buf_length += length;
+}
+
+static void
+_format(struct logger_t *logger, const struct logrecord_t *record)
+{
+    char name[2][NI_MAXHOST + NI_MAXSERV + 4];
+    char line[1024];
+    const char *errmsg = record->err ? strerror(record->err) : "";
+    int length;
+
+    _format_addr(&record->sa[0], record->sa_addrlen[0], name[0], sizeof(name[0]));
+    if (record->count == 1) {
+        length = snprintf(line, sizeof(line), record->fmt, name[0], errmsg);
+    } else {
+        _format_addr(&record->sa[1], record->sa_addrlen[1], name[1], sizeof(name[1]));
+        length = snprintf(line, sizeof(line), record->fmt, name[0], name[1], errmsg);
+    }
+    if (length < 0)
+        return;
+    if ((size_t)length >= sizeof(line))
+        length = sizeof(line) - 1;
+    _append(logger, line, length);
+}
+
+void
+logger_flush(struct logger_t *logger)
+{
+    struct logring_t *ring;
+
+    pthread_mutex_lock(&logger->lock);
+    for (ring = logger->rings; ring; ring = ring->next) {
+        unsigned tail = ring->tail;
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long long dropped;
+
+        while (tail != head) {
+            _format(logger, &ring->records[tail & ring->mask]);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            char line[64];
+            int length;
+
+            length = snprintf(line, sizeof(line),
+                              "[-] logger: %llu messages dropped\n",
+                              dropped - ring->reported);
+            _append(logger, line, length);
+            ring->reported = dropped;
+        }
+    }
+    _write(logger);
+    fflush(logger->fp);
+    pthread_mutex_unlock(&logger->lock);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void *
+_background_thread(void *v)
+{
+    struct logger_t *logger = (struct logger_t *)v;
+    struct timespec ts = {0, FLUSH_INTERVAL_MS * 1000000};
+
+    while (!__atomic_load_n(&logger->is_stopping, __ATOMIC_ACQUIRE)) {
+        logger_flush(logger);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+struct logger_t *
+logger_create(FILE *fp, int is_background)
+{
+    struct logger_t *logger;
+
+    logger = calloc(1, sizeof(*logger));
+    if (logger == NULL)
+        return NULL;
+    logger->fp = fp;
+    pthread_mutex_init(&logger->lock, NULL);
+
+    if (is_background) {
+        int err = pthread_create(&logger->thread, NULL,
+                                 _background_thread, logger);
+        if (err) {
+            fprintf(stderr, "[-] logger: pthread_create(): %s\n", strerror(err));
+            pthread_mutex_destroy(&logger->lock);
+            free(logger);
+            return NULL;
+        }
+        logger->is_background = 1;
+    }
+    return logger;
+}
+
+struct logring_t *
+logger_ring(struct logger_t *logger, unsigned size)
+{
+    struct logring_t *ring;
+    unsigned count = 1;
+
+    while (count < size)
+        count *= 2;
+
+    ring = aligned_alloc(64, (sizeof(*ring) + count * sizeof(ring->records[0]) + 63) & ~(size_t)63);
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = count - 1;
+
+    pthread_mutex_lock(&logger->lock);
+    ring->next = logger->rings;
+    logger->rings = ring;
+    pthread_mutex_unlock(&logger->lock);
+    return ring;
+}
+
+void
+logger_destroy(struct logger_t *logger)
+{
+    if (logger == NULL)
+        return;
+    if (logger->is_background) {
+        __atomic_store_n(&logger->is_stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(logger->thread, NULL);
+    }
+    logger_flush(logger);
+
+    while (logger->rings) {
+        struct logring_t *ring = logger->rings;
+        logger->rings = ring->next;
+        free(ring);
+    }
+    pthread_mutex_destroy(&logger->lock);
+    free(logger);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+
+/**
+ * Counts the lines written so far, and how many match 'expected'.
+ */
+static unsigned
+_selftest_lines(FILE *fp, const char *expected, unsigned *matches)
+{
+    char line[1024];
+    unsigned count = 0;
+
+    *matches = 0;
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        count++;
+        if (strcmp(line, expected) == 0)
+            (*matches)++;
+    }
+    fseek(fp, 0, SEEK_END); /* so that we can write again */
+    return count;
+}
+
+struct selftest_thread_t {
+    struct logger_t *logger;
+    unsigned count;
+    pthread_t thread;
+};
+
+static void *
+_selftest_thread(void *v)
+{
+    struct selftest_thread_t *t = (struct selftest_thread_t *)v;
+    struct logring_t *ring;
+    struct sockaddr_in6 sin6 = {0};
+    unsigned i;
+
+    ring = logger_ring(t->logger, t->count);
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(443);
+    sin6.sin6_addr = in6addr_loopback;
+    for (i = 0; i < t->count; i++)
+        logger_addr(ring, "[+] %s\n", (struct sockaddr *)&sin6, sizeof(sin6), 0);
+    return NULL;
+}
+
+int
+logger_selftest(void)
+{
+    struct logger_t *logger;
+    struct logring_t *ring;
+    struct sockaddr_in sin = {0};
+    struct sockaddr_in6 sin6 = {0};
+    struct selftest_thread_t threads[2];
+    char expected[256];
+    unsigned matches;
+    unsigned count;
+    unsigned i;
+    FILE *fp;
+    int result = 1;
+
+    fp = tmpfile();
+    if (fp == NULL)
+        return 1;
+
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(80);
+    sin.sin_addr.s_addr = htonl(0x0a000001);
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(443);
+    sin6.sin6_addr = in6addr_loopback;
+
+    /* Without the background thread, nothing is written until we flush,
+     * and once the ring is full, messages are dropped and counted. */
+    logger = logger_create(fp, 0);
+    ring = logger_ring(logger, 3);
+    for (i = 0; i < 6; i++)
+        logger_addr(ring, "[-] recv(%s): %s\n", (struct sockaddr *)&sin, sizeof(sin), ECONNRESET);
+    if (_selftest_lines(fp, "", &matches) != 0)
+        goto fail;
+    logger_flush(logger);
+    snprintf(expected, sizeof(expected), "[-] recv([10.0.0.1]:80): %s\n", strerror(ECONNRESET));
+    count = _selftest_lines(fp, expected, &matches);
+    if (count != 5 || matches != 4)
+        goto fail;
+    if (_selftest_lines(fp, "[-] logger: 2 messages dropped\n", &matches) != 5 || matches != 1)
+        goto fail;
+
+    /* Two addresses, and the ring has room again */
+    logger_addr2(ring, "[-] %s -> %s: %s\n",
+                 (struct sockaddr *)&sin, sizeof(sin),
+                 (struct sockaddr *)&sin6, sizeof(sin6), 0);
+    logger_destroy(logger);
+    if (_selftest_lines(fp, "[-] [10.0.0.1]:80 -> [::1]:443: \n", &matches) != 6 || matches != 1)
+        goto fail;
+
+    /* With the background thread, several threads logging at once */
+    rewind(fp);
+    if (ftruncate(fileno(fp), 0) != 0)
+        goto fail;
+    logger = logger_create(fp, 1);
+    if (logger == NULL)
+        goto fail;
+    for (i = 0; i < 2; i++) {
+        threads[i].logger = logger;
+        threads[i].count = 1000;
+        pthread_create(&threads[i].thread, NULL, _selftest_thread, &threads[i]);
+    }
+    for (i = 0; i < 2; i++)
+        pthread_join(threads[i].thread, NULL);
+    logger_destroy(logger);
+    if (_selftest_lines(fp, "[+] [::1]:443\n", &matches) != 2000 || matches != 2000)
+        goto fail;
+
+    result = 0;
+fail:
+    fclose(fp);
+    return result;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+#ifdef LOGGERSTANDALONE
+int
+main(void)
+{
+    if (logger_selftest()) {
+        fprintf(stderr, "[-] logger: selftest failed\n");
+        return 1;
+    } else {
+        fprintf(stderr, "[+] logger: selftest succeeded\n");
+        return 0;
+    }
+}
+#endif
@@ -0,0 +1,96 @@
+/*
+    "Logging connections without formatting them"
+
+    A server that logs every connection calls `getnameinfo()` to format
+    the address, then `fprintf(stderr)` to write the message, which is a
+    system call, since `stderr` isn't buffered. In an accept storm, that
+    can take more time than handling the connection itself.
+
+    With this module, logging a message just copies the binary address, an
+    error number, and a pointer to the format string into a ring buffer.
+    Each thread has its own ring, so there's no locking. A background
+    thread takes the messages out of the rings, formats them, and writes
+    them out many at a time.
+
+    If a ring is full, because the background thread can't keep up, the
+    message is dropped and counted, rather than making the thread logging
+    it wait. The background thread reports how many were dropped.
+*/
+#ifndef UTIL_LOGGER_H
+#define UTIL_LOGGER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdio.h>
+#include <sys/socket.h>
+
+/**
+ * Create the logging subsystem, writing the formatted messages to 'fp'.
+ * @param is_background
+ *      Whether to start a thread to format and write the messages. If
+ *      not, nothing is written until "logger_flush()" is called.
+ * @return
+ *      NULL if the thread couldn't be started.
+ */
+struct logger_t *
+logger_create(FILE *fp, int is_background);
+
+/**
+ * Create a ring buffer for a thread to log messages into. Only that one
+ * thread may use it. It's freed by "logger_destroy()".
+ * @param size
+ *      The most messages it can hold, rounded up to a power of two.
+ */
+struct logring_t *
+logger_ring(struct logger_t *logger, unsigned size);
+
+/**
+ * Log a message about an address, such as the other side of a connection.
+ * Nothing is formatted now. Later, the address is formatted like
+ * "[10.0.0.1]:80", and the message is formatted by calling `printf()`
+ * with the 'fmt' string, and two strings: the address, then the text for
+ * the error number 'err', or "" if it's zero. The format doesn't need to
+ * use the error text, since extra arguments to `printf()` are ignored.
+ * @param fmt
+ *      The format, which must be a string constant, since we only keep a
+ *      pointer to it, such as "[-] recv(%s): %s\n".
+ */
+void
+logger_addr(struct logring_t *ring, const char *fmt,
+    const struct sockaddr *sa, socklen_t sa_addrlen, int err);
+
+/**
+ * The same, for two addresses, such as both sides of a connection. The
+ * 'fmt' gets three strings: the first address, the second, then the text
+ * for the error number.
+ */
+void
+logger_addr2(struct logring_t *ring, const char *fmt,
+    const struct sockaddr *sa, socklen_t sa_addrlen,
+    const struct sockaddr *sa2, socklen_t sa2_addrlen, int err);
+
+/**
+ * Format and write all the messages logged so far. This is what the
+ * background thread does. It may be called from any thread.
+ */
+void
+logger_flush(struct logger_t *logger);
+
+/**
+ * Writes the last messages, stops the background thread, and frees all
+ * the rings.
+ */
+void
+logger_destroy(struct logger_t *logger);
+
+/**
+ * @return
+ *      0 on success, non-zero on failure
+ */
+int
+logger_selftest(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
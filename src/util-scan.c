@@ -0,0 +1,474 @@
+/*
+    Finding the end of a run of characters, many bytes at a time.
+
+    See the header file for the overview. There are three versions of the
+    inner loop. The scalar version looks up each byte in a 256 entry
+    table. The SSE4.2 version uses the `pcmpestri` instruction to compare
+    16 bytes against up to 8 ranges of characters at once, the same trick
+    that picohttpparser uses. The AVX2 version uses `vpshufb` as a table
+    lookup, indexing a bitmap of the allowed ASCII characters by the low
+    nibble of each byte, and picking out the bit by the high nibble, 32
+    bytes at a time.
+
+    The vector versions only find candidates: when a set has more than 8
+    ranges, or a mix of allowed and disallowed characters above 0x7F, the
+    vector version may stop at a character that's actually allowed. We
+    check each candidate against the table and keep going if it's allowed,
+    so that all the versions return exactly the same result.
+*/
+#include "util-scan.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCAN_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/***************************************************************************
+ ***************************************************************************/
+static size_t
+_span_scalar(const struct scanclass_t *cls, const unsigned char *buf,
+    size_t length)
+{
+    const unsigned char *allowed = cls->allowed;
+    size_t i = 0;
+
+    while (i + 4 <= length) {
+        if (!allowed[buf[i]])
+            return i;
+        if (!allowed[buf[i + 1]])
+            return i + 1;
+        if (!allowed[buf[i + 2]])
+            return i + 2;
+        if (!allowed[buf[i + 3]])
+            return i + 3;
+        i += 4;
+    }
+    while (i < length && allowed[buf[i]])
+        i++;
+    return i;
+}
+
+#ifdef SCAN_HAVE_X86
+/***************************************************************************
+ * Returns the index of the first byte in the 16 bytes matching one of
+ * the ranges of disallowed characters, or 16 if there are none.
+ ***************************************************************************/
+__attribute__((target("sse4.2"))) static inline int
+_sse42_find(__m128i ranges, int ranges_length, __m128i x)
+{
+    return _mm_cmpestri(ranges, ranges_length, x, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+}
+
+__attribute__((target("sse4.2"))) static size_t
+_span_sse42(const struct scanclass_t *cls, const unsigned char *buf,
+    size_t length)
+{
+    __m128i ranges = _mm_loadu_si128((const __m128i *)cls->ranges);
+    int ranges_length = cls->ranges_length;
+    size_t i = 0;
+
+    while (i + 16 <= length) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+        int r = _sse42_find(ranges, ranges_length, x);
+        if (r == 16)
+            i += 16;
+        else if (!cls->allowed[buf[i + r]])
+            return i + r;
+        else
+            i += r + 1;
+    }
+
+    /* For the last few bytes, re-check the last 16 bytes of the buffer,
+     * ignoring the ones we've already checked, rather than reading past
+     * the end. */
+    while (i < length && length >= 16) {
+        size_t skip = i - (length - 16);
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + length - 16));
+        __m128i mask = _mm_cmpestrm(ranges, ranges_length, x, 16,
+            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_UNIT_MASK);
+        unsigned bits = (unsigned)_mm_movemask_epi8(mask) >> skip;
+        if (bits == 0)
+            return length;
+        i += __builtin_ctz(bits);
+        if (!cls->allowed[buf[i]])
+            return i;
+        i++;
+    }
+
+    return i + _span_scalar(cls, buf + i, length - i);
+}
+
+/***************************************************************************
+ * Returns a bit for each of the 32 bytes that might not be allowed.
+ ***************************************************************************/
+__attribute__((target("avx2"))) static inline unsigned
+_avx2_find(__m256i nibbles, __m256i bits, __m256i high, __m256i x)
+{
+    const __m256i low4 = _mm256_set1_epi8(0x0F);
+    __m256i row;
+    __m256i bit;
+    __m256i bad;
+
+    /* Look up the row of the bitmap by the low nibble, then the bit
+     * within that row by the high nibble. Bytes above 0x7F select a
+     * zero bit, so look like they aren't allowed */
+    row = _mm256_shuffle_epi8(nibbles, _mm256_and_si256(x, low4));
+    bit = _mm256_shuffle_epi8(bits,
+        _mm256_and_si256(_mm256_srli_epi16(x, 4), low4));
+    bad = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit),
+        _mm256_setzero_si256());
+
+    /* Unless all bytes above 0x7F are allowed, in which case 'high' has
+     * the top bit set, clearing the top bit of the result for them */
+    bad = _mm256_andnot_si256(_mm256_and_si256(x, high), bad);
+
+    return (unsigned)_mm256_movemask_epi8(bad);
+}
+
+/***************************************************************************
+ * The same, for 16 bytes, for short runs
+ ***************************************************************************/
+__attribute__((target("avx2"))) static inline unsigned
+_avx2_find16(__m256i nibbles, __m256i bits, __m256i high, __m128i x)
+{
+    const __m128i low4 = _mm_set1_epi8(0x0F);
+    __m128i row;
+    __m128i bit;
+    __m128i bad;
+
+    row = _mm_shuffle_epi8(_mm256_castsi256_si128(nibbles),
+        _mm_and_si128(x, low4));
+    bit = _mm_shuffle_epi8(_mm256_castsi256_si128(bits),
+        _mm_and_si128(_mm_srli_epi16(x, 4), low4));
+    bad = _mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128());
+    bad = _mm_andnot_si128(_mm_and_si128(x, _mm256_castsi256_si128(high)),
+        bad);
+
+    return (unsigned)_mm_movemask_epi8(bad);
+}
+
+__attribute__((target("avx2"))) static size_t
+_span_avx2(const struct scanclass_t *cls, const unsigned char *buf,
+    size_t length)
+{
+    __m256i nibbles = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)cls->nibbles));
+    __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0,
+        0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i high = _mm256_set1_epi8(cls->is_high_allowed ? -128 : 0);
+    size_t i = 0;
+
+    /* Most runs in a header are short, like a method or a field name, so
+     * check the first 16 bytes on their own before going 32 at a time */
+    if (length >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)buf);
+        unsigned mask = _avx2_find16(nibbles, bits, high, x);
+        if (mask) {
+            i = __builtin_ctz(mask);
+            if (!cls->allowed[buf[i]])
+                return i;
+            i++;
+        } else
+            i = 16;
+    }
+
+    while (i + 32 <= length) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned mask = _avx2_find(nibbles, bits, high, x);
+        if (mask == 0) {
+            i += 32;
+            continue;
+        }
+        i += __builtin_ctz(mask);
+        if (!cls->allowed[buf[i]])
+            return i;
+        i++;
+    }
+
+    /* Same as SSE4.2, re-check the last 32 bytes */
+    while (i < length && length >= 32) {
+        size_t skip = i - (length - 32);
+        __m256i x = _mm256_loadu_si256((const __m256i *)(buf + length - 32));
+        unsigned mask = _avx2_find(nibbles, bits, high, x) >> skip;
+        if (mask == 0)
+            return length;
+        i += __builtin_ctz(mask);
+        if (!cls->allowed[buf[i]])
+            return i;
+        i++;
+    }
+
+    /* Most header fields are shorter than 32 bytes, so for those, do the
+     * same thing 16 bytes at a time */
+    while (i + 16 <= length) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned mask = _avx2_find16(nibbles, bits, high, x);
+        if (mask == 0) {
+            i += 16;
+            continue;
+        }
+        i += __builtin_ctz(mask);
+        if (!cls->allowed[buf[i]])
+            return i;
+        i++;
+    }
+    while (i < length && length >= 16) {
+        size_t skip = i - (length - 16);
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + length - 16));
+        unsigned mask = _avx2_find16(nibbles, bits, high, x) >> skip;
+        if (mask == 0)
+            return length;
+        i += __builtin_ctz(mask);
+        if (!cls->allowed[buf[i]])
+            return i;
+        i++;
+    }
+
+    return i + _span_scalar(cls, buf + i, length - i);
+}
+#endif
+
+/***************************************************************************
+ ***************************************************************************/
+int
+scan_isa_is_supported(enum scan_isa_t isa)
+{
+    switch (isa) {
+    case SCAN_ISA_AUTO:
+    case SCAN_ISA_SCALAR:
+        return 1;
+#ifdef SCAN_HAVE_X86
+    case SCAN_ISA_SSE42:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    case SCAN_ISA_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+const char *
+scan_isa_name(enum scan_isa_t isa)
+{
+    switch (isa) {
+    case SCAN_ISA_AUTO:
+        return "auto";
+    case SCAN_ISA_SCALAR:
+        return "scalar";
+    case SCAN_ISA_SSE42:
+        return "sse4.2";
+    case SCAN_ISA_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+/***************************************************************************
+ * Build the list of ranges of disallowed characters for `pcmpestri`. It
+ * can only handle 8 ranges, so if there are more, we merge the ranges
+ * closest together, which means the allowed characters between them
+ * become candidates that we have to check in the table.
+ ***************************************************************************/
+static void
+_init_ranges(struct scanclass_t *cls)
+{
+    unsigned char lo[128];
+    unsigned char hi[128];
+    size_t count = 0;
+    unsigned c = 0;
+    size_t i;
+
+    while (c < 256) {
+        if (cls->allowed[c]) {
+            c++;
+            continue;
+        }
+        lo[count] = (unsigned char)c;
+        while (c < 256 && !cls->allowed[c])
+            c++;
+        hi[count] = (unsigned char)(c - 1);
+        count++;
+    }
+
+    while (count > 8) {
+        size_t best = 0;
+        for (i = 1; i + 1 < count; i++) {
+            if (lo[i + 1] - hi[i] < lo[best + 1] - hi[best])
+                best = i;
+        }
+        hi[best] = hi[best + 1];
+        memmove(&lo[best + 1], &lo[best + 2], count - best - 2);
+        memmove(&hi[best + 1], &hi[best + 2], count - best - 2);
+        count--;
+    }
+
+    memset(cls->ranges, 0, sizeof(cls->ranges));
+    for (i = 0; i < count; i++) {
+        cls->ranges[i * 2] = lo[i];
+        cls->ranges[i * 2 + 1] = hi[i];
+    }
+    cls->ranges_length = (int)(count * 2);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+scanclass_init(struct scanclass_t *cls, const unsigned char *allowed,
+    enum scan_isa_t isa)
+{
+    unsigned c;
+
+    memset(cls, 0, sizeof(*cls));
+    for (c = 0; c < 256; c++)
+        cls->allowed[c] = allowed[c] ? 1 : 0;
+
+    /* The bitmap for AVX2 */
+    for (c = 0; c < 128; c++) {
+        if (cls->allowed[c])
+            cls->nibbles[c & 0x0F] |= (unsigned char)(1 << (c >> 4));
+    }
+    cls->is_high_allowed = 1;
+    for (c = 128; c < 256; c++) {
+        if (!cls->allowed[c])
+            cls->is_high_allowed = 0;
+    }
+
+    /* The ranges for SSE4.2 */
+    _init_ranges(cls);
+
+    /* Pick the fastest version we can */
+    if (isa == SCAN_ISA_AUTO) {
+        if (scan_isa_is_supported(SCAN_ISA_AVX2))
+            isa = SCAN_ISA_AVX2;
+        else if (scan_isa_is_supported(SCAN_ISA_SSE42))
+            isa = SCAN_ISA_SSE42;
+    }
+    if (!scan_isa_is_supported(isa))
+        isa = SCAN_ISA_SCALAR;
+
+    switch (isa) {
+#ifdef SCAN_HAVE_X86
+    case SCAN_ISA_SSE42:
+        cls->span = _span_sse42;
+        break;
+    case SCAN_ISA_AVX2:
+        cls->span = _span_avx2;
+        break;
+#endif
+    default:
+        isa = SCAN_ISA_SCALAR;
+        cls->span = _span_scalar;
+        break;
+    }
+    cls->isa = isa;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static unsigned
+_selftest_rand(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+/***************************************************************************
+ * Test one version against the scalar version, on random sets of
+ * characters, with random buffers where most of the characters are in
+ * the set, at every offset and length.
+ ***************************************************************************/
+static int
+_selftest_isa(enum scan_isa_t isa)
+{
+    unsigned seed = 1;
+    unsigned test;
+
+    for (test = 0; test < 200; test++) {
+        struct scanclass_t scalar;
+        struct scanclass_t vector;
+        unsigned char allowed[256];
+        unsigned char buf[100];
+        unsigned char members[256];
+        size_t member_count = 0;
+        size_t offset;
+        size_t length;
+        unsigned c;
+
+        /* Sets range from nearly empty to nearly full, and some tests
+         * allow all the high characters */
+        for (c = 0; c < 256; c++) {
+            allowed[c] = (_selftest_rand(&seed) % 8) < (test % 9);
+            if (test & 1 && c >= 128)
+                allowed[c] = 1;
+            if (allowed[c])
+                members[member_count++] = (unsigned char)c;
+        }
+        scanclass_init(&scalar, allowed, SCAN_ISA_SCALAR);
+        scanclass_init(&vector, allowed, isa);
+
+        for (c = 0; c < sizeof(buf); c++) {
+            if (member_count && _selftest_rand(&seed) % 50)
+                buf[c] = members[_selftest_rand(&seed) % member_count];
+            else
+                buf[c] = (unsigned char)_selftest_rand(&seed);
+        }
+
+        for (offset = 0; offset < 40; offset++) {
+            for (length = 0; offset + length <= sizeof(buf); length++) {
+                size_t expected;
+                size_t found;
+
+                expected = scanclass_span(&scalar, buf + offset, length);
+                found = scanclass_span(&vector, buf + offset, length);
+                if (expected != found) {
+                    fprintf(stderr,
+                        "[-] scan: %s: test %u offset %u length %u: "
+                        "found %u, expected %u\n",
+                        scan_isa_name(isa), test, (unsigned)offset,
+                        (unsigned)length, (unsigned)found,
+                        (unsigned)expected);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+scan_selftest(void)
+{
+    int err = 0;
+
+    err |= _selftest_isa(SCAN_ISA_SCALAR);
+    if (scan_isa_is_supported(SCAN_ISA_SSE42))
+        err |= _selftest_isa(SCAN_ISA_SSE42);
+    if (scan_isa_is_supported(SCAN_ISA_AVX2))
+        err |= _selftest_isa(SCAN_ISA_AVX2);
+
+    return err;
+}
+
+#ifdef SCANSTANDALONE
+int
+main(void)
+{
+    if (scan_selftest()) {
+        fprintf(stderr, "[-] scan: selftest failed\n");
+        return 1;
+    } else {
+        fprintf(stderr, "[+] scan: selftest succeeded\n");
+        return 0;
+    }
+}
+#endif
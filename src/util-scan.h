@@ -0,0 +1,105 @@
+/*
+    "Find the end of a run of characters, many bytes at a time"
+
+    Parsing text protocols like HTTP is mostly a matter of finding where
+    one thing ends and the next begins: the end of a token, the next
+    space, the end of the line. Doing this one byte at a time is slow.
+    This module finds the first byte that isn't in a set of "allowed"
+    characters, checking 16 bytes at a time with SSE4.2, or 32 bytes at a
+    time with AVX2, picking the best one the CPU supports at runtime.
+
+    Since we stop at anything that isn't allowed, this also validates the
+    characters in bulk: the caller only needs to look at the one byte
+    where we stopped to decide whether it's a delimiter or an error.
+
+    All the versions return exactly the same result, so the choice is
+    only a matter of speed.
+*/
+#ifndef UTIL_SCAN_H
+#define UTIL_SCAN_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdio.h>
+
+enum scan_isa_t {
+    /** Pick the best one supported by this CPU */
+    SCAN_ISA_AUTO = 0,
+
+    /** Plain C, one byte at a time, used on all other CPUs */
+    SCAN_ISA_SCALAR,
+
+    /** SSE4.2 `pcmpestri` with character ranges, 16 bytes at a time */
+    SCAN_ISA_SSE42,
+
+    /** AVX2 `vpshufb` bitmap lookup, 32 bytes at a time */
+    SCAN_ISA_AVX2,
+};
+
+/**
+ * A set of characters, in the forms needed by each implementation.
+ */
+struct scanclass_t {
+    /** Non-zero for each character in the set */
+    unsigned char allowed[256];
+
+    /** For AVX2, indexed by the low nibble of a character, with bit N
+     * set if the character with high nibble N is allowed, for ASCII */
+    unsigned char nibbles[16];
+    unsigned char is_high_allowed;
+
+    /** For SSE4.2, up to 8 ranges of characters that aren't allowed */
+    unsigned char ranges[16];
+    int ranges_length;
+
+    enum scan_isa_t isa;
+    size_t (*span)(const struct scanclass_t *cls, const unsigned char *buf,
+        size_t length);
+};
+
+/**
+ * Initialize the class from a table of the allowed characters.
+ * @param allowed
+ *      An array of 256 entries, non-zero for each allowed character.
+ * @param isa
+ *      Normally SCAN_ISA_AUTO. If the requested instructions aren't
+ *      supported by this CPU, the scalar version is used instead.
+ */
+void
+scanclass_init(struct scanclass_t *cls, const unsigned char *allowed,
+    enum scan_isa_t isa);
+
+/**
+ * Returns the number of bytes at the start of the buffer that are in the
+ * set. If this is less than 'length', the next byte isn't in the set.
+ */
+static inline size_t
+scanclass_span(const struct scanclass_t *cls, const void *buf, size_t length)
+{
+    return cls->span(cls, (const unsigned char *)buf, length);
+}
+
+/**
+ * Returns the name of the instructions being used, for benchmarks.
+ */
+const char *
+scan_isa_name(enum scan_isa_t isa);
+
+/**
+ * Returns whether the CPU supports the instructions.
+ */
+int
+scan_isa_is_supported(enum scan_isa_t isa);
+
+/**
+ * Compare the vector versions with the scalar version on random input.
+ * @return
+ *      0 on success, non-zero on failure
+ */
+int
+scan_selftest(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -22,19 +22,30 @@
   the flavor of the textbook example pseudo-code. Therefore, you see code
   that looks like the following:
 
-    while (queue_has_more_items(queue)) {
-        r = dequeue(queue);
-        for (a=0; a<ALPHABET_SIZE; a++) {
-            if (GOTO(r,a) == FAIL)
-                GOTO(r,a) = GOTO(GOTO_FAIL(r),a);
-            else
-                enqueue(queue, GOTO(r,a));
-        }
+    for (a=0; a<ALPHABET_SIZE; a++) {
+        if (GOTO(r,a) == FAIL)
+            GOTO(r,a) = GOTO(GOTO_FAIL(r),a);
     }
 
   You aren't supposed to understand the code so much that you are supposed
   to be able to confirm the code matches the textbook pseudo-code.
 
+  The textbook goes through the states breadth-first, with a queue. We
+  instead sort the states by depth, and do one level at a time, since a
+  state only depends upon states closer to the start. That lets us split
+  each level across several threads, see "smack_set_threads()".
+
+
+  INCREMENTAL COMPILATION
+
+  Normally, compiling throws away the patterns and the intermediate
+  tables. With "smack_set_incremental()", we keep them, so that more
+  patterns can be added later. Compiling again then only recalculates
+  the states that can be affected: those that the new patterns extend,
+  those that have them as a suffix (their "fail" states lead there), and
+  the states after them. The final table is still rebuilt from scratch,
+  since adding states can change the width of the rows.
+
 
   COMPRESSION
 
@@ -55,10 +66,14 @@
   have to multiple the "row" index by row width. Because it's a power-of-2,
   we convert that into a shift for performance reasons.
 
-  Ideally, we should do even more optimizations, like a shift-add, allowing
-  half widths (3, 6, 24, 48, 96, 192) that would more closely match the
-  table width to the number of characters. Maybe I'll get around to adding
-  that.
+  That wastes up to half of each row, though. When the table is too big
+  to fit in the cache, and it's enough, we instead use the width halfway
+  between two powers-of-2 (3, 6, 12, 24, 48, 96, 192), which are 3 times
+  a power-of-2, and multiply with a shift-add, like ((row<<1)+row)<<5
+  for a width of 96. A set of patterns with 70 different characters then
+  has a table 3/4 the size, so more of it fits in the cache. For smaller
+  tables, this is slower, since it's one more instruction for each byte.
+  The inner loops are specialized for each kind of width.
 
 
   COMPILATION
@@ -84,8 +99,12 @@
   16-BIT STATE
 
   While the engine compiles using 32-bit states, the last compilation
-  step reduces this to 16-bits states. This can be trivially changed
-  by redefining the type "transition_t".
+  step reduces this to 16-bits states when there are no more than 64k
+  of them, which halves the size of the table so more of it stays in
+  the cache. Larger pattern sets get a table of 32-bit states instead.
+  The inner loops are specialized for each width, so the choice costs
+  nothing while searching. Either way, the current row is kept in the
+  lower 24-bits of the caller's state variable, so that's the limit.
 
 
   64-BIT COMPILATION
@@ -97,25 +116,114 @@
   be 16-bits, which means the tables will still be small.
 
 
-  TODO
-  Make it so that the longest match triggers first.
+  PREFILTER
+
+  The search does one dependent table lookup per byte of input, so it
+  can't go faster than the latency of a load. Most of the input in IDS
+  style matching is nowhere near a pattern, however. As in the "Teddy"
+  algorithm from Hyperscan, when the state-machine is back in its
+  starting state, we use SIMD to look for the next place where a pattern
+  might start, and skip straight to it. Patterns are put into 8 buckets,
+  and for each of the first 1-3 bytes of a pattern, we set the bucket's
+  bit in a table indexed by the low nibble, and in a table indexed by the
+  high nibble. A byte position is a candidate when the AND of the tables
+  for the bytes there has a bit set. With `pshufb`, this checks 16
+  (SSE) or 32 (AVX2) positions at a time.
+
+  Skipping positions where no pattern can start doesn't change which
+  patterns match where, nor the state at the end of the input, so the
+  results are exactly the same as without the prefilter.
+
+
+  SAVED IMAGES
+
+  Compiling a large pattern set can take seconds, which is a long time
+  to wait at startup, in each of several worker processes. Therefore,
+  "smack_save()" writes the compiled state-machine to a file, which
+  "smack_load_mmap()" maps read-only, so that it's ready to search
+  without doing any work, and all the processes share the same physical
+  memory for the table. The file holds a fixed header, then the table,
+  the list of matches for each state, and the match ids, located by
+  their offsets from the start of the file. There are no pointers, so it
+  doesn't matter where the file gets mapped. Sparse states, and the
+  extra information for leftmost-longest, go after the matches. The
+  header has a version
+  number, which must be changed whenever the layout changes. The file
+  isn't portable between systems of different byte-order or "size_t".
+
+
+  MATCH MODES
+
+  Normally, we report every pattern that ends at each byte, the longest
+  first, since a state's own patterns come before those of its "fail"
+  state. With SMACK_MATCH_FIRST, compiling cuts each state's list down to
+  just that first one.
+
+  SMACK_MATCH_LEFTMOST_LONGEST is how a tokenizer works: the match that
+  starts first, the longest of those, then the same again after it, so
+  that matches never overlap. We build this the same way as the Rust
+  "aho-corasick" crate. Once a state has its own match, it and all the
+  states after it fail to a "dead" state, instead of going on to look for
+  patterns that start later. The last match we passed is "pending", and
+  we report it when we reach the dead state, then go back to just after
+  it and search again. A state's pending match, and how many symbols ago
+  it ended, doesn't depend on how we got there, so compiling works it
+  out for each state. The symbols after the match are the last ones of
+  the state's own prefix, so we go back by replaying them from the
+  table, not the input, which may have been in an earlier fragment.
+  That's slower, but it only happens once per match.
+
+
+  SPARSE STATES
+
+  With 100k patterns, there are millions of states, and almost all of
+  them are deep in a single pattern, with only one transition that goes
+  deeper. The rest of the row is the same as the row of its "fail" state,
+  which is the textbook representation. So once the table would be
+  bigger than "smack_set_dense_size()", only the states closest to the
+  start get a row in the table, and the rest just list the transitions
+  that go deeper, and their fail state. When a transition isn't in the
+  list, we try the fail state, and so on, which always ends up at a state
+  with a row, since those are closer to the start. The input near the
+  root of the trie, which is most of it, is still one lookup per byte.
+  The sparse states come after the ones with rows, so the search checks
+  for them with a compare. Like incremental compiling, this isn't done
+  for patterns with anchors, wildcards or the SNMP hack, nor for
+  leftmost-longest.
 
  ****************************************************************************/
 #include "util-smack.h"
+#include "util-clockcycle.h"
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SMACK_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
 /**
- * By default, the table holds only 64k states using 2-byte
- * integers. If you want more states, simply change this to
- * a 4-byte or 8-byte integer
+ * The table holds 2-byte transitions when there are at most 64k states,
+ * otherwise 4-byte transitions, up to SMACK_MAX_STATES.
  */
-typedef unsigned short transition_t;
+typedef unsigned short transition16_t;
+typedef unsigned transition32_t;
+#define SMACK_MAX_STATES 0x1000000
 
 /**
  * These constants represent the anchor-start (^) and anchor-end ($) symbols.
@@ -144,6 +252,14 @@ enum {
 
 static const unsigned BASE_STATE = 0;
 static const unsigned UNANCHORED_STATE = 1;
+
+/**
+ * Levels with fewer states than this per thread aren't worth splitting
+ * across threads.
+ */
+#define SMACK_PARALLEL_MIN 1024
+#define SMACK_MAX_THREADS 64
+
 #define GOTO(r, a) smack->m_state_table[r].m_next_state[a]
 #define GOTO_FAIL(r) smack->m_state_table[r].m_fail_state
 
@@ -157,90 +273,17 @@ static const unsigned UNANCHORED_STATE = 1;
 unsigned print_transitions = 0;
 #endif
 
-/****************************************************************************
- * Build a queue so that we can do a breadth-first enumeration of the
- * sub-patterns
- ****************************************************************************/
-struct QueueElement {
-    unsigned m_data;
-    struct QueueElement *m_next;
-};
-struct Queue {
-    struct QueueElement *m_head;
-    struct QueueElement *m_tail;
-};
-
-struct Queue *
-queue_create(void)
-{
-    struct Queue *queue;
-    queue = (struct Queue *)malloc(sizeof(*queue));
-    if (queue == NULL) {
-        fprintf(stderr, "%s: out of memory error\n", "smack");
-        exit(1);
-    }
-    memset(queue, 0, sizeof(*queue));
-    return queue;
-}
-
-unsigned
-queue_has_more_items(struct Queue *queue)
-{
-    return queue->m_head != NULL;
-}
-
-unsigned
-dequeue(struct Queue *queue)
-{
-    if (queue->m_head == NULL)
-        return 0;
-    else {
-        struct QueueElement *element;
-        unsigned result;
-
-        element = queue->m_head;
-        result = element->m_data;
-        queue->m_head = element->m_next;
-
-        free(element);
-        return result;
-    }
-}
-
-void
-queue_destroy(struct Queue *queue)
-{
-    if (queue == NULL)
-        return;
-    while (queue_has_more_items(queue))
-        dequeue(queue);
-    free(queue);
-}
-
-void
-enqueue(struct Queue *queue, unsigned data)
-{
-    struct QueueElement *element;
-
-    element = (struct QueueElement *)malloc(sizeof(struct QueueElement));
-    if (element == NULL) {
-        fprintf(stderr, "%s: out of memory error\n", "smack");
-        exit(1);
-    }
-
-    if (queue->m_head == NULL) {
-        /* If nothing in the queue, initialize the queue with the
-         * first data */
-        queue->m_head = element;
-    } else {
-        /* Else, add the data to the the tail of the queue */
-        queue->m_tail->m_next = element;
-    }
+/**
+ * Tables bigger than this use rows that aren't a power-of-2 wide, as
+ * described in COMPRESSION above. This is about twice the size of a typical L2 cache,
+ * where the benefit starts to outweigh the cost. The selftest changes it.
+ */
+static size_t smack_shift_add_size = 4 * 1024 * 1024;
 
-    element->m_data = data;
-    element->m_next = NULL;
-    queue->m_tail = element;
-}
+/**
+ * The default for "smack_set_dense_size()"
+ */
+#define SMACK_DENSE_SIZE (16 * 1024 * 1024)
 
 /****************************************************************************
  ****************************************************************************/
@@ -297,6 +340,68 @@ struct SmackMatches {
 #endif
 };
 
+/****************************************************************************
+ * For SMACK_MATCH_LEFTMOST_LONGEST, the match waiting to be reported at
+ * each state, described in MATCH MODES above.
+ ****************************************************************************/
+#define LEFTMOST_NONE (~0U)
+
+struct SmackLeftmost {
+    /** The state whose own match is pending, or LEFTMOST_NONE */
+    unsigned pend;
+
+    /** How many symbols of this state's prefix come after that match */
+    unsigned lag;
+
+    /** The state before this one, and the symbol between them, so we can
+     * replay those symbols */
+    unsigned parent;
+    unsigned symbol;
+};
+
+/****************************************************************************
+ * A state without a row in the table, described in SPARSE STATES above.
+ * Its transitions that go deeper are in the list of edges from 'first' up
+ * to the 'first' of the next state. Each edge is the next state, shifted
+ * left 8 bits, plus the symbol.
+ ****************************************************************************/
+struct SmackSparse {
+    unsigned first;
+    unsigned fail;
+};
+
+/****************************************************************************
+ * The SIMD prefilter used by "smack_search()", described in PREFILTER
+ * above.
+ ****************************************************************************/
+#define PREFILTER_MAX_WIDTH 3
+#define PREFILTER_BUCKETS 8
+
+struct SmackPrefilter {
+    /** For each of the first bytes of the patterns, the bits of the
+     * buckets whose patterns have a byte with that low/high nibble */
+    unsigned char lo[PREFILTER_MAX_WIDTH][16];
+    unsigned char hi[PREFILTER_MAX_WIDTH][16];
+
+    /** The same, combined for each byte, for the scalar version */
+    unsigned char masks[PREFILTER_MAX_WIDTH][256];
+
+    /** The number of bytes of each pattern we look at, which is at most
+     * the length of the shortest pattern */
+    unsigned width;
+
+    /** Whether these patterns can use the prefilter, set by compiling */
+    unsigned is_possible : 1;
+
+    /** Set by "smack_set_prefilter()" */
+    unsigned is_disabled : 1;
+    enum scan_isa_t requested_isa;
+
+    /** Returns the first candidate position from 'i' up to 'limit' */
+    size_t (*find)(const struct SmackPrefilter *pf, const unsigned char *px,
+        size_t i, size_t limit);
+};
+
 /****************************************************************************
  * This is the master structure for the SMACK engine.
  ****************************************************************************/
@@ -345,6 +450,67 @@ struct SMACK {
     struct SmackMatches *m_match;
     unsigned m_match_limit;
 
+    /**
+     * For each state in the intermediate table, its distance from the
+     * start, the state before it and the character between them, and how
+     * many of its matches are its own patterns, rather than from its
+     * "fail" state. Like the intermediate table, these are thrown away
+     * after compiling, unless it's incremental.
+     */
+    unsigned *m_depth;
+    unsigned *m_parent;
+    unsigned short *m_parent_char;
+    unsigned *m_own_count;
+
+    /**
+     * In incremental mode, the matches for the intermediate table, whose
+     * states are numbered differently than the final table.
+     */
+    struct SmackMatches *m_trie_match;
+
+    /** How many patterns are already in the compiled state-machine */
+    unsigned m_pattern_compiled;
+
+    /** Set by "smack_set_incremental()" and "smack_set_threads()" */
+    unsigned is_incremental : 1;
+    unsigned thread_count;
+
+    /** Whether any pattern has the SMACK_SNMP_HACK flag */
+    unsigned is_snmp_hack : 1;
+
+    /** While compiling, the number of each state in the final table */
+    unsigned *m_final_row;
+
+    /**
+     * Set by "smack_set_match_mode()". Leftmost-longest doesn't work with
+     * anchors, wildcards, or the SNMP hack, so compiling them clears
+     * 'is_leftmost' and reports all the matches instead.
+     */
+    enum smack_match_mode match_mode;
+    unsigned is_leftmost : 1;
+
+    /**
+     * For SMACK_MATCH_LEFTMOST_LONGEST, the pending match of each state
+     * in the final table, and the number of the "dead" state, which has
+     * no row. While compiling, the "fail" state of each state.
+     */
+    struct SmackLeftmost *m_leftmost;
+    unsigned m_leftmost_dead;
+    unsigned *m_final_fail;
+
+    /**
+     * The states from 'm_sparse_begin' on don't have a row in the table,
+     * but are in 'm_sparse' instead, if it's not NULL. See SPARSE STATES.
+     * The limit is set by "smack_set_dense_size()". Those from
+     * 'm_sparse_match' on have matches.
+     */
+    size_t dense_size;
+    unsigned m_sparse_begin;
+    unsigned m_sparse_match;
+    struct SmackSparse *m_sparse;
+    unsigned *m_sparse_edges;
+    unsigned m_sparse_edge_count;
+
     /**
      * The opposite of "char_to_symbol", this table takes a symbol and
      * converts it back to a  character. This can be useful in debugging,
@@ -376,16 +542,69 @@ struct SMACK {
      * patterns, then we'll use row sizes of 32 elements. This allows
      * use to optimize row lookups using the fast "shift" operation
      * rather than the slow "multiplication" operation.
+     *
+     * If 'is_shift_add' is set, rows are 3 times that wide, so that
+     * 20 characters use rows of 3<<3=24 elements.
      */
     unsigned row_shift;
+    unsigned is_shift_add;
 
     /**
      * This is the final compressed table. It contains one row for each
      * sub-pattern, and each row is wide enough to hold all the symbols
-     * (must be a power of two) */
-    transition_t *table;
+     * (must be a power of two). The transitions are either 16-bit or
+     * 32-bit, depending on the number of states. */
+    void *table;
+    unsigned is_table32;
+
+    /**
+     * When loaded by "smack_load_mmap()", the mapped file, which holds
+     * the table and the match ids.
+     */
+    void *image;
+    size_t image_size;
+
+    /**
+     * Lets "smack_search()" skip over input where no pattern can start.
+     */
+    struct SmackPrefilter prefilter;
 };
 
+/****************************************************************************
+ * Get the next row from the final table, at 'index' = ROW_INDEX(row) +
+ * column. In the inner loops, 'is_table32' and 'is_shift_add' are
+ * constants, so that the compiler creates a separate version of the loop
+ * for each kind of table.
+ ****************************************************************************/
+#define TRANSITION(table, is_table32, index)                                 \
+    ((is_table32) ? (unsigned)((const transition32_t *)(table))[index]       \
+                  : (unsigned)((const transition16_t *)(table))[index])
+
+#define ROW_INDEX(row, row_shift, is_shift_add)                              \
+    (((is_shift_add) ? ((size_t)(row) << 1) + (row) : (size_t)(row))         \
+        << (row_shift))
+
+static size_t
+row_index(const struct SMACK *smack, unsigned row)
+{
+    return ROW_INDEX(row, smack->row_shift, smack->is_shift_add);
+}
+
+static unsigned
+transition_get(const struct SMACK *smack, size_t index)
+{
+    return TRANSITION(smack->table, smack->is_table32, index);
+}
+
+static void
+transition_set(struct SMACK *smack, size_t index, unsigned row)
+{
+    if (smack->is_table32)
+        ((transition32_t *)smack->table)[index] = row;
+    else
+        ((transition16_t *)smack->table)[index] = (transition16_t)row;
+}
+
 /****************************************************************************
  * Given a row-width, figure out the nearest power-of-two (16,32,64,128,etc.)
  * that can hold that row. Return the number of bits needed to left-shift
@@ -420,6 +639,8 @@ smack_create(const char *name, unsigned nocase)
     memset(smack, 0, sizeof(struct SMACK));
 
     smack->is_nocase = nocase;
+    smack->thread_count = 1;
+    smack->dense_size = SMACK_DENSE_SIZE;
     smack->name = (char *)malloc(strlen(name) + 1);
     if (smack->name == NULL) {
         fprintf(stderr, "%s: out of memory error\n", "smack");
@@ -431,18 +652,48 @@ smack_create(const char *name, unsigned nocase)
 
 /****************************************************************************
  ****************************************************************************/
-static void
-create_intermediate_table(struct SMACK *smack, unsigned size)
+static void *
+grow_array(void *p, size_t old_count, size_t new_count, size_t size)
 {
-    struct SmackRow *x;
+    unsigned char *x;
 
-    x = (struct SmackRow *)malloc(sizeof(*x) * size);
+    x = (unsigned char *)realloc(p, size * new_count);
     if (x == NULL) {
         fprintf(stderr, "%s: out of memory error\n", "smack");
         exit(1);
     }
-    memset(x, 0, sizeof(*x) * size);
-    smack->m_state_table = x;
+    memset(x + size * old_count, 0, size * (new_count - old_count));
+    return x;
+}
+
+/****************************************************************************
+ * Make room for 'size' states in the intermediate table, and the matches
+ * table, keeping the states we already have. The new states have all
+ * their transitions set to FAIL.
+ ****************************************************************************/
+static void
+grow_intermediate_table(struct SMACK *smack, unsigned size)
+{
+    unsigned old_size = smack->m_state_table ? smack->m_state_max : 0;
+
+    if (old_size >= size)
+        return;
+
+    smack->m_state_table = (struct SmackRow *)grow_array(
+        smack->m_state_table, old_size, size, sizeof(struct SmackRow));
+    memset(smack->m_state_table + old_size, 0xFF,
+        sizeof(struct SmackRow) * (size - old_size));
+    smack->m_match = (struct SmackMatches *)grow_array(
+        smack->m_match, old_size, size, sizeof(struct SmackMatches));
+    smack->m_depth = (unsigned *)grow_array(
+        smack->m_depth, old_size, size, sizeof(unsigned));
+    smack->m_parent = (unsigned *)grow_array(
+        smack->m_parent, old_size, size, sizeof(unsigned));
+    smack->m_parent_char = (unsigned short *)grow_array(
+        smack->m_parent_char, old_size, size, sizeof(unsigned short));
+    smack->m_own_count = (unsigned *)grow_array(
+        smack->m_own_count, old_size, size, sizeof(unsigned));
+    smack->m_state_max = size;
 }
 
 /****************************************************************************
@@ -450,10 +701,16 @@ create_intermediate_table(struct SMACK *smack, unsigned size)
 static void
 destroy_intermediate_table(struct SMACK *smack)
 {
-    if (smack->m_state_table) {
-        free(smack->m_state_table);
-        smack->m_state_table = 0;
-    }
+    free(smack->m_state_table);
+    free(smack->m_depth);
+    free(smack->m_parent);
+    free(smack->m_parent_char);
+    free(smack->m_own_count);
+    smack->m_state_table = 0;
+    smack->m_depth = 0;
+    smack->m_parent = 0;
+    smack->m_parent_char = 0;
+    smack->m_own_count = 0;
 }
 
 /****************************************************************************
@@ -533,13 +790,38 @@ destroy_pattern_table(struct SMACK *smack)
 void
 smack_destroy(struct SMACK *smack)
 {
+    /* In incremental mode, the final matches share the ids of the
+     * intermediate ones */
+    if (smack->m_trie_match) {
+        free(smack->m_match);
+        smack->m_match = smack->m_trie_match;
+        smack->m_trie_match = 0;
+    }
+
+    /* The table and match ids of a loaded image point into the file */
+    if (smack->image) {
+        free(smack->m_match);
+        smack->m_match = 0;
+        smack->table = 0;
+        smack->m_leftmost = 0;
+        smack->m_sparse = 0;
+        smack->m_sparse_edges = 0;
+#ifndef _WIN32
+        munmap(smack->image, smack->image_size);
+#endif
+    }
+
     destroy_intermediate_table(smack);
     destroy_matches_table(smack);
     destroy_pattern_table(smack);
 
     if (smack->table)
         free(smack->table);
+    free(smack->m_leftmost);
+    free(smack->m_sparse);
+    free(smack->m_sparse_edges);
 
+    free(smack->name);
     free(smack);
 }
 
@@ -602,6 +884,21 @@ smack_copy_matches(
     row->m_count = total_count;
 }
 
+/****************************************************************************
+ * Keep only the first 'count' matches.
+ ****************************************************************************/
+static void
+truncate_matches(struct SmackMatches *row, unsigned count)
+{
+    if (count >= row->m_count)
+        return;
+    row->m_count = count;
+    if (count == 0) {
+        free(row->m_ids);
+        row->m_ids = NULL;
+    }
+}
+
 /****************************************************************************
  * In order to compress the size of the table, and to do case-insensitive
  * pattern-matches, we convert characters into symbols. We need to create
@@ -720,6 +1017,8 @@ smack_add_pattern(struct SMACK *smack, const void *v_pattern,
         smack->is_anchor_begin = 1;
     if (pat->is_anchor_end)
         smack->is_anchor_end = 1;
+    if (pat->is_snmp_hack)
+        smack->is_snmp_hack = 1;
 
     /*
      * Register the symbols used in the pattern. Hopefully, not all 256
@@ -783,14 +1082,41 @@ DEBUG_set_name(
 #endif
 
 /****************************************************************************
+ * Whether the transition from 'r' to 's' is one of the original prefixes,
+ * rather than a link to some other state added by compiling. These always
+ * go one level deeper, where links never do.
  ****************************************************************************/
-static void
+static unsigned
+is_prefix_edge(const struct SMACK *smack, unsigned r, unsigned s)
+{
+    return s != FAIL && smack->m_depth[s] == smack->m_depth[r] + 1;
+}
+
+/****************************************************************************
+ * Create the state after 'state' for the character 'c'
+ ****************************************************************************/
+static unsigned
+smack_new_state(struct SMACK *smack, unsigned state, unsigned c)
+{
+    unsigned new_state = smack->m_state_count++;
+
+    GOTO(state, c) = new_state;
+    smack->m_depth[new_state] = smack->m_depth[state] + 1;
+    smack->m_parent[new_state] = state;
+    smack->m_parent_char[new_state] = (unsigned short)c;
+    return new_state;
+}
+
+/****************************************************************************
+ * Add the states for a pattern, returning the state where it matches.
+ ****************************************************************************/
+static unsigned
 smack_add_prefixes(struct SMACK *smack, struct SmackPattern *pat)
 {
     size_t i;
     size_t pattern_length;
     unsigned char *pattern;
-    int state = 0;
+    unsigned state = 0;
 
     pattern_length = pat->pattern_length;
     pattern = pat->pattern;
@@ -807,18 +1133,24 @@ smack_add_prefixes(struct SMACK *smack, struct SmackPattern *pat)
      * prefixes for 'f', 'fo', and 'foo'. We won't start adding new states
      * until we reach 'foob', 'fooba', and 'foobar'.
      */
-    for (i = 0; i < pattern_length && GOTO(state, pattern[i]) != FAIL; i++)
-        state = GOTO(state, pattern[i]);
+    for (i = 0; i < pattern_length; i++) {
+        unsigned next = GOTO(state, pattern[i]);
+        if (next == state && smack->is_snmp_hack)
+            continue; /* snmp_hack, space_hack */
+        if (!is_prefix_edge(smack, state, next))
+            break;
+        state = next;
+    }
 
     /*
      * Now that we've matched existing states, start creating new states to
      * complete this pattern.
      */
     for (; i < pattern_length; i++) {
-        unsigned new_state = smack->m_state_count++;
+        unsigned new_state;
         if (pat->is_snmp_hack)
             GOTO(state, 0x80) = state; /* snmp_hack, space_hack */
-        GOTO(state, pattern[i]) = new_state;
+        new_state = smack_new_state(smack, state, pattern[i]);
         state = new_state;
         DEBUG_set_name(smack, pattern, i + 1, new_state);
     }
@@ -827,8 +1159,7 @@ smack_add_prefixes(struct SMACK *smack, struct SmackPattern *pat)
      * If there is an anchor at the end, then create one more state
      */
     if (pat->is_anchor_end) {
-        unsigned new_state = smack->m_state_count++;
-        GOTO(state, CHAR_ANCHOR_END) = new_state;
+        unsigned new_state = smack_new_state(smack, state, CHAR_ANCHOR_END);
         state = new_state;
 #ifdef DEBUG
         DEBUG_set_name(smack, pattern, i + 1, new_state);
@@ -837,9 +1168,14 @@ smack_add_prefixes(struct SMACK *smack, struct SmackPattern *pat)
     }
 
     /*
-     * Now mark the final state as a "match" state.
+     * Now mark the final state as a "match" state. If the state was
+     * already compiled, it has the matches of its "fail" state after its
+     * own, which we have to remove first.
      */
+    truncate_matches(&smack->m_match[state], smack->m_own_count[state]);
     smack_copy_matches(&smack->m_match[state], &pat->id, 1);
+    smack->m_own_count[state] = smack->m_match[state].m_count;
+    return state;
 }
 
 /****************************************************************************
@@ -847,26 +1183,21 @@ smack_add_prefixes(struct SMACK *smack, struct SmackPattern *pat)
 static void
 smack_stage0_compile_prefixes(struct SMACK *smack)
 {
-    unsigned s;
     unsigned a;
 
     /*
-     * Initialize the base-state.
+     * Initialize the base-state. The intermediate table starts out with
+     * all the transitions set to FAIL.
      */
     smack->m_state_count = 1;
-    for (s = 0; s < smack->m_state_max; s++) {
-        for (a = 0; a < ALPHABET_SIZE; a++)
-            GOTO(s, a) = FAIL;
-    }
     DEBUG_set_name(smack, "*", 1, 0);
 
     /*
      * Initialize the anchor-state
      */
     if (smack->is_anchor_begin) {
-        unsigned anchor_begin = smack->m_state_count++;
-        GOTO(BASE_STATE, CHAR_ANCHOR_START) = anchor_begin;
-        DEBUG_set_name(smack, "^", 1, anchor_begin);
+        smack_new_state(smack, BASE_STATE, CHAR_ANCHOR_START);
+        DEBUG_set_name(smack, "^", 1, UNANCHORED_STATE);
     }
 
     /*
@@ -884,195 +1215,573 @@ smack_stage0_compile_prefixes(struct SMACK *smack)
 }
 
 /****************************************************************************
+ * Find the "fail" state and the matches of a state, and link all the
+ * transitions that aren't prefixes of patterns. This only looks at
+ * states closer to the start, which must already be done.
  ****************************************************************************/
 static void
-smack_stage1_generate_fails(struct SMACK *smack)
+smack_link_state(struct SMACK *smack, unsigned r)
 {
-    unsigned s;
+    unsigned f = BASE_STATE;
     unsigned a;
-    struct Queue *queue;
-
-    /* Create a queue for breadth-first enumeration of the patterns*/
-    queue = queue_create();
 
-    /* Do the base-state first */
-    for (a = 0; a < ALPHABET_SIZE; a++) {
-        s = GOTO(BASE_STATE, a);
-        if (s != BASE_STATE) {
-            enqueue(queue, s);
-            GOTO_FAIL(s) = BASE_STATE;
+    if (r == BASE_STATE) {
+        for (a = 0; a < ALPHABET_SIZE; a++) {
+            if (!is_prefix_edge(smack, r, GOTO(r, a)))
+                GOTO(r, a) = BASE_STATE;
         }
+        return;
     }
 
-    /* Build the fail state transitions for each valid state */
-    while (queue_has_more_items(queue)) {
-        unsigned r;
+    /* The fail state is where the state before us goes with the same
+     * character, after failing */
+    if (smack->m_parent[r] != BASE_STATE)
+        f = GOTO(GOTO_FAIL(smack->m_parent[r]), smack->m_parent_char[r]);
+    GOTO_FAIL(r) = f;
 
-        r = dequeue(queue);
+    /* We also match everything our fail state matches */
+    truncate_matches(&smack->m_match[r], smack->m_own_count[r]);
+    if (smack->m_match[f].m_count)
+        smack_copy_matches(&smack->m_match[r], smack->m_match[f].m_ids,
+            smack->m_match[f].m_count);
 
-        /* Find Final States for any Failure */
-        for (a = 0; a < ALPHABET_SIZE; a++) {
-            unsigned f;
+    for (a = 0; a < ALPHABET_SIZE; a++) {
+        unsigned s = GOTO(r, a);
 
-            s = GOTO(r, a);
-            if (s == FAIL)
-                continue;
-            if (s == r)
-                continue; /* snmp_hack, space_hack */
+        if (is_prefix_edge(smack, r, s))
+            continue;
+        if (s == r && smack->is_snmp_hack)
+            continue; /* snmp_hack, space_hack */
+        GOTO(r, a) = GOTO(f, a);
+    }
+}
 
-            enqueue(queue, s); /* Breadth first search on states */
+/****************************************************************************
+ * Run a function for each of the states, splitting them across threads.
+ * If 'states' is NULL, then it's all the states from 0 to 'count'.
+ ****************************************************************************/
+struct SmackJob {
+    struct SMACK *smack;
+    const unsigned *states;
+    unsigned begin;
+    unsigned end;
+    void (*fn)(struct SMACK *smack, unsigned state);
+};
 
-            f = GOTO_FAIL(r);
+static void *
+smack_job_run(void *v_job)
+{
+    struct SmackJob *job = (struct SmackJob *)v_job;
+    unsigned i;
 
-            while (GOTO(f, a) == FAIL)
-                f = GOTO_FAIL(f);
+    for (i = job->begin; i < job->end; i++)
+        job->fn(job->smack, job->states ? job->states[i] : i);
+    return NULL;
+}
 
-            GOTO_FAIL(s) = GOTO(f, a);
+static void
+smack_parallel(struct SMACK *smack, const unsigned *states, unsigned count,
+    void (*fn)(struct SMACK *smack, unsigned state))
+{
+    struct SmackJob jobs[SMACK_MAX_THREADS];
+    unsigned thread_count = smack->thread_count;
+    unsigned t;
+
+    if (thread_count > count / SMACK_PARALLEL_MIN)
+        thread_count = count / SMACK_PARALLEL_MIN;
+    if (thread_count == 0)
+        thread_count = 1;
+
+    for (t = 0; t < thread_count; t++) {
+        jobs[t].smack = smack;
+        jobs[t].states = states;
+        jobs[t].begin = (unsigned)((unsigned long long)count * t
+                                   / thread_count);
+        jobs[t].end = (unsigned)((unsigned long long)count * (t + 1)
+                                 / thread_count);
+        jobs[t].fn = fn;
+    }
 
-            if (smack->m_match[GOTO(f, a)].m_count)
-                smack_copy_matches(&smack->m_match[s],
-                    smack->m_match[GOTO(f, a)].m_ids,
-                    smack->m_match[GOTO(f, a)].m_count);
+#ifndef _WIN32
+    if (thread_count > 1) {
+        pthread_t threads[SMACK_MAX_THREADS];
+        int is_started[SMACK_MAX_THREADS];
+
+        /* If we can't start a thread, we do its part ourselves */
+        for (t = 1; t < thread_count; t++)
+            is_started[t] = (pthread_create(&threads[t], NULL, smack_job_run,
+                                 &jobs[t]) == 0);
+        smack_job_run(&jobs[0]);
+        for (t = 1; t < thread_count; t++) {
+            if (is_started[t])
+                pthread_join(threads[t], NULL);
+            else
+                smack_job_run(&jobs[t]);
         }
+        return;
     }
-
-    queue_destroy(queue);
+#endif
+    for (t = 0; t < thread_count; t++)
+        smack_job_run(&jobs[t]);
 }
 
 /****************************************************************************
+ * Run a function for the states in the list, one level at a time, for
+ * work where each level only depends on the ones before. The states in
+ * each level can be done in parallel. If 'states' is NULL, then it's all
+ * of them.
  ****************************************************************************/
 static void
-smack_stage2_link_fails(struct SMACK *smack)
+smack_for_each_level(struct SMACK *smack, const unsigned *states,
+    unsigned count, void (*fn)(struct SMACK *smack, unsigned state))
 {
-    unsigned a;
-    struct Queue *queue;
+    unsigned *sorted;
+    unsigned *level_start;
+    unsigned max_depth = 0;
+    unsigned i;
+    unsigned d;
 
-    queue = queue_create();
+    /* Sort the states by depth */
+    for (i = 0; i < count; i++) {
+        if (max_depth < smack->m_depth[states ? states[i] : i])
+            max_depth = smack->m_depth[states ? states[i] : i];
+    }
+    level_start = (unsigned *)calloc(max_depth + 2, sizeof(*level_start));
+    sorted = (unsigned *)malloc(sizeof(*sorted) * (count + 1));
+    if (level_start == NULL || sorted == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    for (i = 0; i < count; i++)
+        level_start[smack->m_depth[states ? states[i] : i] + 1]++;
+    for (d = 0; d < max_depth; d++)
+        level_start[d + 1] += level_start[d];
+    for (i = 0; i < count; i++) {
+        unsigned state = states ? states[i] : i;
+        sorted[level_start[smack->m_depth[state]]++] = state;
+    }
 
-    for (a = 0; a < ALPHABET_SIZE; a++) {
-        if (GOTO(BASE_STATE, a) != BASE_STATE)
-            enqueue(queue, GOTO(BASE_STATE, a));
+    /* Now 'level_start[d]' is the end of level 'd' */
+    for (d = 0; d <= max_depth; d++) {
+        unsigned start = d ? level_start[d - 1] : 0;
+        smack_parallel(smack, sorted + start, level_start[d] - start, fn);
     }
 
-    while (queue_has_more_items(queue)) {
-        unsigned r;
+    free(sorted);
+    free(level_start);
+}
 
-        r = dequeue(queue);
+/****************************************************************************
+ * Link the states in the list, or all of them if 'states' is NULL.
+ ****************************************************************************/
+static void
+smack_stage1_link_states(
+    struct SMACK *smack, const unsigned *states, unsigned count)
+{
+    smack_for_each_level(smack, states, count, smack_link_state);
+}
 
-        for (a = 0; a < ALPHABET_SIZE; a++) {
-            if (GOTO(r, a) == FAIL)
-                GOTO(r, a) = GOTO(GOTO_FAIL(r), a);
-            else if (GOTO(r, a) == r)
-                ; /* snmp_hack, space_hack */
-            else
-                enqueue(queue, GOTO(r, a));
-        }
-    }
+/****************************************************************************
+ * How many of a state's matches are reported, depending on the match
+ * mode. Its own patterns come first, and are the longest.
+ ****************************************************************************/
+static unsigned
+final_match_count(const struct SMACK *smack, unsigned s)
+{
+    unsigned count = smack->m_match[s].m_count;
 
-    queue_destroy(queue);
+    if (smack->is_leftmost)
+        count = smack->m_own_count[s];
+    if (smack->match_mode != SMACK_MATCH_ALL && count > 1)
+        count = 1;
+    return count;
 }
 
 /****************************************************************************
+ * Mark the states that get a row in the table, which are the ones closest
+ * to the start, as many as fit in the 'dense_size'. If the whole table
+ * fits, or the patterns can't use sparse states, then that's all of them.
  ****************************************************************************/
 static void
-smack_stage4_make_final_table(struct SMACK *smack)
+smack_choose_dense(
+    struct SMACK *smack, unsigned char *is_dense, int is_sparse_possible)
 {
-    unsigned row;
-    unsigned row_count = smack->m_state_count;
-    unsigned column_count;
-    transition_t *table;
-    unsigned char *char_to_symbol = smack->char_to_symbol;
+    unsigned count = smack->m_state_count;
+    unsigned row_shift = row_shift_from_symbol_count(smack->symbol_count);
+    size_t row_size;
+    unsigned dense_count;
+    unsigned *depth_count;
+    unsigned max_depth = 0;
+    unsigned depth;
+    unsigned i;
 
-    /*
-     * Figure out the row-size-shift. Instead of doing a multiply by the
-     * row-width, we expand it out to the nearest pattern of two, and
-     * then use shifts instead of multiplies.
-     */
-    smack->row_shift = row_shift_from_symbol_count(smack->symbol_count);
-    column_count = 1 << smack->row_shift;
+    row_size = ((size_t)1 << row_shift) * (count > 0x10000
+                                                 ? sizeof(transition32_t)
+                                                 : sizeof(transition16_t));
+    if (!is_sparse_possible || (size_t)count * row_size <= smack->dense_size) {
+        memset(is_dense, 1, count);
+        return;
+    }
+    dense_count = (unsigned)(smack->dense_size / row_size);
+    if (dense_count == 0)
+        dense_count = 1;
 
-    /*
-     * Allocate table:
-     * rows*columns
-     */
-    table = malloc(sizeof(transition_t) * row_count * column_count);
-    if (table == NULL) {
+    /* Find the depth where we run out, so the states before it are dense,
+     * and the first few at that depth */
+    for (i = 0; i < count; i++) {
+        if (max_depth < smack->m_depth[i])
+            max_depth = smack->m_depth[i];
+    }
+    depth_count = (unsigned *)calloc(max_depth + 1, sizeof(*depth_count));
+    if (depth_count == NULL) {
         fprintf(stderr, "%s: out of memory error\n", "smack");
         exit(1);
     }
-    memset(table, 0, sizeof(transition_t) * row_count * column_count);
-
-    for (row = 0; row < row_count; row++) {
-        unsigned col;
-
-        for (col = 0; col < ALPHABET_SIZE; col++) {
-            unsigned transition;
-            unsigned symbol = char_to_symbol[col];
-
-            transition = GOTO(row, col);
-
-            *(table + row * column_count + symbol) = (transition_t)transition;
+    for (i = 0; i < count; i++)
+        depth_count[smack->m_depth[i]]++;
+    for (depth = 0; depth_count[depth] < dense_count; depth++)
+        dense_count -= depth_count[depth];
+    for (i = 0; i < count; i++) {
+        is_dense[i] = (smack->m_depth[i] < depth);
+        if (smack->m_depth[i] == depth && dense_count) {
+            is_dense[i] = 1;
+            dense_count--;
         }
     }
-
-    smack->table = table;
+    free(depth_count);
 }
 
 /****************************************************************************
+ * Number the states for the final table, so that all MATCHES are at the
+ * end, which lets the search check for a match with a compare. If there
+ * are sparse states, they come after the dense ones, and the dense states
+ * with matches come before them, so the search can check for either with
+ * a single compare, then sort it out.
  ****************************************************************************/
 static void
-swap_rows(struct SMACK *smack, unsigned row0, unsigned row1)
+smack_stage3_sort(struct SMACK *smack, int is_sparse_possible)
 {
-    struct SmackRow swap;
-    struct SmackMatches swapm;
-    unsigned s;
-
-    /* Swap the first two states */
-    memcpy(&swap, &smack->m_state_table[row0], sizeof(swap));
-    memcpy(
-        &smack->m_state_table[row0], &smack->m_state_table[row1], sizeof(swap));
-    memcpy(&smack->m_state_table[row1], &swap, sizeof(swap));
-
-    /* Swap the 'match' info */
-    memcpy(&swapm, &smack->m_match[row0], sizeof(swapm));
-    memcpy(&smack->m_match[row0], &smack->m_match[row1], sizeof(swapm));
-    memcpy(&smack->m_match[row1], &swapm, sizeof(swapm));
+    unsigned count = smack->m_state_count;
+    unsigned char *is_dense;
+    unsigned next = 0;
+    unsigned pass;
+    unsigned i;
 
-    /* Now reset any pointers to the swapped states in exisitng states */
-    for (s = 0; s < smack->m_state_count; s++) {
-        unsigned a;
-        for (a = 0; a < ALPHABET_SIZE; a++) {
-            if (GOTO(s, a) == row0)
-                GOTO(s, a) = row1;
-            else if (GOTO(s, a) == row1)
-                GOTO(s, a) = row0;
+    smack->m_final_row = (unsigned *)malloc(sizeof(unsigned) * count);
+    is_dense = (unsigned char *)malloc(count);
+    if (smack->m_final_row == NULL || is_dense == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    smack_choose_dense(smack, is_dense, is_sparse_possible);
+
+    /* Dense without matches, dense with matches, then the same for
+     * the sparse ones */
+    for (pass = 0; pass < 4; pass++) {
+        for (i = 0; i < count; i++) {
+            unsigned s = i;
+
+            /* If we have an anchor pattern, then the search starts in the
+             * anchor state instead, so swap the first two states */
+            if (smack->is_anchor_begin && i <= UNANCHORED_STATE)
+                s = UNANCHORED_STATE - i;
+
+            if ((final_match_count(smack, s) != 0) == (pass & 1)
+                && (is_dense[s] == 0) == (pass >> 1))
+                smack->m_final_row[s] = next++;
         }
+        if (pass == 0)
+            smack->m_match_limit = next;
+        if (pass == 1)
+            smack->m_sparse_begin = next;
+        if (pass == 2)
+            smack->m_sparse_match = next;
     }
+    free(is_dense);
 }
 
 /****************************************************************************
- * Sort the states so that all MATCHES are at the end
+ * Copy a row of the intermediate table to the final table, where it has
+ * a new number, as do the states it goes to.
  ****************************************************************************/
+static unsigned
+sparse_edges(const struct SMACK *smack, unsigned r, unsigned *edges);
+
 static void
-smack_stage3_sort(struct SMACK *smack)
+smack_make_final_row(struct SMACK *smack, unsigned r)
 {
-    unsigned start = 0;
-    unsigned end = smack->m_state_count;
-
-    for (;;) {
-
-        while (start < end && smack->m_match[start].m_count == 0)
-            start++;
-        while (start < end && smack->m_match[end - 1].m_count != 0)
-            end--;
-
-        if (start >= end)
-            break;
-
-        swap_rows(smack, start, end - 1);
+    const unsigned *final_row = smack->m_final_row;
+    size_t row_start = row_index(smack, final_row[r]);
+    unsigned col;
+
+    /* For a sparse state, just count its edges for now, see
+     * "smack_make_sparse_edges()" */
+    if (final_row[r] >= smack->m_sparse_begin) {
+        struct SmackSparse *sparse
+            = &smack->m_sparse[final_row[r] - smack->m_sparse_begin];
+        unsigned edges[ALPHABET_SIZE];
+
+        sparse->first = sparse_edges(smack, r, edges);
+        sparse->fail = final_row[GOTO_FAIL(r)];
+        return;
     }
 
-    smack->m_match_limit = start;
+    for (col = 0; col < ALPHABET_SIZE; col++) {
+        transition_set(smack, row_start + smack->char_to_symbol[col],
+            final_row[GOTO(r, col)]);
+    }
+}
+
+/****************************************************************************
+ * Find the transitions of a sparse state that go deeper, putting them in
+ * 'edges', and returning how many there are.
+ ****************************************************************************/
+static unsigned
+sparse_edges(const struct SMACK *smack, unsigned r, unsigned *edges)
+{
+    unsigned count = 0;
+    unsigned col;
+
+    for (col = 0; col < ALPHABET_SIZE; col++) {
+        unsigned s = GOTO(r, col);
+        unsigned symbol = smack->char_to_symbol[col];
+        unsigned i;
+
+        if (!is_prefix_edge(smack, r, s))
+            continue;
+
+        /* With nocase, several characters have the same symbol */
+        for (i = 0; i < count && (edges[i] & 0xFF) != symbol; i++)
+            ;
+        if (i == count)
+            edges[count++] = smack->m_final_row[s] << 8 | symbol;
+    }
+    return count;
+}
+
+/****************************************************************************
+ * Once we know where each sparse state's edges go, fill them in.
+ ****************************************************************************/
+static void
+smack_make_sparse_edges(struct SMACK *smack, unsigned r)
+{
+    unsigned row = smack->m_final_row[r];
+
+    if (row >= smack->m_sparse_begin) {
+        sparse_edges(smack, r,
+            smack->m_sparse_edges
+                + smack->m_sparse[row - smack->m_sparse_begin].first);
+    }
+}
+
+/****************************************************************************
+ * For leftmost-longest, the same as "smack_make_final_row()", except that
+ * the transitions that aren't prefixes of patterns go the way of our own
+ * "fail" state in the final table, or to the dead state. Since we look at
+ * the rows of our parent and "fail" states, this must be done one level
+ * at a time.
+ ****************************************************************************/
+static void
+smack_make_leftmost_row(struct SMACK *smack, unsigned r)
+{
+    const unsigned *final_row = smack->m_final_row;
+    struct SmackLeftmost *lm = smack->m_leftmost;
+    unsigned dead = smack->m_leftmost_dead;
+    unsigned row = final_row[r];
+    size_t row_start = row_index(smack, row);
+    unsigned fail = row;
+    unsigned col;
+
+    lm[row].pend = LEFTMOST_NONE;
+    lm[row].lag = 0;
+    lm[row].parent = row;
+    lm[row].symbol = 0;
+
+    if (r != BASE_STATE) {
+        unsigned parent = final_row[smack->m_parent[r]];
+        unsigned symbol = smack->char_to_symbol[smack->m_parent_char[r]];
+
+        /* Once we have a match, we don't look for ones that start later */
+        if (smack->m_own_count[r])
+            fail = dead;
+        else if (parent == BASE_STATE)
+            fail = BASE_STATE;
+        else if (smack->m_final_fail[parent] == dead)
+            fail = dead;
+        else
+            fail = transition_get(smack,
+                row_index(smack, smack->m_final_fail[parent]) + symbol);
+
+        /* The pending match is our own, else the one that our "fail"
+         * state has right there, else the one from before */
+        if (smack->m_own_count[r]) {
+            lm[row].pend = row;
+        } else if (fail != dead && lm[fail].pend != LEFTMOST_NONE
+                   && lm[fail].lag == 0) {
+            lm[row].pend = lm[fail].pend;
+        } else if (lm[parent].pend != LEFTMOST_NONE) {
+            lm[row].pend = lm[parent].pend;
+            lm[row].lag = lm[parent].lag + 1;
+        }
+        lm[row].parent = parent;
+        lm[row].symbol = symbol;
+    }
+    smack->m_final_fail[row] = fail;
+
+    for (col = 0; col < ALPHABET_SIZE; col++) {
+        unsigned s = GOTO(r, col);
+        unsigned symbol = smack->char_to_symbol[col];
+        unsigned next;
+
+        if (is_prefix_edge(smack, r, s))
+            next = final_row[s];
+        else if (r == BASE_STATE)
+            next = row;
+        else if (fail == dead)
+            next = dead;
+        else
+            next = transition_get(smack, row_index(smack, fail) + symbol);
+        transition_set(smack, row_start + symbol, next);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+smack_stage4_make_final_table(struct SMACK *smack)
+{
+    unsigned row;
+    unsigned row_count = smack->m_state_count;
+    unsigned dense_count = smack->m_sparse_begin;
+    unsigned column_count;
+    size_t transition_size;
+    struct SmackMatches *final_match;
+
+    /*
+     * Figure out the row-size-shift. Instead of doing a multiply by the
+     * row-width, we expand it out to the nearest pattern of two, and
+     * then use shifts instead of multiplies.
+     */
+    smack->row_shift = row_shift_from_symbol_count(smack->symbol_count);
+
+    /*
+     * Use the narrowest transitions that can hold all the rows
+     */
+    if (row_count > SMACK_MAX_STATES) {
+        fprintf(stderr, "%s: too many states (%u)\n", "smack", row_count);
+        exit(1);
+    }
+    smack->is_table32 = (row_count + smack->is_leftmost > 0x10000);
+    if (smack->is_table32)
+        transition_size = sizeof(transition32_t);
+    else
+        transition_size = sizeof(transition16_t);
+
+    /*
+     * Once the table is too big for the cache, cache misses cost more
+     * than the extra instruction of the shift-add, so use rows 3/4 as
+     * wide if that's enough
+     */
+    smack->is_shift_add = 0;
+    if ((((size_t)dense_count << smack->row_shift) * transition_size
+            > smack_shift_add_size)
+        && smack->row_shift >= 2
+        && (3U << (smack->row_shift - 2)) > smack->symbol_count) {
+        smack->row_shift -= 2;
+        smack->is_shift_add = 1;
+    }
+    column_count = (unsigned)row_index(smack, 1);
+
+    /*
+     * Allocate table:
+     * rows*columns, for the dense states, and the list of sparse states
+     */
+    smack->table = malloc(transition_size * dense_count * column_count);
+    if (smack->table == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    memset(smack->table, 0, transition_size * dense_count * column_count);
+    free(smack->m_sparse);
+    free(smack->m_sparse_edges);
+    smack->m_sparse = 0;
+    smack->m_sparse_edges = 0;
+    smack->m_sparse_edge_count = 0;
+    if (dense_count < row_count) {
+        smack->m_sparse = (struct SmackSparse *)calloc(
+            row_count - dense_count + 1, sizeof(*smack->m_sparse));
+        if (smack->m_sparse == NULL) {
+            fprintf(stderr, "%s: out of memory error\n", "smack");
+            exit(1);
+        }
+    }
+
+    free(smack->m_leftmost);
+    smack->m_leftmost = 0;
+    if (smack->is_leftmost) {
+        smack->m_leftmost = (struct SmackLeftmost *)malloc(
+            sizeof(*smack->m_leftmost) * row_count);
+        smack->m_final_fail = (unsigned *)malloc(sizeof(unsigned) * row_count);
+        if (smack->m_leftmost == NULL || smack->m_final_fail == NULL) {
+            fprintf(stderr, "%s: out of memory error\n", "smack");
+            exit(1);
+        }
+        smack->m_leftmost_dead = row_count;
+        smack_for_each_level(smack, NULL, row_count, smack_make_leftmost_row);
+        free(smack->m_final_fail);
+        smack->m_final_fail = 0;
+    } else
+        smack_parallel(smack, NULL, row_count, smack_make_final_row);
+
+    /* Now that we've counted the edges of the sparse states, we know
+     * where each one's list starts */
+    if (smack->m_sparse) {
+        unsigned first = 0;
+
+        for (row = 0; row <= row_count - dense_count; row++) {
+            unsigned edge_count = smack->m_sparse[row].first;
+            smack->m_sparse[row].first = first;
+            first += edge_count;
+        }
+        smack->m_sparse_edge_count = first;
+        smack->m_sparse_edges = (unsigned *)malloc(
+            sizeof(unsigned) * (first + 1));
+        if (smack->m_sparse_edges == NULL) {
+            fprintf(stderr, "%s: out of memory error\n", "smack");
+            exit(1);
+        }
+        smack_parallel(smack, NULL, row_count, smack_make_sparse_edges);
+    }
+
+    /*
+     * The matches go in the same order, cut down for the match mode. In
+     * incremental mode, we keep the intermediate ones, and the final ones
+     * share their ids.
+     */
+    final_match = (struct SmackMatches *)malloc(
+        sizeof(*final_match) * (row_count + 1));
+    if (final_match == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    for (row = 0; row < row_count; row++) {
+        struct SmackMatches *match = &final_match[smack->m_final_row[row]];
+
+        *match = smack->m_match[row];
+        match->m_count = final_match_count(smack, row);
+        if (match->m_count == 0 && !smack->is_incremental) {
+            free(match->m_ids);
+            match->m_ids = 0;
+        }
+    }
+    if (smack->is_incremental)
+        smack->m_trie_match = smack->m_match;
+    else
+        free(smack->m_match);
+    smack->m_match = final_match;
+
+    free(smack->m_final_row);
+    smack->m_final_row = 0;
 }
 
 /****************************************************************************
@@ -1102,10 +1811,10 @@ smack_fixup_wildcards(struct SMACK *smack)
         for (j = 0; j < pat->pattern_length; j++) {
             unsigned row = 0;
             unsigned offset = 0;
-            size_t row_size = ((size_t)1 << smack->row_shift);
-            transition_t *table;
-            transition_t next_pattern;
-            transition_t base_state = (smack->is_anchor_begin ? 1 : 0);
+            size_t row_size = row_index(smack, 1);
+            size_t row_start;
+            unsigned next_pattern;
+            unsigned base_state = (smack->is_anchor_begin ? 1 : 0);
             size_t k;
 
             /* Skip non-wildcard characters */
@@ -1118,413 +1827,3060 @@ smack_fixup_wildcards(struct SMACK *smack)
                     smack, &row, pat->pattern, &offset, (unsigned)j);
 
             row = row & 0xFFFFFF;
-            table = smack->table + (row << smack->row_shift);
-            next_pattern = table[smack->char_to_symbol['*']];
+            row_start = row_index(smack, row);
+            next_pattern = transition_get(
+                smack, row_start + smack->char_to_symbol['*']);
 
             for (k = 0; k < row_size; k++) {
-                if (table[k] == base_state)
-                    table[k] = next_pattern;
+                if (transition_get(smack, row_start + k) == base_state)
+                    transition_set(smack, row_start + k, next_pattern);
             }
         }
     }
 }
 /****************************************************************************
+ * Find the first candidate position, one byte at a time. This is used
+ * when the CPU has no SIMD, and for the last few bytes otherwise.
  ****************************************************************************/
-void
-smack_compile(struct SMACK *smack)
+static size_t
+prefilter_find_scalar(const struct SmackPrefilter *pf, const unsigned char *px,
+    size_t i, size_t limit)
 {
-    unsigned i;
-
-    /*
-     * Fix up the symbol table to handle "anchors" and "nocase" conditions.
-     */
-    if (smack->is_anchor_begin)
-        smack_add_symbol(smack, CHAR_ANCHOR_START);
-    if (smack->is_anchor_end)
-        smack_add_symbol(smack, CHAR_ANCHOR_END);
-    if (smack->is_nocase) {
-        for (i = 'A'; i <= 'Z'; i++) {
-            smack->char_to_symbol[i] = smack->char_to_symbol[tolower(i)];
+    const unsigned char *m0 = pf->masks[0];
+    const unsigned char *m1 = pf->masks[1];
+    const unsigned char *m2 = pf->masks[2];
+
+    switch (pf->width) {
+    case 1:
+        for (; i < limit; i++) {
+            if (m0[px[i]])
+                return i;
+        }
+        break;
+    case 2:
+        for (; i < limit; i++) {
+            if (m0[px[i]] & m1[px[i + 1]])
+                return i;
         }
+        break;
+    default:
+        for (; i < limit; i++) {
+            if (m0[px[i]] & m1[px[i + 1]] & m2[px[i + 2]])
+                return i;
+        }
+        break;
     }
+    return limit;
+}
 
-    /*
-     * Calculate the maximum possible number of states. This will be somewhat
-     * larger than the number of states we'll actually use because there can
-     * be overlaps
-     */
-    smack->m_state_max = 1;
-    for (i = 0; i < smack->m_pattern_count; i++) {
-        struct SmackPattern *pat = smack->m_pattern_list[i];
+#ifdef SMACK_HAVE_X86
+/****************************************************************************
+ * Look up the bucket bits for 16 bytes, using each nibble as an index.
+ ****************************************************************************/
+__attribute__((target("sse4.2"))) static inline __m128i
+prefilter_sse_lookup(__m128i lo, __m128i hi, __m128i x)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F);
 
-        smack->m_state_max += pat->pattern_length;
-        smack->m_state_max += pat->is_anchor_begin;
-        smack->m_state_max += pat->is_anchor_end;
+    return _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, nibble)),
+        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(x, 4), nibble)));
+}
+
+/****************************************************************************
+ * Check 16 positions at a time. The bytes that follow each position are
+ * checked by loading the input again at an offset of 1 and 2 bytes.
+ ****************************************************************************/
+__attribute__((target("sse4.2"))) static size_t
+prefilter_find_sse42(const struct SmackPrefilter *pf, const unsigned char *px,
+    size_t i, size_t limit)
+{
+    unsigned width = pf->width;
+    __m128i lo[PREFILTER_MAX_WIDTH];
+    __m128i hi[PREFILTER_MAX_WIDTH];
+    unsigned t;
+
+    for (t = 0; t < width; t++) {
+        lo[t] = _mm_loadu_si128((const __m128i *)pf->lo[t]);
+        hi[t] = _mm_loadu_si128((const __m128i *)pf->hi[t]);
     }
 
-    /*
-     * Allocate a state-table that can hold that number of states
-     */
-    create_intermediate_table(smack, smack->m_state_max);
-    create_matches_table(smack, smack->m_state_max);
+    for (; i + 16 <= limit; i += 16) {
+        __m128i m;
+        unsigned bits;
 
-    /*
-     * Go through the various compilation stages
-     */
-    smack_stage0_compile_prefixes(smack);
-    smack_stage1_generate_fails(smack);
-    smack_stage2_link_fails(smack);
+        m = prefilter_sse_lookup(lo[0], hi[0],
+            _mm_loadu_si128((const __m128i *)(px + i)));
+        for (t = 1; t < width; t++)
+            m = _mm_and_si128(m, prefilter_sse_lookup(lo[t], hi[t],
+                _mm_loadu_si128((const __m128i *)(px + i + t))));
 
-    /* If we have an anchor pattern, then swap
-     * the first two states. */
-    if (smack->is_anchor_begin) {
-        swap_rows(smack, BASE_STATE, UNANCHORED_STATE);
+        bits = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(m, _mm_setzero_si128())) ^ 0xFFFF;
+        if (bits)
+            return i + __builtin_ctz(bits);
     }
+    return prefilter_find_scalar(pf, px, i, limit);
+}
 
-    /* prettify table for debugging */
-    smack_stage3_sort(smack);
+/****************************************************************************
+ ****************************************************************************/
+__attribute__((target("avx2"))) static inline __m256i
+prefilter_avx2_lookup(__m256i lo, __m256i hi, __m256i x)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
 
-    /*
-     * Build the final table we use for evaluation
-     */
-    smack_stage4_make_final_table(smack);
+    return _mm256_and_si256(
+        _mm256_shuffle_epi8(lo, _mm256_and_si256(x, nibble)),
+        _mm256_shuffle_epi8(
+            hi, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+}
 
-    /*
-     * Fixup the wildcard states
-     */
-    smack_fixup_wildcards(smack);
+/****************************************************************************
+ * The same as the SSE version, but 32 positions at a time. Since
+ * `vpshufb` looks up each 16-byte lane separately, the tables are
+ * duplicated into both lanes.
+ ****************************************************************************/
+__attribute__((target("avx2"))) static size_t
+prefilter_find_avx2(const struct SmackPrefilter *pf, const unsigned char *px,
+    size_t i, size_t limit)
+{
+    unsigned width = pf->width;
+    __m256i lo[PREFILTER_MAX_WIDTH];
+    __m256i hi[PREFILTER_MAX_WIDTH];
+    unsigned t;
+
+    for (t = 0; t < width; t++) {
+        lo[t] = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)pf->lo[t]));
+        hi[t] = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)pf->hi[t]));
+    }
 
-    /*
-     * Get rid of the original pattern tables, since we no longer need them.
-     * However, if this is a debug build, keep the tables around to make
-     * debugging easier
-     */
-#ifndef DEBUG
-    destroy_pattern_table(smack);
-    destroy_intermediate_table(smack);
+    for (; i + 32 <= limit; i += 32) {
+        __m256i m;
+        unsigned bits;
+
+        m = prefilter_avx2_lookup(lo[0], hi[0],
+            _mm256_loadu_si256((const __m256i *)(px + i)));
+        for (t = 1; t < width; t++)
+            m = _mm256_and_si256(m, prefilter_avx2_lookup(lo[t], hi[t],
+                _mm256_loadu_si256((const __m256i *)(px + i + t))));
+
+        bits = ~(unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(m, _mm256_setzero_si256()));
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return prefilter_find_sse42(pf, px, i, limit);
+}
+#endif
+
+/****************************************************************************
+ * Pick the implementation of the prefilter, falling back to the scalar
+ * version if the CPU doesn't support the one requested.
+ ****************************************************************************/
+static void
+prefilter_set_isa(struct SmackPrefilter *pf, enum scan_isa_t isa)
+{
+    pf->requested_isa = isa;
+    if (isa == SCAN_ISA_AUTO) {
+        if (scan_isa_is_supported(SCAN_ISA_AVX2))
+            isa = SCAN_ISA_AVX2;
+        else if (scan_isa_is_supported(SCAN_ISA_SSE42))
+            isa = SCAN_ISA_SSE42;
+    }
+    if (!scan_isa_is_supported(isa))
+        isa = SCAN_ISA_SCALAR;
+
+    switch (isa) {
+#ifdef SMACK_HAVE_X86
+    case SCAN_ISA_AVX2:
+        pf->find = prefilter_find_avx2;
+        break;
+    case SCAN_ISA_SSE42:
+        pf->find = prefilter_find_sse42;
+        break;
 #endif
+    default:
+        pf->find = prefilter_find_scalar;
+        break;
+    }
 }
 
 /****************************************************************************
- * Found!
- *
- * We found one or more patterns in the input stream. Go through the list
- * and notify the caller of "smack_search()" which ones we found.
  ****************************************************************************/
-static unsigned
-handle_match(const struct SMACK *smack, unsigned index,
-    int (*callback_function)(size_t id, int index, void *callback_data),
-    void *callback_data, unsigned state)
+void
+smack_set_prefilter(struct SMACK *smack, int is_enabled, enum scan_isa_t isa)
 {
-    unsigned i;
-    struct SmackMatches *match = &smack->m_match[state];
+    smack->prefilter.is_disabled = !is_enabled;
+    prefilter_set_isa(&smack->prefilter, isa);
+}
 
-    /*
-     * Notify caller of all possible matches.
-     */
-    for (i = 0; i < match->m_count; i++) {
-        size_t id = match->m_ids[i];
-        callback_function(id, index, callback_data);
-    }
+/****************************************************************************
+ * Sort patterns so that those with similar starts go into the same
+ * bucket, which makes the prefilter more selective.
+ ****************************************************************************/
+static int
+compare_patterns(const void *lhs, const void *rhs)
+{
+    const struct SmackPattern *a = *(const struct SmackPattern *const *)lhs;
+    const struct SmackPattern *b = *(const struct SmackPattern *const *)rhs;
+    size_t length = a->pattern_length;
+    int x;
+
+    if (length > b->pattern_length)
+        length = b->pattern_length;
+    x = memcmp(a->pattern, b->pattern, length);
+    if (x == 0 && a->pattern_length != b->pattern_length)
+        x = (a->pattern_length < b->pattern_length) ? -1 : 1;
+    return x;
+}
 
-    return match->m_count;
+/****************************************************************************
+ ****************************************************************************/
+static void
+prefilter_add_byte(
+    struct SmackPrefilter *pf, unsigned t, unsigned char c, unsigned bucket)
+{
+    pf->lo[t][c & 0x0F] |= (unsigned char)(1 << bucket);
+    pf->hi[t][c >> 4] |= (unsigned char)(1 << bucket);
 }
 
 /****************************************************************************
+ * Build the prefilter tables from the first few bytes of each pattern.
+ * This must be done before the patterns are discarded.
  ****************************************************************************/
-unsigned
-smack_search(const struct SMACK *smack, const void *v_px, unsigned length,
-    FOUND_CALLBACK cb_found, void *callback_data, unsigned *current_state)
+static void
+smack_stage5_make_prefilter(struct SMACK *smack)
 {
-    const unsigned char *px = (const unsigned char *)v_px;
-    unsigned row;
+    struct SmackPrefilter *pf = &smack->prefilter;
+    struct SmackPattern **list;
+    unsigned count = smack->m_pattern_count;
+    size_t min_length = ~(size_t)0;
+    unsigned candidates = 0;
     unsigned i;
-    const unsigned char *char_to_symbol = smack->char_to_symbol;
-    transition_t *table = smack->table;
-    unsigned row_shift = smack->row_shift;
-    unsigned found_count = 0;
-    const struct SmackMatches *match = smack->m_match;
+    unsigned t;
 
-    /* Get the row. This is encoded as the lower 24-bits of the state
-     * variable */
-    row = *current_state & 0xFFFFFF;
+    memset(pf->lo, 0, sizeof(pf->lo));
+    memset(pf->hi, 0, sizeof(pf->hi));
+    memset(pf->masks, 0, sizeof(pf->masks));
+    pf->is_possible = 0;
+    prefilter_set_isa(pf, pf->requested_isa);
 
-    /* 'for all bytes in this block' */
-    for (i = 0; i < length; i++) {
-        unsigned char column;
-        unsigned char c;
+    /*
+     * The prefilter relies on the search restarting in the BASE_STATE
+     * whenever no pattern is partly matched, which isn't true with
+     * anchors, and wildcards can match any byte.
+     */
+    if (count == 0 || smack->is_anchor_begin || smack->is_anchor_end)
+        return;
+    for (i = 0; i < count; i++) {
+        struct SmackPattern *pat = smack->m_pattern_list[i];
+        if (pat->is_wildcards || pat->is_snmp_hack)
+            return;
+        if (min_length > pat->pattern_length)
+            min_length = pat->pattern_length;
+    }
+    pf->width = PREFILTER_MAX_WIDTH;
+    if (pf->width > min_length)
+        pf->width = (unsigned)min_length;
 
-        /* Get the next character of input */
-        c = px[i];
+    list = (struct SmackPattern **)malloc(sizeof(*list) * count);
+    if (list == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    memcpy(list, smack->m_pattern_list, sizeof(*list) * count);
+    qsort(list, count, sizeof(*list), compare_patterns);
 
-        /* Convert that character into a symbol. This compresses the table.
-         * Even though there are 256 possible combinations for a byte, we
-         * are probably using fewer than 32 individual characters in the
-         * patterns we are looking for. This step allows us to create tables
-         * that are only 32 elements wide, instead of 256 elements wide */
-        column = char_to_symbol[c];
+    for (i = 0; i < count; i++) {
+        unsigned bucket = (unsigned)((size_t)i * PREFILTER_BUCKETS / count);
 
-        /*
-         * If debugging, and the variable is set, then print out the
-         * transition to the command line. This is a good way of visualizing
-         * how they work.
-         */
-#ifdef DEBUG
-        if (print_transitions) {
-            printf("%s+%c = %s%s\n", smack->m_match[row].DEBUG_name, c,
-                smack->m_match[*(table + (row << row_shift) + column)]
-                    .DEBUG_name,
-                smack->m_match[*(table + (row << row_shift) + column)].m_count
-                    ? "$$"
-                    : "");
-            print_transitions--;
+        for (t = 0; t < pf->width; t++) {
+            unsigned char c = list[i]->pattern[t];
+
+            prefilter_add_byte(pf, t, c, bucket);
+            if (smack->is_nocase && islower(c))
+                prefilter_add_byte(pf, t, (unsigned char)toupper(c), bucket);
         }
-#endif
+    }
+    free(list);
 
-        /*
-         * STATE TRANSITION
-         * Given the current row, lookup the symbol, and find the next row.
-         * Logically, this is the following  calculation:
-         *    row = table[row][column]
-         * However, since row can have a variable width (depending on the
-         * number of characters in a pattern), we have to do the calculation
-         * manually.
-         */
-        row = *(table + (row << row_shift) + column);
+    for (t = 0; t < pf->width; t++) {
+        unsigned c;
+        for (c = 0; c < 256; c++)
+            pf->masks[t][c] = pf->lo[t][c & 0x0F] & pf->hi[t][c >> 4];
+    }
 
-        /* Test to see if we have one (or more) matches, and if so, call
-         * the callback function */
-        if (match[row].m_count)
-            found_count = handle_match(smack, i, cb_found, callback_data, row);
+    /* If patterns can start with most bytes, the prefilter would only
+     * slow things down */
+    for (i = 0; i < 256; i++) {
+        if (pf->masks[0][i])
+            candidates++;
     }
-    *current_state = row;
+    if (candidates <= 128)
+        pf->is_possible = 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+smack_set_threads(struct SMACK *smack, unsigned thread_count)
+{
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > SMACK_MAX_THREADS)
+        thread_count = SMACK_MAX_THREADS;
+    smack->thread_count = thread_count;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+smack_set_incremental(struct SMACK *smack, int is_incremental)
+{
+    smack->is_incremental = (is_incremental != 0);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+smack_set_match_mode(struct SMACK *smack, enum smack_match_mode mode)
+{
+    smack->match_mode = mode;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+smack_set_dense_size(struct SMACK *smack, size_t size)
+{
+    smack->dense_size = size;
+}
+
+/****************************************************************************
+ * Count what the search uses, not the intermediate tables kept for
+ * compiling, nor the patterns.
+ ****************************************************************************/
+size_t
+smack_memory_size(const struct SMACK *smack)
+{
+    size_t size = 0;
+    unsigned i;
+
+    if (smack->table == NULL)
+        return 0;
+    size += (size_t)smack->m_sparse_begin * row_index(smack, 1)
+            * (smack->is_table32 ? sizeof(transition32_t)
+                                 : sizeof(transition16_t));
+    size += sizeof(*smack->m_match) * smack->m_state_count;
+    for (i = 0; i < smack->m_state_count; i++)
+        size += sizeof(size_t) * smack->m_match[i].m_count;
+    if (smack->m_sparse) {
+        size += sizeof(*smack->m_sparse)
+                * (smack->m_state_count - smack->m_sparse_begin + 1);
+        size += sizeof(*smack->m_sparse_edges) * smack->m_sparse_edge_count;
+    }
+    if (smack->m_leftmost)
+        size += sizeof(*smack->m_leftmost) * smack->m_state_count;
+    return size;
+}
+
+/****************************************************************************
+ * Patterns with anchors, wildcards, or the SNMP hack change the states in
+ * ways that can't be redone for just part of the table.
+ ****************************************************************************/
+static int
+smack_is_incremental_possible(const struct SMACK *smack)
+{
+    unsigned i;
+
+    if (smack->is_anchor_begin || smack->is_anchor_end || smack->is_snmp_hack)
+        return 0;
+    for (i = 0; i < smack->m_pattern_count; i++) {
+        if (smack->m_pattern_list[i]->is_wildcards)
+            return 0;
+    }
+    return 1;
+}
+
+/****************************************************************************
+ * Throw away the results of compiling, but not the patterns, in order to
+ * compile again from scratch.
+ ****************************************************************************/
+static void
+smack_reset_compiled(struct SMACK *smack)
+{
+    if (smack->m_trie_match) {
+        free(smack->m_match);
+        smack->m_match = smack->m_trie_match;
+        smack->m_trie_match = 0;
+    }
+    destroy_matches_table(smack);
+    destroy_intermediate_table(smack);
+    free(smack->table);
+    smack->table = 0;
+    smack->m_state_count = 0;
+    smack->m_state_max = 0;
+}
+
+/****************************************************************************
+ * The last stages of compiling, which are the same either way.
+ ****************************************************************************/
+static void
+smack_compile_finish(struct SMACK *smack)
+{
+    int is_plain = smack_is_incremental_possible(smack);
+
+    /* Leftmost-longest and sparse states have the same limits as
+     * incremental compiling */
+    smack->is_leftmost = (smack->match_mode == SMACK_MATCH_LEFTMOST_LONGEST
+                          && is_plain);
+
+    /* Number the states so that the matches are at the end */
+    smack_stage3_sort(smack, is_plain && !smack->is_leftmost);
+
+    /*
+     * Build the final table we use for evaluation
+     */
+    smack_stage4_make_final_table(smack);
+
+    /*
+     * Fixup the wildcard states
+     */
+    smack_fixup_wildcards(smack);
+
+    /*
+     * Build the prefilter that lets the search skip ahead
+     */
+    smack_stage5_make_prefilter(smack);
+
+    smack->m_pattern_compiled = smack->m_pattern_count;
+
+    /*
+     * Get rid of the original pattern tables, since we no longer need them,
+     * unless we are going to add more patterns. If this is a debug build,
+     * keep the tables around to make debugging easier
+     */
+#ifndef DEBUG
+    if (!smack->is_incremental) {
+        destroy_pattern_table(smack);
+        destroy_intermediate_table(smack);
+    }
+#endif
+}
+
+/****************************************************************************
+ * In incremental mode, add the patterns that were added since compiling
+ * to the intermediate table, then link again only the states that they
+ * can affect.
+ ****************************************************************************/
+static void
+smack_compile_more(struct SMACK *smack)
+{
+    unsigned old_count = smack->m_state_count;
+    unsigned state_max = old_count;
+    unsigned char *is_affected;
+    unsigned *affected;
+    unsigned affected_count = 0;
+    unsigned *fail_start;
+    unsigned *fail_list;
+    unsigned i;
+
+    /* The final table and matches are built again from scratch */
+    free(smack->m_match);
+    smack->m_match = smack->m_trie_match;
+    smack->m_trie_match = 0;
+    free(smack->table);
+    smack->table = 0;
+
+    for (i = smack->m_pattern_compiled; i < smack->m_pattern_count; i++)
+        state_max += (unsigned)smack->m_pattern_list[i]->pattern_length;
+    grow_intermediate_table(smack, state_max);
+
+    is_affected = (unsigned char *)calloc(state_max, 1);
+    affected = (unsigned *)malloc(sizeof(*affected) * state_max);
+    fail_start = (unsigned *)calloc(old_count + 1, sizeof(*fail_start));
+    fail_list = (unsigned *)malloc(sizeof(*fail_list) * old_count);
+    if (is_affected == NULL || affected == NULL || fail_start == NULL
+        || fail_list == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+#define MARK_AFFECTED(s)                                                     \
+    if (!is_affected[s]) {                                                   \
+        is_affected[s] = 1;                                                  \
+        affected[affected_count++] = s;                                      \
+    }
+
+    /*
+     * Add the new patterns. The states they extend are affected, as are
+     * the states where they match, if those already existed
+     */
+    for (i = smack->m_pattern_compiled; i < smack->m_pattern_count; i++) {
+        unsigned state = smack_add_prefixes(smack, smack->m_pattern_list[i]);
+        MARK_AFFECTED(state);
+    }
+    for (i = old_count; i < smack->m_state_count; i++) {
+        MARK_AFFECTED(i);
+        MARK_AFFECTED(smack->m_parent[i]);
+    }
+
+    /* List the states that fail to each of the old states */
+    for (i = 1; i < old_count; i++)
+        fail_start[GOTO_FAIL(i)]++;
+    for (i = 0; i < old_count; i++)
+        fail_start[i + 1] += fail_start[i];
+    for (i = 1; i < old_count; i++)
+        fail_list[--fail_start[GOTO_FAIL(i)]] = i;
+
+    /*
+     * The states that fail to an affected state can be affected too, as
+     * can the states that come after them
+     */
+    for (i = 0; i < affected_count; i++) {
+        unsigned r = affected[i];
+        unsigned j;
+        unsigned a;
+
+        if (r < old_count) {
+            for (j = fail_start[r]; j < fail_start[r + 1]; j++)
+                MARK_AFFECTED(fail_list[j]);
+        }
+        for (a = 0; a < ALPHABET_SIZE; a++) {
+            unsigned s = GOTO(r, a);
+            if (is_prefix_edge(smack, r, s))
+                MARK_AFFECTED(s);
+        }
+    }
+#undef MARK_AFFECTED
+
+    smack_stage1_link_states(smack, affected, affected_count);
+
+    free(is_affected);
+    free(affected);
+    free(fail_start);
+    free(fail_list);
+
+    smack_compile_finish(smack);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+smack_compile(struct SMACK *smack)
+{
+    unsigned state_max;
+    unsigned i;
+
+    /* If this was compiled before, in incremental mode */
+    if (smack->m_trie_match) {
+        if (smack->is_nocase) {
+            for (i = 'A'; i <= 'Z'; i++)
+                smack->char_to_symbol[i] = smack->char_to_symbol[tolower(i)];
+        }
+        if (smack_is_incremental_possible(smack)) {
+            smack_compile_more(smack);
+            return;
+        }
+        smack_reset_compiled(smack);
+    }
+
+    /*
+     * Fix up the symbol table to handle "anchors" and "nocase" conditions.
+     */
+    if (smack->is_anchor_begin)
+        smack_add_symbol(smack, CHAR_ANCHOR_START);
+    if (smack->is_anchor_end)
+        smack_add_symbol(smack, CHAR_ANCHOR_END);
+    if (smack->is_nocase) {
+        for (i = 'A'; i <= 'Z'; i++) {
+            smack->char_to_symbol[i] = smack->char_to_symbol[tolower(i)];
+        }
+    }
+
+    /*
+     * Calculate the maximum possible number of states. This will be somewhat
+     * larger than the number of states we'll actually use because there can
+     * be overlaps
+     */
+    state_max = 1;
+    for (i = 0; i < smack->m_pattern_count; i++) {
+        struct SmackPattern *pat = smack->m_pattern_list[i];
+
+        state_max += (unsigned)pat->pattern_length;
+        state_max += pat->is_anchor_begin;
+        state_max += pat->is_anchor_end;
+    }
+
+    /*
+     * Allocate a state-table that can hold that number of states
+     */
+    grow_intermediate_table(smack, state_max);
+
+    /*
+     * Go through the various compilation stages
+     */
+    smack_stage0_compile_prefixes(smack);
+    smack_stage1_link_states(smack, NULL, smack->m_state_count);
+    smack_compile_finish(smack);
+}
+
+/****************************************************************************
+ * Found!
+ *
+ * We found one or more patterns in the input stream. Go through the list
+ * and notify the caller of "smack_search()" which ones we found.
+ ****************************************************************************/
+static unsigned
+handle_match(const struct SMACK *smack, int index,
+    int (*callback_function)(size_t id, int index, void *callback_data),
+    void *callback_data, unsigned state)
+{
+    unsigned i;
+    struct SmackMatches *match = &smack->m_match[state];
+
+    /*
+     * Notify caller of all possible matches.
+     */
+    for (i = 0; i < match->m_count; i++) {
+        size_t id = match->m_ids[i];
+        callback_function(id, index, callback_data);
+    }
+
+    return match->m_count;
+}
+
+/****************************************************************************
+ * Get the next state from a sparse state, following the "fail" states
+ * until we find the symbol in the list of edges, or get to a state with a
+ * row in the table, as described in SPARSE STATES above.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+sparse_transition(const struct SMACK *smack, unsigned row, unsigned column,
+    const int is_table32, const int is_shift_add)
+{
+    const struct SmackSparse *sparse = smack->m_sparse;
+    const unsigned *edges = smack->m_sparse_edges;
+    unsigned sparse_begin = smack->m_sparse_begin;
+
+    while (row >= sparse_begin) {
+        const struct SmackSparse *entry = &sparse[row - sparse_begin];
+        unsigned i;
+
+        for (i = entry[0].first; i < entry[1].first; i++) {
+            if ((edges[i] & 0xFF) == column)
+                return edges[i] >> 8;
+        }
+        row = entry->fail;
+    }
+    return TRANSITION(smack->table, is_table32,
+        ROW_INDEX(row, smack->row_shift, is_shift_add) + column);
+}
+
+/****************************************************************************
+ * Get the next state, whether the current one is dense or sparse, for
+ * when it doesn't need to be fast.
+ ****************************************************************************/
+static unsigned
+next_state(const struct SMACK *smack, unsigned row, unsigned column)
+{
+    if (row >= smack->m_sparse_begin) {
+        switch (smack->is_table32 | smack->is_shift_add << 1) {
+        case 0:
+            return sparse_transition(smack, row, column, 0, 0);
+        case 1:
+            return sparse_transition(smack, row, column, 1, 0);
+        case 2:
+            return sparse_transition(smack, row, column, 0, 1);
+        default:
+            return sparse_transition(smack, row, column, 1, 1);
+        }
+    }
+    return transition_get(smack, row_index(smack, row) + column);
+}
+
+/****************************************************************************
+ * The search when there are sparse states. The dense states without
+ * matches are below 'match_limit', and everything else is past it, so
+ * the fast path is still a single compare. We don't look at the matches
+ * for sparse states, to save a cache miss, since we know which have them.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+smack_search_sparse(const struct SMACK *smack, const unsigned char *px,
+    unsigned length, FOUND_CALLBACK cb_found, void *callback_data,
+    unsigned *current_state, const int is_table32, const int is_shift_add)
+{
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    unsigned match_limit = smack->m_match_limit;
+    unsigned sparse_begin = smack->m_sparse_begin;
+    unsigned sparse_match = smack->m_sparse_match;
+    unsigned found_count = 0;
+    unsigned row;
+    unsigned i;
+
+    row = *current_state & 0xFFFFFF;
+    for (i = 0; i < length; i++) {
+        unsigned column = char_to_symbol[px[i]];
+
+        if (row < sparse_begin)
+            row = TRANSITION(table, is_table32,
+                ROW_INDEX(row, row_shift, is_shift_add) + column);
+        else
+            row = sparse_transition(
+                smack, row, column, is_table32, is_shift_add);
+
+        if (row >= match_limit && (row < sparse_begin || row >= sparse_match))
+            found_count = handle_match(smack, i, cb_found, callback_data, row);
+    }
+    *current_state = row;
+    return found_count;
+}
+
+/****************************************************************************
+ * For leftmost-longest, we've reached the dead state, going from 'row' with
+ * the symbol in 'column', at 'index' in the input. Report the pending
+ * match, then search again from after it, replaying the symbols of the
+ * state's prefix that came after the match, and this one. Those may find
+ * more matches. At the end of the input, 'column' is -1, and we keep going
+ * until there's nothing pending. Returns the new state.
+ ****************************************************************************/
+static unsigned
+leftmost_confirm(const struct SMACK *smack, unsigned row, int column,
+    int index, FOUND_CALLBACK cb_found, void *callback_data,
+    unsigned *found_count)
+{
+    const struct SmackLeftmost *lm = smack->m_leftmost;
+    unsigned char stack_symbols[256];
+    unsigned char *symbols = stack_symbols;
+    unsigned lag = lm[row].lag;
+    unsigned length = lag + (column >= 0);
+    int start = index - (int)lag;
+    unsigned k;
+    unsigned r;
+
+    if (length > sizeof(stack_symbols)) {
+        symbols = (unsigned char *)malloc(length);
+        if (symbols == NULL) {
+            fprintf(stderr, "%s: out of memory error\n", "smack");
+            exit(1);
+        }
+    }
+    for (k = lag, r = row; k > 0; k--) {
+        symbols[k - 1] = (unsigned char)lm[r].symbol;
+        r = lm[r].parent;
+    }
+    if (column >= 0)
+        symbols[lag] = (unsigned char)column;
+
+    /* We've already gone through the symbols up to 'k' to get here */
+    for (k = lag;;) {
+        if (k < length) {
+            unsigned next = transition_get(
+                smack, row_index(smack, row) + symbols[k]);
+            if (next != smack->m_leftmost_dead) {
+                row = next;
+                k++;
+                continue;
+            }
+        } else if (column >= 0 || lm[row].pend == LEFTMOST_NONE)
+            break;
+
+        /* The match ended 'lag' symbols before the one at 'k' */
+        *found_count = handle_match(smack,
+            start + (int)k - 1 - (int)lm[row].lag, cb_found, callback_data,
+            lm[row].pend);
+        k -= lm[row].lag;
+        row = BASE_STATE;
+    }
+
+    if (symbols != stack_symbols)
+        free(symbols);
+    return row;
+}
+
+/****************************************************************************
+ * The search for leftmost-longest. Reaching a match state doesn't report
+ * it; reaching the dead state does.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+smack_search_leftmost(const struct SMACK *smack, const unsigned char *px,
+    unsigned length, FOUND_CALLBACK cb_found, void *callback_data,
+    unsigned *current_state, const int is_table32, const int is_shift_add)
+{
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    unsigned dead = smack->m_leftmost_dead;
+    unsigned found_count = 0;
+    unsigned row;
+    unsigned i;
+
+    row = *current_state & 0xFFFFFF;
+    for (i = 0; i < length; i++) {
+        unsigned column = char_to_symbol[px[i]];
+        unsigned next;
+
+        next = TRANSITION(table, is_table32,
+            ROW_INDEX(row, row_shift, is_shift_add) + column);
+        if (next == dead)
+            next = leftmost_confirm(smack, row, (int)column, (int)i,
+                cb_found, callback_data, &found_count);
+        row = next;
+    }
+    *current_state = row;
+    return found_count;
+}
+
+/****************************************************************************
+ * The same as "smack_search()", but whenever we're back in the starting
+ * state, we use the prefilter to skip to the next place where a pattern
+ * might start.
+ *
+ * The last (width - 1) bytes can't be checked by the prefilter, since a
+ * pattern starting there might continue into the next fragment, so we
+ * always run the state-machine over them. This also means the state at
+ * the end of the input is the same as without the prefilter.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+smack_search_prefilter(const struct SMACK *smack, const unsigned char *px,
+    unsigned length, FOUND_CALLBACK cb_found, void *callback_data,
+    unsigned *current_state, const int is_table32, const int is_shift_add)
+{
+    const struct SmackPrefilter *pf = &smack->prefilter;
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    const struct SmackMatches *match = smack->m_match;
+    unsigned found_count = 0;
+    unsigned row;
+    size_t limit = 0;
+    size_t i = 0;
+
+    row = *current_state & 0xFFFFFF;
+    if (length >= pf->width)
+        limit = length - pf->width + 1;
+
+    while (i < length) {
+        if (row == BASE_STATE && i < limit) {
+            i = pf->find(pf, px, i, limit);
+            if (i >= length)
+                break;
+        }
+
+        row = TRANSITION(table, is_table32,
+            ROW_INDEX(row, row_shift, is_shift_add) + char_to_symbol[px[i]]);
+        if (match[row].m_count)
+            found_count = handle_match(
+                smack, (unsigned)i, cb_found, callback_data, row);
+        i++;
+    }
+    *current_state = row;
+    return found_count;
+}
+
+/****************************************************************************
+ * The search, one byte at a time, specialized for 16-bit or 32-bit
+ * transitions, and for the kind of row width.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+smack_search_bytes(const struct SMACK *smack, const unsigned char *px,
+    unsigned length, FOUND_CALLBACK cb_found, void *callback_data,
+    unsigned *current_state, const int is_table32, const int is_shift_add)
+{
+    unsigned row;
+    unsigned i;
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    unsigned found_count = 0;
+    const struct SmackMatches *match = smack->m_match;
+
+    /* Get the row. This is encoded as the lower 24-bits of the state
+     * variable */
+    row = *current_state & 0xFFFFFF;
+
+    /* 'for all bytes in this block' */
+    for (i = 0; i < length; i++) {
+        unsigned char column;
+        unsigned char c;
+
+        /* Get the next character of input */
+        c = px[i];
+
+        /* Convert that character into a symbol. This compresses the table.
+         * Even though there are 256 possible combinations for a byte, we
+         * are probably using fewer than 32 individual characters in the
+         * patterns we are looking for. This step allows us to create tables
+         * that are only 32 elements wide, instead of 256 elements wide */
+        column = char_to_symbol[c];
+
+        /*
+         * If debugging, and the variable is set, then print out the
+         * transition to the command line. This is a good way of visualizing
+         * how they work.
+         */
+#ifdef DEBUG
+        if (print_transitions) {
+            unsigned next = transition_get(smack, row_index(smack, row) + column);
+            printf("%s+%c = %s%s\n", smack->m_match[row].DEBUG_name, c,
+                smack->m_match[next].DEBUG_name,
+                smack->m_match[next].m_count ? "$$" : "");
+            print_transitions--;
+        }
+#endif
+
+        /*
+         * STATE TRANSITION
+         * Given the current row, lookup the symbol, and find the next row.
+         * Logically, this is the following  calculation:
+         *    row = table[row][column]
+         * However, since row can have a variable width (depending on the
+         * number of characters in a pattern), we have to do the calculation
+         * manually.
+         */
+        row = TRANSITION(table, is_table32,
+            ROW_INDEX(row, row_shift, is_shift_add) + column);
+
+        /* Test to see if we have one (or more) matches, and if so, call
+         * the callback function */
+        if (match[row].m_count)
+            found_count = handle_match(smack, i, cb_found, callback_data, row);
+    }
+    *current_state = row;
+    return found_count;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+unsigned
+smack_search(const struct SMACK *smack, const void *v_px, unsigned length,
+    FOUND_CALLBACK cb_found, void *callback_data, unsigned *current_state)
+{
+    const unsigned char *px = (const unsigned char *)v_px;
+
+    if (smack->m_leftmost) {
+        switch (smack->is_table32 | smack->is_shift_add << 1) {
+        case 0:
+            return smack_search_leftmost(smack, px, length, cb_found,
+                callback_data, current_state, 0, 0);
+        case 1:
+            return smack_search_leftmost(smack, px, length, cb_found,
+                callback_data, current_state, 1, 0);
+        case 2:
+            return smack_search_leftmost(smack, px, length, cb_found,
+                callback_data, current_state, 0, 1);
+        default:
+            return smack_search_leftmost(smack, px, length, cb_found,
+                callback_data, current_state, 1, 1);
+        }
+    }
+
+    /* The patterns that use sparse states are too many for the
+     * prefilter to be much use */
+    if (smack->m_sparse) {
+        switch (smack->is_table32 | smack->is_shift_add << 1) {
+        case 0:
+            return smack_search_sparse(smack, px, length, cb_found,
+                callback_data, current_state, 0, 0);
+        case 1:
+            return smack_search_sparse(smack, px, length, cb_found,
+                callback_data, current_state, 1, 0);
+        case 2:
+            return smack_search_sparse(smack, px, length, cb_found,
+                callback_data, current_state, 0, 1);
+        default:
+            return smack_search_sparse(smack, px, length, cb_found,
+                callback_data, current_state, 1, 1);
+        }
+    }
+
+    if (smack->prefilter.is_possible && !smack->prefilter.is_disabled) {
+        switch (smack->is_table32 | smack->is_shift_add << 1) {
+        case 0:
+            return smack_search_prefilter(smack, px, length, cb_found,
+                callback_data, current_state, 0, 0);
+        case 1:
+            return smack_search_prefilter(smack, px, length, cb_found,
+                callback_data, current_state, 1, 0);
+        case 2:
+            return smack_search_prefilter(smack, px, length, cb_found,
+                callback_data, current_state, 0, 1);
+        default:
+            return smack_search_prefilter(smack, px, length, cb_found,
+                callback_data, current_state, 1, 1);
+        }
+    }
+
+    switch (smack->is_table32 | smack->is_shift_add << 1) {
+    case 0:
+        return smack_search_bytes(smack, px, length, cb_found, callback_data,
+            current_state, 0, 0);
+    case 1:
+        return smack_search_bytes(smack, px, length, cb_found, callback_data,
+            current_state, 1, 0);
+    case 2:
+        return smack_search_bytes(smack, px, length, cb_found, callback_data,
+            current_state, 0, 1);
+    default:
+        return smack_search_bytes(smack, px, length, cb_found, callback_data,
+            current_state, 1, 1);
+    }
+}
+
+/****************************************************************************
+ * Searching several streams at once. A single search can't go faster than
+ * the latency of the table lookup for each byte, since each lookup
+ * depends on the one before. Lookups in different streams don't depend
+ * on each other, so if we do one byte from each stream in turn, the CPU
+ * can have several lookups in flight at the same time.
+ ****************************************************************************/
+#define SMACK_MULTI_LANES 8
+
+struct SmackLane {
+    const unsigned char *px;
+    size_t offset;
+    size_t length;
+    unsigned row;
+    struct SmackStream *stream;
+};
+
+/****************************************************************************
+ * Start the next stream in a lane, returning zero when there are none.
+ * Streams with no input are finished right away.
+ ****************************************************************************/
+static int
+multi_next_stream(struct SmackLane *lane, struct SmackStream **next,
+    struct SmackStream *end)
+{
+    while (*next < end) {
+        struct SmackStream *stream = (*next)++;
+
+        stream->found_count = 0;
+        if (stream->length == 0)
+            continue;
+        lane->px = (const unsigned char *)stream->px;
+        lane->offset = 0;
+        lane->length = stream->length;
+        lane->row = *stream->state & 0xFFFFFF;
+        lane->stream = stream;
+        return 1;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ * Run all the lanes for the next 'n' bytes.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) void
+multi_lockstep(const struct SMACK *smack, struct SmackLane *lanes,
+    unsigned lane_count, size_t n, FOUND_CALLBACK cb_found,
+    const int is_table32, const int is_shift_add)
+{
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    unsigned match_limit = smack->m_match_limit;
+    size_t i;
+    unsigned k;
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < lane_count; k++) {
+            struct SmackLane *lane = &lanes[k];
+            unsigned row;
+
+            row = TRANSITION(table, is_table32,
+                ROW_INDEX(lane->row, row_shift, is_shift_add)
+                    + char_to_symbol[lane->px[lane->offset + i]]);
+            lane->row = row;
+
+            /* The states with matches are sorted to the end, so we
+             * don't need another lookup to check for one */
+            if (row >= match_limit)
+                lane->stream->found_count = handle_match(smack,
+                    (unsigned)(lane->offset + i), cb_found,
+                    lane->stream->cb_data, row);
+        }
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+smack_search_multi(const struct SMACK *smack, struct SmackStream *streams,
+    unsigned count, FOUND_CALLBACK cb_found)
+{
+    struct SmackLane lanes[SMACK_MULTI_LANES];
+    struct SmackStream *next = streams;
+    struct SmackStream *end = streams + count;
+    unsigned lane_count = 0;
+    unsigned k;
+
+    /* The prefilter skips most of the input, which is faster than
+     * looking at every byte, even several streams at a time. Leftmost
+     * matches and sparse states also need their own loop */
+    if ((smack->prefilter.is_possible && !smack->prefilter.is_disabled)
+        || smack->m_leftmost || smack->m_sparse) {
+        for (k = 0; k < count; k++) {
+            streams[k].found_count = smack_search(smack, streams[k].px,
+                streams[k].length, cb_found, streams[k].cb_data,
+                streams[k].state);
+        }
+        return;
+    }
+
+    while (lane_count < SMACK_MULTI_LANES
+           && multi_next_stream(&lanes[lane_count], &next, end))
+        lane_count++;
+
+    while (lane_count) {
+        size_t n = ~(size_t)0;
+
+        /* Run all the lanes until the shortest one runs out */
+        for (k = 0; k < lane_count; k++) {
+            if (n > lanes[k].length - lanes[k].offset)
+                n = lanes[k].length - lanes[k].offset;
+        }
+        switch (smack->is_table32 | smack->is_shift_add << 1) {
+        case 0:
+            multi_lockstep(smack, lanes, lane_count, n, cb_found, 0, 0);
+            break;
+        case 1:
+            multi_lockstep(smack, lanes, lane_count, n, cb_found, 1, 0);
+            break;
+        case 2:
+            multi_lockstep(smack, lanes, lane_count, n, cb_found, 0, 1);
+            break;
+        default:
+            multi_lockstep(smack, lanes, lane_count, n, cb_found, 1, 1);
+            break;
+        }
+
+        /* Finish the streams that ran out, and start new ones in their
+         * place, or close up the gaps if there are none left */
+        for (k = 0; k < lane_count;) {
+            struct SmackLane *lane = &lanes[k];
+
+            lane->offset += n;
+            if (lane->offset < lane->length) {
+                k++;
+                continue;
+            }
+            *lane->stream->state = lane->row;
+            if (multi_next_stream(lane, &next, end))
+                k++;
+            else
+                lanes[k] = lanes[--lane_count];
+        }
+    }
+}
+
+/*****************************************************************************
+ * Run the state-machine until the next match. This is specialized for
+ * each kind of table by calling it with a constant 'is_table32' and
+ * 'is_shift_add'.
+ *****************************************************************************/
+static inline __attribute__((always_inline)) size_t
+inner_match(const unsigned char *px, size_t length,
+    const unsigned char *char_to_symbol, const void *table,
+    unsigned *state, unsigned match_limit, unsigned row_shift,
+    const int is_table32, const int is_shift_add)
+{
+    const unsigned char *px_start = px;
+    const unsigned char *px_end = px + length;
+    unsigned row = *state;
+
+    for (; px < px_end; px++) {
+        unsigned char column;
+
+        /* Convert that character into a symbol. This compresses the table.
+         * Even though there are 256 possible combinations for a byte, we
+         * are probably using fewer than 32 individual characters in the
+         * patterns we are looking for. This step allows us to create tables
+         * that are only 32 elements wide, instead of 256 elements wide */
+        column = char_to_symbol[*px];
+
+        /*
+         * STATE TRANSITION
+         * Given the current row, lookup the symbol, and find the next row.
+         * Logically, this is the following  calculation:
+         *    row = table[row][column]
+         * However, since row can have a variable width (depending on the
+         * number of characters in a pattern), we have to do the calculation
+         * manually.
+         */
+        row = TRANSITION(table, is_table32,
+            ROW_INDEX(row, row_shift, is_shift_add) + column);
+
+        if (row >= match_limit)
+            break;
+    }
+
+    *state = row;
+    return px - px_start;
+}
+
+
+/*****************************************************************************
+ * The same, for the common row width of 128 symbols.
+ *****************************************************************************/
+static inline __attribute__((always_inline)) size_t
+inner_match_shift7(const unsigned char *px, size_t length,
+    const unsigned char *char_to_symbol, const void *table,
+    unsigned *state, unsigned match_limit, const int is_table32)
+{
+    const unsigned char *px_start = px;
+    const unsigned char *px_end = px + length;
+    unsigned row = *state;
+
+    for (; px < px_end; px++) {
+        unsigned char column;
+        column = char_to_symbol[*px];
+        row = TRANSITION(table, is_table32, (row << 7) + column);
+        if (row >= match_limit)
+            break;
+    }
+
+    *state = row;
+    return px - px_start;
+}
+
+/*****************************************************************************
+ *****************************************************************************/
+size_t
+smack_search_next(const struct SMACK *smack, unsigned *current_state,
+    const void *v_px, unsigned *offset, unsigned length)
+{
+    const unsigned char *px = (const unsigned char *)v_px;
+    unsigned row;
+    register size_t i = 0;
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    register unsigned row_shift = smack->row_shift;
+    const struct SmackMatches *match = smack->m_match;
+    unsigned current_matches = 0;
+    size_t id = (size_t)-1;
+    register unsigned match_limit = smack->m_match_limit;
+
+    if (offset)
+        i = *offset;
+    
+    /* Get the row. This is encoded as the lower 24-bits of the state
+     * variable */
+    row = *current_state & 0xFFFFFF;
+
+    /* See if there are current matches we are processing */
+    current_matches = (*current_state) >> 24;
+
+    /* 'for all bytes in this block' */
+    if (!current_matches && smack->m_sparse) {
+        for (; i < length; i++) {
+            row = next_state(smack, row, char_to_symbol[px[i]]);
+            if (match[row].m_count)
+                break;
+        }
+        if (i < length) {
+            i++; /* points to first byte after match */
+            current_matches = match[row].m_count;
+        }
+    } else if (!current_matches) {
+        /*if ((length-i) & 1)
+            i += inner_match(px + i,
+                             length - i,
+                             char_to_symbol,
+                             table,
+                             &row,
+                             match_limit,
+                             row_shift);
+        if (row < match_limit && i < length)*/
+        switch (row_shift | (smack->is_table32 << 8)
+                | (smack->is_shift_add << 9)) {
+        case 7:
+            i += inner_match_shift7(px + i, length - i, char_to_symbol, table,
+                &row, match_limit, 0);
+            break;
+        case 7 | (1 << 8):
+            i += inner_match_shift7(px + i, length - i, char_to_symbol, table,
+                &row, match_limit, 1);
+            break;
+        default:
+            switch (smack->is_table32 | smack->is_shift_add << 1) {
+            case 0:
+                i += inner_match(px + i, length - i, char_to_symbol, table,
+                    &row, match_limit, row_shift, 0, 0);
+                break;
+            case 1:
+                i += inner_match(px + i, length - i, char_to_symbol, table,
+                    &row, match_limit, row_shift, 1, 0);
+                break;
+            case 2:
+                i += inner_match(px + i, length - i, char_to_symbol, table,
+                    &row, match_limit, row_shift, 0, 1);
+                break;
+            default:
+                i += inner_match(px + i, length - i, char_to_symbol, table,
+                    &row, match_limit, row_shift, 1, 1);
+                break;
+            }
+            break;
+        }
+
+        /* Test to see if we have one (or more) matches, and if so, call
+         * the callback function */
+        if (match[row].m_count) {
+            i++; /* points to first byte after match */
+            current_matches = match[row].m_count;
+        }
+    }
+
+    if (offset)
+        *offset = (unsigned)i;
+
+    /* If we broke early because we found a match, return that match */
+    if (current_matches) {
+        id = match[row].m_ids[current_matches - 1];
+        current_matches--;
+    }
+
+    *current_state = row | (current_matches << 24);
+    return id;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+size_t
+smack_next_match(const struct SMACK *smack, unsigned *current_state)
+{
+    unsigned row, current_matches;
+    size_t id = SMACK_NOT_FOUND;
+
+    /* split the state variable */
+    row = *current_state & 0xFFFFFF;
+    current_matches = (*current_state) >> 24;
+
+    /* If we broke early because we found a match, return that match */
+    if (current_matches) {
+        const struct SmackMatches *match = smack->m_match;
+        id = match[row].m_ids[current_matches - 1];
+        current_matches--;
+    }
+
+    /* Recombine the state */
+    *current_state = row | (current_matches << 24);
+
+    return id;
+}
+
+/****************************************************************************
+ * Copy the ids of the state 'row', starting with 'cursor->next_id', to the
+ * list of matches, as many as fit. Returns how many we copied, and leaves
+ * 'next_id' at zero if that's all of them.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+batch_copy(const struct SMACK *smack, unsigned row, unsigned index,
+    struct SmackMatch *matches, unsigned max, struct SmackCursor *cursor)
+{
+    const struct SmackMatches *match = &smack->m_match[row];
+    unsigned first = cursor->next_id;
+    unsigned count = match->m_count - first;
+    unsigned i;
+
+    if (count > max) {
+        count = max;
+        cursor->next_id = first + count;
+    } else
+        cursor->next_id = 0;
+    for (i = 0; i < count; i++) {
+        matches[i].id = match->m_ids[first + i];
+        matches[i].offset = index;
+    }
+    return count;
+}
+
+/****************************************************************************
+ * The loop for "smack_search_batch()", the same as "smack_search()" with or
+ * without the prefilter, except that instead of calling the callback, we
+ * copy the ids, and stop when the list is full.
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+smack_search_batch_loop(const struct SMACK *smack, const unsigned char *px,
+    unsigned length, struct SmackMatch *matches, unsigned max,
+    struct SmackCursor *cursor, const int is_table32, const int is_shift_add,
+    const int is_prefilter)
+{
+    const struct SmackPrefilter *pf = &smack->prefilter;
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    unsigned match_limit = smack->m_match_limit;
+    unsigned row = cursor->state;
+    size_t i = cursor->offset;
+    size_t limit = 0;
+    unsigned count = 0;
+
+    /* The rest of the ids from the last time, if it filled up */
+    if (cursor->next_id) {
+        count = batch_copy(smack, row, (unsigned)i - 1, matches, max, cursor);
+        if (count == max)
+            return count;
+    }
+
+    if (is_prefilter && length >= pf->width)
+        limit = length - pf->width + 1;
+
+    for (; i < length; i++) {
+        if (is_prefilter && row == BASE_STATE && i < limit) {
+            i = pf->find(pf, px, i, limit);
+            if (i >= length)
+                break;
+        }
+
+        row = TRANSITION(table, is_table32,
+            ROW_INDEX(row, row_shift, is_shift_add) + char_to_symbol[px[i]]);
+        if (row >= match_limit) {
+            count += batch_copy(smack, row, (unsigned)i, matches + count,
+                max - count, cursor);
+            if (count == max) {
+                i++;
+                break;
+            }
+        }
+    }
+
+    cursor->state = row;
+    cursor->offset = (unsigned)i;
+    return count;
+}
+
+/****************************************************************************
+ * The same, when there are sparse states, like "smack_search_sparse()".
+ ****************************************************************************/
+static inline __attribute__((always_inline)) unsigned
+smack_search_batch_sparse(const struct SMACK *smack, const unsigned char *px,
+    unsigned length, struct SmackMatch *matches, unsigned max,
+    struct SmackCursor *cursor, const int is_table32, const int is_shift_add)
+{
+    const unsigned char *char_to_symbol = smack->char_to_symbol;
+    const void *table = smack->table;
+    unsigned row_shift = smack->row_shift;
+    unsigned match_limit = smack->m_match_limit;
+    unsigned sparse_begin = smack->m_sparse_begin;
+    unsigned sparse_match = smack->m_sparse_match;
+    unsigned row = cursor->state;
+    unsigned i = cursor->offset;
+    unsigned count = 0;
+
+    if (cursor->next_id) {
+        count = batch_copy(smack, row, i - 1, matches, max, cursor);
+        if (count == max)
+            return count;
+    }
+
+    for (; i < length; i++) {
+        unsigned column = char_to_symbol[px[i]];
+
+        if (row < sparse_begin)
+            row = TRANSITION(table, is_table32,
+                ROW_INDEX(row, row_shift, is_shift_add) + column);
+        else
+            row = sparse_transition(
+                smack, row, column, is_table32, is_shift_add);
+
+        if (row >= match_limit
+            && (row < sparse_begin || row >= sparse_match)) {
+            count += batch_copy(
+                smack, row, i, matches + count, max - count, cursor);
+            if (count == max) {
+                i++;
+                break;
+            }
+        }
+    }
+
+    cursor->state = row;
+    cursor->offset = i;
+    return count;
+}
+
+/****************************************************************************
+ * Find the matches without a callback, filling in a list of them, and
+ * returning when it's full or we get to the end of the input. The cursor
+ * keeps where we got to, so that we carry on from there the next time.
+ ****************************************************************************/
+unsigned
+smack_search_batch(const struct SMACK *smack, const void *v_px,
+    unsigned length, struct SmackMatch *matches, unsigned max,
+    struct SmackCursor *cursor)
+{
+    const unsigned char *px = (const unsigned char *)v_px;
+    unsigned count;
+
+    if (smack->m_leftmost || max == 0)
+        return 0;
+
+    if (smack->m_sparse) {
+        switch (smack->is_table32 | smack->is_shift_add << 1) {
+        case 0:
+            count = smack_search_batch_sparse(
+                smack, px, length, matches, max, cursor, 0, 0);
+            break;
+        case 1:
+            count = smack_search_batch_sparse(
+                smack, px, length, matches, max, cursor, 1, 0);
+            break;
+        case 2:
+            count = smack_search_batch_sparse(
+                smack, px, length, matches, max, cursor, 0, 1);
+            break;
+        default:
+            count = smack_search_batch_sparse(
+                smack, px, length, matches, max, cursor, 1, 1);
+            break;
+        }
+    } else {
+        int is_prefilter = smack->prefilter.is_possible
+                           && !smack->prefilter.is_disabled;
+
+        switch (smack->is_table32 | smack->is_shift_add << 1
+                | is_prefilter << 2) {
+        case 0:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 0, 0, 0);
+            break;
+        case 1:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 1, 0, 0);
+            break;
+        case 2:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 0, 1, 0);
+            break;
+        case 3:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 1, 1, 0);
+            break;
+        case 4:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 0, 0, 1);
+            break;
+        case 5:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 1, 0, 1);
+            break;
+        case 6:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 0, 1, 1);
+            break;
+        default:
+            count = smack_search_batch_loop(
+                smack, px, length, matches, max, cursor, 1, 1, 1);
+            break;
+        }
+    }
+
+    /* Done with this input, so the next one starts at the beginning */
+    if (count < max)
+        cursor->offset = 0;
+    return count;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+size_t smack_search_done(const struct SMACK *smack, unsigned *current_state)
+{
+    //unsigned found_count = 0;
+    unsigned row = *current_state;
+    const struct SmackMatches *match = smack->m_match;
+    unsigned column = smack->char_to_symbol[CHAR_ANCHOR_END];
+    size_t id = (size_t)-1;
+    
+    /*
+     * This is the same logic as for "smack_search()", except there is
+     * only one byte of input -- the virtual character ($) that represents
+     * the anchor at the end of some patterns.
+     */
+    row = next_state(smack, row, column);
+    if (match[row].m_count)
+        id = match[row].m_ids[0];
+    return id;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+unsigned
+smack_search_end(const struct SMACK *smack, FOUND_CALLBACK cb_found,
+    void *callback_data, unsigned *current_state)
+{
+    unsigned found_count = 0;
+    unsigned row = *current_state;
+    const struct SmackMatches *match = smack->m_match;
+    unsigned column = smack->char_to_symbol[CHAR_ANCHOR_END];
+
+    /* For leftmost-longest, report whatever is still pending */
+    if (smack->m_leftmost) {
+        *current_state = leftmost_confirm(smack, row & 0xFFFFFF, -1, 0,
+            cb_found, callback_data, &found_count);
+        return found_count;
+    }
+
+    /*
+     * This is the same logic as for "smack_search()", except there is
+     * only one byte of input -- the virtual character ($) that represents
+     * the anchor at the end of some patterns.
+     */
+    row = next_state(smack, row, column);
+    if (match[row].m_count)
+        found_count = handle_match(smack, 0, cb_found, callback_data, row);
+
+    *current_state = row;
     return found_count;
 }
 
+/****************************************************************************
+ * The layout of the file written by "smack_save()", described in SAVED
+ * IMAGES above. The header is followed by the table, the state matches,
+ * and the ids, each aligned to IMAGE_ALIGN bytes.
+ ****************************************************************************/
+#define SMACK_IMAGE_MAGIC "SMACKDFA"
+#define SMACK_IMAGE_VERSION 4
+#define SMACK_IMAGE_BYTE_ORDER 0x01020304
+#define IMAGE_ALIGN 64
+
+enum {
+    IMAGE_NOCASE = 0x01,
+    IMAGE_ANCHOR_BEGIN = 0x02,
+    IMAGE_ANCHOR_END = 0x04,
+    IMAGE_TABLE32 = 0x08,
+    IMAGE_PREFILTER = 0x10,
+    IMAGE_SHIFT_ADD = 0x20,
+    IMAGE_LEFTMOST = 0x40,
+    IMAGE_SPARSE = 0x80,
+};
+
+struct SmackImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t id_size;
+    uint32_t flags;
+    uint32_t row_shift;
+    uint32_t state_count;
+    uint32_t match_limit;
+    uint32_t symbol_count;
+    uint32_t prefilter_width;
+    uint32_t sparse_begin;
+    uint32_t sparse_match;
+    uint32_t edge_count;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t table_offset;
+    uint64_t table_size;
+    uint64_t matches_offset;
+    uint64_t leftmost_offset;
+    uint64_t sparse_offset;
+    uint64_t edges_offset;
+    uint64_t ids_offset;
+    uint64_t id_count;
+    unsigned char char_to_symbol[ALPHABET_SIZE];
+    unsigned char prefilter_lo[PREFILTER_MAX_WIDTH][16];
+    unsigned char prefilter_hi[PREFILTER_MAX_WIDTH][16];
+    char name[64];
+};
+
+/** For each state, where its ids are in the list of all the ids */
+struct SmackImageMatch {
+    uint32_t first;
+    uint32_t count;
+};
+
+static uint64_t
+image_align(uint64_t offset)
+{
+    return (offset + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+}
+
+/****************************************************************************
+ * Write a block, padded with zeroes up to the 'offset' where it goes.
+ ****************************************************************************/
+static int
+image_write(FILE *fp, uint64_t *current, uint64_t offset, const void *buf,
+    size_t length)
+{
+    static const unsigned char zeroes[IMAGE_ALIGN];
+
+    if (offset - *current > sizeof(zeroes))
+        return -1;
+    if (fwrite(zeroes, 1, (size_t)(offset - *current), fp)
+        != (size_t)(offset - *current))
+        return -1;
+    if (length && fwrite(buf, 1, length, fp) != length)
+        return -1;
+    *current = offset + length;
+    return 0;
+}
+
+/****************************************************************************
+ * Save the compiled state-machine. We write to a temporary file, then
+ * rename it, so that processes that have the old file mapped aren't
+ * affected by it being overwritten.
+ ****************************************************************************/
+int
+smack_save(const struct SMACK *smack, const char *filename)
+{
+    struct SmackImageHeader hdr;
+    struct SmackImageMatch *matches;
+    size_t *ids;
+    uint64_t current = 0;
+    char *tmpname;
+    unsigned i;
+    FILE *fp;
+    int err = 0;
+
+    if (smack->table == NULL) {
+        fprintf(stderr, "%s: save: not compiled\n", "smack");
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SMACK_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SMACK_IMAGE_VERSION;
+    hdr.byte_order = SMACK_IMAGE_BYTE_ORDER;
+    hdr.header_size = sizeof(hdr);
+    hdr.id_size = sizeof(size_t);
+    hdr.flags = (smack->is_nocase ? IMAGE_NOCASE : 0)
+                | (smack->is_anchor_begin ? IMAGE_ANCHOR_BEGIN : 0)
+                | (smack->is_anchor_end ? IMAGE_ANCHOR_END : 0)
+                | (smack->is_table32 ? IMAGE_TABLE32 : 0)
+                | (smack->prefilter.is_possible ? IMAGE_PREFILTER : 0)
+                | (smack->is_shift_add ? IMAGE_SHIFT_ADD : 0)
+                | (smack->m_leftmost ? IMAGE_LEFTMOST : 0)
+                | (smack->m_sparse ? IMAGE_SPARSE : 0);
+    hdr.row_shift = smack->row_shift;
+    hdr.state_count = smack->m_state_count;
+    hdr.match_limit = smack->m_match_limit;
+    hdr.symbol_count = smack->symbol_count;
+    hdr.prefilter_width = smack->prefilter.width;
+    hdr.sparse_begin = smack->m_sparse_begin;
+    hdr.sparse_match = smack->m_sparse_match;
+    hdr.edge_count = smack->m_sparse ? smack->m_sparse_edge_count : 0;
+    memcpy(hdr.char_to_symbol, smack->char_to_symbol,
+        sizeof(hdr.char_to_symbol));
+    memcpy(hdr.prefilter_lo, smack->prefilter.lo, sizeof(hdr.prefilter_lo));
+    memcpy(hdr.prefilter_hi, smack->prefilter.hi, sizeof(hdr.prefilter_hi));
+    snprintf(hdr.name, sizeof(hdr.name), "%s", smack->name);
+
+    /*
+     * Flatten the per-state lists of ids into one list
+     */
+    matches = (struct SmackImageMatch *)calloc(smack->m_state_count + 1,
+        sizeof(*matches));
+    if (matches == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    for (i = 0; i < smack->m_state_count; i++) {
+        matches[i].first = (uint32_t)hdr.id_count;
+        matches[i].count = smack->m_match[i].m_count;
+        hdr.id_count += smack->m_match[i].m_count;
+    }
+    ids = (size_t *)malloc(sizeof(*ids) * (size_t)(hdr.id_count + 1));
+    if (ids == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    for (i = 0; i < smack->m_state_count; i++) {
+        if (matches[i].count)
+            memcpy(ids + matches[i].first, smack->m_match[i].m_ids,
+                sizeof(*ids) * matches[i].count);
+    }
+
+    hdr.table_offset = image_align(sizeof(hdr));
+    hdr.table_size = (uint64_t)hdr.sparse_begin * row_index(smack, 1)
+                     * (smack->is_table32 ? sizeof(transition32_t)
+                                          : sizeof(transition16_t));
+    hdr.matches_offset = image_align(hdr.table_offset + hdr.table_size);
+    hdr.ids_offset = image_align(
+        hdr.matches_offset + sizeof(*matches) * (uint64_t)hdr.state_count);
+    if (smack->m_leftmost) {
+        hdr.leftmost_offset = hdr.ids_offset;
+        hdr.ids_offset = image_align(hdr.leftmost_offset
+            + sizeof(*smack->m_leftmost) * (uint64_t)hdr.state_count);
+    }
+    if (smack->m_sparse) {
+        hdr.sparse_offset = hdr.ids_offset;
+        hdr.edges_offset = image_align(hdr.sparse_offset
+            + sizeof(*smack->m_sparse)
+                  * (uint64_t)(hdr.state_count - hdr.sparse_begin + 1));
+        hdr.ids_offset = image_align(hdr.edges_offset
+            + sizeof(*smack->m_sparse_edges) * (uint64_t)hdr.edge_count);
+    }
+    hdr.file_size = hdr.ids_offset + sizeof(*ids) * hdr.id_count;
+
+    tmpname = (char *)malloc(strlen(filename) + 5);
+    if (tmpname == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    memcpy(tmpname, filename, strlen(filename));
+    memcpy(tmpname + strlen(filename), ".tmp", 5);
+
+    fp = fopen(tmpname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", "smack", tmpname, strerror(errno));
+        free(tmpname);
+        free(matches);
+        free(ids);
+        return -1;
+    }
+    errno = 0;
+    if (image_write(fp, &current, 0, &hdr, sizeof(hdr))
+        || image_write(fp, &current, hdr.table_offset, smack->table,
+               (size_t)hdr.table_size)
+        || image_write(fp, &current, hdr.matches_offset, matches,
+               sizeof(*matches) * hdr.state_count)
+        || (smack->m_leftmost
+            && image_write(fp, &current, hdr.leftmost_offset,
+                smack->m_leftmost,
+                sizeof(*smack->m_leftmost) * hdr.state_count))
+        || (smack->m_sparse
+            && (image_write(fp, &current, hdr.sparse_offset, smack->m_sparse,
+                    sizeof(*smack->m_sparse)
+                        * (hdr.state_count - hdr.sparse_begin + 1))
+                || image_write(fp, &current, hdr.edges_offset,
+                    smack->m_sparse_edges,
+                    sizeof(*smack->m_sparse_edges) * hdr.edge_count)))
+        || image_write(fp, &current, hdr.ids_offset, ids,
+               sizeof(*ids) * (size_t)hdr.id_count))
+        err = errno ? errno : EIO;
+    if (fclose(fp) != 0 && err == 0)
+        err = errno;
+    if (err == 0 && rename(tmpname, filename) != 0)
+        err = errno;
+    if (err) {
+        fprintf(stderr, "%s: %s: %s\n", "smack", filename, strerror(err));
+        remove(tmpname);
+    }
+
+    free(tmpname);
+    free(matches);
+    free(ids);
+    return err ? -1 : 0;
+}
+
+#ifndef _WIN32
+/****************************************************************************
+ * Check that everything in the header makes sense, and that all the
+ * offsets are within the file, so that we never read outside the map.
+ ****************************************************************************/
+static int
+image_is_valid(const unsigned char *image, size_t image_size)
+{
+    const struct SmackImageHeader *hdr;
+    const struct SmackImageMatch *matches;
+    uint64_t transition_size;
+    uint64_t matches_size;
+    uint64_t matches_end;
+    uint64_t row_width;
+    unsigned i;
+
+    if (image_size < sizeof(*hdr))
+        return 0;
+    hdr = (const struct SmackImageHeader *)image;
+    if (memcmp(hdr->magic, SMACK_IMAGE_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != SMACK_IMAGE_VERSION
+        || hdr->byte_order != SMACK_IMAGE_BYTE_ORDER
+        || hdr->header_size != sizeof(*hdr)
+        || hdr->id_size != sizeof(size_t) || hdr->file_size != image_size)
+        return 0;
+
+    if (hdr->row_shift > 9 || hdr->state_count == 0
+        || hdr->state_count > SMACK_MAX_STATES
+        || hdr->match_limit > hdr->state_count
+        || hdr->sparse_begin == 0 || hdr->sparse_begin > hdr->state_count
+        || hdr->match_limit > hdr->sparse_begin
+        || hdr->sparse_match < hdr->sparse_begin
+        || hdr->sparse_match > hdr->state_count
+        || (hdr->sparse_begin < hdr->state_count)
+               != !!(hdr->flags & IMAGE_SPARSE)
+        || hdr->prefilter_width > PREFILTER_MAX_WIDTH)
+        return 0;
+    row_width = ROW_INDEX(1, hdr->row_shift, hdr->flags & IMAGE_SHIFT_ADD);
+    for (i = 0; i < ALPHABET_SIZE; i++) {
+        if (hdr->char_to_symbol[i] >= row_width)
+            return 0;
+    }
+
+    /* Each part must be aligned and inside the file */
+    transition_size = (hdr->flags & IMAGE_TABLE32) ? sizeof(transition32_t)
+                                                   : sizeof(transition16_t);
+    matches_size = sizeof(*matches) * (uint64_t)hdr->state_count;
+    if (hdr->table_size
+        != hdr->sparse_begin * row_width * transition_size)
+        return 0;
+    if (hdr->table_offset % IMAGE_ALIGN || hdr->matches_offset % IMAGE_ALIGN
+        || hdr->leftmost_offset % IMAGE_ALIGN
+        || hdr->sparse_offset % IMAGE_ALIGN || hdr->edges_offset % IMAGE_ALIGN
+        || hdr->ids_offset % IMAGE_ALIGN)
+        return 0;
+    matches_end = hdr->matches_offset + matches_size;
+    if (hdr->flags & IMAGE_LEFTMOST) {
+        if (hdr->leftmost_offset < matches_end)
+            return 0;
+        matches_end = hdr->leftmost_offset + sizeof(struct SmackLeftmost)
+                                                 * (uint64_t)hdr->state_count;
+    }
+    if (hdr->flags & IMAGE_SPARSE) {
+        if (hdr->sparse_offset < matches_end
+            || hdr->edges_offset < hdr->sparse_offset
+                                       + sizeof(struct SmackSparse)
+                                             * (uint64_t)(hdr->state_count
+                                                 - hdr->sparse_begin + 1))
+            return 0;
+        matches_end = hdr->edges_offset
+                      + sizeof(unsigned) * (uint64_t)hdr->edge_count;
+    }
+    if (hdr->table_offset < sizeof(*hdr)
+        || hdr->table_offset + hdr->table_size > hdr->matches_offset
+        || matches_end > hdr->ids_offset
+        || hdr->id_count > (image_size - hdr->ids_offset) / sizeof(size_t)
+        || hdr->ids_offset + hdr->id_count * sizeof(size_t) != image_size)
+        return 0;
+
+    /* States at or beyond the 'match_limit' are the ones with matches */
+    matches = (const struct SmackImageMatch *)(image + hdr->matches_offset);
+    for (i = 0; i < hdr->state_count; i++) {
+        if ((uint64_t)matches[i].first + matches[i].count > hdr->id_count)
+            return 0;
+        if (i < hdr->sparse_begin
+            && (matches[i].count != 0) != (i >= hdr->match_limit))
+            return 0;
+        if (i >= hdr->sparse_begin
+            && (matches[i].count != 0) != (i >= hdr->sparse_match))
+            return 0;
+    }
+
+    /* The sparse states' edges and fail states must be in range. Like the
+     * table, that doesn't mean they're right */
+    if (hdr->flags & IMAGE_SPARSE) {
+        const struct SmackSparse *sparse;
+        const unsigned *edges;
+        unsigned count = hdr->state_count - hdr->sparse_begin;
+
+        sparse = (const struct SmackSparse *)(image + hdr->sparse_offset);
+        edges = (const unsigned *)(image + hdr->edges_offset);
+        if (sparse[0].first != 0 || sparse[count].first != hdr->edge_count)
+            return 0;
+        for (i = 0; i < count; i++) {
+            if (sparse[i].first > sparse[i + 1].first
+                || sparse[i].fail >= hdr->state_count)
+                return 0;
+        }
+        for (i = 0; i < hdr->edge_count; i++) {
+            if ((edges[i] >> 8) >= hdr->state_count
+                || (edges[i] & 0xFF) >= row_width)
+                return 0;
+        }
+    }
+
+    /* The pending matches must point to states, and the symbols to
+     * columns. As with the table, it must be trusted to be consistent */
+    if (hdr->flags & IMAGE_LEFTMOST) {
+        const struct SmackLeftmost *lm;
+
+        lm = (const struct SmackLeftmost *)(image + hdr->leftmost_offset);
+        for (i = 0; i < hdr->state_count; i++) {
+            if ((lm[i].pend != LEFTMOST_NONE
+                    && lm[i].pend >= hdr->state_count)
+                || lm[i].parent >= hdr->state_count
+                || lm[i].symbol >= row_width)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/****************************************************************************
+ * Map the file, and build a SMACK object around it. The only thing we
+ * allocate is the list of matches for each state, which points to the
+ * ids in the file. The transitions in the table aren't checked, so the
+ * file must be trusted, like the program itself.
+ ****************************************************************************/
+struct SMACK *
+smack_load_mmap(const char *filename)
+{
+    const struct SmackImageHeader *hdr;
+    const struct SmackImageMatch *matches;
+    struct SMACK *smack;
+    struct stat st;
+    unsigned char *image;
+    size_t image_size;
+    unsigned i;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s: %s\n", "smack", filename, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "%s: %s: not a saved state-machine\n", "smack",
+            filename);
+        close(fd);
+        return NULL;
+    }
+    image_size = (size_t)st.st_size;
+    image = (unsigned char *)mmap(0, image_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "%s: %s: %s\n", "smack", filename, strerror(errno));
+        return NULL;
+    }
+    if (!image_is_valid(image, image_size)) {
+        fprintf(stderr, "%s: %s: not a saved state-machine\n", "smack",
+            filename);
+        munmap(image, image_size);
+        return NULL;
+    }
+    hdr = (const struct SmackImageHeader *)image;
+
+    smack = smack_create("", (hdr->flags & IMAGE_NOCASE) != 0);
+    free(smack->name);
+    smack->name = (char *)malloc(sizeof(hdr->name));
+    if (smack->name == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    memcpy(smack->name, hdr->name, sizeof(hdr->name));
+    smack->name[sizeof(hdr->name) - 1] = '\0';
+
+    smack->image = image;
+    smack->image_size = image_size;
+    smack->is_anchor_begin = (hdr->flags & IMAGE_ANCHOR_BEGIN) != 0;
+    smack->is_anchor_end = (hdr->flags & IMAGE_ANCHOR_END) != 0;
+    smack->is_table32 = (hdr->flags & IMAGE_TABLE32) != 0;
+    smack->is_shift_add = (hdr->flags & IMAGE_SHIFT_ADD) != 0;
+    smack->row_shift = hdr->row_shift;
+    smack->m_state_count = hdr->state_count;
+    smack->m_match_limit = hdr->match_limit;
+    smack->symbol_count = hdr->symbol_count;
+    memcpy(smack->char_to_symbol, hdr->char_to_symbol,
+        sizeof(smack->char_to_symbol));
+    smack->table = image + hdr->table_offset;
+    if (hdr->flags & IMAGE_LEFTMOST) {
+        smack->m_leftmost
+            = (struct SmackLeftmost *)(image + hdr->leftmost_offset);
+        smack->m_leftmost_dead = hdr->state_count;
+    }
+    smack->m_sparse_begin = hdr->sparse_begin;
+    smack->m_sparse_match = hdr->sparse_match;
+    if (hdr->flags & IMAGE_SPARSE) {
+        smack->m_sparse = (struct SmackSparse *)(image + hdr->sparse_offset);
+        smack->m_sparse_edges = (unsigned *)(image + hdr->edges_offset);
+        smack->m_sparse_edge_count = hdr->edge_count;
+    }
+
+    create_matches_table(smack, hdr->state_count);
+    matches = (const struct SmackImageMatch *)(image + hdr->matches_offset);
+    for (i = 0; i < hdr->state_count; i++) {
+        smack->m_match[i].m_count = matches[i].count;
+        if (matches[i].count)
+            smack->m_match[i].m_ids = (size_t *)(image + hdr->ids_offset)
+                                      + matches[i].first;
+    }
+
+    /* The scalar masks are just the nibble tables combined */
+    if (hdr->flags & IMAGE_PREFILTER) {
+        struct SmackPrefilter *pf = &smack->prefilter;
+        unsigned t;
+
+        memcpy(pf->lo, hdr->prefilter_lo, sizeof(pf->lo));
+        memcpy(pf->hi, hdr->prefilter_hi, sizeof(pf->hi));
+        pf->width = hdr->prefilter_width;
+        for (t = 0; t < pf->width; t++) {
+            unsigned c;
+            for (c = 0; c < 256; c++)
+                pf->masks[t][c] = pf->lo[t][c & 0x0F] & pf->hi[t][c >> 4];
+        }
+        pf->is_possible = (pf->width != 0);
+    }
+    prefilter_set_isa(&smack->prefilter, SCAN_ISA_AUTO);
+
+    return smack;
+}
+#else
+struct SMACK *
+smack_load_mmap(const char *filename)
+{
+    fprintf(stderr, "%s: %s: mmap not supported\n", "smack", filename);
+    return NULL;
+}
+#endif
+
 /*****************************************************************************
+ * Provide my own rand() simply to avoid static-analysis warning me that
+ * 'rand()' is unrandom, when in fact we want the non-random properties of
+ * rand() for regression testing.
  *****************************************************************************/
-static size_t
-inner_match(const unsigned char *px, size_t length,
-    const unsigned char *char_to_symbol, const transition_t *table,
-    unsigned *state, unsigned match_limit, unsigned row_shift)
+static unsigned
+r_rand(unsigned *seed)
 {
-    const unsigned char *px_start = px;
-    const unsigned char *px_end = px + length;
-    unsigned row = *state;
+    static const unsigned a = 214013;
+    static const unsigned c = 2531011;
+    
+    *seed = (*seed) * a + c;
+    return (*seed)>>16 & 0x7fff;
+}
 
-    for (; px < px_end; px++) {
-        unsigned char column;
+/****************************************************************************
+ * The matches found by "smack_search()", for comparing with and without
+ * the prefilter.
+ ****************************************************************************/
+#define SELFTEST_MAX_MATCHES 65536
+#define SELFTEST_MODE_LENGTH 300
+struct SelftestMatches {
+    size_t base;
+    size_t count;
+    size_t ids[SELFTEST_MAX_MATCHES];
+    size_t offsets[SELFTEST_MAX_MATCHES];
+};
 
-        /* Convert that character into a symbol. This compresses the table.
-         * Even though there are 256 possible combinations for a byte, we
-         * are probably using fewer than 32 individual characters in the
-         * patterns we are looking for. This step allows us to create tables
-         * that are only 32 elements wide, instead of 256 elements wide */
-        column = char_to_symbol[*px];
+static int
+selftest_found(size_t id, int offset, void *data)
+{
+    struct SelftestMatches *m = (struct SelftestMatches *)data;
 
-        /*
-         * STATE TRANSITION
-         * Given the current row, lookup the symbol, and find the next row.
-         * Logically, this is the following  calculation:
-         *    row = table[row][column]
-         * However, since row can have a variable width (depending on the
-         * number of characters in a pattern), we have to do the calculation
-         * manually.
-         */
-        row = *(table + (row << row_shift) + column);
+    if (m->count < SELFTEST_MAX_MATCHES) {
+        m->ids[m->count] = id;
+        m->offsets[m->count] = m->base + offset;
+        m->count++;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ * Search the text in random sized fragments, carrying the state across
+ * them. Returns the state at the end, and the sum of the return values.
+ ****************************************************************************/
+static unsigned
+selftest_search(const struct SMACK *s, const unsigned char *text,
+    size_t length, struct SelftestMatches *m, unsigned seed,
+    unsigned *found_sum)
+{
+    unsigned state = 0;
+    size_t offset = 0;
+
+    m->count = 0;
+    *found_sum = 0;
+    while (offset < length) {
+        size_t n = 1 + r_rand(&seed) % 100;
+        if (n > length - offset)
+            n = length - offset;
+        m->base = offset;
+        *found_sum += smack_search(s, text + offset, (unsigned)n,
+            selftest_found, m, &state);
+        offset += n;
+    }
+    return state;
+}
+
+/****************************************************************************
+ * For "smack_search_multi()", a digest of each stream's matches.
+ ****************************************************************************/
+struct SelftestDigest {
+    size_t count;
+    unsigned long long hash;
+};
+
+static int
+selftest_digest(size_t id, int offset, void *data)
+{
+    struct SelftestDigest *d = (struct SelftestDigest *)data;
+
+    d->count++;
+    d->hash = d->hash * 1000003 + id * 4099 + (unsigned)offset;
+    return 0;
+}
+
+/****************************************************************************
+ * Check that searching many streams at once gives the same results as
+ * searching them one at a time, with each stream in several fragments
+ * of different sizes, some empty.
+ ****************************************************************************/
+static int
+selftest_multi(int is_prefilter)
+{
+    enum { STREAMS = 21, FRAGMENTS = 3 };
+    static unsigned char text[STREAMS][600];
+    static const char *patterns[] = {"abc", "bcd", "cab", "a", "dddd",
+        "abcabc", "xyz", "yzx", 0};
+    struct SelftestDigest expected[STREAMS];
+    struct SelftestDigest found[STREAMS];
+    unsigned expected_counts[STREAMS];
+    unsigned expected_states[STREAMS];
+    unsigned states[STREAMS];
+    struct SmackStream streams[STREAMS];
+    struct SMACK *s;
+    unsigned seed = 2;
+    unsigned i;
+    unsigned f;
+    int err = 0;
+
+    s = smack_create("multi", 0);
+    for (i = 0; patterns[i]; i++)
+        smack_add_pattern(s, patterns[i], strlen(patterns[i]), i, 0);
+    smack_compile(s);
+    smack_set_prefilter(s, is_prefilter, SCAN_ISA_AUTO);
+
+    memset(expected, 0, sizeof(expected));
+    memset(found, 0, sizeof(found));
+    memset(expected_states, 0, sizeof(expected_states));
+    memset(states, 0, sizeof(states));
+
+    for (f = 0; f < FRAGMENTS && !err; f++) {
+        for (i = 0; i < STREAMS; i++) {
+            size_t j;
+
+            for (j = 0; j < sizeof(text[i]); j++)
+                text[i][j] = (unsigned char)"abcdxyz."[r_rand(&seed) % 8];
+            streams[i].px = text[i];
+            streams[i].length = r_rand(&seed) % sizeof(text[i]);
+            if ((i + f) % 5 == 0)
+                streams[i].length = 0;
+            streams[i].state = &states[i];
+            streams[i].cb_data = &found[i];
+            streams[i].found_count = ~0U;
+
+            expected_counts[i] = smack_search(s, text[i], streams[i].length,
+                selftest_digest, &expected[i], &expected_states[i]);
+        }
+
+        smack_search_multi(s, streams, STREAMS, selftest_digest);
+
+        for (i = 0; i < STREAMS; i++) {
+            if (states[i] != expected_states[i]
+                || streams[i].found_count != expected_counts[i]
+                || found[i].count != expected[i].count
+                || found[i].hash != expected[i].hash)
+                err = 1;
+        }
+    }
+    smack_destroy(s);
+
+    if (err)
+        fprintf(stderr, "smack: search_multi differs\n");
+    return err;
+}
+
+/****************************************************************************
+ * Check an automaton with more than 64k states, which needs the 32-bit
+ * table, by finding two long patterns in text, in fragments.
+ ****************************************************************************/
+static int
+selftest_table32(void)
+{
+    enum { PATTERN_LENGTH = 33000 };
+    static unsigned char patterns[2][PATTERN_LENGTH];
+    static unsigned char text[3 * PATTERN_LENGTH];
+    static struct SelftestMatches found;
+    struct SMACK *s;
+    unsigned seed = 3;
+    unsigned found_sum;
+    unsigned mode;
+    unsigned i;
+    size_t j;
+    int err = 0;
 
-        if (row >= match_limit)
-            break;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < PATTERN_LENGTH; j++)
+            patterns[i][j] = (unsigned char)"abcd"[r_rand(&seed) % 4];
     }
 
-    *state = row;
-    return px - px_start;
-}
+    /* The second pattern starts right after the first one ends */
+    for (j = 0; j < sizeof(text); j++)
+        text[j] = (unsigned char)"abcde"[r_rand(&seed) % 5];
+    memcpy(text + 100, patterns[0], PATTERN_LENGTH);
+    memcpy(text + 100 + PATTERN_LENGTH, patterns[1], PATTERN_LENGTH);
+
+    /* The same with leftmost-longest, since the matches don't overlap */
+    for (mode = 0; mode < 2 && !err; mode++) {
+        s = smack_create("table32", 0);
+        if (mode)
+            smack_set_match_mode(s, SMACK_MATCH_LEFTMOST_LONGEST);
+        for (i = 0; i < 2; i++)
+            smack_add_pattern(s, patterns[i], PATTERN_LENGTH, i, 0);
+        smack_compile(s);
+
+        for (i = 0; i < 2 && !err; i++) {
+            smack_set_prefilter(s, i, SCAN_ISA_AUTO);
+            selftest_search(s, text, sizeof(text), &found, i, &found_sum);
+            if (!s->is_table32 || found.count != 2
+                || found.ids[0] != 0
+                || found.offsets[0] != 100 + PATTERN_LENGTH - 1
+                || found.ids[1] != 1
+                || found.offsets[1] != 100 + 2 * PATTERN_LENGTH - 1)
+                err = 1;
+        }
+        smack_destroy(s);
+    }
 
+    if (err)
+        fprintf(stderr, "smack: 32-bit table failed\n");
+    return err;
+}
 
-/*****************************************************************************
- *****************************************************************************/
-static size_t
-inner_match_shift7(const unsigned char *px, size_t length,
-    const unsigned char *char_to_symbol, const transition_t *table,
-    unsigned *state, unsigned match_limit)
+/****************************************************************************
+ * The matches that SMACK_MATCH_FIRST or SMACK_MATCH_LEFTMOST_LONGEST
+ * should find, the slow way. For each place, the longest pattern ending
+ * there, or the leftmost-longest ones. Patterns added more than once
+ * report the first id.
+ ****************************************************************************/
+static void
+selftest_mode_expected(enum smack_match_mode mode,
+    unsigned char patterns[][SELFTEST_MODE_LENGTH], const size_t *lengths,
+    unsigned pattern_count, const unsigned char *text, size_t length,
+    struct SelftestMatches *m)
 {
-    const unsigned char *px_start = px;
-    const unsigned char *px_end = px + length;
-    unsigned row = *state;
+    size_t start = 0;
+    size_t end;
+
+    m->count = 0;
+    if (mode == SMACK_MATCH_FIRST) {
+        for (end = 1; end <= length; end++) {
+            unsigned best = pattern_count;
+            unsigned k;
+
+            for (k = 0; k < pattern_count; k++) {
+                if (lengths[k] <= end
+                    && memcmp(text + end - lengths[k], patterns[k],
+                           lengths[k]) == 0
+                    && (best == pattern_count || lengths[k] > lengths[best]))
+                    best = k;
+            }
+            if (best != pattern_count) {
+                m->ids[m->count] = best;
+                m->offsets[m->count++] = end - 1;
+            }
+        }
+        return;
+    }
 
-    for (; px < px_end; px++) {
-        unsigned char column;
-        column = char_to_symbol[*px];
-        row = *(table + (row << 7) + column);
-        if (row >= match_limit)
+    while (start < length) {
+        unsigned best = pattern_count;
+
+        for (; start < length && best == pattern_count; start++) {
+            unsigned k;
+
+            for (k = 0; k < pattern_count; k++) {
+                if (lengths[k] <= length - start
+                    && memcmp(text + start, patterns[k], lengths[k]) == 0
+                    && (best == pattern_count || lengths[k] > lengths[best]))
+                    best = k;
+            }
+        }
+        if (best == pattern_count)
             break;
+        start += lengths[best] - 1;
+        m->ids[m->count] = best;
+        m->offsets[m->count++] = start - 1;
     }
-
-    *state = row;
-    return px - px_start;
 }
 
-/*****************************************************************************
- *****************************************************************************/
-size_t
-smack_search_next(const struct SMACK *smack, unsigned *current_state,
-    const void *v_px, unsigned *offset, unsigned length)
+/****************************************************************************
+ * Check the match modes against the slow way, with random patterns from a
+ * small alphabet, so they overlap a lot, and random text in fragments.
+ * Leftmost matches can be found in a later fragment, or at the end. The
+ * last round has a match pending for hundreds of bytes, so replaying it
+ * doesn't fit on the stack.
+ ****************************************************************************/
+static int
+selftest_match_modes(void)
 {
-    const unsigned char *px = (const unsigned char *)v_px;
-    unsigned row;
-    register size_t i = 0;
-    const unsigned char *char_to_symbol = smack->char_to_symbol;
-    const transition_t *table = smack->table;
-    register unsigned row_shift = smack->row_shift;
-    const struct SmackMatches *match = smack->m_match;
-    unsigned current_matches = 0;
-    size_t id = (size_t)-1;
-    register unsigned match_limit = smack->m_match_limit;
-
-    if (offset)
-        i = *offset;
-    
-    /* Get the row. This is encoded as the lower 24-bits of the state
-     * variable */
-    row = *current_state & 0xFFFFFF;
+    static unsigned char patterns[40][SELFTEST_MODE_LENGTH];
+    static struct SelftestMatches expected;
+    static struct SelftestMatches found;
+    static unsigned char text[3000];
+    size_t lengths[40];
+    unsigned seed = 9;
+    unsigned round;
+    int err = 0;
+
+    for (round = 0; round < 200 && !err; round++) {
+        enum smack_match_mode mode = (round & 1) ? SMACK_MATCH_FIRST
+                                                 : SMACK_MATCH_LEFTMOST_LONGEST;
+        unsigned is_last = (round == 199);
+        unsigned symbol_count = 1 + r_rand(&seed) % 4;
+        unsigned pattern_count = is_last ? 2 : 1 + r_rand(&seed) % 40;
+        unsigned state;
+        unsigned sum;
+        struct SMACK *s;
+        unsigned i;
 
-    /* See if there are current matches we are processing */
-    current_matches = (*current_state) >> 24;
+        for (i = 0; i < pattern_count; i++) {
+            size_t k;
 
-    /* 'for all bytes in this block' */
-    if (!current_matches) {
-        /*if ((length-i) & 1)
-            i += inner_match(px + i,
-                             length - i,
-                             char_to_symbol,
-                             table,
-                             &row,
-                             match_limit,
-                             row_shift);
-        if (row < match_limit && i < length)*/
-        switch (row_shift) {
-        case 7:
-            i += inner_match_shift7(
-                px + i, length - i, char_to_symbol, table, &row, match_limit);
-            break;
-        default:
-            i += inner_match(px + i, length - i, char_to_symbol, table, &row,
-                match_limit, row_shift);
-            break;
+            lengths[i] = 1 + r_rand(&seed) % (1 + r_rand(&seed) % 8);
+            for (k = 0; k < lengths[i]; k++)
+                patterns[i][k] = (unsigned char)('a' + r_rand(&seed)
+                                                 % symbol_count);
         }
-
-        /* Test to see if we have one (or more) matches, and if so, call
-         * the callback function */
-        if (match[row].m_count) {
-            i++; /* points to first byte after match */
-            current_matches = match[row].m_count;
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = (unsigned char)('a' + r_rand(&seed) % symbol_count);
+        if (is_last) {
+            mode = SMACK_MATCH_LEFTMOST_LONGEST;
+            lengths[0] = 1;
+            lengths[1] = SELFTEST_MODE_LENGTH;
+            memset(patterns, 'a', sizeof(patterns));
+            patterns[1][SELFTEST_MODE_LENGTH - 1] = 'b';
+            memset(text, 'a', SELFTEST_MODE_LENGTH);
         }
+
+        s = smack_create("modes", 0);
+        smack_set_match_mode(s, mode);
+        for (i = 0; i < pattern_count; i++)
+            smack_add_pattern(s, patterns[i], lengths[i], i, 0);
+        smack_shift_add_size = (round & 2) ? 0 : 4 * 1024 * 1024;
+        smack_compile(s);
+        smack_shift_add_size = 4 * 1024 * 1024;
+
+        state = selftest_search(s, text, sizeof(text), &found, round, &sum);
+        found.base = sizeof(text);
+        smack_search_end(s, selftest_found, &found, &state);
+        selftest_mode_expected(mode, patterns, lengths, pattern_count, text,
+            sizeof(text), &expected);
+        if (found.count != expected.count
+            || memcmp(found.ids, expected.ids,
+                   found.count * sizeof(found.ids[0])) != 0
+            || memcmp(found.offsets, expected.offsets,
+                   found.count * sizeof(found.offsets[0])) != 0)
+            err = 1;
+        smack_destroy(s);
     }
 
-    if (offset)
-        *offset = (unsigned)i;
+    if (err)
+        fprintf(stderr, "smack: match modes failed, round %u\n", round - 1);
+    return err;
+}
 
-    /* If we broke early because we found a match, return that match */
-    if (current_matches) {
-        id = match[row].m_ids[current_matches - 1];
-        current_matches--;
+/****************************************************************************
+ * Check that adding patterns in batches in incremental mode, with several
+ * threads, finds the same matches as compiling them all at once. A small
+ * alphabet makes the new patterns overlap the old ones. The last round
+ * has enough states to split the levels between threads, and some rounds
+ * end with an anchored pattern, which compiles everything again.
+ ****************************************************************************/
+static int
+selftest_incremental(void)
+{
+    static struct SelftestMatches expected;
+    static struct SelftestMatches found;
+    static unsigned char text[5000];
+    unsigned seed = 7;
+    unsigned round;
+    int err = 0;
+
+    for (round = 0; round < 30 && !err; round++) {
+        struct SMACK *s[2];
+        unsigned is_last = (round == 29);
+        unsigned symbol_count = is_last ? 60 : 2 + r_rand(&seed) % 6;
+        unsigned pattern_count = is_last ? 4000 : 1 + r_rand(&seed) % 60;
+        unsigned batch_count = 2 + r_rand(&seed) % 4;
+        unsigned is_anchored = !is_last && (round % 4 == 3);
+        unsigned nocase = round & 1;
+        unsigned pattern_seed = seed;
+        unsigned expected_sum;
+        unsigned sum;
+        unsigned b;
+        unsigned i;
+
+        s[0] = smack_create("full", nocase);
+        s[1] = smack_create("incremental", nocase);
+        smack_set_incremental(s[1], 1);
+        smack_set_threads(s[1], 4);
+        for (b = 0; b < batch_count; b++) {
+            for (i = b * pattern_count / batch_count;
+                 i < (b + 1) * pattern_count / batch_count; i++) {
+                unsigned char pattern[10];
+                size_t length = 1 + r_rand(&pattern_seed) % sizeof(pattern);
+                size_t k;
+
+                /* Sometimes the same pattern again, with a new id */
+                for (k = 0; k < length; k++)
+                    pattern[k] = (unsigned char)('a' + r_rand(&pattern_seed)
+                                                 % symbol_count);
+                if (r_rand(&pattern_seed) % 8 == 0)
+                    length = 1 + i % 3;
+                smack_add_pattern(s[0], pattern, length, i, 0);
+                smack_add_pattern(s[1], pattern, length, i, 0);
+            }
+            if (is_anchored && b == batch_count - 1) {
+                smack_add_pattern(s[0], "ab", 2, pattern_count,
+                    SMACK_ANCHOR_BEGIN);
+                smack_add_pattern(s[1], "ab", 2, pattern_count,
+                    SMACK_ANCHOR_BEGIN);
+            }
+            smack_compile(s[1]);
+        }
+        smack_compile(s[0]);
+
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = (unsigned char)("aA"[r_rand(&seed) % 2]
+                                      + r_rand(&seed) % symbol_count);
+        text[0] = 'a';
+        text[1] = 'b';
+
+        if (selftest_search(s[0], text, sizeof(text), &expected, round,
+                &expected_sum)
+                != selftest_search(s[1], text, sizeof(text), &found, round,
+                    &sum)
+            || sum != expected_sum || found.count != expected.count
+            || memcmp(found.ids, expected.ids,
+                   found.count * sizeof(found.ids[0])) != 0
+            || memcmp(found.offsets, expected.offsets,
+                   found.count * sizeof(found.offsets[0])) != 0)
+            err = 1;
+        smack_destroy(s[0]);
+        smack_destroy(s[1]);
     }
 
-    *current_state = row | (current_matches << 24);
-    return id;
+    if (err)
+        fprintf(stderr, "smack: incremental compile failed, round %u\n",
+            round - 1);
+    return err;
 }
 
 /****************************************************************************
+ * Check that sparse states find the same matches as the full table, with
+ * random patterns and text, searching in fragments, several streams at
+ * once, and with "smack_search_next()". The dense size goes from only
+ * the start state up to most of the table.
  ****************************************************************************/
-size_t
-smack_next_match(const struct SMACK *smack, unsigned *current_state)
+static int
+selftest_sparse(void)
 {
-    unsigned row, current_matches;
-    size_t id = SMACK_NOT_FOUND;
+    enum { STREAMS = 3 };
+    static struct SelftestMatches expected;
+    static struct SelftestMatches found;
+    static unsigned char text[5000];
+    unsigned seed = 11;
+    unsigned round;
+    int err = 0;
+
+    for (round = 0; round < 20 && !err; round++) {
+        struct SMACK *s[2];
+        unsigned symbol_count = 2 + r_rand(&seed) % 20;
+        unsigned pattern_count = 1 + r_rand(&seed) % 300;
+        unsigned nocase = round & 1;
+        struct SelftestDigest digests[2][STREAMS];
+        struct SmackStream streams[STREAMS];
+        unsigned states[STREAMS];
+        unsigned expected_sum;
+        unsigned sum;
+        unsigned i;
+        unsigned k;
 
-    /* split the state variable */
-    row = *current_state & 0xFFFFFF;
-    current_matches = (*current_state) >> 24;
+        for (k = 0; k < 2; k++) {
+            s[k] = smack_create("sparse", nocase);
+            smack_set_match_mode(s[k], (round & 2) ? SMACK_MATCH_FIRST
+                                                   : SMACK_MATCH_ALL);
+        }
+        smack_set_dense_size(s[1], (round % 5) * 4096);
+        smack_set_threads(s[1], 1 + round % 3);
+        for (i = 0; i < pattern_count; i++) {
+            unsigned char pattern[12];
+            size_t length = 1 + r_rand(&seed) % sizeof(pattern);
+            size_t j;
+
+            for (j = 0; j < length; j++)
+                pattern[j] = (unsigned char)('a' + r_rand(&seed)
+                                             % symbol_count);
+            smack_add_pattern(s[0], pattern, length, i, 0);
+            smack_add_pattern(s[1], pattern, length, i, 0);
+        }
+        smack_shift_add_size = (round & 4) ? 0 : 4 * 1024 * 1024;
+        smack_compile(s[0]);
+        smack_compile(s[1]);
+        smack_shift_add_size = 4 * 1024 * 1024;
+        if (round % 5 == 0 && s[1]->m_sparse == NULL)
+            err = 1;
+
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = (unsigned char)("aA"[r_rand(&seed) % 2]
+                                      + r_rand(&seed) % symbol_count);
+
+        selftest_search(s[0], text, sizeof(text), &expected, round,
+            &expected_sum);
+        selftest_search(s[1], text, sizeof(text), &found, round, &sum);
+        if (sum != expected_sum || found.count != expected.count
+            || memcmp(found.ids, expected.ids,
+                   found.count * sizeof(found.ids[0])) != 0
+            || memcmp(found.offsets, expected.offsets,
+                   found.count * sizeof(found.offsets[0])) != 0)
+            err = 1;
+
+        /* Several streams at once, which searches them one at a time */
+        for (k = 0; k < 2; k++) {
+            smack_set_prefilter(s[k], 0, SCAN_ISA_AUTO);
+            memset(digests[k], 0, sizeof(digests[k]));
+            memset(states, 0, sizeof(states));
+            for (i = 0; i < STREAMS; i++) {
+                streams[i].px = text + i * 1000;
+                streams[i].length = 1000 + i;
+                streams[i].state = &states[i];
+                streams[i].cb_data = &digests[k][i];
+            }
+            smack_search_multi(s[k], streams, STREAMS, selftest_digest);
+        }
+        if (memcmp(digests[0], digests[1], sizeof(digests[0])) != 0)
+            err = 1;
 
-    /* If we broke early because we found a match, return that match */
-    if (current_matches) {
-        const struct SmackMatches *match = smack->m_match;
-        id = match[row].m_ids[current_matches - 1];
-        current_matches--;
+        /* One match at a time */
+        for (k = 0; k < 2; k++) {
+            struct SelftestMatches *m = k ? &found : &expected;
+            unsigned state = 0;
+            unsigned offset = 0;
+            size_t id;
+
+            m->count = 0;
+            while (offset < sizeof(text) && m->count < SELFTEST_MAX_MATCHES) {
+                id = smack_search_next(s[k], &state, text, &offset,
+                    sizeof(text));
+                while (id != SMACK_NOT_FOUND
+                       && m->count < SELFTEST_MAX_MATCHES) {
+                    m->ids[m->count] = id;
+                    m->offsets[m->count] = offset;
+                    m->count++;
+                    id = smack_next_match(s[k], &state);
+                }
+            }
+        }
+        if (found.count != expected.count
+            || memcmp(found.ids, expected.ids,
+                   found.count * sizeof(found.ids[0])) != 0
+            || memcmp(found.offsets, expected.offsets,
+                   found.count * sizeof(found.offsets[0])) != 0)
+            err = 1;
+
+        smack_destroy(s[0]);
+        smack_destroy(s[1]);
     }
 
-    /* Recombine the state */
-    *current_state = row | (current_matches << 24);
-
-    return id;
+    if (err)
+        fprintf(stderr, "smack: sparse states failed, round %u\n", round - 1);
+    return err;
 }
 
 /****************************************************************************
+ * Check that "smack_search_batch()" finds the same matches as
+ * "smack_search()", in fragments, with lists of matches so short that
+ * they fill up in the middle of a state's ids. Some patterns are added
+ * several times, so that there are states with lots of ids.
  ****************************************************************************/
-size_t smack_search_done(const struct SMACK *smack, unsigned *current_state)
+static int
+selftest_batch(void)
 {
-    //unsigned found_count = 0;
-    transition_t *table = smack->table;
-    unsigned row_shift = smack->row_shift;
-    unsigned row = *current_state;
-    const struct SmackMatches *match = smack->m_match;
-    unsigned column = smack->char_to_symbol[CHAR_ANCHOR_END];
-    size_t id = (size_t)-1;
-    
-    /*
-     * This is the same logic as for "smack_search()", except there is
-     * only one byte of input -- the virtual character ($) that represents
-     * the anchor at the end of some patterns.
-     */
-    row = *(table + (row << row_shift) + column);
-    if (match[row].m_count)
-        id = match[row].m_ids[0];
-    return id;
+    static struct SelftestMatches expected;
+    static unsigned char text[5000];
+    struct SmackMatch batch[7];
+    unsigned seed = 13;
+    unsigned round;
+    int err = 0;
+
+    for (round = 0; round < 16 && !err; round++) {
+        struct SmackCursor cursor;
+        unsigned symbol_count = 2 + r_rand(&seed) % 8;
+        unsigned pattern_count = 1 + r_rand(&seed) % 200;
+        unsigned expected_sum;
+        unsigned max = 1 + round % 7;
+        size_t count = 0;
+        size_t offset = 0;
+        unsigned fragment_seed = round;
+        struct SMACK *s;
+        unsigned i;
+
+        s = smack_create("batch", round & 1);
+        if (round & 2)
+            smack_set_match_mode(s, SMACK_MATCH_FIRST);
+        if (round & 4)
+            smack_set_dense_size(s, 0);
+        for (i = 0; i < pattern_count; i++) {
+            unsigned char pattern[8];
+            size_t length = 1 + r_rand(&seed) % sizeof(pattern);
+            size_t j;
+
+            for (j = 0; j < length; j++)
+                pattern[j] = (unsigned char)('a' + r_rand(&seed)
+                                             % symbol_count);
+            smack_add_pattern(s, pattern, length, i, 0);
+            if (i % 10 == 0)
+                smack_add_pattern(s, pattern, length, i + 1000, 0);
+        }
+        if (round % 8 == 3)
+            smack_add_pattern(s, "ab", 2, 2000, SMACK_ANCHOR_BEGIN);
+        smack_shift_add_size = (round & 8) ? 0 : 4 * 1024 * 1024;
+        smack_compile(s);
+        smack_shift_add_size = 4 * 1024 * 1024;
+
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = (unsigned char)("aA"[r_rand(&seed) % 2]
+                                      + r_rand(&seed) % symbol_count);
+        text[0] = 'a';
+        text[1] = 'b';
+        selftest_search(s, text, sizeof(text), &expected, round,
+            &expected_sum);
+
+        /* The same fragments as "selftest_search()" */
+        memset(&cursor, 0, sizeof(cursor));
+        while (offset < sizeof(text) && !err) {
+            size_t n = 1 + r_rand(&fragment_seed) % 100;
+            unsigned found;
+
+            if (n > sizeof(text) - offset)
+                n = sizeof(text) - offset;
+            do {
+                found = smack_search_batch(s, text + offset, (unsigned)n,
+                    batch, max, &cursor);
+                for (i = 0; i < found && !err; i++, count++) {
+                    if (count >= expected.count
+                        || batch[i].id != expected.ids[count]
+                        || offset + batch[i].offset
+                               != expected.offsets[count])
+                        err = 1;
+                }
+            } while (found == max && !err);
+            offset += n;
+        }
+        if (count != expected.count)
+            err = 1;
+        smack_destroy(s);
+    }
+
+    if (err)
+        fprintf(stderr, "smack: batch search failed, round %u\n", round - 1);
+    return err;
 }
 
 /****************************************************************************
+ * Check that the prefilter finds exactly the same matches as the plain
+ * state-machine, with random patterns and text.
  ****************************************************************************/
-unsigned
-smack_search_end(const struct SMACK *smack, FOUND_CALLBACK cb_found,
-    void *callback_data, unsigned *current_state)
+static int
+selftest_prefilter(void)
 {
-    unsigned found_count = 0;
-    transition_t *table = smack->table;
-    unsigned row_shift = smack->row_shift;
-    unsigned row = *current_state;
-    const struct SmackMatches *match = smack->m_match;
-    unsigned column = smack->char_to_symbol[CHAR_ANCHOR_END];
+    static const char alphabet[] = "abcdefgHIJKLMNOPxyz \r\n\x00\x80\xff";
+    static struct SelftestMatches expected;
+    static struct SelftestMatches found;
+    unsigned char text[4096];
+    unsigned seed = 1;
+    unsigned round;
+
+    for (round = 0; round < 200; round++) {
+        struct SMACK *s;
+        unsigned pattern_count = 1 + r_rand(&seed) % 40;
+        unsigned min_length = 1 + round % 4;
+        unsigned expected_state;
+        unsigned expected_sum;
+        unsigned text_alphabet;
+        enum scan_isa_t isa;
+        unsigned i;
 
-    /*
-     * This is the same logic as for "smack_search()", except there is
-     * only one byte of input -- the virtual character ($) that represents
-     * the anchor at the end of some patterns.
-     */
-    row = *(table + (row << row_shift) + column);
-    if (match[row].m_count)
-        found_count = handle_match(smack, 0, cb_found, callback_data, row);
+        s = smack_create("prefilter", round & 1);
+        for (i = 0; i < pattern_count; i++) {
+            unsigned char pattern[16];
+            size_t length = min_length + r_rand(&seed) % 6;
+            size_t j;
+            for (j = 0; j < length; j++)
+                pattern[j] = alphabet[r_rand(&seed) % 8 + (round & 8)];
+            smack_add_pattern(s, pattern, length, i, 0);
+        }
+        smack_compile(s);
 
-    *current_state = row;
-    return found_count;
+        /* Mostly bytes that aren't in the patterns, sometimes not */
+        text_alphabet = (round & 2) ? 8 : sizeof(alphabet) - 1;
+        for (i = 0; i < sizeof(text); i++) {
+            if (r_rand(&seed) % 16 == 0)
+                text[i] = (unsigned char)r_rand(&seed);
+            else
+                text[i] = alphabet[r_rand(&seed) % text_alphabet];
+        }
+
+        smack_set_prefilter(s, 0, SCAN_ISA_AUTO);
+        expected_state = selftest_search(s, text, sizeof(text), &expected,
+            round, &expected_sum);
+
+        for (isa = SCAN_ISA_SCALAR; isa <= SCAN_ISA_AVX2; isa++) {
+            unsigned state;
+            unsigned sum;
+
+            smack_set_prefilter(s, 1, isa);
+            state = selftest_search(s, text, sizeof(text), &found, round,
+                &sum);
+            if (state != expected_state || sum != expected_sum
+                || found.count != expected.count
+                || memcmp(found.ids, expected.ids,
+                       found.count * sizeof(found.ids[0])) != 0
+                || memcmp(found.offsets, expected.offsets,
+                       found.count * sizeof(found.offsets[0])) != 0) {
+                fprintf(stderr, "smack: prefilter %s differs, round %u\n",
+                    scan_isa_name(isa), round);
+                smack_destroy(s);
+                return 1;
+            }
+        }
+        smack_destroy(s);
+    }
+    return 0;
 }
 
-#if 0
-/*****************************************************************************
- * Provide my own rand() simply to avoid static-analysis warning me that
- * 'rand()' is unrandom, when in fact we want the non-random properties of
- * rand() for regression testing.
- *****************************************************************************/
-static unsigned
-r_rand(unsigned *seed)
+/****************************************************************************
+ * Check that rows 3/4 as wide, which are normally only used for large
+ * tables, give the same results as power-of-2 rows, for each way of
+ * searching, with different numbers of symbols.
+ ****************************************************************************/
+static int
+selftest_shift_add(void)
 {
-    static const unsigned a = 214013;
-    static const unsigned c = 2531011;
-    
-    *seed = (*seed) * a + c;
-    return (*seed)>>16 & 0x7fff;
+    static struct SelftestMatches expected;
+    static struct SelftestMatches found;
+    static unsigned char text[2][3000];
+    unsigned seed = 5;
+    unsigned shift_add_count = 0;
+    unsigned round;
+    int err = 0;
+
+    for (round = 0; round < 40 && !err; round++) {
+        struct SMACK *s[2];
+        unsigned symbol_count = 2 + r_rand(&seed) % 200;
+        unsigned pattern_count = 1 + r_rand(&seed) % 50;
+        struct SelftestDigest digests[2][2];
+        struct SmackStream streams[2];
+        unsigned states[2][2];
+        size_t ids[2][64];
+        unsigned id_count[2];
+        unsigned i;
+        unsigned j;
+
+        /* Patterns with bytes from the first 'symbol_count' ones */
+        for (j = 0; j < 2; j++) {
+            unsigned pattern_seed = seed;
+
+            smack_shift_add_size = j ? 0 : ~(size_t)0;
+            s[j] = smack_create("shift-add", 0);
+            for (i = 0; i < pattern_count; i++) {
+                unsigned char pattern[8];
+                size_t length = 1 + r_rand(&pattern_seed) % sizeof(pattern);
+                size_t k;
+                for (k = 0; k < length; k++)
+                    pattern[k] = (unsigned char)(r_rand(&pattern_seed)
+                                                 % symbol_count);
+                smack_add_pattern(s[j], pattern, length, i, 0);
+            }
+            smack_compile(s[j]);
+        }
+        smack_shift_add_size = 4 * 1024 * 1024;
+        for (j = 0; j < 2; j++) {
+            for (i = 0; i < sizeof(text[j]); i++)
+                text[j][i] = (unsigned char)(r_rand(&seed) % symbol_count);
+        }
+        if (s[0]->is_shift_add)
+            err = 1;
+        shift_add_count += s[1]->is_shift_add;
+
+        /* smack_search(), with and without the prefilter */
+        for (i = 0; i < 2 && !err; i++) {
+            unsigned expected_sum;
+            unsigned sum;
+
+            smack_set_prefilter(s[0], i, SCAN_ISA_AUTO);
+            smack_set_prefilter(s[1], i, SCAN_ISA_AUTO);
+            if (selftest_search(s[0], text[0], sizeof(text[0]), &expected,
+                    round, &expected_sum)
+                    != selftest_search(s[1], text[0], sizeof(text[0]),
+                        &found, round, &sum)
+                || sum != expected_sum || found.count != expected.count
+                || memcmp(found.ids, expected.ids,
+                       found.count * sizeof(found.ids[0])) != 0
+                || memcmp(found.offsets, expected.offsets,
+                       found.count * sizeof(found.offsets[0])) != 0)
+                err = 1;
+        }
+
+        /* smack_search_multi() */
+        memset(digests, 0, sizeof(digests));
+        memset(states, 0, sizeof(states));
+        for (j = 0; j < 2; j++) {
+            smack_set_prefilter(s[j], 0, SCAN_ISA_AUTO);
+            for (i = 0; i < 2; i++) {
+                streams[i].px = text[i];
+                streams[i].length = sizeof(text[i]);
+                streams[i].state = &states[j][i];
+                streams[i].cb_data = &digests[j][i];
+            }
+            smack_search_multi(s[j], streams, 2, selftest_digest);
+        }
+        if (memcmp(digests[0], digests[1], sizeof(digests[0])) != 0
+            || memcmp(states[0], states[1], sizeof(states[0])) != 0)
+            err = 1;
+
+        /* smack_search_next() */
+        for (j = 0; j < 2; j++) {
+            unsigned state = 0;
+            unsigned offset = 0;
+
+            id_count[j] = 0;
+            while (offset < sizeof(text[0]) && id_count[j] < 64) {
+                size_t id = smack_search_next(s[j], &state, text[0], &offset,
+                    sizeof(text[0]));
+                while (id != SMACK_NOT_FOUND && id_count[j] < 64) {
+                    ids[j][id_count[j]++] = id + offset * 64;
+                    id = smack_next_match(s[j], &state);
+                }
+            }
+        }
+        if (id_count[0] != id_count[1]
+            || memcmp(ids[0], ids[1], id_count[0] * sizeof(ids[0][0])) != 0)
+            err = 1;
+
+        smack_destroy(s[0]);
+        smack_destroy(s[1]);
+    }
+
+    if (shift_add_count == 0)
+        err = 1;
+    if (err)
+        fprintf(stderr, "smack: shift-add rows differ\n");
+    return err;
 }
+
+/****************************************************************************
+ * Check that a state-machine saved and loaded again finds the same
+ * matches, and that damaged files aren't loaded.
+ ****************************************************************************/
+static int
+selftest_save(void)
+{
+#ifndef _WIN32
+    static const char *patterns[] = {"GET", "get /", "Host:", "\r\n\r\n",
+        "xyz", "abcabc", "bca", 0};
+    static struct SelftestMatches expected;
+    static struct SelftestMatches found;
+    unsigned char text[8192];
+    char filename[] = "/tmp/smack-selftest-XXXXXX";
+    unsigned seed = 4;
+    unsigned round;
+    int err = 0;
+    int fd;
+
+    fd = mkstemp(filename);
+    if (fd == -1) {
+        fprintf(stderr, "smack: %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    for (round = 0; round < 8 && !err; round++) {
+        struct SMACK *s;
+        struct SMACK *loaded;
+        unsigned i;
+
+        /* Case-sensitive or not, with or without anchors (which disable
+         * the prefilter), with power-of-2 rows or not, leftmost, and
+         * sparse states */
+        s = smack_create("save", round & 1);
+        if (round == 4 || round == 5)
+            smack_set_match_mode(s, SMACK_MATCH_LEFTMOST_LONGEST);
+        if (round >= 6)
+            smack_set_dense_size(s, 0);
+        for (i = 0; patterns[i]; i++)
+            smack_add_pattern(s, patterns[i], strlen(patterns[i]), i, 0);
+        if ((round & 2) && round < 6)
+            smack_add_pattern(s, "ab", 2, 100, SMACK_ANCHOR_BEGIN);
+        smack_shift_add_size = (round & 1) ? 0 : 4 * 1024 * 1024;
+        smack_compile(s);
+        smack_shift_add_size = 4 * 1024 * 1024;
+
+        for (i = 0; i < sizeof(text); i++) {
+            text[i] = (unsigned char)"abcxyzGETgt /HostHOST:\r\n"
+                [r_rand(&seed) % 24];
+        }
+
+        loaded = NULL;
+        if (smack_save(s, filename) == 0)
+            loaded = smack_load_mmap(filename);
+        if (loaded == NULL
+            || loaded->prefilter.is_possible != s->prefilter.is_possible
+            || loaded->is_shift_add != (round & 1)
+            || (loaded->m_leftmost != NULL) != (round == 4 || round == 5)
+            || (loaded->m_sparse != NULL) != (round >= 6))
+            err = 1;
+
+        for (i = 0; i < 2 && !err; i++) {
+            unsigned expected_state;
+            unsigned expected_sum;
+            unsigned state;
+            unsigned sum;
+
+            smack_set_prefilter(s, i, SCAN_ISA_AUTO);
+            smack_set_prefilter(loaded, i, SCAN_ISA_AUTO);
+            expected_state = selftest_search(s, text, sizeof(text), &expected,
+                round, &expected_sum);
+            state = selftest_search(loaded, text, sizeof(text), &found, round,
+                &sum);
+            if (state != expected_state || sum != expected_sum
+                || found.count != expected.count || found.count == 0
+                || memcmp(found.ids, expected.ids,
+                       found.count * sizeof(found.ids[0])) != 0
+                || memcmp(found.offsets, expected.offsets,
+                       found.count * sizeof(found.offsets[0])) != 0)
+                err = 1;
+        }
+        if (loaded)
+            smack_destroy(loaded);
+        smack_destroy(s);
+    }
+
+    /* A truncated file, and one with a different version */
+    if (!err) {
+        FILE *fp;
+        long size;
+        char *buf;
+
+        fp = fopen(filename, "rb");
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        buf = (char *)malloc((size_t)size);
+        if (buf == NULL || fread(buf, 1, (size_t)size, fp) != (size_t)size)
+            err = 1;
+        fclose(fp);
+
+        if (!err) {
+            fp = fopen(filename, "wb");
+            fwrite(buf, 1, (size_t)size - 1, fp);
+            fclose(fp);
+            if (smack_load_mmap(filename) != NULL)
+                err = 1;
+
+            buf[8]++;
+            fp = fopen(filename, "wb");
+            fwrite(buf, 1, (size_t)size, fp);
+            fclose(fp);
+            if (smack_load_mmap(filename) != NULL)
+                err = 1;
+        }
+        free(buf);
+    }
+    remove(filename);
+
+    if (err)
+        fprintf(stderr, "smack: save/load failed\n");
+    return err;
+#else
+    return 0;
 #endif
+}
 
 /****************************************************************************
  ****************************************************************************/
@@ -1592,14 +4948,108 @@ smack_selftest(void)
     }*/
     smack_destroy(s);
 
+    if (selftest_prefilter())
+        return 1;
+    if (selftest_multi(0) || selftest_multi(1))
+        return 1;
+    if (selftest_table32())
+        return 1;
+    if (selftest_shift_add())
+        return 1;
+    if (selftest_incremental())
+        return 1;
+    if (selftest_match_modes())
+        return 1;
+    if (selftest_sparse())
+        return 1;
+    if (selftest_batch())
+        return 1;
+    if (selftest_save())
+        return 1;
+    return 0;
+}
+
+/****************************************************************************
+ * Count the matches, for "smack_benchmark()".
+ ****************************************************************************/
+static int
+benchmark_found(size_t id, int offset, void *data)
+{
+    (void)id;
+    (void)offset;
+    (*(unsigned long long *)data)++;
+    return 0;
+}
+
+/****************************************************************************
+ * A quick benchmark of random patterns in random text, printing the cycles
+ * per byte and the size of the table. See "bench-smack" for real ones.
+ ****************************************************************************/
+int
+smack_benchmark(void)
+{
+    enum { TEXT_SIZE = 4 * 1024 * 1024 };
+    static const unsigned pattern_counts[] = {30, 1000, 10000, 100000};
+    unsigned char *text;
+    unsigned seed = 1;
+    unsigned nocase;
+    unsigned k;
+    size_t i;
+
+    text = (unsigned char *)malloc(TEXT_SIZE);
+    if (text == NULL) {
+        fprintf(stderr, "%s: out of memory error\n", "smack");
+        exit(1);
+    }
+    for (i = 0; i < TEXT_SIZE; i++)
+        text[i] = (unsigned char)(' ' + r_rand(&seed) % 95);
+
+    for (k = 0; k < sizeof(pattern_counts) / sizeof(pattern_counts[0]); k++) {
+        for (nocase = 0; nocase < 2; nocase++) {
+            unsigned long long found = 0;
+            unsigned long long start;
+            unsigned long long stop;
+            unsigned state = 0;
+            struct SMACK *s;
+            unsigned j;
+
+            s = smack_create("benchmark", nocase);
+            for (j = 0; j < pattern_counts[k]; j++) {
+                unsigned char pattern[16];
+                size_t length = 4 + r_rand(&seed) % 12;
+
+                for (i = 0; i < length; i++)
+                    pattern[i] = (unsigned char)(' ' + r_rand(&seed) % 95);
+                smack_add_pattern(s, pattern, length, j, 0);
+            }
+            smack_compile(s);
+
+            start = util_clockcycle();
+            smack_search(s, text, TEXT_SIZE, benchmark_found, &found, &state);
+            stop = util_clockcycle();
+
+            printf("smack: %6u patterns %-7s %6.2f cycles/byte %8llu matches "
+                   "%10lu bytes\n",
+                pattern_counts[k], nocase ? "nocase" : "case",
+                (double)(stop - start) / TEXT_SIZE, found,
+                (unsigned long)smack_memory_size(s));
+            smack_destroy(s);
+        }
+    }
+    free(text);
     return 0;
 }
 
 #ifdef SMACKSTANDALONE
 int
-main(void)
+main(int argc, char *argv[])
 {
-    int err = smack_selftest();
+    int err;
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+        return smack_benchmark();
+
+    err = smack_selftest();
 
     if (err) {
         fprintf(stderr, "[-] smack: selftest failed\n");
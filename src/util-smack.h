@@ -1,6 +1,7 @@
 #ifndef _SMACK_H
 #define _SMACK_H
 #include <stdio.h>
+#include "util-scan.h"
 
 #define SMACK_NOT_FOUND ((size_t)(~0))
 
@@ -22,6 +23,16 @@ enum {
     SMACK_CASE_INSENSITIVE = 1,
 };
 
+/**
+ * Which of the patterns that match are reported, see
+ * "smack_set_match_mode()".
+ */
+enum smack_match_mode {
+    SMACK_MATCH_ALL = 0,
+    SMACK_MATCH_FIRST = 1,
+    SMACK_MATCH_LEFTMOST_LONGEST = 2,
+};
+
 /**
  * This is the function that will be called whenever SMACK
  * finds a pattern.
@@ -43,9 +54,9 @@ void smack_destroy(struct SMACK *smack);
 /**
  * Registers a pattern with the search engine. The 'smack' object
  * must have been created with 'smack_create()', but you must not
- * have yet called 'smack_compile()' to compile the patterns. The
- * "id" field can contain a pointer (size_t is 64-bit on 64-bit
- * systems).
+ * have yet called 'smack_compile()' to compile the patterns, unless
+ * 'smack_set_incremental()' is enabled. The "id" field can contain a
+ * pointer (size_t is 64-bit on 64-bit systems).
  */
 void smack_add_pattern(struct SMACK *smack, const void *pattern,
     size_t pattern_length, size_t id, unsigned flags);
@@ -58,6 +69,64 @@ void smack_add_pattern(struct SMACK *smack, const void *pattern,
  */
 void smack_compile(struct SMACK *smack);
 
+/**
+ * Sets how many threads "smack_compile()" can use. Big pattern sets are
+ * compiled one depth at a time, with the states at each depth split
+ * between the threads. The result is the same regardless. The default is
+ * one thread.
+ */
+void smack_set_threads(struct SMACK *smack, unsigned thread_count);
+
+/**
+ * In incremental mode, more patterns can be added with
+ * "smack_add_pattern()" after "smack_compile()", then compiled again
+ * without starting over, redoing only the parts of the state-machine the
+ * new patterns can change. This keeps the intermediate tables in memory.
+ * It must be set before compiling the first time. Patterns with anchors,
+ * wildcards, or the SNMP hack can still be added, but then everything is
+ * compiled again from scratch.
+ */
+void smack_set_incremental(struct SMACK *smack, int is_incremental);
+
+/**
+ * Chooses which matches are reported, which is worked out when compiling,
+ * so call it before "smack_compile()".
+ *
+ * SMACK_MATCH_ALL, the default, reports every pattern ending at each
+ * offset, the longest first. SMACK_MATCH_FIRST reports only the longest.
+ *
+ * SMACK_MATCH_LEFTMOST_LONGEST works like a tokenizer: the match that
+ * starts first, the longest of the ones that start there, then the same
+ * after it, so matches never overlap. A match isn't reported until it
+ * can't get any longer, which may be in a later fragment, in which case
+ * its offset is negative, relative to the start of that fragment. Call
+ * "smack_search_end()" after the last fragment to report the last match,
+ * with offsets relative to the end of the input. This can't be used with
+ * "smack_search_next()", and isn't used for patterns with anchors,
+ * wildcards, or the SNMP hack, which get SMACK_MATCH_ALL instead.
+ *
+ * With the last two, if the same pattern was added more than once, only
+ * the first id is reported.
+ */
+void smack_set_match_mode(struct SMACK *smack, enum smack_match_mode mode);
+
+/**
+ * Limits how many bytes the table of transitions can use, 16 megabytes
+ * by default. With more patterns than that, the states furthest from the
+ * start only list the transitions that go deeper, which uses a lot less
+ * memory, but is slower when the input gets that far. A size of zero means
+ * only the start state gets a row. Call it before "smack_compile()".
+ */
+void smack_set_dense_size(struct SMACK *smack, size_t size);
+
+/**
+ * Returns how many bytes of memory the compiled state-machine uses for
+ * searching: the table, sparse states, and the list of matches for each
+ * state. This is for benchmarks, to compare different ways of compiling
+ * the same patterns.
+ */
+size_t smack_memory_size(const struct SMACK *smack);
+
 /**
  * Run the state-machine, searching for the compiled patterns within
  * a block of data/text. This can only be called after "smack_compile()"
@@ -76,6 +145,98 @@ void smack_compile(struct SMACK *smack);
 unsigned smack_search(const struct SMACK *smack, const void *px, unsigned length,
     FOUND_CALLBACK cb_found, void *cb_data, unsigned *state);
 
+/**
+ * One of several independent inputs to search at once, such as the
+ * next fragment from each of several TCP connections, each with its own
+ * state variable.
+ */
+struct SmackStream {
+    const void *px;
+    unsigned length;
+    unsigned *state;
+    void *cb_data;
+
+    /** Set to what "smack_search()" would have returned */
+    unsigned found_count;
+};
+
+/**
+ * The same as calling "smack_search()" for each of the streams, but
+ * faster. Up to 8 streams are searched in lockstep in the same loop, so
+ * that the CPU can do their table lookups in parallel, instead of waiting
+ * for each lookup before doing the next one. Matches are reported in
+ * order for each stream, but interleaved between streams.
+ */
+void smack_search_multi(const struct SMACK *smack, struct SmackStream *streams,
+    unsigned count, FOUND_CALLBACK cb_found);
+
+/**
+ * A match found by "smack_search_batch()": the pattern's id, and the
+ * offset of its last byte in the input.
+ */
+struct SmackMatch {
+    size_t id;
+    unsigned offset;
+};
+
+/**
+ * Where "smack_search_batch()" got to. Set it to zeroes at the start of
+ * the input, then leave it alone, like the state for "smack_search()".
+ */
+struct SmackCursor {
+    unsigned state;
+    unsigned offset;
+    unsigned next_id;
+};
+
+/**
+ * Instead of calling a function for each match like "smack_search()",
+ * this fills in the list of 'matches', up to 'max' of them, and returns
+ * how many. If that's 'max', call it again with the same input to get
+ * the rest. If it's fewer, we got to the end of this fragment, and the
+ * next call starts on the next fragment, with patterns that cross from
+ * one to the other still found. The matches are the same, in the same
+ * order, as with "smack_search()". This can't be used with
+ * SMACK_MATCH_LEFTMOST_LONGEST.
+ */
+unsigned smack_search_batch(const struct SMACK *smack, const void *px,
+    unsigned length, struct SmackMatch *matches, unsigned max,
+    struct SmackCursor *cursor);
+
+/**
+ * Choose whether `smack_search()` uses the SIMD prefilter to skip over
+ * input where no pattern can start, and which instructions it uses.
+ * By default, it's enabled with SCAN_ISA_AUTO. The results are the same
+ * either way, so this is only for benchmarks and testing. The prefilter
+ * isn't used for patterns with anchors or wildcards, or when there are
+ * too many patterns for it to skip much.
+ */
+void smack_set_prefilter(struct SMACK *smack, int is_enabled,
+    enum scan_isa_t isa);
+
+/**
+ * Writes the compiled state-machine to a file, so that it can be loaded
+ * with "smack_load_mmap()" instead of compiling the patterns again. The
+ * "id" of each pattern is saved as a number, so this isn't useful when
+ * ids are pointers. The file is replaced atomically.
+ *
+ * @return
+ *      zero on success, or -1 if the file couldn't be written
+ */
+int smack_save(const struct SMACK *smack, const char *filename);
+
+/**
+ * Maps a file written by "smack_save()" read-only, so that it's ready to
+ * search right away, and processes that load the same file share its
+ * memory. Free it with "smack_destroy()". Patterns can't be added to it.
+ * The file is checked for being the right version and format, but the
+ * transitions aren't validated, so only load files you trust.
+ *
+ * @return
+ *      the state-machine, or NULL if the file can't be loaded
+ */
+struct SMACK *smack_load_mmap(const char *filename);
+
 size_t smack_search_next(const struct SMACK *smack, unsigned *state, const void *px,
     unsigned *offset, unsigned length);
 size_t smack_search_done(const struct SMACK *smack, unsigned *state);
@@ -89,8 +250,8 @@ size_t smack_next_match(const struct SMACK *smack, unsigned *state);
 /**
  * Call this after search is done. This is not generally necessary.
  * It's only purpose is to detect patterns that have the
- * SMACK_ANCHOR_END flag set. If no pattern has that flag, then
- * this function will do nothing.
+ * SMACK_ANCHOR_END flag set, and to report the last match for
+ * SMACK_MATCH_LEFTMOST_LONGEST. Otherwise, this function will do nothing.
  */
 unsigned smack_search_end(const struct SMACK *smack, FOUND_CALLBACK cb_found,
     void *cb_data, unsigned *state);
@@ -104,6 +265,11 @@ unsigned smack_search_end(const struct SMACK *smack, FOUND_CALLBACK cb_found,
  */
 int smack_selftest(void);
 
+/**
+ * Prints how fast random patterns are found in random text, in clock
+ * cycles per byte, for a quick check. "bin/bench-smack" does it properly.
+ * Run it with "smack-unittest --benchmark".
+ */
 int smack_benchmark(void);
 
 #endif /*_SMACK_H*/